@@ -0,0 +1,228 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench.h"
+#include "bdvmi/backendfactory.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/mockbackend.h"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#ifndef PACKAGE_VERSION
+#define PACKAGE_VERSION "unknown"
+#endif
+
+namespace bdvmi {
+namespace bench {
+
+Runner::Runner( std::ostream &out, Format format, const std::string &filter, double minTime,
+                unsigned int repetitions )
+    : out_{ out }
+    , format_{ format }
+    , filter_{ filter }
+    , minTime_{ minTime }
+    , repetitions_{ repetitions ? repetitions : 1 }
+{
+}
+
+bool Runner::wanted( const std::string &name ) const
+{
+	return filter_.empty() || name.find( filter_ ) != std::string::npos;
+}
+
+double Runner::time( const Body &body, size_t iterations ) const
+{
+	auto start = std::chrono::steady_clock::now();
+
+	body( iterations );
+
+	return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+std::string Runner::quote( const std::string &s ) const
+{
+	std::string quoted = "\"";
+
+	for ( auto &&c : s ) {
+		if ( c == '"' || c == '\\' )
+			quoted += '\\';
+		quoted += c;
+	}
+
+	return quoted + "\"";
+}
+
+void Runner::run( const std::string &name, const std::string &param, size_t items, const Body &body )
+{
+	if ( !wanted( name ) )
+		return;
+
+	// Calibrate (this doubles as the warm-up)
+	size_t iterations = 1;
+	double elapsed    = time( body, iterations );
+
+	while ( elapsed < minTime_ ) {
+		double scale = elapsed > 0 ? 1.4 * minTime_ / elapsed : 100;
+
+		iterations = std::max( iterations + 1, static_cast<size_t>( iterations * std::min( scale, 100.0 ) ) );
+		elapsed    = time( body, iterations );
+	}
+
+	std::vector<double> samples;
+
+	for ( unsigned int i = 0; i < repetitions_; ++i )
+		samples.push_back( time( body, iterations ) * 1e9 / iterations );
+
+	std::sort( samples.begin(), samples.end() );
+
+	double median      = samples[samples.size() / 2];
+	double fastest     = samples.front();
+	double itemsPerSec = median > 0 ? items * 1e9 / median : 0;
+
+	std::ostringstream line;
+	line << std::fixed;
+
+	if ( format_ == FORMAT_CSV )
+		line << name << "," << param << "," << iterations << "," << items << "," << std::setprecision( 3 )
+		     << median << "," << fastest << "," << std::setprecision( 0 ) << itemsPerSec;
+	else
+		line << "{\"type\":\"result\",\"name\":" << quote( name ) << ",\"param\":" << quote( param )
+		     << ",\"iterations\":" << iterations << ",\"items\":" << items << ",\"ns_per_op\":"
+		     << std::setprecision( 3 ) << median << ",\"ns_per_op_min\":" << fastest
+		     << ",\"items_per_sec\":" << std::setprecision( 0 ) << itemsPerSec << "}";
+
+	out_ << line.str() << std::endl;
+}
+
+void Runner::context()
+{
+	char host[256] = "unknown";
+	char date[64]  = "";
+
+	gethostname( host, sizeof( host ) - 1 );
+
+	time_t    now = ::time( nullptr );
+	struct tm tm;
+
+	if ( gmtime_r( &now, &tm ) )
+		strftime( date, sizeof( date ), "%Y-%m-%dT%H:%M:%SZ", &tm );
+
+	if ( format_ == FORMAT_CSV ) {
+		out_ << "# libbdvmi " << PACKAGE_VERSION << ", " << host << ", " << date << ", "
+		     << std::thread::hardware_concurrency() << " cpus, min time " << minTime_ << "s, "
+		     << repetitions_ << " repetitions\n"
+		     << "name,param,iterations,items,ns_per_op,ns_per_op_min,items_per_sec" << std::endl;
+		return;
+	}
+
+	out_ << "{\"type\":\"context\",\"library\":\"libbdvmi\",\"version\":" << quote( PACKAGE_VERSION )
+	     << ",\"host\":" << quote( host ) << ",\"date\":" << quote( date )
+	     << ",\"cpus\":" << std::thread::hardware_concurrency() << ",\"min_time\":" << minTime_
+	     << ",\"repetitions\":" << repetitions_ << "}" << std::endl;
+}
+
+std::unique_ptr<Driver> mockDriver( BackendFactory &factory, MockConfig config )
+{
+	config.mapLatency_        = 0;
+	config.protectionLatency_ = 0;
+	config.registersLatency_  = 0;
+	config.eventLatency_      = 0;
+
+	factory.mockConfig( config );
+
+	return factory.driver( config.domains_.front(), false );
+}
+
+} // namespace bench
+} // namespace bdvmi
+
+namespace {
+
+void usage( const char *program )
+{
+	std::cerr << "Usage: " << program << " [-c] [-f filter] [-t seconds] [-r repetitions]\n"
+	          << "  -c  CSV output (the default is one JSON object per line)\n"
+	          << "  -f  only run the benchmarks whose name contains filter\n"
+	          << "  -t  minimum duration of a measurement (default 0.2)\n"
+	          << "  -r  measurements per benchmark, the median is reported (default 5)" << std::endl;
+}
+
+} // anonymous namespace
+
+int main( int argc, char *argv[] )
+{
+	using namespace bdvmi::bench;
+
+	Runner::Format format      = Runner::FORMAT_JSON;
+	std::string    filter;
+	double         minTime     = 0.2;
+	unsigned int   repetitions = 5;
+	int            opt;
+
+	while ( ( opt = getopt( argc, argv, "cf:t:r:h" ) ) != -1 ) {
+		switch ( opt ) {
+			case 'c':
+				format = Runner::FORMAT_CSV;
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			case 't':
+				minTime = atof( optarg );
+				break;
+			case 'r':
+				repetitions = atoi( optarg );
+				break;
+			default:
+				usage( argv[0] );
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	Runner runner( std::cout, format, filter, minTime, repetitions );
+
+	runner.context();
+
+	using Suite = void ( * )( Runner & );
+
+	const Suite suites[] = { pageCacheBench, protectionBench, statsBench, statsDisabledBench,
+	                         loggerBench,    registersBench,  ringBench,  eventsBench,
+	                         scanBench,      hashBench };
+
+	int ret = 0;
+
+	for ( auto &&suite : suites ) {
+		try {
+			suite( runner );
+		} catch ( const std::exception &e ) {
+			std::cerr << "Benchmark failed: " << e.what() << std::endl;
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
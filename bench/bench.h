@@ -0,0 +1,93 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIBENCH_H_INCLUDED__
+#define __BDVMIBENCH_H_INCLUDED__
+
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+
+namespace bdvmi {
+
+class BackendFactory;
+class Driver;
+struct MockConfig;
+
+namespace bench {
+
+// Keep the compiler from optimizing value (and whatever computed it) away
+template <typename T> inline void keep( const T &value )
+{
+	asm volatile( "" : : "m"( value ) : "memory" );
+}
+
+class Runner {
+
+public:
+	enum Format { FORMAT_JSON, FORMAT_CSV };
+
+	// Runs the measured operation `iterations' times
+	using Body = std::function<void( size_t iterations )>;
+
+public:
+	Runner( std::ostream &out, Format format, const std::string &filter, double minTime, unsigned int repetitions );
+
+public:
+	// Does name pass the filter? Suites check this before expensive setup.
+	bool wanted( const std::string &name ) const;
+
+	// Find an iteration count that takes at least minTime seconds, time `repetitions' runs of it and
+	// report the median and the fastest one, per operation. name is "suite/benchmark", param tells runs
+	// of the same benchmark apart ("limit=1536"), items is how many things one operation processes
+	// (gfns, requests), for the items/s figure.
+	void run( const std::string &name, const std::string &param, size_t items, const Body &body );
+
+	// What the results were measured on (library version, date, CPUs, settings)
+	void context();
+
+private:
+	double time( const Body &body, size_t iterations ) const;
+
+	std::string quote( const std::string &s ) const;
+
+private:
+	std::ostream &out_;
+	Format        format_;
+	std::string   filter_;
+	double        minTime_;
+	unsigned int  repetitions_;
+};
+
+// A BACKEND_MOCK guest with the given configuration, all latencies zeroed, so that only
+// the library's own cost gets measured
+std::unique_ptr<Driver> mockDriver( BackendFactory &factory, MockConfig config );
+
+void pageCacheBench( Runner &runner );
+void protectionBench( Runner &runner );
+void statsBench( Runner &runner );
+void statsDisabledBench( Runner &runner ); // benchstatsoff.cpp, built with BDVMI_DISABLE_STATS
+void loggerBench( Runner &runner );
+void registersBench( Runner &runner );
+void ringBench( Runner &runner );
+void eventsBench( Runner &runner );
+void scanBench( Runner &runner );
+void hashBench( Runner &runner );
+
+} // namespace bench
+} // namespace bdvmi
+
+#endif // __BDVMIBENCH_H_INCLUDED__
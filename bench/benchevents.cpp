@@ -0,0 +1,142 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bench.h"
+#include "bdvmi/backendfactory.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/eventhandler.h"
+#include "bdvmi/eventmanager.h"
+#include "bdvmi/mockbackend.h"
+#include <signal.h>
+#include <string>
+
+namespace bdvmi {
+namespace bench {
+
+namespace {
+
+class NullHandler : public EventHandler {
+
+public:
+	void handleCR( unsigned short, unsigned short, const Registers &, uint64_t, uint64_t, HVAction & ) override
+	{
+	}
+
+	void handleMSR( unsigned short, uint32_t, uint64_t, uint64_t, HVAction & ) override
+	{
+	}
+
+	void handlePageFault( unsigned short, const Registers &, uint64_t, uint64_t, bool, bool, bool, bool,
+	                      HVAction &, EmulatorContext &, unsigned short & ) override
+	{
+	}
+
+	void handleVMCALL( unsigned short, const Registers & ) override
+	{
+	}
+
+	void handleXSETBV( unsigned short ) override
+	{
+	}
+
+	bool handleBreakpoint( unsigned short, const Registers &, uint64_t ) override
+	{
+		return true;
+	}
+
+	void handleInterrupt( unsigned short, const Registers &, uint32_t, uint64_t, uint64_t ) override
+	{
+	}
+
+	void handleDescriptorAccess( unsigned short, const Registers &, unsigned int, unsigned short &,
+	                             HVAction & ) override
+	{
+	}
+
+	void handleSessionOver( GuestState ) override
+	{
+	}
+
+	void handleFatalError() override
+	{
+	}
+
+	void runPreEvent() override
+	{
+	}
+
+	void runPostEvent() override
+	{
+	}
+};
+
+} // anonymous namespace
+
+// Whole events, from the (mock) backend through EventManager to a handler that does nothing
+void eventsBench( Runner &runner )
+{
+	if ( !runner.wanted( "events/" ) )
+		return;
+
+	BackendFactory factory( BackendFactory::BACKEND_MOCK );
+	MockConfig     config;
+	size_t         remaining = 0;
+
+	config.memorySize_ = gfn_to_gpa( 256 );
+	config.vcpus_      = 4;
+	config.generator_  = [&remaining]( MockEvent &event ) {
+		if ( !remaining )
+			return false;
+
+		--remaining;
+
+		event.type_     = MockEvent::PAGE_FAULT;
+		event.vcpu_     = remaining & 3;
+		event.gpa_      = gfn_to_gpa( remaining & 255 );
+		event.gva_      = 0xfffff80000000000 + event.gpa_;
+		event.access_   = Driver::PAGE_WRITE;
+		event.regs_.rip = 0xfffff80002c5c000;
+
+		return true;
+	};
+
+	auto         driver = mockDriver( factory, config );
+	sig_atomic_t stop   = 0;
+	auto         em     = factory.eventManager( *driver, stop );
+	NullHandler  handler;
+
+	em->handler( &handler );
+
+	for ( bool trace : { false, true } ) {
+		driver->eventTrace().enable( trace );
+
+		for ( size_t workers : { 0, 4 } ) {
+			std::string param = workers ? "workers=" + std::to_string( workers ) : "serial";
+
+			em->parallelEvents( workers );
+
+			runner.run( "events/page_fault", trace ? param + ",trace" : param, 1, [&]( size_t iterations ) {
+				remaining = iterations;
+				em->waitForEvents();
+			} );
+		}
+	}
+
+	driver->eventTrace().enable( false );
+	em->handler( nullptr );
+}
+
+} // namespace bench
+} // namespace bdvmi
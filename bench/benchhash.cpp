@@ -0,0 +1,90 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bench.h"
+#include "pagehash.h"
+#include "bdvmi/backendfactory.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/mockbackend.h"
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+namespace bench {
+
+void hashBench( Runner &runner )
+{
+	if ( !runner.wanted( "hash/" ) )
+		return;
+
+	const size_t         pages = 256;
+	std::mt19937         rng( 7 );
+	std::vector<uint8_t> buffer( pages * PAGE_SIZE );
+
+	for ( auto &&b : buffer )
+		b = static_cast<uint8_t>( rng() );
+
+	// The hash alone, over already mapped memory
+	runner.run( "hash/page", std::string( "kernel=" ) + pageHashKernel(), pages, [&]( size_t iterations ) {
+		uint64_t digest = 0;
+
+		for ( size_t i = 0; i < iterations; ++i )
+			for ( size_t p = 0; p < pages; ++p )
+				digest ^= pageHash( buffer.data() + p * PAGE_SIZE );
+
+		keep( digest );
+	} );
+
+	// hashPages() over 16 MB worth of gfns, with the pages writable (every call maps and hashes
+	// them) and write-protected (the digests are cached)
+	BackendFactory factory( BackendFactory::BACKEND_MOCK );
+	MockConfig     config;
+
+	config.memorySize_ = 64ull << 20;
+
+	auto driver = mockDriver( factory, config );
+
+	std::vector<unsigned long long> gfns;
+	std::vector<uint64_t>           digests( 4096 );
+
+	for ( unsigned long long gfn = 0; gfn < digests.size(); ++gfn )
+		gfns.push_back( gfn * 3 ); // not contiguous
+
+	for ( bool cached : { false, true } ) {
+		if ( cached ) {
+			unsigned long long end = gfn_to_gpa( gfns.back() + 1 );
+
+			if ( !driver->setPageProtectionRange( 0, end, true, false, true, 0 ) )
+				throw std::runtime_error( "setPageProtectionRange() failed" );
+
+			driver->flushPageProtections();
+		}
+
+		std::string param = std::string( "cached=" ) + ( cached ? "yes" : "no" );
+
+		runner.run( "hash/pages", param, gfns.size(), [&]( size_t iterations ) {
+			for ( size_t i = 0; i < iterations; ++i )
+				if ( !driver->hashPages( gfns.data(), gfns.size(), digests.data() ) )
+					throw std::runtime_error( "hashPages() failed" );
+
+			keep( digests.front() );
+		} );
+	}
+}
+
+} // namespace bench
+} // namespace bdvmi
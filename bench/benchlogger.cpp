@@ -0,0 +1,113 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bench.h"
+#include "bdvmi/logger.h"
+#include <string>
+#include <utility>
+
+namespace bdvmi {
+namespace bench {
+
+namespace {
+
+using Level = std::ostream &( * )( std::ostream & );
+
+void logLines( Level level, size_t iterations )
+{
+	unsigned long long gpa = 0x7ff0e000;
+
+	for ( size_t i = 0; i < iterations; ++i )
+		logger << level << "Page fault at GPA " << HEXLOG( gpa + i ) << " on vCPU " << ( i & 7 ) << std::flush;
+}
+
+void logTraceLinesGuarded( size_t iterations )
+{
+	unsigned long long gpa = 0x7ff0e000;
+
+	for ( size_t i = 0; i < iterations; ++i )
+		BDVMI_LOG( TRACE ) << "Page fault at GPA " << HEXLOG( gpa + i ) << " on vCPU " << ( i & 7 )
+		                   << std::flush;
+}
+
+} // anonymous namespace
+
+void loggerBench( Runner &runner )
+{
+	if ( !runner.wanted( "logger/" ) )
+		return;
+
+	const std::pair<const char *, Level> levels[] = {
+		{ "debug", DEBUG }, { "info", INFO }, { "warning", WARNING }, { "error", ERROR }, { "trace", TRACE }
+	};
+
+	bool   trace = logger.trace();
+	size_t lines = 0;
+
+	// No sinks: the line is formatted, then thrown away
+	for ( auto &&level : levels )
+		runner.run( "logger/line", std::string( level.first ) + ",no_sink", 1,
+		            [&]( size_t iterations ) { logLines( level.second, iterations ); } );
+
+	// BDVMI_LOG() doesn't get past the level check
+	runner.run( "logger/guarded_line", "trace,no_sink", 1, logTraceLinesGuarded );
+
+	auto sink = [&]( const std::string &line ) { lines += line.size(); };
+
+	logger.debug( sink );
+	logger.info( sink );
+	logger.warning( sink );
+	logger.error( sink );
+
+	for ( bool enableTrace : { false, true } ) {
+		logger.trace( enableTrace );
+
+		for ( auto &&level : levels ) {
+			std::string param = level.first;
+
+			if ( level.second == TRACE )
+				param += enableTrace ? ",trace_on" : ",trace_off";
+			else if ( enableTrace )
+				continue;
+
+			runner.run( "logger/line", param, 1,
+			            [&]( size_t iterations ) { logLines( level.second, iterations ); } );
+		}
+
+		runner.run( "logger/guarded_line", enableTrace ? "trace,trace_on" : "trace,trace_off", 1,
+		            logTraceLinesGuarded );
+	}
+
+	// The sink runs on the background thread, the queue never fills up
+	logger.async( true, LogStreambuf::ASYNC_CAPACITY_DEFAULT, LogStreambuf::ASYNC_WAIT );
+
+	runner.run( "logger/line", "info,async", 1, [&]( size_t iterations ) {
+		logLines( INFO, iterations );
+		logger.drain();
+	} );
+
+	logger.async( false );
+
+	keep( lines );
+
+	logger.debug( nullptr );
+	logger.info( nullptr );
+	logger.warning( nullptr );
+	logger.error( nullptr );
+	logger.trace( trace );
+}
+
+} // namespace bench
+} // namespace bdvmi
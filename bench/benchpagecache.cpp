@@ -0,0 +1,104 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bench.h"
+#include "bdvmi/backendfactory.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/mockbackend.h"
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+namespace bench {
+
+namespace {
+
+// Map and unmap pages gfn 0 .. pages - 1, round robin, through the page cache
+void cycle( Driver &driver, size_t pages, size_t iterations, size_t &next )
+{
+	for ( size_t i = 0; i < iterations; ++i ) {
+		void *pointer = nullptr;
+
+		if ( driver.mapPhysMemToHost( gfn_to_gpa( next ), PAGE_SIZE, 0, pointer ) != MAP_SUCCESS )
+			throw std::runtime_error( "mapPhysMemToHost() failed" );
+
+		keep( *static_cast<char *>( pointer ) );
+		driver.unmapPhysMem( pointer );
+
+		if ( ++next == pages )
+			next = 0;
+	}
+}
+
+} // anonymous namespace
+
+void pageCacheBench( Runner &runner )
+{
+	if ( !runner.wanted( "pagecache/" ) )
+		return;
+
+	BackendFactory factory( BackendFactory::BACKEND_MOCK );
+	MockConfig     config;
+
+	for ( size_t limit : { 64, 1536, 16384 } ) {
+		config.memorySize_ = gfn_to_gpa( 2 * limit );
+
+		auto   driver = mockDriver( factory, config );
+		size_t next   = 0;
+
+		driver->setPageCacheLimit( limit );
+
+		std::string param = "limit=" + std::to_string( limit );
+
+		// update() + release() of a cached page
+		runner.run( "pagecache/hit", param, 1, [&]( size_t iterations ) {
+			cycle( *driver, limit / 2, iterations, next );
+		} );
+
+		// Twice as many pages as fit: every update() misses and makes cleanup() evict a page
+		next = 0;
+		runner.run( "pagecache/miss_evict", param, 1, [&]( size_t iterations ) {
+			cycle( *driver, 2 * limit, iterations, next );
+		} );
+	}
+
+	config.memorySize_ = gfn_to_gpa( 1024 );
+
+	auto driver = mockDriver( factory, config );
+
+	// updateRange() + releaseRange() of a cached multi-page view
+	for ( size_t count : { 2, 16, 256 } ) {
+		std::vector<unsigned long long> gfns;
+
+		for ( size_t i = 0; i < count; ++i )
+			gfns.push_back( i * 3 );
+
+		runner.run( "pagecache/range_hit", "pages=" + std::to_string( count ), count, [&]( size_t iterations ) {
+			for ( size_t i = 0; i < iterations; ++i ) {
+				void *pointer = nullptr;
+
+				if ( driver->mapGfns( gfns.data(), gfns.size(), 0, pointer ) != MAP_SUCCESS )
+					throw std::runtime_error( "mapGfns() failed" );
+
+				keep( *static_cast<char *>( pointer ) );
+				driver->unmapGfns( pointer, gfns.size() );
+			}
+		} );
+	}
+}
+
+} // namespace bench
+} // namespace bdvmi
@@ -0,0 +1,74 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bench.h"
+#include "bdvmi/backendfactory.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/mockbackend.h"
+#include <string>
+
+namespace bdvmi {
+namespace bench {
+
+void protectionBench( Runner &runner )
+{
+	if ( !runner.wanted( "protection/" ) )
+		return;
+
+	BackendFactory factory( BackendFactory::BACKEND_MOCK );
+	MockConfig     config;
+
+	for ( unsigned long long gfns : { 1000ull, 10000ull, 100000ull, 1000000ull } ) {
+		config.memorySize_ = gfn_to_gpa( gfns );
+
+		auto        driver  = mockDriver( factory, config );
+		bool        execute = false;
+		std::string param   = "gfns=" + std::to_string( gfns );
+
+		// Every gfn changes, so every one of them gets written out by the flush
+		runner.run( "protection/set_flush", param, gfns, [&]( size_t iterations ) {
+			for ( size_t i = 0; i < iterations; ++i ) {
+				execute = !execute;
+
+				for ( unsigned long long gfn = 0; gfn < gfns; ++gfn )
+					driver->setPageProtection( gfn_to_gpa( gfn ), true, false, execute );
+
+				driver->flushPageProtections();
+			}
+		} );
+
+		// Nothing changes, so there's nothing to flush
+		runner.run( "protection/set_unchanged", param, gfns, [&]( size_t iterations ) {
+			for ( size_t i = 0; i < iterations; ++i ) {
+				for ( unsigned long long gfn = 0; gfn < gfns; ++gfn )
+					driver->setPageProtection( gfn_to_gpa( gfn ), true, false, execute );
+
+				driver->flushPageProtections();
+			}
+		} );
+
+		runner.run( "protection/range_flush", param, gfns, [&]( size_t iterations ) {
+			for ( size_t i = 0; i < iterations; ++i ) {
+				execute = !execute;
+
+				driver->setPageProtectionRange( 0, gfn_to_gpa( gfns ), true, false, execute );
+				driver->flushPageProtections();
+			}
+		} );
+	}
+}
+
+} // namespace bench
+} // namespace bdvmi
@@ -0,0 +1,83 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bench.h"
+#include "bdvmi/backendfactory.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/mockbackend.h"
+
+namespace bdvmi {
+namespace bench {
+
+void registersBench( Runner &runner )
+{
+	if ( !runner.wanted( "registers/" ) )
+		return;
+
+	Registers source;
+	Registers target;
+
+	source.rip = 0xfffff80002c5c000;
+	source.cr3 = 0x187000;
+
+	runner.run( "registers/copy", "", 1, [&]( size_t iterations ) {
+		for ( size_t i = 0; i < iterations; ++i ) {
+			source.rax = i;
+			target     = source;
+			keep( target );
+		}
+	} );
+
+	runner.run( "registers/assign_groups", "writable", 1, [&]( size_t iterations ) {
+		for ( size_t i = 0; i < iterations; ++i ) {
+			source.rax = i;
+			target.assignGroups( source, Registers::GROUP_WRITABLE );
+			keep( target );
+		}
+	} );
+
+	runner.run( "registers/changed_groups", "", 1, [&]( size_t iterations ) {
+		for ( size_t i = 0; i < iterations; ++i ) {
+			source.rax = i;
+			keep( target.changedGroups( source ) );
+		}
+	} );
+
+	BackendFactory factory( BackendFactory::BACKEND_MOCK );
+	MockConfig     config;
+
+	config.memorySize_ = gfn_to_gpa( 16 );
+
+	auto driver = mockDriver( factory, config );
+
+	runner.run( "registers/driver", "registers", 1, [&]( size_t iterations ) {
+		for ( size_t i = 0; i < iterations; ++i ) {
+			driver->registers( 0, target );
+			keep( target );
+		}
+	} );
+
+	runner.run( "registers/driver", "cached_registers", 1, [&]( size_t iterations ) {
+		const Registers *regs = nullptr;
+
+		for ( size_t i = 0; i < iterations; ++i ) {
+			driver->cachedRegisters( 0, regs );
+			keep( regs );
+		}
+	} );
+}
+
+} // namespace bench
+} // namespace bdvmi
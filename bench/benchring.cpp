@@ -0,0 +1,155 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bench.h"
+#include "xcwrapper.h"
+#include "xenvmevent_v5.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+namespace bdvmi {
+namespace bench {
+
+namespace {
+
+// Xen's end of the vm_event ring
+void produce( vm_event_v5_front_ring_t &front, size_t count, size_t first )
+{
+	for ( size_t i = 0; i < count; ++i ) {
+		vm_event_request_v5_t *req = RING_GET_REQUEST( &front, front.req_prod_pvt );
+
+		memset( req, 0, sizeof( *req ) );
+
+		req->version           = 5;
+		req->reason            = 1;
+		req->vcpu_id           = ( first + i ) & 7;
+		req->u.mem_access.gfn  = first + i;
+		req->data.regs.x86.rip = 0xfffff80002c5c000 + i;
+
+		++front.req_prod_pvt;
+	}
+
+	RING_PUSH_REQUESTS( &front );
+}
+
+size_t consumeResponses( vm_event_v5_front_ring_t &front )
+{
+	size_t count = 0;
+
+	while ( RING_HAS_UNCONSUMED_RESPONSES( &front ) ) {
+		keep( RING_GET_RESPONSE( &front, front.rsp_cons )->u.mem_access.gfn );
+		++front.rsp_cons;
+		++count;
+	}
+
+	return count;
+}
+
+} // anonymous namespace
+
+// The ring handling steps of XenEventManager::waitForEvents(), getRequest(), handleRequest()
+// and putResponse(), without the handler and without the event channel notification
+void ringBench( Runner &runner )
+{
+	if ( !runner.wanted( "ring/" ) )
+		return;
+
+	void *page = nullptr;
+
+	if ( posix_memalign( &page, PAGE_SIZE, PAGE_SIZE ) )
+		throw std::runtime_error( "could not allocate the ring page" );
+
+	std::unique_ptr<void, void ( * )( void * )> pageGuard( page, free );
+
+	auto *                   sring = static_cast<vm_event_v5_sring_t *>( page );
+	vm_event_v5_front_ring_t front;
+	vm_event_v5_back_ring_t  back;
+	std::mutex               ringMutex;
+
+	SHARED_RING_INIT( sring );
+	FRONT_RING_INIT( &front, sring, PAGE_SIZE );
+	BACK_RING_INIT( &back, sring, PAGE_SIZE );
+
+	size_t ringSize = RING_SIZE( &back );
+
+	for ( size_t batch : { static_cast<size_t>( 1 ), ringSize } ) {
+		runner.run( "ring/request_response", "batch=" + std::to_string( batch ), 1, [&]( size_t iterations ) {
+			vm_event_request_v5_t  req;
+			vm_event_response_v5_t rsp;
+
+			for ( size_t done = 0; done < iterations; ) {
+				size_t count = std::min( batch, iterations - done );
+
+				produce( front, count, done );
+
+				for ( ;; ) {
+					{
+						std::lock_guard<std::mutex> lock( ringMutex );
+
+						if ( !RING_HAS_UNCONSUMED_REQUESTS( &back ) )
+							break;
+
+						RING_IDX reqCons = back.req_cons;
+
+						memcpy( &req, RING_GET_REQUEST( &back, reqCons ), sizeof( req ) );
+						++reqCons;
+
+						back.req_cons         = reqCons;
+						back.sring->req_event = reqCons + 1;
+					}
+
+					memset( &rsp, 0, sizeof( rsp ) );
+
+					rsp.vcpu_id            = req.vcpu_id;
+					rsp.flags              = req.flags;
+					rsp.reason             = req.reason;
+					rsp.altp2m_idx         = req.altp2m_idx;
+					rsp.data.regs.x86      = req.data.regs.x86;
+					rsp.version            = req.version;
+					rsp.u.mem_access.flags = req.u.mem_access.flags;
+					rsp.u.mem_access.gfn   = req.u.mem_access.gfn;
+
+					std::lock_guard<std::mutex> lock( ringMutex );
+
+					RING_IDX rspProd = back.rsp_prod_pvt;
+
+					memcpy( RING_GET_RESPONSE( &back, rspProd ), &rsp, sizeof( rsp ) );
+					back.rsp_prod_pvt = rspProd + 1;
+
+					if ( batch == 1 )
+						RING_PUSH_RESPONSES( &back );
+				}
+
+				if ( batch > 1 ) {
+					std::lock_guard<std::mutex> lock( ringMutex );
+					RING_PUSH_RESPONSES( &back );
+				}
+
+				if ( consumeResponses( front ) != count )
+					throw std::runtime_error( "lost ring responses" );
+
+				done += count;
+			}
+		} );
+	}
+}
+
+} // namespace bench
+} // namespace bdvmi
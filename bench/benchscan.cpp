@@ -0,0 +1,109 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bench.h"
+#include "patternscanner.h"
+#include "bdvmi/backendfactory.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/mockbackend.h"
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+namespace bench {
+
+namespace {
+
+// Pool tag / magic sized signatures, unlikely to occur in random data
+std::vector<std::string> signatures( size_t count )
+{
+	std::vector<std::string> patterns;
+	std::mt19937             rng( 42 );
+
+	for ( size_t i = 0; i < count; ++i ) {
+		std::string pattern( 4 + i % 13, '\0' );
+
+		for ( auto &&c : pattern )
+			c = static_cast<char>( rng() );
+
+		patterns.push_back( pattern );
+	}
+
+	return patterns;
+}
+
+} // anonymous namespace
+
+void scanBench( Runner &runner )
+{
+	if ( !runner.wanted( "scan/" ) )
+		return;
+
+	const size_t         pages = 256;
+	std::mt19937         rng( 7 );
+	std::vector<uint8_t> buffer( pages * PAGE_SIZE );
+
+	for ( auto &&b : buffer )
+		b = static_cast<uint8_t>( rng() );
+
+	// The kernel alone, over one batch worth of (already mapped) memory
+	for ( size_t count : { 1, 4, 16 } ) {
+		PatternScanner          scanner( signatures( count ) );
+		PatternScanner::Matches matches;
+
+		std::string param =
+		    std::string( "kernel=" ) + PatternScanner::kernelName() + ",patterns=" + std::to_string( count );
+
+		runner.run( "scan/kernel", param, pages, [&]( size_t iterations ) {
+			for ( size_t i = 0; i < iterations; ++i ) {
+				matches.clear();
+				scanner.scan( buffer.data(), buffer.size(), buffer.size(), matches );
+				keep( matches.size() );
+			}
+		} );
+	}
+
+	// The whole thing, mapping included, over a 64 MB guest
+	BackendFactory factory( BackendFactory::BACKEND_MOCK );
+	MockConfig     config;
+
+	config.memorySize_ = 64ull << 20;
+
+	auto                     driver   = mockDriver( factory, config );
+	std::vector<std::string> patterns = signatures( 4 );
+	size_t                   found    = 0;
+
+	auto count = [&found]( unsigned long long /* gpa */, size_t /* pattern */ ) {
+		++found;
+		return true;
+	};
+
+	for ( unsigned int threads : { 1, 4 } ) {
+		std::string param = "threads=" + std::to_string( threads );
+
+		runner.run( "scan/physical", param, gpa_to_gfn( config.memorySize_ ), [&]( size_t iterations ) {
+			for ( size_t i = 0; i < iterations; ++i )
+				if ( !driver->scanPhysical( 0, config.memorySize_, patterns, count, threads ) )
+					throw std::runtime_error( "scanPhysical() failed" );
+
+			keep( found );
+		} );
+	}
+}
+
+} // namespace bench
+} // namespace bdvmi
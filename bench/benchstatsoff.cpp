@@ -0,0 +1,43 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+// StatsCounter the way the translation units that define BDVMI_DISABLE_STATS see it
+#define BDVMI_DISABLE_STATS
+
+#include "bench.h"
+#include "bdvmi/statscollector.h"
+
+namespace bdvmi {
+namespace bench {
+
+void statsDisabledBench( Runner &runner )
+{
+	StatsCollector &collector = StatsCollector::instance();
+	bool            enabled   = collector.enabled();
+
+	collector.enable( true );
+
+	runner.run( "stats/counter", "compiled_out", 1, []( size_t iterations ) {
+		for ( size_t i = 0; i < iterations; ++i ) {
+			StatsCounter counter( "benchCounter" );
+			keep( counter );
+		}
+	} );
+
+	collector.enable( enabled );
+}
+
+} // namespace bench
+} // namespace bdvmi
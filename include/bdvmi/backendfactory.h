@@ -25,11 +25,15 @@ namespace bdvmi {
 class DomainWatcher;
 class Driver;
 class EventManager;
+struct MockConfig;
 
 class BackendFactory {
 
 public:
-	enum BackendType { BACKEND_XEN, BACKEND_KVM };
+	// BACKEND_REPLAY plays back an EventRecorder trace: driver() takes the trace path
+	// instead of a domain, and there's no domainWatcher(). BACKEND_MOCK simulates a guest
+	// as described by mockConfig() (see bdvmi/mockbackend.h).
+	enum BackendType { BACKEND_XEN, BACKEND_KVM, BACKEND_REPLAY, BACKEND_MOCK };
 
 public:
 	explicit BackendFactory( BackendType type );
@@ -41,12 +45,16 @@ public:
 
 	std::unique_ptr<EventManager> eventManager( Driver &driver, sig_atomic_t &sigStop );
 
+	// What the BACKEND_MOCK objects created from now on simulate
+	void mockConfig( const MockConfig &config );
+
 public:
 	BackendFactory( const BackendFactory & ) = delete;
 	BackendFactory &operator=( const BackendFactory & ) = delete;
 
 private:
-	BackendType type_;
+	BackendType                 type_;
+	std::shared_ptr<MockConfig> mockConfig_;
 };
 
 } // namespace bdvmi
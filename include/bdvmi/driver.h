@@ -20,8 +20,17 @@
 #include <boost/container/flat_map.hpp>
 #include <cstdlib>
 #include <cstring>
+#include <atomic>
+#include <functional>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "eventtrace.h"
+#include "pageattributes.h"
 
 #define PAGE_SHIFT 12
 #define PAGE_SIZE  ( 1UL << PAGE_SHIFT )
@@ -52,19 +61,63 @@
 namespace bdvmi {
 
 class PageCache;
+class PatternScanner;
 
 struct Registers {
 
 	enum GuestX86Mode { ERROR, CS_TYPE_16, CS_TYPE_32, CS_TYPE_64 };
 
-	uint64_t sysenter_cs{};
-	uint64_t sysenter_esp{};
-	uint64_t sysenter_eip{};
-	uint64_t msr_efer{};
-	uint64_t msr_star{};
-	uint64_t msr_lstar{};
-	uint64_t msr_pat{};
-	uint64_t msr_cstar{};
+	// Field groups, for tracking which parts of the state a write actually changes
+	enum Group : uint32_t {
+		GROUP_GPRS       = 0x01, // rax - r15
+		GROUP_RIP_RFLAGS = 0x02,
+		GROUP_SEGMENTS   = 0x04, // selectors, descriptor caches, fs/gs base, idtr, gdtr
+		GROUP_CONTROL    = 0x08, // cr0 - cr4
+		GROUP_MSRS       = 0x10,
+
+		GROUP_WRITABLE = GROUP_GPRS | GROUP_RIP_RFLAGS // what Driver::setRegisters() can change
+	};
+
+	// The groups in which *this and other differ
+	uint32_t changedGroups( const Registers &other ) const;
+
+	// Copy over the fields in groups from other
+	void assignGroups( const Registers &other, uint32_t groups );
+
+	// Get the value of one of the MSRs kept in here, false if msr isn't one of them
+	bool msr( uint32_t index, uint64_t &value ) const;
+
+	// What nearly every event looks at comes first: the GPRs, rip, rflags and the control
+	// registers take up the first three cache lines, segments and MSRs come after them
+	uint64_t rax{};
+	uint64_t rcx{};
+	uint64_t rdx{};
+	uint64_t rbx{};
+	uint64_t rsp{};
+	uint64_t rbp{};
+	uint64_t rsi{};
+	uint64_t rdi{};
+	uint64_t r8{};
+	uint64_t r9{};
+	uint64_t r10{};
+	uint64_t r11{};
+	uint64_t r12{};
+	uint64_t r13{};
+	uint64_t r14{};
+	uint64_t r15{};
+	uint64_t rip{};
+	uint64_t rflags{};
+	uint64_t cr3{};
+	uint64_t cr0{};
+	uint64_t cr2{};
+	uint64_t cr4{};
+
+	uint32_t     cs_arbytes{};
+	GuestX86Mode guest_x86_mode{ ERROR };
+
+	uint64_t fs_base{};
+	uint64_t gs_base{};
+	uint64_t shadow_gs{};
 
 	uint64_t cs_base{};
 	uint64_t cs_limit{};
@@ -87,59 +140,52 @@ struct Registers {
 	uint64_t gs_limit{};
 	uint64_t gs_sel{};
 	uint64_t gs_arbytes{};
-	uint64_t shadow_gs{};
 
-	uint64_t fs_base{};
-	uint64_t gs_base{};
 	uint64_t idtr_base{};
 	uint64_t idtr_limit{};
 	uint64_t gdtr_base{};
 	uint64_t gdtr_limit{};
 
-	uint64_t rax{};
-	uint64_t rcx{};
-	uint64_t rdx{};
-	uint64_t rbx{};
-	uint64_t rsp{};
-	uint64_t rbp{};
-	uint64_t rsi{};
-	uint64_t rdi{};
-	uint64_t r8{};
-	uint64_t r9{};
-	uint64_t r10{};
-	uint64_t r11{};
-	uint64_t r12{};
-	uint64_t r13{};
-	uint64_t r14{};
-	uint64_t r15{};
-	uint64_t rflags{};
-	uint64_t rip{};
-	uint64_t cr0{};
-	uint64_t cr2{};
-	uint64_t cr3{};
-	uint64_t cr4{};
-
-	uint32_t cs_arbytes{};
-
-	GuestX86Mode guest_x86_mode{ ERROR };
+	uint64_t sysenter_cs{};
+	uint64_t sysenter_esp{};
+	uint64_t sysenter_eip{};
+	uint64_t msr_efer{};
+	uint64_t msr_star{};
+	uint64_t msr_lstar{};
+	uint64_t msr_pat{};
+	uint64_t msr_cstar{};
 };
 
+// Only the first size_ bytes of data_ mean anything, so neither construction nor reset()
+// bother clearing the rest
 struct EmulatorContext {
 	void reset()
 	{
 		address_ = 0;
 		size_    = 0;
-		memset( data_, 0, sizeof( data_ ) );
 	}
 
 	uint64_t address_{};
 	uint32_t size_{};
-	uint8_t  data_[164]{};
+	uint8_t  data_[164];
 };
 
 enum MapReturnCode { MAP_SUCCESS, MAP_FAILED_GENERIC, MAP_PAGE_NOT_PRESENT, MAP_INVALID_PARAMETER };
 
+// Page cache counters, cumulative since the cache was created (see Driver::pageCacheStats())
+struct PageCacheStats {
+	unsigned long long hits{ 0 };
+	unsigned long long misses{ 0 };
+	unsigned long long evictions{ 0 };
+	unsigned long long notPresent{ 0 };  // MAP_PAGE_NOT_PRESENT failures
+	unsigned long long mapFailures{ 0 }; // other mapping failures
+	size_t             mapped{ 0 };      // currently mapped pages
+	size_t             pinned{ 0 };      // currently mapped pages that are in use
+	size_t             limit{ 0 };       // current limit (changes over time in adaptive mode)
+};
+
 class EventHandler;
+class EventRecorder;
 
 class Driver {
 
@@ -150,6 +196,20 @@ public:
 	using ViewConvertibleMap = boost::container::flat_map<uint16_t, ConvertibleMap>;
 	using MemAccessMap       = boost::container::flat_map<uint64_t, uint8_t>;
 	using ViewMemAccessMap   = boost::container::flat_map<uint16_t, MemAccessMap>;
+	using ViewPageAttributes = boost::container::flat_map<uint16_t, PageAttributeTable>;
+
+	// One element of a readPhysical() / writePhysical() scatter/gather list
+	struct PhysIoVec {
+		unsigned long long gpa{ 0 };
+		void *             buffer{ nullptr };
+		size_t             length{ 0 };
+	};
+
+	// Told about every scanPhysical() match: where it starts and which pattern it is (the
+	// index into the patterns vector). Return false to stop the scan.
+	using ScanCallback = std::function<bool( unsigned long long gpa, size_t pattern )>;
+
+	static constexpr unsigned int MAX_PAUSE_VCPUS = 64; // bits in a pauseVcpus() mask
 
 public:
 	Driver( EventHandler *handler = nullptr )
@@ -171,6 +231,18 @@ public:
 		return handler_;
 	}
 
+	// Tell r about every guest page and register set handed out from now on (nullptr to stop)
+	void recorder( EventRecorder *r )
+	{
+		recorder_ = r;
+	}
+
+	// The per-vCPU event timeline, filled in by the EventManager (disabled by default)
+	EventTrace &eventTrace()
+	{
+		return eventTrace_;
+	}
+
 public:
 	// Get VCPU count
 	virtual bool cpuCount( unsigned int &count ) const = 0;
@@ -185,16 +257,39 @@ public:
 	bool setPageProtection( unsigned long long guestAddress, bool read, bool write, bool execute,
 	                        unsigned short view = 0 );
 
+	// Set the protection of all the guest pages overlapping [gpaStart, gpaEnd) (_NOT_ virtual).
+	// Contiguous pages with the same protection are written out as ranges whenever the
+	// hypervisor interface supports it.
+	bool setPageProtectionRange( unsigned long long gpaStart, unsigned long long gpaEnd, bool read, bool write,
+	                             bool execute, unsigned short view = 0 );
+
 	// Get guest page protection (_NOT_ virtual)
 	bool getPageProtection( unsigned long long guestAddress, bool &read, bool &write, bool &execute,
 	                        unsigned short view = 0 );
 
+	// Query the protection of each guest page overlapping [gpaStart, gpaEnd) and cache it, so that
+	// getPageProtection() won't have to ask the hypervisor about them later (_NOT_ virtual). This
+	// runs on the calling thread, and on Xen still costs one hypercall per page; the cache lock is
+	// only held while storing the results, every PROTECTION_QUERY_BATCH pages.
+	bool cachePageProtectionRange( unsigned long long gpaStart, unsigned long long gpaEnd,
+	                               unsigned short view = 0 );
+
 	// Flush page protections (_NOT_ virtual)
 	void flushPageProtections();
 
 	// Get registers
 	virtual bool registers( unsigned short vcpu, Registers &regs ) const = 0;
 
+	// Zero-copy registers(): regs points into the per-vCPU register cache and stays valid until
+	// vcpu resumes (i.e. the end of the event being handled for it, or unpause()), so don't hold
+	// on to it past that. Fails quietly if vcpu can't be cached right now (it's running), in which
+	// case registers() should be used instead.
+	virtual bool cachedRegisters( unsigned short vcpu, const Registers *&regs ) const = 0;
+
+	// Get a single MSR, from the per-vCPU register cache if possible and otherwise
+	// in the cheapest way the backend can fetch it
+	virtual bool readMsr( unsigned short vcpu, uint32_t msr, uint64_t &value ) const = 0;
+
 	// Set registers
 	virtual bool setRegisters( unsigned short vcpu, const Registers &regs, bool setEip, bool delay ) = 0;
 
@@ -203,6 +298,46 @@ public:
 
 	virtual bool unmapPhysMem( void *hostPtr ) = 0;
 
+	// Map count guest frames, in the order given, into a single contiguous host view. On success,
+	// pointer is the (page-aligned) host address of gfns[0]. Release with unmapGfns( pointer, count ).
+	// Backends that can't map guest memory contiguously (KVM) return a snapshot instead: it is read
+	// when mapping and doesn't see later guest writes, and only the bytes changed through the view
+	// are written back to the guest by unmapGfns(). The guest's own writes to other bytes of those
+	// pages in the meantime are kept, concurrent writes to the same bytes are lost either way.
+	virtual MapReturnCode mapGfns( const unsigned long long *gfns, size_t count, uint32_t flags,
+	                               void *&pointer ) = 0;
+
+	virtual bool unmapGfns( void *hostPtr, size_t count ) = 0;
+
+	// Like mapPhysMemToHost(), but [address, address + length) may span several pages (_NOT_ virtual)
+	MapReturnCode mapPhysMemRange( unsigned long long address, size_t length, uint32_t flags, void *&pointer );
+
+	// Release a mapping obtained via mapPhysMemRange(), with the same length (_NOT_ virtual)
+	bool unmapPhysMemRange( void *hostPtr, size_t length );
+
+	// Copy length bytes of guest memory at gpa (which may cross pages) into buffer (_NOT_ virtual).
+	// Small chunks of pages that are not in the page cache get copied directly by drivers that
+	// support it, everything else goes through mapPhysMemToHost().
+	bool readPhysical( unsigned long long gpa, void *buffer, size_t length );
+
+	// Copy length bytes from buffer to guest memory at gpa (which may cross pages) (_NOT_ virtual)
+	bool writePhysical( unsigned long long gpa, const void *buffer, size_t length );
+
+	// Scatter/gather versions of the above (_NOT_ virtual)
+	bool readPhysical( const PhysIoVec *iov, size_t count );
+
+	bool writePhysical( const PhysIoVec *iov, size_t count );
+
+	// Find the occurrences of patterns (1 to PAGE_SIZE bytes each) that lie entirely inside
+	// [gpaStart, gpaEnd), SCAN_BATCH pages at a time, and hand them to callback (_NOT_ virtual).
+	// Pages that aren't present are skipped quietly. Matches come in address order, unless
+	// threads > 1 spreads the batches over that many threads: then callback, still called for one
+	// match at a time, runs on them too. False for bad parameters or present pages that couldn't
+	// be mapped (the rest of the range still gets scanned).
+	bool scanPhysical( unsigned long long gpaStart, unsigned long long gpaEnd,
+	                   const std::vector<std::string> &patterns, const ScanCallback &callback,
+	                   unsigned int threads = 1 );
+
 	virtual bool injectTrap( unsigned short vcpu, uint8_t trapNumber, uint32_t errorCode, uint64_t cr2 ) = 0;
 
 	virtual bool setRepOptimizations( bool enable ) = 0;
@@ -213,23 +348,98 @@ public:
 
 	virtual bool unpause() = 0;
 
+	// Stop just the vCPUs whose bits are set in mask (bit n is vCPU n, so only the first
+	// MAX_PAUSE_VCPUS can be picked), e.g. the ones that might touch what's being patched,
+	// until unpauseVcpus() lets them go (_NOT_ virtual). Calls nest per vCPU. Backends that
+	// can't stop single vCPUs pause the whole domain while any vCPU is paused.
+	bool pauseVcpus( uint64_t mask );
+
+	// (_NOT_ virtual)
+	bool unpauseVcpus( uint64_t mask );
+
+	// The vCPUs pauseVcpus() currently keeps stopped (_NOT_ virtual)
+	uint64_t pausedVcpus();
+
 	virtual size_t setPageCacheLimit( size_t limit ) = 0;
 
+	// Let the page cache grow or shrink its limit within [minLimit, maxLimit] depending on
+	// the observed miss rate (0, 0 turns this off and keeps the current limit)
+	virtual bool setPageCacheLimitRange( size_t minLimit, size_t maxLimit ) = 0;
+
+	virtual bool pageCacheStats( PageCacheStats &stats ) = 0;
+
+	// Once `pages' > 0, sequential page cache misses make the cache map the next `pages' gfns
+	virtual size_t setPageCacheReadAhead( size_t pages ) = 0;
+
+	// Hint that gfns are about to be mapped, so that they get mapped now (e.g. before resuming the VCPU)
+	virtual void prefetchGfns( const unsigned long long *gfns, size_t count ) = 0;
+
 	virtual bool getXSAVESize( unsigned short vcpu, size_t &size ) = 0;
 
 	virtual bool getXSAVEArea( unsigned short vcpu, void *buffer, size_t bufSize ) = 0;
 
+	// Translate gva by walking the page tables at cr3 with the paging mode of vcpu (_NOT_ virtual).
+	// A translation is only cached if every paging structure used for the walk is write-protected
+	// in all views via setPageProtection(), so that the event managers hear about writes to them.
+	// It then stays cached until that CR3 is written, paging is reconfigured, or one of those
+	// paging structures gets written.
+	bool translateGva( unsigned short vcpu, unsigned long long cr3, unsigned long long gva,
+	                   unsigned long long &gpa );
+
+	// Drop all cached translations (_NOT_ virtual)
+	void flushTranslations();
+
+	// Drop the cached translations for one address space (_NOT_ virtual)
+	void flushTranslations( unsigned long long cr3 );
+
+	// vcpu is about to write to gfn, drop whatever was translated through it or hashed from it
+	// (_NOT_ virtual)
+	void invalidateTranslations( unsigned short vcpu, unsigned long long gfn );
+
+	// vcpu has been resumed since its last invalidateTranslations() call (_NOT_ virtual)
+	void retireTranslationWrites( unsigned short vcpu );
+
 	// Get the maximum accessible guest frame number (_NOT_ virtual)
 	bool maxGPFN( unsigned long long &gfn );
 
+	// Have the backend log which guest pages get written to, from now on (_NOT_ virtual)
+	bool startDirtyTracking();
+
+	// (_NOT_ virtual)
+	bool stopDirtyTracking();
+
+	// Bit i of bitmap (bitmap[i / 64] >> ( i % 64 )) tells whether gfn firstGfn + i has been written
+	// to since startDirtyTracking(), or since the last fetchDirtyBitmap() that covered it (_NOT_
+	// virtual). Every call collects (and resets) the backend's log for the whole guest, what's
+	// outside [firstGfn, firstGfn + count) is kept for later calls.
+	bool fetchDirtyBitmap( unsigned long long firstGfn, size_t count, std::vector<uint64_t> &bitmap );
+
+	// digests[i] = a 64-bit hash of the contents of page gfns[i] (_NOT_ virtual). Digests are cached
+	// for as long as libbdvmi gets to hear about writes to their pages: while a page is write-protected
+	// in every view protections have been set for (the event managers report the write faults), or
+	// while dirty page tracking is on. writePhysical() drops them too, but writes through pointers
+	// from mapPhysMemToHost() and friends go unnoticed. With dirty tracking on, every call collects
+	// the backend's log for the whole guest first, so hash many pages per call.
+	bool hashPages( const unsigned long long *gfns, size_t count, uint64_t *digests );
+
+	// Drop all cached page digests (_NOT_ virtual)
+	void flushPageHashes();
+
 	virtual bool getEPTPageConvertible( unsigned short index, unsigned long long guestAddress,
 	                                    bool &convertible ) = 0;
 
 	bool setEPTPageConvertible( unsigned short index, unsigned long long guestAddress, bool convertible );
 
-	virtual bool createEPT( unsigned short &index ) = 0;
+	// Create a new (rwx) view. The protection cache knows about it from now on, so that pages
+	// don't count as write-protected until they are in this view too (_NOT_ virtual).
+	bool createEPT( unsigned short &index );
+
+	// Destroy a view, and drop its protection cache (_NOT_ virtual)
+	bool destroyEPT( unsigned short index );
 
-	virtual bool destroyEPT( unsigned short index ) = 0;
+	// Create a new view with srcView's page protections. The protection cache is shared
+	// with srcView (copy-on-write), flushing srcView's delayed writes first (_NOT_ virtual)
+	bool cloneEPT( unsigned short srcView, unsigned short &dstView );
 
 	virtual bool switchEPT( unsigned short index ) = 0;
 
@@ -247,7 +457,7 @@ public:
 
 	virtual void enableCache( unsigned short vcpu ) = 0;
 
-	virtual void disableCache() = 0;
+	virtual void disableCache( unsigned short vcpu ) = 0;
 
 	virtual uint32_t startTime() = 0;
 
@@ -267,30 +477,178 @@ public:
 
 	virtual bool getXCR0( unsigned short vcpu, uint64_t &xcr0 ) const = 0;
 
+	// Can this driver copy guest memory without mapping it?
+	virtual bool physCopySupported() const = 0;
+
+protected:
+	// For the backends, called with whatever mapPhysMemToHost(), mapGfns() and registers()
+	// are about to return (cheap enough when nothing is being recorded)
+	void recordPage( unsigned long long gfn, const void *page ) const;
+
+	void recordRegisters( unsigned short vcpu, const Registers &regs ) const;
+
+	// Dump the event trace (if EventTrace::fatalDumpPath() has been set) and flush the log, then
+	// tell the handler
+	void fatalError();
+
 private:
 	virtual void *mapGuestPageImpl( unsigned long long gfn ) = 0;
 
 	virtual void unmapGuestPageImpl( void *hostPtr, unsigned long long gfn ) = 0;
 
+	virtual void *mapGuestPagesImpl( const unsigned long long *gfns, size_t count ) = 0;
+
+	virtual void unmapGuestPagesImpl( void *hostPtr, size_t count ) = 0;
+
 	virtual bool setPageProtectionImpl( const MemAccessMap &accessMap, unsigned short view ) = 0;
 
 	virtual bool setPageConvertibleImpl( const ConvertibleMap &convMap, unsigned short view ) = 0;
 
+	virtual bool createEPTImpl( unsigned short &index ) = 0;
+
+	virtual bool destroyEPTImpl( unsigned short index ) = 0;
+
+	// Create dstView, copied == true if the backend has also given it srcView's page protections
+	// (otherwise cloneEPT() writes them out). The default is createEPTImpl(), copied == false.
+	virtual bool cloneEPTImpl( unsigned short srcView, unsigned short &dstView, bool &copied );
+
 	// Get guest page protection
 	virtual bool getPageProtectionImpl( unsigned long long guestAddress, bool &read, bool &write, bool &execute,
 	                                    unsigned short view ) = 0;
 
+	// Get the protection (PageRestriction bits) of count pages starting at firstGfn,
+	// PageAttributeTable::UNKNOWN for the ones that can't be queried
+	virtual bool getPageProtectionRangeImpl( unsigned long long firstGfn, size_t count, uint8_t *access,
+	                                         unsigned short view ) = 0;
+
 	virtual bool maxGPFNImpl( unsigned long long &gfn ) = 0;
 
+	// present[i] = can firstGfn + i be mapped?
+	virtual void probeGfnsImpl( unsigned long long firstGfn, size_t count, std::vector<bool> &present ) = 0;
+
+	// Turn the backend's dirty page log on / off
+	virtual bool startDirtyLogImpl() = 0;
+
+	virtual bool stopDirtyLogImpl() = 0;
+
+	// Set the bits of the gfns below pages that have been written to since the last call (or since
+	// startDirtyLogImpl()) in bitmap, which comes zeroed ( pages + 63 ) / 64 words long, and
+	// start over
+	virtual bool fetchDirtyLogImpl( unsigned long long pages, std::vector<uint64_t> &bitmap ) = 0;
+
+	// Direct copies, never crossing a page boundary (only used if physCopySupported())
+	virtual bool readPhysicalImpl( unsigned long long gpa, void *buffer, size_t length ) = 0;
+
+	virtual bool writePhysicalImpl( unsigned long long gpa, const void *buffer, size_t length ) = 0;
+
+	// Is gfn currently mapped by the page cache?
+	virtual bool isPageCached( unsigned long long gfn ) = 0;
+
+	// pauseVcpus() / unpauseVcpus() have just stopped / let go of vcpus, paused is everything
+	// they keep stopped now (vcpuPause_.mutex_ held)
+	virtual bool pauseVcpusImpl( uint64_t vcpus, uint64_t paused ) = 0;
+
+	virtual bool unpauseVcpusImpl( uint64_t vcpus, uint64_t paused ) = 0;
+
+private:
+	static constexpr size_t PHYS_COPY_MAX          = 512; // bytes, per page
+	static constexpr size_t PROTECTION_QUERY_BATCH = 512; // pages queried between cache updates
+
+	bool copyPhysical( unsigned long long gpa, char *buffer, size_t length, bool write );
+
+private:
+	static constexpr size_t SCAN_BATCH = 256; // pages probed, mapped and scanned together
+
+	using ScanMatches = std::vector<std::pair<unsigned long long, size_t>>; // ( gpa, pattern )
+
+	// scanPhysical() for one batch, [firstGfn, lastGfn] clipped to [gpaStart, gpaEnd). Returns the
+	// number of present pages that couldn't be mapped.
+	size_t scanBatch( const PatternScanner &scanner, unsigned long long firstGfn, unsigned long long lastGfn,
+	                  unsigned long long gpaStart, unsigned long long gpaEnd, ScanMatches &matches );
+
+private:
+	static constexpr size_t MAX_TRANSLATIONS = 16384; // cached translations + dependencies
+
+	// Software TLB: gva page -> gpa page, per CR3
+	struct TranslationCache {
+		using Dependents = std::vector<std::pair<uint64_t, uint64_t>>; // ( cr3, gva page )
+
+		struct AddressSpace {
+			std::unordered_map<uint64_t, uint64_t> translations_; // gva page -> gpa page
+			std::unordered_set<uint64_t>           walked_;       // paging structure gfns depended on
+		};
+
+		std::unordered_map<uint64_t, AddressSpace>   tlb_;
+		std::unordered_map<uint64_t, Dependents>     dependents_;    // paging structure gfn -> translations
+		std::unordered_map<unsigned short, uint64_t> pendingWrites_; // vcpu -> paging structure gfn
+		size_t                                       size_{ 0 };     // translations_ + dependents_ entries
+		std::atomic<bool>                            active_{ false };
+		std::mutex                                   mutex_;
+	};
+
+	static constexpr size_t MAX_PAGE_HASHES = 1 << 20; // cached page digests
+	static constexpr size_t HASH_BATCH      = 256;     // pages mapped and hashed together
+
+	// hashPages() digests of pages whose writes libbdvmi would hear about
+	struct PageHashCache {
+		std::unordered_map<uint64_t, uint64_t>       digests_;         // gfn -> digest
+		std::unordered_map<unsigned short, uint64_t> pendingWrites_;   // vcpu -> gfn
+		uint64_t                                     writes_{ 0 };     // invalidations so far
+		std::atomic<bool>                            active_{ false }; // hashPages() has been called
+		std::mutex                                   mutex_;
+	};
+
+	bool readPagingEntry( unsigned long long gpa, bool wide, uint64_t &entry );
+
+	void clearTranslationsLocked();
+
+	PageAttributeTable &accessTable( unsigned short view );
+
+	unsigned long long lastGfnBeforeHole( unsigned long long gfn );
+
+	// Is gfn write-protected in every view, with memAccessCacheMutex_ held? Delayed writes don't count,
+	// and neither do views (or gfns) the cache knows nothing about.
+	bool writeProtectedLocked( unsigned long long gfn ) const;
+
+	void dropPageHashes( unsigned long long firstGfn, unsigned long long lastGfn );
+
+	// Add the backend's dirty log to dirtyLog_.pending_ (dropping the digests of what's been written
+	// to), with dirtyLog_.mutex_ held
+	bool collectDirtyLogLocked();
+
 private:
 	EventHandler *     handler_{ nullptr };
-	ViewMemAccessMap   memAccessCache_;
-	ViewMemAccessMap   delayedMemAccessWrite_;
+	ViewPageAttributes memAccessCache_; // also tracks the delayed writes
+	MemAccessMap       flushScratch_;   // reused by flushPageProtections(), keeps its storage
 	ViewConvertibleMap delayedConvertibleWrite_;
-	std::mutex         memAccessCacheMutex_;
+	std::mutex         memAccessCacheMutex_; // taken before pageHashes_.mutex_
 	std::mutex         convertibleCacheMutex_;
 	std::mutex         maxGPFNMutex_;
 	unsigned long long maxGPFN_{ 0 };
+	TranslationCache   translations_;
+	PageHashCache      pageHashes_;
+
+	// What the backend's dirty log has reported and fetchDirtyBitmap() hasn't handed out yet
+	struct DirtyLog {
+		bool                  active_{ false };
+		std::vector<uint64_t> pending_; // one bit per gfn, from 0
+		std::vector<uint64_t> scratch_;
+		std::mutex            mutex_;
+	};
+
+	DirtyLog dirtyLog_;
+
+	// Per-vCPU pauseVcpus() nesting
+	struct VcpuPause {
+		unsigned int counts_[MAX_PAUSE_VCPUS]{};
+		uint64_t     paused_{ 0 }; // counts_[n] != 0
+		std::mutex   mutex_;
+	};
+
+	VcpuPause vcpuPause_;
+
+	std::atomic<EventRecorder *> recorder_{ nullptr };
+	EventTrace                   eventTrace_;
 
 	friend class PageCache;
 };
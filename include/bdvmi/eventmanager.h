@@ -16,9 +16,16 @@
 #ifndef __BDVMIEVENTMANAGER_H_INCLUDED__
 #define __BDVMIEVENTMANAGER_H_INCLUDED__
 
+#include "driver.h"
+#include "eventhandler.h"
 #include <signal.h>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace bdvmi {
 
@@ -70,9 +77,93 @@ public:
 
 	bool disableDescriptorEvents();
 
+	// Handle every pending event (but no more than budget of them, 0 for no limit) before
+	// replying to any, and then flush page protections and reply to all of them at once.
+	// Page protections are thus written out after EventHandler::runPostEvent(). Only the
+	// Xen backend batches, the others ignore this.
+	void batchEvents( bool enable, size_t budget = 0 )
+	{
+		batchEvents_ = enable;
+		batchBudget_ = budget;
+	}
+
+	// Handle events on a pool of `workers' threads (0, the default, handles them on the thread
+	// that called waitForEvents()). Events from the same vCPU are still handled one at a time
+	// and in order, but the EventHandler callbacks (runPreEvent() and runPostEvent() included)
+	// are then called from the worker threads, concurrently for different vCPUs, so they must
+	// be thread-safe. Batching is off while this is on. Takes effect on the next
+	// waitForEvents() call.
+	void parallelEvents( size_t workers )
+	{
+		workers_ = workers;
+	}
+
+	// After handling events, keep polling for new ones for up to usecs microseconds before
+	// going to sleep waiting for them (0, the default, always sleeps). This keeps a CPU busy
+	// in exchange for not paying for a wakeup when events come in bursts. The statistics
+	// tell whether it's worth it: "busyPollHits" counts the spins that found an event,
+	// "busyPollMisses" the ones that gave up, both with the time spent spinning.
+	void busyPoll( unsigned int usecs )
+	{
+		busyPollUs_ = usecs;
+	}
+
+	// Filters answer matching events right away with their action, without calling the
+	// EventHandler at all (not even runPreEvent() / runPostEvent()). Like the enable*Events()
+	// calls, they're not synchronised with the event loop: set them up from EventHandler
+	// callbacks or before waitForEvents() (only the latter with parallelEvents() on).
+
+	// A CR write matches if ( newValue & mask ) == value or, if relative is set,
+	// ( ( newValue ^ oldValue ) & mask ) == value, so ~0, 0, true catches writes of the value
+	// that's already there. action can be NONE, or SKIP_INSTRUCTION / EMULATE_NOWRITE to deny
+	// the write. Of several matching filters, the first one added wins.
+	bool addCrFilter( unsigned int cr, uint64_t mask, uint64_t value, HVAction action, bool relative = false );
+
+	// Same as addCrFilter(), for MSR writes
+	bool addMsrFilter( unsigned int msr, uint64_t mask, uint64_t value, HVAction action, bool relative = false );
+
+	// A page fault matches if its gfn is in [firstGfn, lastGfn] and all the kinds of access it
+	// reports are in access (Driver::PAGE_READ | PAGE_WRITE | PAGE_EXECUTE; writes often come
+	// with a read). action can be NONE (emulate the access) or ALLOW_VIRTUAL (retry it). If
+	// ranges overlap, any of the matching filters may be used.
+	bool addPageFaultFilter( unsigned long long firstGfn, unsigned long long lastGfn, uint8_t access,
+	                         HVAction action );
+
+	void clearFilters();
+
+	// Deferred replies, only for page faults so far. Called from EventHandler::handlePageFault(),
+	// defer() returns a token and the event doesn't get its reply when the callback returns (the
+	// action, instructionSize and emulatorCtx it sets are ignored). Instead, the vCPU stays
+	// stopped until complete() is called with the token, from any thread, while other vCPUs'
+	// events keep being handled. runPostEvent() still runs when the callback returns. defer()
+	// returns 0 if the current event can't be deferred. Whatever is still deferred when
+	// waitForEvents() returns gets completed with NONE.
+	uint64_t defer();
+
+	bool complete( uint64_t token, HVAction action, unsigned short instructionSize = 0,
+	               const EmulatorContext *emulatorCtx = nullptr );
+
 	// Loop waiting for events
 	virtual void waitForEvents() = 0;
 
+	// The other way to run the event loop, for serving many domains out of a few threads (see
+	// EventReactor): wait for pollFds() to become readable (level-triggered, they may change
+	// between calls), then call processPending(), which handles whatever is there without ever
+	// sleeping, but no more than budget events (0 for no limit), and returns how many it has
+	// handled. If that's budget, more may be pending, so call it again before waiting. The
+	// EventHandler is called back on the thread calling processPending(), parallelEvents() doesn't
+	// apply and only one thread at a time may call it. After stop() (or the guest going away),
+	// the next call completes whatever is still deferred and finished() becomes true. Don't mix
+	// with waitForEvents().
+	virtual std::vector<int> pollFds() = 0;
+
+	virtual size_t processPending( size_t budget = 0 ) = 0;
+
+	bool finished() const
+	{
+		return finished_;
+	}
+
 	// Stop the event loop
 	virtual void stop() = 0;
 
@@ -110,13 +201,100 @@ private:
 		return false;
 	}
 
+protected:
+	// Call ready() until it returns true or busyPollUs_ runs out, and count the outcome
+	bool spin( const std::function<bool()> &ready ) const;
+
+	// true (and the filter's action) if the event was filtered out
+	bool filterCr( unsigned int cr, uint64_t oldValue, uint64_t newValue, HVAction &action ) const;
+
+	bool filterMsr( unsigned int msr, uint64_t oldValue, uint64_t newValue, HVAction &action ) const;
+
+	bool filterPageFault( unsigned long long gfn, bool read, bool write, bool execute, HVAction &action ) const;
+
+	struct Completion {
+		HVAction        action_{ NONE };
+		unsigned short  instructionSize_{ 0 };
+		EmulatorContext emulatorCtx_;
+	};
+
+	using DeferredReply = std::function<bool( const Completion & )>;
+
+	// Bracket the EventHandler callbacks that may defer(). endDeferrable() returns the
+	// token if the callback did, 0 otherwise.
+	void beginDeferrable();
+
+	uint64_t endDeferrable();
+
+	// Hand over everything it takes to reply to the event behind token
+	void deferReply( uint64_t token, DeferredReply reply );
+
+	// Complete everything still deferred with NONE
+	void completeDeferred();
+
+	// Scratch space for handling one vCPU's events, reused from one event to the next, so it
+	// isn't zeroed every time: whoever fills it in has to cover all of regs_ (and reset()
+	// emulatorCtx_). Kept on cache lines of its own.
+	struct alignas( 64 ) EventContext {
+		Registers       regs_;
+		EmulatorContext emulatorCtx_;
+	};
+
+	// Allocate the contexts of vCPUs [0, count), never while events are being handled
+	void reserveEventContexts( unsigned int count );
+
+	// vcpu's context, or the calling thread's own one if reserveEventContexts() hasn't covered vcpu
+	EventContext &eventContext( unsigned short vcpu );
+
 protected:
 	sig_atomic_t &         sigStop_;
 	std::set<unsigned int> enabledCrs_;
 	std::set<unsigned int> enabledMsrs_;
+	bool                   batchEvents_{ false };
+	size_t                 batchBudget_{ 0 };
+	size_t                 workers_{ 0 };
+	unsigned int           busyPollUs_{ 0 };
+	bool                   finished_{ false }; // by processPending()
+
+private:
+	struct ValueFilter {
+		unsigned int index_; // CR or MSR number
+		uint64_t     mask_;
+		uint64_t     value_;
+		bool         relative_;
+		HVAction     action_;
+	};
+
+	struct PageFaultFilter {
+		unsigned long long firstGfn_;
+		unsigned long long lastGfn_;
+		uint8_t            access_;
+		HVAction           action_;
+	};
+
+	static bool matchValue( const std::vector<ValueFilter> &filters, unsigned int index, uint64_t oldValue,
+	                        uint64_t newValue, HVAction &action );
+
+	struct EventContextDeleter {
+		void operator()( EventContext *ctx ) const;
+	};
+
+	struct DeferredSlot {
+		DeferredReply reply_;              // empty until deferReply()
+		bool          completed_{ false }; // complete() got here before deferReply()
+		Completion    completion_;
+	};
 
 private:
-	EventHandler *handler_{ nullptr };
+	std::vector<ValueFilter>     crFilters_;
+	std::vector<ValueFilter>     msrFilters_;
+	std::vector<PageFaultFilter> pageFaultFilters_; // sorted by firstGfn_
+	unsigned long long           maxPageFaultSpan_{ 0 };
+	std::mutex                                 deferredMutex_;
+	std::unordered_map<uint64_t, DeferredSlot> deferred_;
+	uint64_t                                   nextToken_{ 1 };
+	std::vector<std::unique_ptr<EventContext, EventContextDeleter>> eventContexts_;
+	EventHandler *               handler_{ nullptr };
 	bool          breakpointEnabled_{ false };
 	bool          xsetbvEnabled_{ false };
 	bool          vmcallEnabled_{ false };
@@ -0,0 +1,120 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENTREACTOR_H_INCLUDED__
+#define __BDVMIEVENTREACTOR_H_INCLUDED__
+
+#include <signal.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace bdvmi {
+
+class EventManager;
+
+// Runs many domains' event loops in one process, instead of a forked process (and a
+// waitForEvents() loop) per domain: one epoll set over all the EventManagers' pollFds(), and
+// a few threads taking turns at processPending() for the domains that have work. Every turn
+// handles at most budget events, after which a domain that still has some goes to the back of
+// the queue, so a chatty guest can't starve the others. A domain is only handled by one thread
+// at a time, so its EventHandler callbacks never run concurrently.
+class EventReactor {
+
+public:
+	// Called once the EventManager is finished(), after the reactor has let go of it (so it
+	// may be destroyed from here)
+	using FinishedCallback = std::function<void( EventManager & )>;
+
+public:
+	// Throws std::runtime_error if the epoll set can't be created
+	EventReactor( sig_atomic_t &sigStop, size_t threads = 1, size_t budget = 64 );
+
+	~EventReactor();
+
+public:
+	// Start serving em (it must have a handler by now). Safe to call from any thread, and
+	// while run() is running. false if its fds can't be polled.
+	bool add( EventManager &em, FinishedCallback finished = nullptr );
+
+	// Stop serving em without finishing it, waiting for its turn to end if it's being
+	// handled. Not from em's own EventHandler callbacks.
+	void remove( EventManager &em );
+
+	size_t domains() const;
+
+	// Loop until sigStop (or stop()), then stop() every EventManager and keep going until
+	// they're all finished
+	void run();
+
+	void stop()
+	{
+		stop_ = true;
+	}
+
+public: // no copying around
+	EventReactor( const EventReactor & ) = delete;
+	EventReactor &operator=( const EventReactor & ) = delete;
+
+private:
+	struct Entry {
+		uint64_t         id_{ 0 }; // what epoll hands back, so stale events can't reach a new entry
+		EventManager *   em_{ nullptr };
+		FinishedCallback finished_;
+		std::vector<int> fds_;
+		bool             queued_{ false }; // on ready_
+		bool             busy_{ false };   // a thread is in its processPending()
+	};
+
+private:
+	void loop();
+
+	// Wait up to ms for fds to become readable and queue their domains. Called with lock held,
+	// releases it while waiting.
+	void poll( std::unique_lock<std::mutex> &lock, int ms );
+
+	// The fds are EPOLLONESHOT, so they stay quiet while their domain is handled
+	void rearm( const Entry &entry );
+
+	void queue( Entry *entry );
+
+	// Stop polling entry's fds and forget it
+	void drop( Entry *entry );
+
+private:
+	sig_atomic_t &                                       sigStop_;
+	const size_t                                         threads_;
+	const size_t                                         budget_;
+	int                                                  epollFd_{ -1 };
+	mutable std::mutex                                   mutex_;
+	std::condition_variable                              workAvailable_;
+	std::condition_variable                              idle_; // an entry's turn has ended
+	std::unordered_map<uint64_t, std::unique_ptr<Entry>> entries_;
+	std::deque<Entry *>                                  ready_;
+	uint64_t                                             nextId_{ 1 };
+	bool                                                 polling_{ false };
+	bool                                                 stopping_{ false };
+	std::atomic<bool>                                    stop_{ false };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENTREACTOR_H_INCLUDED__
@@ -0,0 +1,115 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENTRECORDER_H_INCLUDED__
+#define __BDVMIEVENTRECORDER_H_INCLUDED__
+
+#include "eventhandler.h"
+#include <stdint.h>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+namespace bdvmi {
+
+class Driver;
+struct Registers;
+
+// Writes the events an EventHandler gets to a file, together with the guest pages and
+// registers it is handed by the Driver while handling them, so that BACKEND_REPLAY can
+// later feed the very same events to an EventHandler without a hypervisor. It sits
+// between the EventManager and the real handler:
+//
+//	EventRecorder recorder( *driver, &handler );
+//
+//	if ( recorder.open( "guest.trace" ) )
+//		eventManager->handler( &recorder );
+//
+// Pages are captured when they are mapped (once per event), so before the handler gets
+// to write to them. Pages mapped outside of event callbacks are recorded too, on their
+// own. Safe to use with EventManager::parallelEvents().
+class EventRecorder : public EventHandler {
+
+public:
+	EventRecorder( Driver &driver, EventHandler *handler );
+
+	~EventRecorder() override;
+
+public:
+	// Truncates path, then starts recording
+	bool open( const std::string &path );
+
+	void close();
+
+public:
+	void handleCR( unsigned short vcpu, unsigned short crNumber, const Registers &regs, uint64_t oldValue,
+	               uint64_t newValue, HVAction &action ) override;
+
+	void handleMSR( unsigned short vcpu, uint32_t msr, uint64_t oldValue, uint64_t newValue,
+	                HVAction &action ) override;
+
+	void handlePageFault( unsigned short vcpu, const Registers &regs, uint64_t physAddress, uint64_t virtAddress,
+	                      bool read, bool write, bool execute, bool inGpt, HVAction &action,
+	                      EmulatorContext &emulatorCtx, unsigned short &instructionSize ) override;
+
+	void handleVMCALL( unsigned short vcpu, const Registers &regs ) override;
+
+	void handleXSETBV( unsigned short vcpu ) override;
+
+	bool handleBreakpoint( unsigned short vcpu, const Registers &regs, uint64_t gpa ) override;
+
+	void handleInterrupt( unsigned short vcpu, const Registers &regs, uint32_t vector, uint64_t errorCode,
+	                      uint64_t cr2 ) override;
+
+	void handleDescriptorAccess( unsigned short vcpu, const Registers &regs, unsigned int flags,
+	                             unsigned short &instructionLength, HVAction &action ) override;
+
+	void handleSessionOver( GuestState state ) override;
+
+	void handleFatalError() override;
+
+	void runPreEvent() override;
+
+	void runPostEvent() override;
+
+public: // called by Driver
+	void addPage( unsigned long long gfn, const void *page );
+
+	void addRegisters( unsigned short vcpu, const Registers &regs );
+
+public: // no copying around
+	EventRecorder( const EventRecorder & ) = delete;
+	EventRecorder &operator=( const EventRecorder & ) = delete;
+
+private:
+	// The record being put together for the event the current thread is handling
+	struct Pending;
+
+	void write( const Pending &pending );
+
+	static thread_local Pending *current_;
+
+private:
+	Driver &      driver_;
+	EventHandler *handler_;
+	std::mutex    mutex_;
+	std::ofstream file_;
+	uint64_t      offset_{ 0 }; // where the next record goes
+	bool          failed_{ false };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENTRECORDER_H_INCLUDED__
@@ -0,0 +1,236 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENTTRACE_H_INCLUDED__
+#define __BDVMIEVENTTRACE_H_INCLUDED__
+
+#include "statscollector.h"
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+
+// A flight recorder for events: every vCPU gets a fixed-size ring of binary records (one per
+// event, stamped with StatsCollector::timestamp()), overwritten oldest first. Recording costs a
+// few timestamps and relaxed stores per event, and nothing but a relaxed load while disabled, so
+// it can stay on in production. dump() writes what the rings hold to a file, toChromeTrace()
+// turns such a file into Trace Event JSON (chrome://tracing, https://ui.perfetto.dev).
+class EventTrace {
+
+public:
+	enum EventType : uint8_t {
+		CR,
+		MSR,
+		PAGE_FAULT,
+		VMCALL,
+		XSETBV,
+		BREAKPOINT,
+		INTERRUPT,
+		DESCRIPTOR,
+		SINGLESTEP,
+		OTHER
+	};
+
+	// Record::flags_
+	static constexpr uint8_t FLAG_DEFERRED = 1 << 0; // replied_ is when the reply was deferred
+
+	// All the times are timestamp()s. handlerStart_ is 0 for events that were answered by a filter
+	// (see EventManager::filterCr() and friends) without calling the handler.
+	struct Record {
+		uint64_t sequence_;     // 1-based, per vCPU
+		uint64_t received_;     // read off the ring / socket
+		uint64_t handlerStart_; // EventHandler::runPreEvent() is about to be called
+		uint64_t handlerEnd_;   // EventHandler::runPostEvent() has returned
+		uint64_t replied_;      // the reply is on its way (or queued, when replies are batched)
+		uint64_t arg_;          // gpa for page faults, CR / MSR number, interrupt vector
+		uint32_t hypercalls_;   // issued while handling the event
+		uint32_t pageCacheMisses_;
+		uint16_t vcpu_;
+		uint8_t  type_; // EventType
+		uint8_t  flags_;
+		uint32_t reserved_;
+	};
+
+	static_assert( sizeof( Record ) == 64, "Record should be one cache line" );
+
+	// The dump file starts with a FileHeader, followed by records_ Records sorted by received_
+	static constexpr char     MAGIC[8] = { 'B', 'D', 'V', 'M', 'I', 'E', 'V', 'T' };
+	static constexpr uint32_t VERSION  = 1;
+
+	struct FileHeader {
+		char     magic_[8];
+		uint32_t version_;
+		uint32_t recordSize_; // sizeof( Record )
+		uint64_t nsPerTick_;  // 32.32 fixed point, timestamp() units -> ns
+		uint64_t records_;
+	};
+
+	static constexpr size_t MAX_VCPUS       = 256;
+	static constexpr size_t DEFAULT_RECORDS = 4096; // per vCPU
+
+	// Fills out one Record, from construction (received_) to destruction (replied_). Handler
+	// times come from handlerStart() / handlerEnd(), which go to the thread's innermost Scope, so
+	// the code in between doesn't need to know about it.
+	class Scope {
+
+	public:
+		Scope( EventTrace &trace, unsigned short vcpu, EventType type, uint64_t arg = 0,
+		       uint64_t received = 0 )
+		{
+			if ( trace.enabled() )
+				begin( trace, vcpu, type, arg, received );
+		}
+
+		~Scope()
+		{
+			if ( trace_ )
+				end();
+		}
+
+	public:
+		void flags( uint8_t flags )
+		{
+			record_.flags_ |= flags;
+		}
+
+		// The reply has been sent (by default, that's assumed to happen when the Scope ends)
+		void replied()
+		{
+			if ( trace_ )
+				record_.replied_ = StatsCollector::timestamp();
+		}
+
+	public:
+		Scope( const Scope & ) = delete;
+		Scope &operator=( const Scope & ) = delete;
+
+	private:
+		void begin( EventTrace &trace, unsigned short vcpu, EventType type, uint64_t arg, uint64_t received );
+
+		void end();
+
+	private:
+		EventTrace *trace_{ nullptr };
+		Scope *     previous_{ nullptr };
+		uint32_t    hypercalls_{ 0 };
+		uint32_t    pageCacheMisses_{ 0 };
+		Record      record_{};
+
+		friend class EventTrace;
+	};
+
+public:
+	EventTrace() = default;
+
+	~EventTrace();
+
+public:
+	// records (per vCPU, rounded up to a power of 2) only matters until the first event is
+	// recorded, the rings never change size after that
+	void enable( bool value, size_t records = DEFAULT_RECORDS );
+
+	bool enabled() const
+	{
+		return enable_.load( std::memory_order_relaxed );
+	}
+
+	// Where a handleFatalError() dumps the rings to (empty, the default: nowhere)
+	void fatalDumpPath( const std::string &path );
+
+	// Write all the records currently in the rings to path. Safe to call while events are
+	// being recorded, records that get overwritten while they're being copied are left out.
+	bool dump( const std::string &path ) const;
+
+	// Called right before EventHandler::handleFatalError()
+	void fatalError() const;
+
+	// Convert a dump() file to Trace Event JSON: one "thread" per vCPU, every event a slice from
+	// received_ to replied_, with the handler as a nested slice and the counts as arguments
+	static bool toChromeTrace( const std::string &dumpPath, const std::string &jsonPath );
+
+	// For the backends: a hypercall / the page cache had to map a page, on this thread
+	static void countHypercall()
+	{
+		++hypercalls_;
+	}
+
+	static void countPageCacheMiss()
+	{
+		++pageCacheMisses_;
+	}
+
+	static void handlerStart()
+	{
+		if ( current_ )
+			current_->record_.handlerStart_ = StatsCollector::timestamp();
+	}
+
+	static void handlerEnd()
+	{
+		if ( current_ )
+			current_->record_.handlerEnd_ = StatsCollector::timestamp();
+	}
+
+	// received for Scope, when the event is handled somewhere else than where it's read
+	uint64_t receivedTimestamp() const
+	{
+		return enabled() ? StatsCollector::timestamp() : 0;
+	}
+
+public:
+	EventTrace( const EventTrace & ) = delete;
+	EventTrace &operator=( const EventTrace & ) = delete;
+
+private:
+	static constexpr size_t WORDS = sizeof( Record ) / sizeof( uint64_t );
+
+	// A record, stored as relaxed atomics so that dump() can read it while it's being written.
+	// words_[0] (the sequence number) is 0 while the rest is being rewritten.
+	struct Slot {
+		std::array<std::atomic<uint64_t>, WORDS> words_;
+	};
+
+	struct Ring {
+		explicit Ring( size_t size );
+
+		std::atomic<uint64_t>   head_{ 0 }; // records written so far, only the writer touches it
+		size_t                  mask_;
+		std::unique_ptr<Slot[]> slots_;
+	};
+
+	Ring *ring( unsigned short vcpu );
+
+	void write( const Record &record );
+
+private:
+	static thread_local uint32_t hypercalls_;
+	static thread_local uint32_t pageCacheMisses_;
+	static thread_local Scope *  current_;
+
+	std::atomic_bool                           enable_{ false };
+	size_t                                     records_{ DEFAULT_RECORDS };
+	std::array<std::atomic<Ring *>, MAX_VCPUS> rings_{};
+	std::string                                fatalDumpPath_;
+	mutable std::mutex                         mutex_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENTTRACE_H_INCLUDED__
@@ -26,6 +26,12 @@
 
 #define HEXLOG( v ) std::hex << std::showbase << v << std::dec
 
+// BDVMI_LOG( TRACE ) << "gfn " << HEXLOG( gfn ) << std::flush; is logger << TRACE << ..., except
+// that nothing after the level is evaluated, let alone formatted, if the line would be dropped
+#define BDVMI_LOG( level )                                                                                             \
+	!bdvmi::logger.enabled( bdvmi::LogStreambuf::level ) ? ( void )0                                               \
+	                                                     : bdvmi::LogVoidify() & bdvmi::logger << bdvmi::level
+
 namespace bdvmi {
 
 std::ostream &DEBUG( std::ostream &os );
@@ -43,12 +49,31 @@ class LogStreambuf : public std::streambuf {
 public:
 	enum LogLevel { DEBUG, INFO, WARNING, ERROR, TRACE };
 
+	// What happens to a line logged while the async queue is full
+	enum AsyncOverflow {
+		ASYNC_DROP, // throw it away (and count it, see LogStream::dropped())
+		ASYNC_WAIT  // wait for the background thread to make room
+	};
+
+	static constexpr size_t ASYNC_CAPACITY_DEFAULT = 4096; // lines
+	static constexpr size_t ASYNC_LINE_RESERVE     = 256;  // bytes pre-allocated per queued line
+
 private:
 	struct Buffer {
 		std::string contents_;
 		LogLevel    level_{ DEBUG };
 	};
 
+	// Marks the thread's buffers as gone when they're destroyed, since loggers (usually global
+	// objects) may still be flushed after that
+	struct Buffers {
+		~Buffers();
+
+		std::unordered_map<long, Buffer> map_;
+	};
+
+	struct AsyncQueue;
+
 public:
 	LogStreambuf();
 	~LogStreambuf();
@@ -56,25 +81,74 @@ public:
 public:
 	void level( LogLevel level );
 
+	// Is there a sink for level (and, for TRACE, is tracing on)?
+	bool enabled( LogLevel level ) const
+	{
+		return enabledLevels_.load( std::memory_order_relaxed ) & ( 1U << level );
+	}
+
 private:
 	int_type        overflow( int_type c ) override;
 	std::streamsize xsputn( const char_type *s, std::streamsize n ) override;
 	int_type        sync() override;
 
+	// The thread's buffer for this logger (nullptr once the thread's buffers are gone)
+	Buffer *buffer()
+	{
+		if ( cachedIndex_ == index_ )
+			return cachedBuffer_;
+
+		return lookupBuffer();
+	}
+
+	Buffer *lookupBuffer();
+
+	void updateEnabledLevels();
+
+	// Hand line to its level's sink; false for an unknown level
+	bool deliver( LogLevel level, const std::string &line ) const;
+
+	// Queue (or, with ASYNC_DROP and a full queue, drop) buffer's line; false if it has to be
+	// delivered synchronously after all, because the background thread is gone
+	bool pushAsync( const Buffer &buffer );
+
+	void async( bool value, size_t capacity, AsyncOverflow overflow );
+
+	void drain();
+
+	unsigned long long dropped() const;
+
+	void runAsync();
+
 private:
-	thread_local static std::unordered_map<long, Buffer> buffers_;
-	static std::atomic_long                              indexGenerator_;
-	long                                                 index_{ 0 };
-	LogHelperFunction                                    debug_;
-	LogHelperFunction                                    error_;
-	LogHelperFunction                                    info_;
-	LogHelperFunction                                    warning_;
-	std::atomic_bool                                     trace_{ false };
-	std::string                                          prefix_;
+	thread_local static Buffers  buffers_;
+	thread_local static bool     buffersGone_;
+	thread_local static long     cachedIndex_;
+	thread_local static Buffer * cachedBuffer_;
+	static std::atomic_long      indexGenerator_;
+	long                         index_{ 0 };
+	LogHelperFunction            debug_;
+	LogHelperFunction            error_;
+	LogHelperFunction            info_;
+	LogHelperFunction            warning_;
+	std::atomic_bool             trace_{ false };
+	std::atomic<unsigned int>    enabledLevels_{ 0 }; // 1 << LogLevel, for every level with a sink
+	std::string                  prefix_;
+	thread_local static bool     inAsyncThread_;
+	std::atomic_bool             asyncOn_{ false };
+	AsyncQueue *                 queue_{ nullptr }; // created by the first async( true ), then kept
+	std::mutex                   asyncMutex_;
 
 	friend class LogStream;
 };
 
+// Swallows the stream, so that both branches of BDVMI_LOG() are void
+struct LogVoidify {
+	void operator&( std::ostream & )
+	{
+	}
+};
+
 class LogStream : public std::ostream {
 
 public:
@@ -86,21 +160,25 @@ public:
 	void debug( LogHelperFunction fn )
 	{
 		lsb_.debug_ = std::move( fn );
+		lsb_.updateEnabledLevels();
 	}
 
 	void error( LogHelperFunction fn )
 	{
 		lsb_.error_ = std::move( fn );
+		lsb_.updateEnabledLevels();
 	}
 
 	void info( LogHelperFunction fn )
 	{
 		lsb_.info_ = std::move( fn );
+		lsb_.updateEnabledLevels();
 	}
 
 	void warning( LogHelperFunction fn )
 	{
 		lsb_.warning_ = std::move( fn );
+		lsb_.updateEnabledLevels();
 	}
 
 	bool trace() const
@@ -111,6 +189,12 @@ public:
 	void trace( bool value )
 	{
 		lsb_.trace_ = value;
+		lsb_.updateEnabledLevels();
+	}
+
+	bool enabled( LogStreambuf::LogLevel level ) const
+	{
+		return lsb_.enabled( level );
 	}
 
 	void prefix( const std::string &prefix )
@@ -118,6 +202,29 @@ public:
 		lsb_.prefix_ = prefix;
 	}
 
+	// Call the sinks from a background thread, so that a slow sink doesn't hold up the thread that
+	// logs. Lines go through a lock-free queue of capacity (rounded up to a power of 2) pre-allocated
+	// lines, which only matters the first time, and are delivered in batches. Set the sinks up first,
+	// and, since threads don't survive fork(), switch this on after forking. Switching it off (or
+	// destroying the logger) delivers everything still queued.
+	void async( bool value, size_t capacity = LogStreambuf::ASYNC_CAPACITY_DEFAULT,
+	            LogStreambuf::AsyncOverflow overflow = LogStreambuf::ASYNC_DROP )
+	{
+		lsb_.async( value, capacity, overflow );
+	}
+
+	// Wait until the lines queued so far have reached the sinks (a no-op if not async)
+	void drain()
+	{
+		lsb_.drain();
+	}
+
+	// Lines lost to a full queue, with ASYNC_DROP
+	unsigned long long dropped() const
+	{
+		return lsb_.dropped();
+	}
+
 private:
 	LogStreambuf lsb_;
 };
@@ -0,0 +1,73 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMOCKBACKEND_H_INCLUDED__
+#define __BDVMIMOCKBACKEND_H_INCLUDED__
+
+#include "driver.h"
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+
+// One event for BACKEND_MOCK to deliver
+struct MockEvent {
+	enum Type { CR, MSR, PAGE_FAULT, VMCALL, XSETBV, BREAKPOINT, INTERRUPT, DESCRIPTOR };
+
+	Type           type_{ PAGE_FAULT };
+	unsigned short vcpu_{ 0 };
+
+	// CR: index_ is the CR number, MSR: the MSR, interrupt: the vector, descriptor access:
+	// BDVMI_DESC_ACCESS_* flags
+	uint32_t index_{ 0 };
+	uint64_t oldValue_{ 0 };  // CR, MSR
+	uint64_t newValue_{ 0 };  // CR, MSR
+	uint64_t gpa_{ 0 };       // page fault, breakpoint
+	uint64_t gva_{ 0 };       // page fault
+	uint8_t  access_{ 0 };    // page fault, Driver::PAGE_* bits
+	uint64_t errorCode_{ 0 }; // interrupt
+	uint64_t cr2_{ 0 };       // interrupt
+
+	// What Driver::registers() returns for vcpu_ from now on, and what the handler is given
+	Registers regs_;
+};
+
+// What BACKEND_MOCK simulates. All latencies are in nanoseconds and get busy-waited, so
+// that they show up as CPU time the way real hypercalls (mostly) do; 0 means "free".
+struct MockConfig {
+	unsigned long long memorySize_{ 256ull << 20 }; // bytes of (zeroed) guest memory
+	unsigned int       vcpus_{ 1 };
+
+	unsigned int mapLatency_{ 0 };        // per page mapped or unmapped
+	unsigned int protectionLatency_{ 0 }; // per page whose protection is set or queried
+	unsigned int registersLatency_{ 0 };  // per register query or write
+	unsigned int eventLatency_{ 0 };      // per event, between getting it and replying to it
+
+	// The events delivered by waitForEvents(), loops_ times over (0 means forever, i.e.
+	// until stop()). If generator_ is set, it's called instead for every event, and
+	// waitForEvents() returns once it returns false.
+	std::vector<MockEvent>             events_;
+	size_t                             loops_{ 1 };
+	std::function<bool( MockEvent & )> generator_;
+
+	// What the domain watcher reports, once
+	std::vector<std::string> domains_{ "00000000-0000-0000-0000-000000000001" };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMOCKBACKEND_H_INCLUDED__
@@ -0,0 +1,104 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIPAGEATTRIBUTES_H_INCLUDED__
+#define __BDVMIPAGEATTRIBUTES_H_INCLUDED__
+
+#include <stdint.h>
+#include <boost/container/flat_map.hpp>
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace bdvmi {
+
+// Packed gfn -> rwx (Driver::PageRestriction bits) table, 3 bits per gfn, plus a
+// one bit per gfn dirty bitmap. Guest memory is covered by lazily allocated chunks,
+// so both set() and get() are O(1) and only touched regions cost memory. Gfns past
+// the range given to reserve() still work, they just go through a hash lookup.
+// Tables made by cloneFrom() share their chunks until one of them writes to one.
+// Not thread-safe, Driver serializes access (for all the tables sharing chunks).
+class PageAttributeTable {
+
+public:
+	// -w- is never a valid EPT setting (it's a misconfiguration), so it means "don't know"
+	static constexpr uint8_t UNKNOWN = 0x02;
+
+	static constexpr size_t SLOTS_PER_WORD  = 21; // 3 bits each, the top bit of every word is unused
+	static constexpr size_t WORDS_PER_CHUNK = 512;
+	static constexpr size_t CHUNK_GFNS      = SLOTS_PER_WORD * WORDS_PER_CHUNK;
+	static constexpr size_t MAX_DIRECT      = 1 << 16; // chunks (~2.6 TB of guest memory)
+
+private:
+	struct Chunk {
+		// Attributes are stored XOR-ed with UNKNOWN, so that zeroed memory reads back as UNKNOWN
+		uint64_t attrs_[WORDS_PER_CHUNK]{};
+		uint64_t dirty_[( CHUNK_GFNS + 63 ) / 64]{};
+		bool     onDirtyList_{ false };
+	};
+
+public:
+	using AccessMap = boost::container::flat_map<uint64_t, uint8_t>;
+
+public:
+	// Size the directory for gfns up to maxGfn
+	void reserve( unsigned long long maxGfn );
+
+	// Returns UNKNOWN for gfns that have never been set()
+	uint8_t get( unsigned long long gfn ) const;
+
+	// dirty == true: also remember that gfn needs to be written out by takeDirty()
+	void set( unsigned long long gfn, uint8_t attr, bool dirty );
+
+	bool dirty() const
+	{
+		return !dirtyChunks_.empty();
+	}
+
+	// Is gfn waiting to be written out by takeDirty()?
+	bool dirty( unsigned long long gfn ) const;
+
+	// Append all the dirty gfns (in ascending order) and their attributes to accessMap,
+	// and mark them clean
+	void takeDirty( AccessMap &accessMap );
+
+	// Append every gfn whose attribute is known and isn't skip (in ascending order) to accessMap
+	void collect( AccessMap &accessMap, uint8_t skip ) const;
+
+	// Become a copy of other, without its dirty state. O(number of chunks), the chunks
+	// themselves are only copied by the first set() that touches them.
+	void cloneFrom( const PageAttributeTable &other );
+
+	// Forget everything
+	void clear();
+
+private:
+	Chunk *chunk( size_t index ) const;
+
+	// Also makes shared chunks private, so the result can be written to
+	Chunk *chunk( size_t index, bool create );
+
+private:
+	// Shared chunks are never on a dirty list, set() unshares them first
+	std::vector<std::shared_ptr<Chunk>>                chunks_;
+	std::unordered_map<size_t, std::shared_ptr<Chunk>> farChunks_;
+	std::vector<size_t>                                dirtyChunks_;
+	size_t                                             dirtyCount_{ 0 };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIPAGEATTRIBUTES_H_INCLUDED__
@@ -17,24 +17,92 @@
 #define __BDVMIPAGECACHE_H_INCLUDED__
 
 #include "driver.h"
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 namespace bdvmi {
 
+// Safe for concurrent use. Pages are spread over SHARD_COUNT independently locked
+// shards by a hash of the gfn, so threads mapping different pages rarely contend; the
+// price is that the LRU order is only kept per shard, i.e. eviction is approximate. The
+// size limit is global: a shard may use more than its share while the others leave room,
+// and gives it back when a shard that's under its share needs it.
 class PageCache {
 
 public:
-	static constexpr size_t MAX_CACHE_SIZE_DEFAULT = 1536; // pages
+	static constexpr size_t MAX_CACHE_SIZE_DEFAULT       = 1536; // pages
+	static constexpr size_t MAX_RANGE_CACHE_SIZE_DEFAULT = 64;   // multi-page views
+	static constexpr size_t SHARD_COUNT                  = 16;   // power of 2
+	static constexpr size_t MAX_READ_AHEAD               = 64;   // pages
+	static constexpr size_t READ_AHEAD_THRESHOLD         = 2;    // sequential misses
+	static constexpr size_t MAX_READ_AHEAD_BACKLOG       = 256;  // gfns waiting for the read-ahead thread
+	static constexpr size_t MIN_CACHE_SIZE               = 50;   // pages, magic number!
+	static constexpr size_t ADAPT_WINDOW                 = 4096; // lookups between limit adjustments
+	static constexpr size_t ADAPT_GROW_MISS_PERCENT      = 5;
+	static constexpr size_t ADAPT_SHRINK_MISS_PERCENT    = 1;
+	static constexpr size_t ADAPT_SHRINK_DELAY           = 8;    // windows without shrinking after growing
 
 private:
+	// Idle (inUse == 0) gfns, most recently released first. Pages that are
+	// still in use are never on this list, so eviction never has to skip them.
+	using LRUList = std::list<unsigned long>;
+
 	struct CacheInfo {
-		unsigned long accessed{ 0 };
-		void *        pointer{ nullptr };
-		short         inUse{ 1 };
+		void *            pointer{ nullptr };
+		std::atomic<int>  inUse{ 1 };
+		bool              onLru{ false };
+		LRUList::iterator lruPos;
+	};
+
+	struct ReverseInfo {
+		unsigned long gfn{ 0 };
+		CacheInfo *   info{ nullptr };
 	};
 
 	using CacheMap        = std::unordered_map<unsigned long, CacheInfo>;
-	using ReverseCacheMap = std::unordered_map<void *, unsigned long>;
+	using ReverseCacheMap = std::unordered_map<void *, ReverseInfo>;
+
+	struct Shard {
+		std::mutex mutex_;
+		CacheMap   cache_;
+		LRUList    lru_;
+	};
+
+	struct ReverseShard {
+		std::mutex      mutex_;
+		ReverseCacheMap reverseCache_;
+	};
+
+	// Multi-page views (see Driver::mapGfns()) are cached separately, keyed by the
+	// exact gfn list they were created for, and follow the same refcounting rules.
+	struct RangeInfo;
+
+	using RangeCacheMap        = std::map<std::vector<unsigned long long>, RangeInfo>;
+	using RangeLRUList         = std::list<RangeCacheMap::iterator>;
+	using ReverseRangeCacheMap = std::unordered_map<void *, RangeCacheMap::iterator>;
+
+	struct RangeInfo {
+		void *                 pointer{ nullptr };
+		short                  inUse{ 1 };
+		RangeLRUList::iterator lruPos;
+	};
+
+	// Read-ahead is mapped by its own thread (started on first use), so that the miss
+	// that triggered it doesn't wait for it
+	struct ReadAheadWorker {
+		std::mutex                      mutex_;
+		std::condition_variable         wake_;
+		std::thread                     thread_;
+		std::vector<unsigned long long> gfns_; // oldest first
+		bool                            stop_{ false };
+	};
 
 public:
 	PageCache( Driver *driver );
@@ -43,6 +111,26 @@ public:
 public:
 	size_t setLimit( size_t limit );
 
+	// Adjust the limit every ADAPT_WINDOW lookups: grow it by 25% (up to maxLimit) while more than
+	// ADAPT_GROW_MISS_PERCENT of them miss and pages are being evicted to make room, and shrink it
+	// by 12.5% (down to minLimit, unmapping idle pages right away) while fewer than
+	// ADAPT_SHRINK_MISS_PERCENT miss. 0, 0 disables it.
+	bool setLimitRange( size_t minLimit, size_t maxLimit );
+
+	void stats( PageCacheStats &stats );
+
+	// Map the next `pages' gfns in the background once a sequential miss pattern is detected
+	// (0 disables read-ahead)
+	size_t setReadAhead( size_t pages );
+
+	// Map whatever is not already cached out of gfns, without taking references. No shard
+	// lock is held while mapping, so lookups of other pages go on meanwhile.
+	void prefetch( const unsigned long long *gfns, size_t count );
+
+	// Wait for the read-ahead thread to exit. It maps through the driver, so this must run
+	// before the driver goes away, whether or not the cache is reset.
+	void stopReadAhead();
+
 	void reset();
 	void driver( Driver *driver )
 	{
@@ -50,11 +138,34 @@ public:
 	}
 	MapReturnCode update( unsigned long gfn, void *&pointer );
 	bool          release( void *pointer );
+	bool          contains( unsigned long gfn );
+	MapReturnCode updateRange( const unsigned long long *gfns, size_t count, void *&pointer );
+	bool          releaseRange( void *pointer );
 
 private:
-	MapReturnCode insertNew( unsigned long gfn, void *&pointer );
-	void          cleanup();
-	unsigned long generateIndex() const;
+	Shard &shard( unsigned long gfn )
+	{
+		// Fibonacci hashing, so that strided access patterns don't all land in one shard
+		return shards_[( ( gfn * 0x9e3779b97f4a7c15ULL ) >> 32 ) & ( SHARD_COUNT - 1 )];
+	}
+
+	ReverseShard &reverseShard( void *pointer )
+	{
+		return reverseShards_[( reinterpret_cast<uintptr_t>( pointer ) >> PAGE_SHIFT ) & ( SHARD_COUNT - 1 )];
+	}
+
+	MapReturnCode insertNew( Shard &s, unsigned long gfn, void *&pointer );
+	MapReturnCode mapNew( unsigned long gfn, void *&pointer );
+	void          insertMapped( Shard &s, unsigned long gfn, void *mapped, bool pin );
+	void          countLookup( bool hit );
+	void          adaptLimit();
+	void          readAheadAfterMiss( unsigned long gfn );
+	void          runReadAhead();
+	void          cleanup( Shard &s );
+	bool          reclaim( Shard &s, size_t share );
+	bool          evictOldest( Shard &s );
+	void          evict( Shard &s, CacheMap::iterator ci );
+	void          cleanupRanges();
 	bool          checkPages( void *addr, size_t size ) const;
 
 public: // no copying around
@@ -62,11 +173,33 @@ public: // no copying around
 	PageCache &operator=( const PageCache & ) = delete;
 
 private:
-	Driver *        driver_;
-	CacheMap        cache_;
-	ReverseCacheMap reverseCache_;
-	size_t          cacheLimit_{ MAX_CACHE_SIZE_DEFAULT };
-	int             linuxMajVersion_{ -1 };
+	Driver *                              driver_;
+	std::array<Shard, SHARD_COUNT>        shards_;
+	std::array<ReverseShard, SHARD_COUNT> reverseShards_;
+	std::atomic<size_t>                   cacheLimit_{ MAX_CACHE_SIZE_DEFAULT };
+	std::atomic<size_t>                   mapped_{ 0 }; // pages, all shards
+	int                                   linuxMajVersion_{ -1 };
+	std::atomic<size_t>                   readAhead_{ 0 };
+	std::atomic<unsigned long>            nextExpectedGfn_{ ~0UL };
+	std::atomic<size_t>                   sequentialMisses_{ 0 };
+	ReadAheadWorker                       readAheadWorker_;
+
+	std::atomic<unsigned long long> hits_{ 0 };
+	std::atomic<unsigned long long> misses_{ 0 };
+	std::atomic<unsigned long long> evictions_{ 0 };
+	std::atomic<unsigned long long> notPresent_{ 0 };
+	std::atomic<unsigned long long> mapFailures_{ 0 };
+	std::atomic<size_t>             minLimit_{ 0 };
+	std::atomic<size_t>             maxLimit_{ 0 };
+	std::atomic<size_t>             windowLookups_{ 0 };
+	std::atomic<size_t>             windowMisses_{ 0 };
+	std::atomic<size_t>             windowEvictions_{ 0 };
+	size_t                          shrinkDelay_{ 0 }; // only touched by adaptLimit()
+
+	std::mutex           rangeMutex_;
+	RangeCacheMap        rangeCache_;
+	ReverseRangeCacheMap reverseRangeCache_;
+	RangeLRUList         rangeLru_;
 };
 
 } // namespace bdvmi
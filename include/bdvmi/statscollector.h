@@ -16,16 +16,92 @@
 #ifndef __BDVMISTATSCOLLECTOR_H_INCLUDED__
 #define __BDVMISTATSCOLLECTOR_H_INCLUDED__
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <stdint.h>
 #include <string>
-#include <atomic>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+#include <x86intrin.h>
 
 namespace bdvmi {
 
+// Counters are interned: a name is registered once and gets a small integer id, and from then on
+// counting goes to a per-thread shard with relaxed atomics (no locks, no hashing, no allocations
+// after a thread's first hit of a counter). Every counter keeps a log-bucketed latency histogram
+// (8 buckets per power of 2, i.e. within 12.5%), and shards are only added up by snapshot().
 class StatsCollector {
 
+public:
+	using CounterId = unsigned int;
+
+	static constexpr CounterId INVALID_COUNTER = ~0U;
+	static constexpr size_t    MAX_COUNTERS    = 256;
+
+	// Histogram layout: values below SUB_BUCKETS ns get a bucket each, then every power of 2 up to
+	// 2^MAX_LOG2 ns (~18 minutes, anything longer lands in the last bucket) is split in SUB_BUCKETS
+	static constexpr unsigned int SUB_BUCKET_BITS = 3;
+	static constexpr unsigned int SUB_BUCKETS     = 1 << SUB_BUCKET_BITS;
+	static constexpr unsigned int MAX_LOG2        = 40;
+	static constexpr unsigned int BUCKETS         = ( MAX_LOG2 - SUB_BUCKET_BITS + 2 ) * SUB_BUCKETS;
+
+	struct Stat {
+		std::string                   name_;
+		unsigned long                 count_{ 0 };
+		std::chrono::duration<double> time_{ std::chrono::duration<double>::zero() };
+		std::chrono::nanoseconds      p50_{ 0 };
+		std::chrono::nanoseconds      p90_{ 0 };
+		std::chrono::nanoseconds      p99_{ 0 };
+		std::chrono::nanoseconds      p999_{ 0 };
+		std::chrono::nanoseconds      max_{ 0 };
+		std::vector<unsigned long>    buckets_; // BUCKETS of them, see bucketLimit()
+	};
+
+private:
+	using Histogram = std::array<std::atomic<unsigned long>, BUCKETS>;
+
+	// Only the owning thread writes to a slot. A slot whose epoch_ isn't the collector's is stale
+	// (a reset happened since it was last written), readers skip it and the owner zeroes it first.
+	struct Slot {
+		std::atomic<unsigned int>       epoch_{ 0 };
+		std::atomic<unsigned long>      count_{ 0 };
+		std::atomic<unsigned long long> nanoseconds_{ 0 };
+		std::atomic<unsigned long long> max_{ 0 };
+		std::atomic<Histogram *>        histogram_{ nullptr };
+	};
+
+	struct Shard {
+		~Shard();
+
+		std::array<Slot, MAX_COUNTERS> slots_;
+	};
+
+	struct Totals {
+		unsigned long                     count_{ 0 };
+		unsigned long long                nanoseconds_{ 0 };
+		unsigned long long                max_{ 0 };
+		std::array<unsigned long, BUCKETS> buckets_{};
+	};
+
+	// Unregisters (and folds into retired_) the thread's shard when the thread exits
+	struct ShardHolder {
+		~ShardHolder();
+
+		Shard *shard_{ nullptr };
+	};
+
+	static constexpr size_t LITERAL_SLOTS = 4 * MAX_COUNTERS; // power of 2
+
+	// Lock-free const char * -> id lookup, so that counting by string literal doesn't need to hash
+	// the string or take a lock (several literals with the same contents share the id)
+	struct Literal {
+		std::atomic<const char *> name_{ nullptr };
+		CounterId                 id_{ INVALID_COUNTER };
+	};
+
 private:
 	StatsCollector() = default;
 
@@ -36,23 +112,111 @@ public:
 public:
 	static StatsCollector &instance();
 
+	// What StatsCounter measures with: the TSC when it's constant (calibrated against the steady
+	// clock by enable(), and more precisely with every snapshot()), steady clock nanoseconds if not
+	static uint64_t timestamp()
+	{
+		return tsc_ ? __rdtsc() : steadyNanoseconds();
+	}
+
+	// The largest value (in nanoseconds) that lands in histogram bucket index
+	static unsigned long long bucketLimit( unsigned int index );
+
 public:
+	// How long a timestamp() tick is, as 32.32 fixed point nanoseconds (calibrating first if need be)
+	uint64_t nsPerTick();
+
+	// Enabling or disabling also resets all counters
 	void enable( bool value );
 
+	bool enabled() const
+	{
+		return enable_.load( std::memory_order_relaxed );
+	}
+
+	// Register name (or find it, if it's already been registered). Returns INVALID_COUNTER once
+	// MAX_COUNTERS names are in use. Takes a lock, call it once and keep the result.
+	CounterId intern( const std::string &name );
+
+	// intern() for string literals (or other strings that outlive the collector), lock-free after
+	// the first call with a given pointer
+	CounterId literal( const char *name );
+
+	// elapsed is a timestamp() difference
+	void countElapsed( CounterId id, uint64_t elapsed )
+	{
+		if ( id >= MAX_COUNTERS || !enabled() )
+			return;
+
+		unsigned __int128 scaled = elapsed;
+
+		record( id, ( scaled * nsPerTick_.load( std::memory_order_relaxed ) ) >> 32 );
+	}
+
+	void count( CounterId                            id,
+	            const std::chrono::duration<double> &duration = std::chrono::duration<double>::zero() )
+	{
+		if ( id < MAX_COUNTERS && enabled() )
+			record( id, std::chrono::duration_cast<std::chrono::nanoseconds>( duration ).count() );
+	}
+
 	void count( const std::string &                  st,
 	            const std::chrono::duration<double> &duration = std::chrono::duration<double>::zero() );
 
-	void dump() const;
+	// Every counter that's been hit since the last enable() or reset, with its percentiles.
+	// reset == true: start counting from scratch.
+	std::vector<Stat> snapshot( bool reset = false );
 
-	bool enabled() const
+	void dump();
+
+private:
+	static uint64_t steadyNanoseconds()
 	{
-		return enable_;
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		           std::chrono::steady_clock::now().time_since_epoch() )
+		    .count();
+	}
+
+	static unsigned int bucket( unsigned long long nanoseconds );
+
+	void record( CounterId id, unsigned long long nanoseconds );
+
+	Shard &localShard()
+	{
+		thread_local ShardHolder holder;
+
+		if ( !holder.shard_ )
+			holder.shard_ = addShard();
+
+		return *holder.shard_;
 	}
 
+	Shard *addShard();
+
+	void removeShard( Shard *shard );
+
+	void calibrate();
+
+	// Measure the TSC against the steady clock over the whole time since calibrate()
+	void refineCalibration();
+
+	// slot's values, if they belong to the current epoch
+	void add( Totals &totals, const Slot &slot ) const;
+
 private:
-	std::atomic_bool                                                                         enable_{ false };
-	std::unordered_map<std::string, std::pair<unsigned long, std::chrono::duration<double>>> stats_;
-	mutable std::mutex                                                                       statsMutex_;
+	static bool tsc_;
+
+	std::atomic_bool                           enable_{ false };
+	std::atomic<unsigned int>                  epoch_{ 1 };
+	std::atomic<uint64_t>                      nsPerTick_{ 1ULL << 32 }; // 32.32 fixed point
+	uint64_t                                   calibrationTicks_{ 0 };
+	uint64_t                                   calibrationNanoseconds_{ 0 };
+	std::array<Literal, LITERAL_SLOTS>         literals_;
+	std::vector<std::string>                   names_;
+	std::unordered_map<std::string, CounterId> ids_;
+	std::vector<Shard *>                       shards_;
+	std::vector<Totals>                        retired_; // from the shards of threads that exited
+	mutable std::mutex                         statsMutex_;
 };
 
 #ifndef BDVMI_DISABLE_STATS
@@ -60,26 +224,38 @@ private:
 class StatsCounter {
 
 public:
-	explicit StatsCounter( std::string st )
-	    : name_{ std::move( st ) }
+	explicit StatsCounter( StatsCollector::CounterId id )
+	    : id_{ StatsCollector::instance().enabled() ? id : StatsCollector::INVALID_COUNTER }
 	{
-		if ( !StatsCollector::instance().enabled() )
-			return;
+		if ( id_ != StatsCollector::INVALID_COUNTER )
+			start_ = StatsCollector::timestamp();
+	}
 
-		start_ = std::chrono::high_resolution_clock::now();
+	explicit StatsCounter( const char *st )
+	    : id_{ StatsCollector::instance().enabled() ? StatsCollector::instance().literal( st )
+	                                                 : StatsCollector::INVALID_COUNTER }
+	{
+		if ( id_ != StatsCollector::INVALID_COUNTER )
+			start_ = StatsCollector::timestamp();
 	}
 
-	~StatsCounter()
+	explicit StatsCounter( const std::string &st )
+	    : id_{ StatsCollector::instance().enabled() ? StatsCollector::instance().intern( st )
+	                                                 : StatsCollector::INVALID_COUNTER }
 	{
-		if ( !StatsCollector::instance().enabled() )
-			return;
+		if ( id_ != StatsCollector::INVALID_COUNTER )
+			start_ = StatsCollector::timestamp();
+	}
 
-		StatsCollector::instance().count( name_, std::chrono::high_resolution_clock::now() - start_ );
+	~StatsCounter()
+	{
+		if ( id_ != StatsCollector::INVALID_COUNTER )
+			StatsCollector::instance().countElapsed( id_, StatsCollector::timestamp() - start_ );
 	}
 
 private:
-	std::string                                                 name_;
-	std::chrono::time_point<std::chrono::high_resolution_clock> start_;
+	StatsCollector::CounterId id_;
+	uint64_t                  start_{ 0 };
 };
 
 #else
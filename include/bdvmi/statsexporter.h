@@ -0,0 +1,114 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMISTATSEXPORTER_H_INCLUDED__
+#define __BDVMISTATSEXPORTER_H_INCLUDED__
+
+#include "statscollector.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+namespace bdvmi {
+
+// The layout of /dev/shm/bdvmi-<uuid>, for monitoring tools: a StatsSegmentHeader followed by
+// maxCounters_ StatsSegmentCounters, counters_ of which are in use. Everything after the magic and
+// version may change when version_ does.
+//
+// The segment is updated as a seqlock: sequence_ is odd while an update is in progress. To read,
+// load sequence_ (acquire), retry later if it's odd, copy what's needed, then check (after an
+// acquire fence) that sequence_ hasn't changed, and retry if it has. Readers never block the
+// introspection process.
+constexpr char     STATS_SEGMENT_MAGIC[8] = { 'B', 'D', 'V', 'M', 'I', 'S', 'T', 'S' };
+constexpr uint32_t STATS_SEGMENT_VERSION  = 1;
+constexpr size_t   STATS_NAME_SIZE        = 64;
+
+struct StatsSegmentCounter {
+	char     name_[STATS_NAME_SIZE]; // zero terminated
+	uint64_t count_;
+	uint64_t nanoseconds_; // total
+	uint64_t p50_;         // ns
+	uint64_t p90_;
+	uint64_t p99_;
+	uint64_t p999_;
+	uint64_t max_;
+	uint64_t buckets_[StatsCollector::BUCKETS]; // counts, see StatsSegmentHeader::bucketLimits_
+};
+
+struct StatsSegmentHeader {
+	char                  magic_[8];
+	uint32_t              version_;
+	uint32_t              headerSize_;  // sizeof( StatsSegmentHeader )
+	uint32_t              counterSize_; // sizeof( StatsSegmentCounter )
+	uint32_t              maxCounters_;
+	uint32_t              buckets_;
+	uint32_t              counters_;
+	uint64_t              pid_;
+	std::atomic<uint64_t> sequence_;
+	uint64_t              updated_; // CLOCK_REALTIME ns of the last update
+	uint64_t              enabled_; // StatsCollector::enabled()
+	uint64_t              bucketLimits_[StatsCollector::BUCKETS]; // ns, inclusive
+};
+
+// Publishes StatsCollector::snapshot() to /dev/shm/bdvmi-<uuid>, from its own thread every
+// interval (or only when publish() is called, with an interval of 0). The segment is created
+// afresh (one left over under that name is unlinked first) with mode 0600, so monitoring tools
+// have to run as the same user, and it's removed when the exporter goes away. Threads don't
+// survive fork(), so forked per-domain processes should each create their own exporter, after
+// forking.
+class StatsExporter {
+
+public:
+	explicit StatsExporter( const std::string &uuid,
+	                        std::chrono::milliseconds interval = std::chrono::milliseconds( 1000 ) );
+
+	~StatsExporter();
+
+public:
+	void publish();
+
+	// The segment's name, relative to /dev/shm
+	const std::string &name() const
+	{
+		return name_;
+	}
+
+public:
+	StatsExporter( const StatsExporter & ) = delete;
+	StatsExporter &operator=( const StatsExporter & ) = delete;
+
+private:
+	void run();
+
+private:
+	std::string               name_;
+	std::chrono::milliseconds interval_;
+	size_t                    size_{ 0 };
+	StatsSegmentHeader *      header_{ nullptr };
+	StatsSegmentCounter *     counters_{ nullptr };
+	std::mutex                publishMutex_;
+	std::mutex                stopMutex_;
+	std::condition_variable   stopped_;
+	bool                      stop_{ false };
+	std::thread               thread_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMISTATSEXPORTER_H_INCLUDED__
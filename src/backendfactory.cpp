@@ -14,6 +14,12 @@
 // License along with this library.
 
 #include "bdvmi/backendfactory.h"
+#include "bdvmi/mockbackend.h"
+#include "mockdomainwatcher.h"
+#include "mockdriver.h"
+#include "mockeventmanager.h"
+#include "replaydriver.h"
+#include "replayeventmanager.h"
 #include "xendriver.h"
 #include "xendomainwatcher.h"
 #include "xeneventmanager.h"
@@ -29,8 +35,11 @@ namespace bdvmi {
 BackendFactory::BackendFactory( BackendType type )
     : type_{ type }
 {
-	if ( type_ != BACKEND_XEN && type_ != BACKEND_KVM )
-		throw std::runtime_error( "Xen and KVM are the only supported backends for now" );
+	if ( type_ != BACKEND_XEN && type_ != BACKEND_KVM && type_ != BACKEND_REPLAY && type_ != BACKEND_MOCK )
+		throw std::runtime_error( "Xen, KVM, replay and mock are the only supported backends for now" );
+
+	if ( type_ == BACKEND_MOCK )
+		mockConfig_ = std::make_shared<MockConfig>();
 }
 
 std::unique_ptr<DomainWatcher> BackendFactory::domainWatcher( sig_atomic_t &sigStop )
@@ -42,6 +51,10 @@ std::unique_ptr<DomainWatcher> BackendFactory::domainWatcher( sig_atomic_t &sigS
 		case BACKEND_KVM:
 			return std::make_unique<KvmDomainWatcher>( sigStop );
 #endif
+		case BACKEND_REPLAY:
+			throw std::runtime_error( "There are no domains to watch when replaying a trace" );
+		case BACKEND_MOCK:
+			return std::make_unique<MockDomainWatcher>( sigStop, mockConfig_->domains_ );
 		default:
 			throw std::runtime_error( "Xen and KVM are the only supported backends for now" );
 	}
@@ -56,6 +69,10 @@ std::unique_ptr<Driver> BackendFactory::driver( const std::string &domain, bool
 		case BACKEND_KVM:
 			return std::make_unique<KvmDriver>( domain, altp2m );
 #endif
+		case BACKEND_REPLAY:
+			return std::make_unique<ReplayDriver>( domain );
+		case BACKEND_MOCK:
+			return std::make_unique<MockDriver>( domain, *mockConfig_ );
 		default:
 			throw std::runtime_error( "Xen and KVM are the only supported backends for now" );
 	}
@@ -70,9 +87,21 @@ std::unique_ptr<EventManager> BackendFactory::eventManager( Driver &driver, sig_
 		case BACKEND_KVM:
 			return std::make_unique<KvmEventManager>( dynamic_cast<KvmDriver &>( driver ), sigStop );
 #endif
+		case BACKEND_REPLAY:
+			return std::make_unique<ReplayEventManager>( dynamic_cast<ReplayDriver &>( driver ), sigStop );
+		case BACKEND_MOCK:
+			return std::make_unique<MockEventManager>( dynamic_cast<MockDriver &>( driver ), sigStop );
 		default:
 			throw std::runtime_error( "Xen and KVM are the only supported backends for now" );
 	}
 }
 
+void BackendFactory::mockConfig( const MockConfig &config )
+{
+	if ( type_ != BACKEND_MOCK )
+		throw std::runtime_error( "Only the mock backend can be configured like this" );
+
+	*mockConfig_ = config;
+}
+
 } // namespace bdvmi
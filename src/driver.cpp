@@ -14,11 +14,191 @@
 // License along with this library.
 
 #include "bdvmi/driver.h"
+#include "bdvmi/eventhandler.h"
+#include "bdvmi/eventrecorder.h"
 #include "bdvmi/logger.h"
+#include "pagehash.h"
+#include "patternscanner.h"
+#include <algorithm>
+#include <system_error>
+#include <thread>
 #include <utility>
+#include <vector>
+
+#define X86_CR0_PG   ( 1ULL << 31 )
+#define X86_CR4_PSE  ( 1ULL << 4 )
+#define X86_CR4_PAE  ( 1ULL << 5 )
+#define X86_CR4_LA57 ( 1ULL << 12 )
+#define X86_EFER_LMA ( 1ULL << 10 )
+
+#define PT_PRESENT   ( 1ULL << 0 )
+#define PT_PAGE_SIZE ( 1ULL << 7 )
+#define PT_ADDR_MASK 0x000ffffffffff000ULL
 
 namespace bdvmi {
 
+#define REGS_DIFFER( f ) ( f != other.f )
+
+uint32_t Registers::changedGroups( const Registers &other ) const
+{
+	uint32_t groups = 0;
+
+	if ( REGS_DIFFER( rax ) || REGS_DIFFER( rcx ) || REGS_DIFFER( rdx ) || REGS_DIFFER( rbx ) ||
+	     REGS_DIFFER( rsp ) || REGS_DIFFER( rbp ) || REGS_DIFFER( rsi ) || REGS_DIFFER( rdi ) ||
+	     REGS_DIFFER( r8 ) || REGS_DIFFER( r9 ) || REGS_DIFFER( r10 ) || REGS_DIFFER( r11 ) ||
+	     REGS_DIFFER( r12 ) || REGS_DIFFER( r13 ) || REGS_DIFFER( r14 ) || REGS_DIFFER( r15 ) )
+		groups |= GROUP_GPRS;
+
+	if ( REGS_DIFFER( rip ) || REGS_DIFFER( rflags ) )
+		groups |= GROUP_RIP_RFLAGS;
+
+	if ( REGS_DIFFER( cs_base ) || REGS_DIFFER( cs_limit ) || REGS_DIFFER( cs_sel ) ||
+	     REGS_DIFFER( cs_arbytes ) || REGS_DIFFER( ss_base ) || REGS_DIFFER( ss_limit ) ||
+	     REGS_DIFFER( ss_sel ) || REGS_DIFFER( ss_arbytes ) || REGS_DIFFER( ds_base ) ||
+	     REGS_DIFFER( ds_limit ) || REGS_DIFFER( ds_sel ) || REGS_DIFFER( ds_arbytes ) ||
+	     REGS_DIFFER( es_base ) || REGS_DIFFER( es_limit ) || REGS_DIFFER( es_sel ) ||
+	     REGS_DIFFER( es_arbytes ) || REGS_DIFFER( fs_base ) || REGS_DIFFER( fs_limit ) ||
+	     REGS_DIFFER( fs_sel ) || REGS_DIFFER( fs_arbytes ) || REGS_DIFFER( gs_base ) ||
+	     REGS_DIFFER( gs_limit ) || REGS_DIFFER( gs_sel ) || REGS_DIFFER( gs_arbytes ) ||
+	     REGS_DIFFER( idtr_base ) || REGS_DIFFER( idtr_limit ) || REGS_DIFFER( gdtr_base ) ||
+	     REGS_DIFFER( gdtr_limit ) )
+		groups |= GROUP_SEGMENTS;
+
+	if ( REGS_DIFFER( cr0 ) || REGS_DIFFER( cr2 ) || REGS_DIFFER( cr3 ) || REGS_DIFFER( cr4 ) )
+		groups |= GROUP_CONTROL;
+
+	if ( REGS_DIFFER( sysenter_cs ) || REGS_DIFFER( sysenter_esp ) || REGS_DIFFER( sysenter_eip ) ||
+	     REGS_DIFFER( msr_efer ) || REGS_DIFFER( msr_star ) || REGS_DIFFER( msr_lstar ) ||
+	     REGS_DIFFER( msr_pat ) || REGS_DIFFER( msr_cstar ) || REGS_DIFFER( shadow_gs ) )
+		groups |= GROUP_MSRS;
+
+	return groups;
+}
+
+#undef REGS_DIFFER
+
+void Registers::assignGroups( const Registers &other, uint32_t groups )
+{
+	if ( groups & GROUP_GPRS ) {
+		rax = other.rax;
+		rcx = other.rcx;
+		rdx = other.rdx;
+		rbx = other.rbx;
+		rsp = other.rsp;
+		rbp = other.rbp;
+		rsi = other.rsi;
+		rdi = other.rdi;
+		r8  = other.r8;
+		r9  = other.r9;
+		r10 = other.r10;
+		r11 = other.r11;
+		r12 = other.r12;
+		r13 = other.r13;
+		r14 = other.r14;
+		r15 = other.r15;
+	}
+
+	if ( groups & GROUP_RIP_RFLAGS ) {
+		rip    = other.rip;
+		rflags = other.rflags;
+	}
+
+	if ( groups & GROUP_SEGMENTS ) {
+		cs_base    = other.cs_base;
+		cs_limit   = other.cs_limit;
+		cs_sel     = other.cs_sel;
+		cs_arbytes = other.cs_arbytes;
+		ss_base    = other.ss_base;
+		ss_limit   = other.ss_limit;
+		ss_sel     = other.ss_sel;
+		ss_arbytes = other.ss_arbytes;
+		ds_base    = other.ds_base;
+		ds_limit   = other.ds_limit;
+		ds_sel     = other.ds_sel;
+		ds_arbytes = other.ds_arbytes;
+		es_base    = other.es_base;
+		es_limit   = other.es_limit;
+		es_sel     = other.es_sel;
+		es_arbytes = other.es_arbytes;
+		fs_base    = other.fs_base;
+		fs_limit   = other.fs_limit;
+		fs_sel     = other.fs_sel;
+		fs_arbytes = other.fs_arbytes;
+		gs_base    = other.gs_base;
+		gs_limit   = other.gs_limit;
+		gs_sel     = other.gs_sel;
+		gs_arbytes = other.gs_arbytes;
+		idtr_base  = other.idtr_base;
+		idtr_limit = other.idtr_limit;
+		gdtr_base  = other.gdtr_base;
+		gdtr_limit = other.gdtr_limit;
+
+		guest_x86_mode = other.guest_x86_mode;
+	}
+
+	if ( groups & GROUP_CONTROL ) {
+		cr0 = other.cr0;
+		cr2 = other.cr2;
+		cr3 = other.cr3;
+		cr4 = other.cr4;
+	}
+
+	if ( groups & GROUP_MSRS ) {
+		sysenter_cs  = other.sysenter_cs;
+		sysenter_esp = other.sysenter_esp;
+		sysenter_eip = other.sysenter_eip;
+		msr_efer     = other.msr_efer;
+		msr_star     = other.msr_star;
+		msr_lstar    = other.msr_lstar;
+		msr_pat      = other.msr_pat;
+		msr_cstar    = other.msr_cstar;
+		shadow_gs    = other.shadow_gs;
+	}
+}
+
+bool Registers::msr( uint32_t index, uint64_t &value ) const
+{
+	switch ( index ) {
+		case MSR_IA32_SYSENTER_CS:
+			value = sysenter_cs;
+			break;
+		case MSR_IA32_SYSENTER_ESP:
+			value = sysenter_esp;
+			break;
+		case MSR_IA32_SYSENTER_EIP:
+			value = sysenter_eip;
+			break;
+		case MSR_EFER:
+			value = msr_efer;
+			break;
+		case MSR_STAR:
+			value = msr_star;
+			break;
+		case MSR_LSTAR:
+			value = msr_lstar;
+			break;
+		case MSR_CSTAR:
+			value = msr_cstar;
+			break;
+		case MSR_IA32_CR_PAT:
+			value = msr_pat;
+			break;
+		case MSR_FS_BASE:
+			value = fs_base;
+			break;
+		case MSR_GS_BASE:
+			value = gs_base;
+			break;
+		case MSR_SHADOW_GS_BASE:
+			value = shadow_gs;
+			break;
+		default:
+			return false;
+	}
+
+	return true;
+}
+
 bool Driver::setPageProtection( unsigned long long guestAddress, bool read, bool write, bool execute,
                                 unsigned short view )
 {
@@ -43,17 +223,55 @@ bool Driver::setPageProtection( unsigned long long guestAddress, bool read, bool
 
 	std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
 
-	auto &&accessMap = memAccessCache_[view];
-	auto   it        = accessMap.find( gfn );
+	PageAttributeTable &table   = accessTable( view );
+	uint8_t             current = table.get( gfn );
 
-	if ( it == accessMap.end() && read && write && execute )
+	if ( current == PageAttributeTable::UNKNOWN && read && write && execute )
 		return true;
 
-	if ( it != accessMap.end() && it->second == memaccess )
+	if ( current == memaccess )
 		return true;
 
-	memAccessCache_[view][gfn]        = memaccess;
-	delayedMemAccessWrite_[view][gfn] = memaccess;
+	table.set( gfn, memaccess, true );
+
+	// Writes to gfn might not fault anymore
+	if ( write )
+		dropPageHashes( gfn, gfn );
+
+	return true;
+}
+
+bool Driver::setPageProtectionRange( unsigned long long gpaStart, unsigned long long gpaEnd, bool read, bool write,
+                                     bool execute, unsigned short view )
+{
+	if ( write && !read ) {
+		logger << ERROR << "Attempted to set GPAs [" << std::hex << std::showbase << gpaStart << ", " << gpaEnd
+		       << ") " << ( read ? "r" : "-" ) << ( write ? "w" : "-" ) << ( execute ? "x" : "-" ) << std::flush;
+		return false;
+	}
+
+	if ( gpaEnd <= gpaStart )
+		return gpaEnd == gpaStart;
+
+	uint64_t firstGfn  = gpa_to_gfn( gpaStart );
+	uint64_t lastGfn   = gpa_to_gfn( gpaEnd - 1 );
+	uint8_t  memaccess = ( read ? PAGE_READ : 0 ) | ( write ? PAGE_WRITE : 0 ) | ( execute ? PAGE_EXECUTE : 0 );
+
+	std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
+
+	PageAttributeTable &table = accessTable( view );
+
+	for ( uint64_t gfn = firstGfn; gfn <= lastGfn; ++gfn ) {
+		uint8_t current = table.get( gfn );
+
+		if ( current == memaccess || ( current == PageAttributeTable::UNKNOWN && read && write && execute ) )
+			continue;
+
+		table.set( gfn, memaccess, true );
+	}
+
+	if ( write )
+		dropPageHashes( firstGfn, lastGfn );
 
 	return true;
 }
@@ -79,12 +297,9 @@ bool Driver::getPageProtection( unsigned long long guestAddress, bool &read, boo
 	{
 		std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
 
-		auto &&accessMap = memAccessCache_[view];
-		auto   it        = accessMap.find( gfn );
-
-		if ( it != accessMap.end() ) {
-			memaccess = it->second;
+		memaccess = accessTable( view ).get( gfn );
 
+		if ( memaccess != PageAttributeTable::UNKNOWN ) {
 			read    = !!( memaccess & PAGE_READ );
 			write   = !!( memaccess & PAGE_WRITE );
 			execute = !!( memaccess & PAGE_EXECUTE );
@@ -99,7 +314,146 @@ bool Driver::getPageProtection( unsigned long long guestAddress, bool &read, boo
 	memaccess = ( read ? PAGE_READ : 0 ) | ( write ? PAGE_WRITE : 0 ) | ( execute ? PAGE_EXECUTE : 0 );
 
 	std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
-	memAccessCache_[view][gfn] = memaccess;
+
+	PageAttributeTable &table = accessTable( view );
+
+	// Don't clobber a setPageProtection() that happened in the meantime
+	if ( table.get( gfn ) == PageAttributeTable::UNKNOWN )
+		table.set( gfn, memaccess, false );
+
+	return true;
+}
+
+bool Driver::cachePageProtectionRange( unsigned long long gpaStart, unsigned long long gpaEnd, unsigned short view )
+{
+	if ( gpaEnd <= gpaStart )
+		return gpaEnd == gpaStart;
+
+	uint64_t firstGfn = gpa_to_gfn( gpaStart );
+	uint64_t lastGfn  = gpa_to_gfn( gpaEnd - 1 );
+
+	std::vector<uint8_t> access;
+
+	for ( uint64_t gfn = firstGfn; gfn <= lastGfn; gfn += PROTECTION_QUERY_BATCH ) {
+		size_t  count   = PROTECTION_QUERY_BATCH;
+		uint8_t unknown = PageAttributeTable::UNKNOWN;
+
+		if ( lastGfn - gfn + 1 < count )
+			count = lastGfn - gfn + 1;
+
+		access.assign( count, unknown );
+
+		// Don't hold the lock during the hypercalls
+		if ( !getPageProtectionRangeImpl( gfn, count, access.data(), view ) )
+			return false;
+
+		std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
+
+		PageAttributeTable &table = accessTable( view );
+
+		for ( size_t i = 0; i < count; ++i )
+			// Don't clobber a setPageProtection() that happened in the meantime
+			if ( access[i] != PageAttributeTable::UNKNOWN && table.get( gfn + i ) == PageAttributeTable::UNKNOWN )
+				table.set( gfn + i, access[i], false );
+	}
+
+	return true;
+}
+
+PageAttributeTable &Driver::accessTable( unsigned short view )
+{
+	auto it = memAccessCache_.find( view );
+
+	if ( it != memAccessCache_.end() )
+		return it->second;
+
+	PageAttributeTable &table = memAccessCache_[view];
+
+	// Size the directory up front if we already know how much memory the guest has (don't
+	// wait for maxGPFN() to find out, we're holding memAccessCacheMutex_)
+	std::unique_lock<std::mutex> guard( maxGPFNMutex_, std::try_to_lock );
+
+	if ( guard.owns_lock() && maxGPFN_ )
+		table.reserve( maxGPFN_ );
+
+	return table;
+}
+
+bool Driver::cloneEPT( unsigned short srcView, unsigned short &dstView )
+{
+	std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
+
+	PageAttributeTable &srcTable = accessTable( srcView );
+
+	// Whatever copies srcView needs to see its delayed writes
+	if ( srcTable.dirty() ) {
+		flushScratch_.clear();
+		srcTable.takeDirty( flushScratch_ );
+
+		if ( !setPageProtectionImpl( flushScratch_, srcView ) ) {
+			logger << ERROR << "Could not flush the page protections of view " << srcView << std::flush;
+			return false;
+		}
+	}
+
+	bool copied = false;
+
+	if ( !cloneEPTImpl( srcView, dstView, copied ) )
+		return false;
+
+	PageAttributeTable &dstTable = accessTable( dstView );
+
+	// accessTable( dstView ) might have moved srcView's table around
+	const PageAttributeTable &source = memAccessCache_.find( srcView )->second;
+
+	if ( !copied ) {
+		// New views start out rwx
+		flushScratch_.clear();
+		source.collect( flushScratch_, PAGE_READ | PAGE_WRITE | PAGE_EXECUTE );
+
+		if ( !flushScratch_.empty() && !setPageProtectionImpl( flushScratch_, dstView ) ) {
+			logger << ERROR << "Could not copy the page protections of view " << srcView << " to view "
+			       << dstView << std::flush;
+			destroyEPTImpl( dstView );
+			memAccessCache_.erase( dstView );
+			return false;
+		}
+	}
+
+	dstTable.cloneFrom( source );
+
+	return true;
+}
+
+bool Driver::cloneEPTImpl( unsigned short /* srcView */, unsigned short &dstView, bool &copied )
+{
+	copied = false;
+
+	return createEPTImpl( dstView );
+}
+
+bool Driver::createEPT( unsigned short &index )
+{
+	if ( !createEPTImpl( index ) )
+		return false;
+
+	std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
+
+	// Nothing is known about the new view's pages yet, which is what writeProtectedLocked() needs to see
+	memAccessCache_.erase( index );
+	accessTable( index );
+
+	return true;
+}
+
+bool Driver::destroyEPT( unsigned short index )
+{
+	if ( !destroyEPTImpl( index ) )
+		return false;
+
+	std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
+
+	memAccessCache_.erase( index );
 
 	return true;
 }
@@ -109,15 +463,14 @@ void Driver::flushPageProtections()
 	{
 		std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
 
-		for ( auto &&item : delayedMemAccessWrite_ ) {
-			if ( item.second.empty() )
+		for ( auto &&item : memAccessCache_ ) {
+			if ( !item.second.dirty() )
 				continue;
 
-			setPageProtectionImpl( item.second, item.first );
+			flushScratch_.clear();
+			item.second.takeDirty( flushScratch_ );
 
-			// item.second.clear();
-			decltype( item.second ) notUsingMemory;
-			std::swap( item.second, notUsingMemory );
+			setPageProtectionImpl( flushScratch_, item.first );
 		}
 	}
 
@@ -135,105 +488,1034 @@ void Driver::flushPageProtections()
 	}
 }
 
-bool Driver::maxGPFN( unsigned long long &gfn )
+MapReturnCode Driver::mapPhysMemRange( unsigned long long address, size_t length, uint32_t flags, void *&pointer )
 {
-	std::lock_guard<std::mutex> guard( maxGPFNMutex_ );
+	pointer = nullptr;
 
-	// Integrators call this method before becoming multi-threaded relying on the fact
-	// that the result gets cached and the algorithm below never gets to run again
-	if ( maxGPFN_ ) {
-		gfn = maxGPFN_;
-		return true;
+	if ( !length )
+		return MAP_INVALID_PARAMETER;
+
+	unsigned long long firstGfn = gpa_to_gfn( address );
+	unsigned long long lastGfn  = gpa_to_gfn( address + length - 1 );
+
+	if ( firstGfn == lastGfn )
+		return mapPhysMemToHost( address, length, flags, pointer );
+
+	std::vector<unsigned long long> gfns;
+	gfns.reserve( lastGfn - firstGfn + 1 );
+
+	for ( unsigned long long gfn = firstGfn; gfn <= lastGfn; ++gfn )
+		gfns.push_back( gfn );
+
+	void *        mapped = nullptr;
+	MapReturnCode mrc    = mapGfns( gfns.data(), gfns.size(), flags, mapped );
+
+	if ( mrc != MAP_SUCCESS )
+		return mrc;
+
+	pointer = static_cast<char *>( mapped ) + ( address & ~PAGE_MASK );
+
+	return MAP_SUCCESS;
+}
+
+bool Driver::unmapPhysMemRange( void *hostPtr, size_t length )
+{
+	if ( !length )
+		return false;
+
+	uintptr_t start = reinterpret_cast<uintptr_t>( hostPtr );
+	size_t    count = ( ( start + length - 1 ) >> PAGE_SHIFT ) - ( start >> PAGE_SHIFT ) + 1;
+
+	if ( count == 1 )
+		return unmapPhysMem( hostPtr );
+
+	return unmapGfns( reinterpret_cast<void *>( start & PAGE_MASK ), count );
+}
+
+bool Driver::copyPhysical( unsigned long long gpa, char *buffer, size_t length, bool write )
+{
+	while ( length ) {
+		size_t chunk = std::min<size_t>( length, PAGE_SIZE - ( gpa & ~PAGE_MASK ) );
+
+		// Mapping (and then unmapping) a page costs way more than copying a few bytes
+		// out of it, unless it's already mapped. A recorder needs to see whole pages, though.
+		if ( chunk <= PHYS_COPY_MAX && physCopySupported() && !recorder_ &&
+		     !isPageCached( gpa_to_gfn( gpa ) ) ) {
+			if ( write ? !writePhysicalImpl( gpa, buffer, chunk ) : !readPhysicalImpl( gpa, buffer, chunk ) )
+				return false;
+		} else {
+			void *mapped = nullptr;
+
+			if ( mapPhysMemToHost( gpa, chunk, 0, mapped ) != MAP_SUCCESS )
+				return false;
+
+			if ( write )
+				memcpy( mapped, buffer, chunk );
+			else
+				memcpy( buffer, mapped, chunk );
+
+			unmapPhysMem( mapped );
+		}
+
+		gpa += chunk;
+		buffer += chunk;
+		length -= chunk;
 	}
 
-	unsigned long long maxGpfn = 0;
+	return true;
+}
 
-	if ( !maxGPFNImpl( maxGpfn ) )
+bool Driver::readPhysical( unsigned long long gpa, void *buffer, size_t length )
+{
+	if ( !buffer && length )
 		return false;
 
-		//
-		// The code below resided in the introspection engine (introcore), but it was decided that
-		// it should be pushed down to the glue layer. While in its initial location the following
-		// explanation existed for it:
-		//
-		// although there is a GLUE_IFACE.QueryGuestInfo information class that returns this
-		// information, #IG_QUERY_INFO_CLASS_MAX_GPFN, in practice is has been observed to not
-		// always be accurate. Especially on XEN, for example, for guests with 1G of memory it
-		// would usually report back 4G of memory available, or for guests with more memory, the
-		// value would be slightly below the last page the guest could actually access. Since
-		// having this information is vital for some subsystems (such as the \#VE one), we try to
-		// figure it out ourselves. The algorithm is simple enough. Start with the page returned
-		// by #IG_QUERY_INFO_CLASS_MAX_GPFN query, and try to see if there is any memory available
-		// about it. If a physical page is mappable, we consider that it is available to the guest,
-		// since introcore should not be able to access memory that is not available to the guest.
-		// We do this search until a hole of 256 consecutive invalid pages is found. If during this
-		// search a valid page is found above the one returned by the hypervisor, we consider it to
-		// be the last physical page which the guest can access. If no page is found about the hint
-		// value, we may be in the case in which the hypervisor reported more than the guest has
-		// access to. While this is not as critical as the case in which the value is lower, it may
-		// still lead to unnecessary memory consumption. In this case we go below the page returned
-		// by the hypervisor until we find a page that we can map. The first page that can be
-		// mapped is treated as the last physical page the guest can access. Since this value will
-		// not change while introcore is running, it is cached inside the #gGuest variable and
-		// subsequent calls to this function will return the cached value, in order to avoid long
-		// pauses every time the query is done.
-		//
+	return copyPhysical( gpa, static_cast<char *>( buffer ), length, false );
+}
 
-#define MAX_GPA_SEARCH_COUNT 256
+bool Driver::writePhysical( unsigned long long gpa, const void *buffer, size_t length )
+{
+	if ( !buffer && length )
+		return false;
 
-	bool atLeastOneValid = false;
+	// copyPhysical() only reads from buffer when write == true
+	bool ret = copyPhysical( gpa, const_cast<char *>( static_cast<const char *>( buffer ) ), length, true );
 
-	// A frame number is returned, so shift it to make it a GPA again.
-	unsigned long long lastOkGpa = maxGpfn << 12;
-	unsigned long long testGpa   = lastOkGpa + PAGE_SIZE;
+	// Even if it failed, some of it might have been written
+	if ( length )
+		dropPageHashes( gpa_to_gfn( gpa ), gpa_to_gfn( gpa + length - 1 ) );
 
-	// Sometimes max GPFN does not actually tell us what is the last GPA that the guest can
-	// access, so we try to find it by mapping some pages above it and see where we are
-	// forced to stop. We've observed that for some VMs, GPFNs above max GPFN are sometimes
-	// used by a guest (for PTs, for example).
-	unsigned int invalidCount = 0;
-	while ( invalidCount < MAX_GPA_SEARCH_COUNT ) {
-		void *dummy = nullptr;
+	return ret;
+}
+
+bool Driver::readPhysical( const PhysIoVec *iov, size_t count )
+{
+	if ( !iov && count )
+		return false;
+
+	for ( size_t i = 0; i < count; ++i )
+		if ( !readPhysical( iov[i].gpa, iov[i].buffer, iov[i].length ) )
+			return false;
+
+	return true;
+}
+
+bool Driver::writePhysical( const PhysIoVec *iov, size_t count )
+{
+	if ( !iov && count )
+		return false;
+
+	for ( size_t i = 0; i < count; ++i )
+		if ( !writePhysical( iov[i].gpa, iov[i].buffer, iov[i].length ) )
+			return false;
+
+	return true;
+}
+
+size_t Driver::scanBatch( const PatternScanner &scanner, unsigned long long firstGfn, unsigned long long lastGfn,
+                          unsigned long long gpaStart, unsigned long long gpaEnd, ScanMatches &matches )
+{
+	// Also look at the next page, for matches that start in this batch and end in the next one
+	size_t count = lastGfn - firstGfn + 1;
+	size_t peek  = ( scanner.maxLength() > 1 && gfn_to_gpa( lastGfn + 1 ) < gpaEnd ) ? 1 : 0;
+
+	std::vector<bool> present;
+
+	// Mapping a hole fails noisily (and, for a whole range, takes the present pages with it),
+	// so only the runs of present pages get mapped
+	probeGfnsImpl( firstGfn, count + peek, present );
+	present.resize( count + peek, false );
+
+	std::vector<unsigned long long> gfns;
+	PatternScanner::Matches         found;
+	unsigned long long              scanEnd = std::min<unsigned long long>( gfn_to_gpa( lastGfn + 1 ), gpaEnd );
+	size_t                          failed  = 0;
+
+	for ( size_t i = 0; i < count; ) {
+		if ( !present[i] ) {
+			++i;
+			continue;
+		}
+
+		size_t j = i;
+
+		gfns.clear();
+
+		while ( j < count + peek && present[j] )
+			gfns.push_back( firstGfn + j++ );
+
+		void *mapped = nullptr;
 
-		if ( mapPhysMemToHost( testGpa, PAGE_SIZE, PHYSMAP_NO_CACHE, dummy ) == MAP_SUCCESS ) {
-			lastOkGpa = testGpa;
-			unmapPhysMem( dummy );
-			invalidCount    = 0;
-			atLeastOneValid = true;
-		} else
-			invalidCount++;
+		if ( mapGfns( gfns.data(), gfns.size(), PHYSMAP_NO_CACHE, mapped ) != MAP_SUCCESS ) {
+			failed += std::min( j, count ) - i;
+			i = j;
+			continue;
+		}
+
+		// Matches start in [from, to) (this batch's part of the run) and end by end
+		unsigned long long runGpa = gfn_to_gpa( firstGfn + i );
+		unsigned long long from   = std::max( runGpa, gpaStart );
+		unsigned long long to     = std::min<unsigned long long>( gfn_to_gpa( firstGfn + std::min( j, count ) ),
+		                                                      scanEnd );
+		unsigned long long end    = std::min<unsigned long long>( gfn_to_gpa( firstGfn + j ), gpaEnd );
+
+		const uint8_t *data = static_cast<const uint8_t *>( mapped ) + ( from - runGpa );
 
-		testGpa += PAGE_SIZE;
+		found.clear();
+		scanner.scan( data, to - from, end - from, found );
+
+		for ( auto &&match : found )
+			matches.emplace_back( from + match.offset_, match.pattern_ );
+
+		unmapGfns( mapped, gfns.size() );
+		i = j;
 	}
 
-	if ( !atLeastOneValid ) {
-		testGpa = lastOkGpa;
+	return failed;
+}
+
+bool Driver::scanPhysical( unsigned long long gpaStart, unsigned long long gpaEnd,
+                           const std::vector<std::string> &patterns, const ScanCallback &callback,
+                           unsigned int threads )
+{
+	if ( gpaStart >= gpaEnd || patterns.empty() || !callback )
+		return false;
 
-		while ( true ) {
-			void *dummy = nullptr;
+	for ( auto &&pattern : patterns )
+		if ( pattern.empty() || pattern.size() > PAGE_SIZE ) {
+			logger << ERROR << "scanPhysical(): patterns have to be 1 to " << std::dec << PAGE_SIZE
+			       << " bytes long" << std::flush;
+			return false;
+		}
 
-			if ( mapPhysMemToHost( testGpa, PAGE_SIZE, PHYSMAP_NO_CACHE, dummy ) == MAP_SUCCESS ) {
-				lastOkGpa = testGpa;
-				unmapPhysMem( dummy );
-				break;
-			}
+	unsigned long long maxGfn = 0;
 
-			testGpa -= PAGE_SIZE;
+	if ( maxGPFN( maxGfn ) )
+		gpaEnd = std::min<unsigned long long>( gpaEnd, gfn_to_gpa( maxGfn + 1 ) );
 
-			if ( !testGpa ) {
-				logger << ERROR << "No valid GPA was found" << std::flush;
-				return false;
-			}
+	if ( gpaStart >= gpaEnd )
+		return true; // nothing but holes up there
+
+	PatternScanner     scanner( patterns );
+	unsigned long long firstGfn = gpa_to_gfn( gpaStart );
+	unsigned long long lastGfn  = gpa_to_gfn( gpaEnd - 1 );
+	unsigned long long batches  = ( lastGfn - firstGfn ) / SCAN_BATCH + 1;
+
+	std::atomic<unsigned long long> nextBatch{ 0 };
+	std::atomic<size_t>             failed{ 0 };
+	std::atomic<bool>               stop{ false };
+	std::mutex                      callbackMutex;
+
+	auto worker = [&]() {
+		ScanMatches matches;
+
+		for ( unsigned long long batch; !stop && ( batch = nextBatch++ ) < batches; ) {
+			unsigned long long first = firstGfn + batch * SCAN_BATCH;
+			unsigned long long last  = std::min( lastGfn, first + SCAN_BATCH - 1 );
+
+			matches.clear();
+			failed += scanBatch( scanner, first, last, gpaStart, gpaEnd, matches );
+
+			if ( matches.empty() )
+				continue;
+
+			std::lock_guard<std::mutex> guard( callbackMutex );
+
+			for ( auto &&match : matches )
+				if ( stop || !callback( match.first, match.second ) ) {
+					stop = true;
+					break;
+				}
 		}
+	};
+
+	std::vector<std::thread> workers;
+	unsigned long long       extra = std::min<unsigned long long>( threads ? threads - 1 : 0, batches - 1 );
+
+	try {
+		for ( unsigned long long i = 0; i < extra; ++i )
+			workers.emplace_back( worker );
+	} catch ( const std::system_error &e ) {
+		// Make do with the threads that did start
+		logger << WARNING << "scanPhysical(): could not start a worker thread: " << e.what() << std::flush;
 	}
 
-#undef MAX_GPA_SEARCH_COUNT
+	worker();
 
-	maxGPFN_ = gfn = lastOkGpa >> 12;
+	for ( auto &&t : workers )
+		t.join();
 
-	logger << DEBUG << "MaxGPFN: " << std::hex << std::showbase << maxGPFN_ << std::flush;
+	if ( failed ) {
+		logger << WARNING << "scanPhysical(): " << failed << " present pages could not be mapped" << std::flush;
+		return false;
+	}
 
 	return true;
 }
 
+bool Driver::readPagingEntry( unsigned long long gpa, bool wide, uint64_t &entry )
+{
+	void *ptr = nullptr;
+
+	// Paging structures are hot, so always go through the page cache
+	if ( mapPhysMemToHost( gpa, wide ? 8 : 4, 0, ptr ) != MAP_SUCCESS )
+		return false;
+
+	if ( wide )
+		entry = *static_cast<uint64_t *>( ptr );
+	else
+		entry = *static_cast<uint32_t *>( ptr );
+
+	unmapPhysMem( ptr );
+
+	return true;
+}
+
+bool Driver::translateGva( unsigned short vcpu, unsigned long long cr3, unsigned long long gva,
+                           unsigned long long &gpa )
+{
+	const uint64_t key     = cr3 & ~( 1ULL << 63 ) & ~0x1fULL; // drop the PCID no-flush bit
+	const uint64_t gvaPage = gva & PAGE_MASK;
+
+	{
+		std::lock_guard<std::mutex> guard( translations_.mutex_ );
+
+		auto as = translations_.tlb_.find( key );
+
+		if ( as != translations_.tlb_.end() ) {
+			auto t = as->second.translations_.find( gvaPage );
+
+			if ( t != as->second.translations_.end() ) {
+				gpa = t->second | ( gva & ~PAGE_MASK );
+				return true;
+			}
+		}
+	}
+
+	// Usually called while vcpu is stopped in an event, so this is normally just a pointer into the cache
+	Registers        regsCopy;
+	const Registers *regs = nullptr;
+
+	if ( !cachedRegisters( vcpu, regs ) ) {
+		if ( !registers( vcpu, regsCopy ) )
+			return false;
+
+		regs = &regsCopy;
+	}
+
+	if ( !( regs->cr0 & X86_CR0_PG ) ) {
+		gpa = gva;
+		return true;
+	}
+
+	uint64_t walked[5];
+	size_t   levels = 0;
+	uint64_t entry  = 0;
+	uint64_t result = 0;
+
+	if ( regs->msr_efer & X86_EFER_LMA ) {
+		// 4-level or 5-level paging, 1G pages at level 3 and 2M pages at level 2
+		int      level = ( regs->cr4 & X86_CR4_LA57 ) ? 5 : 4;
+		uint64_t table = cr3 & PT_ADDR_MASK;
+
+		for ( ;; --level ) {
+			uint64_t entryGpa = table + ( ( gva >> ( 12 + 9 * ( level - 1 ) ) ) & 0x1ff ) * 8;
+
+			walked[levels++] = gpa_to_gfn( entryGpa );
+
+			if ( !readPagingEntry( entryGpa, true, entry ) || !( entry & PT_PRESENT ) )
+				return false;
+
+			if ( level == 1 ) {
+				result = ( entry & PT_ADDR_MASK ) | ( gva & 0xfff );
+				break;
+			}
+
+			if ( ( level == 2 || level == 3 ) && ( entry & PT_PAGE_SIZE ) ) {
+				uint64_t pageMask = ( 1ULL << ( 12 + 9 * ( level - 1 ) ) ) - 1;
+
+				result = ( entry & PT_ADDR_MASK & ~pageMask ) | ( gva & pageMask );
+				break;
+			}
+
+			table = entry & PT_ADDR_MASK;
+		}
+	} else if ( regs->cr4 & X86_CR4_PAE ) {
+		// PAE paging, 2M pages at the page directory level
+		uint64_t entryGpa = ( cr3 & 0xffffffe0ULL ) + ( ( gva >> 30 ) & 0x3 ) * 8;
+
+		walked[levels++] = gpa_to_gfn( entryGpa );
+
+		if ( !readPagingEntry( entryGpa, true, entry ) || !( entry & PT_PRESENT ) )
+			return false;
+
+		entryGpa         = ( entry & PT_ADDR_MASK ) + ( ( gva >> 21 ) & 0x1ff ) * 8;
+		walked[levels++] = gpa_to_gfn( entryGpa );
+
+		if ( !readPagingEntry( entryGpa, true, entry ) || !( entry & PT_PRESENT ) )
+			return false;
+
+		if ( entry & PT_PAGE_SIZE )
+			result = ( entry & PT_ADDR_MASK & ~0x1fffffULL ) | ( gva & 0x1fffff );
+		else {
+			entryGpa         = ( entry & PT_ADDR_MASK ) + ( ( gva >> 12 ) & 0x1ff ) * 8;
+			walked[levels++] = gpa_to_gfn( entryGpa );
+
+			if ( !readPagingEntry( entryGpa, true, entry ) || !( entry & PT_PRESENT ) )
+				return false;
+
+			result = ( entry & PT_ADDR_MASK ) | ( gva & 0xfff );
+		}
+	} else {
+		// Legacy 32-bit paging, 4M pages (with PSE-36 high address bits) if CR4.PSE is set
+		uint64_t entryGpa = ( cr3 & 0xfffff000ULL ) + ( ( gva >> 22 ) & 0x3ff ) * 4;
+
+		walked[levels++] = gpa_to_gfn( entryGpa );
+
+		if ( !readPagingEntry( entryGpa, false, entry ) || !( entry & PT_PRESENT ) )
+			return false;
+
+		if ( ( entry & PT_PAGE_SIZE ) && ( regs->cr4 & X86_CR4_PSE ) )
+			result = ( entry & 0xffc00000ULL ) | ( ( ( entry >> 13 ) & 0xff ) << 32 ) | ( gva & 0x3fffff );
+		else {
+			entryGpa         = ( entry & 0xfffff000ULL ) + ( ( gva >> 12 ) & 0x3ff ) * 4;
+			walked[levels++] = gpa_to_gfn( entryGpa );
+
+			if ( !readPagingEntry( entryGpa, false, entry ) || !( entry & PT_PRESENT ) )
+				return false;
+
+			result = ( entry & 0xfffff000ULL ) | ( gva & 0xfff );
+		}
+	}
+
+	gpa = result;
+
+	std::lock_guard<std::mutex> accessGuard( memAccessCacheMutex_ );
+
+	// Nothing would tell us that a paging structure we can write freely has changed
+	for ( size_t i = 0; i < levels; ++i )
+		if ( !writeProtectedLocked( walked[i] ) )
+			return true;
+
+	std::lock_guard<std::mutex> guard( translations_.mutex_ );
+
+	// Don't cache what was read out of a paging structure with a write in flight
+	for ( auto &&pending : translations_.pendingWrites_ )
+		for ( size_t i = 0; i < levels; ++i )
+			if ( walked[i] == pending.second )
+				return true;
+
+	if ( translations_.size_ + levels + 1 > MAX_TRANSLATIONS )
+		clearTranslationsLocked();
+
+	auto &as = translations_.tlb_[key];
+
+	if ( as.translations_.emplace( gvaPage, result & PAGE_MASK ).second )
+		++translations_.size_;
+
+	for ( size_t i = 0; i < levels; ++i ) {
+		translations_.dependents_[walked[i]].emplace_back( key, gvaPage );
+		as.walked_.insert( walked[i] );
+	}
+
+	translations_.size_ += levels;
+	translations_.active_ = true;
+
+	return true;
+}
+
+void Driver::clearTranslationsLocked()
+{
+	translations_.tlb_.clear();
+	translations_.dependents_.clear();
+	translations_.size_ = 0;
+}
+
+void Driver::flushTranslations()
+{
+	std::lock_guard<std::mutex> guard( translations_.mutex_ );
+
+	clearTranslationsLocked();
+}
+
+void Driver::flushTranslations( unsigned long long cr3 )
+{
+	if ( !translations_.active_ )
+		return;
+
+	const uint64_t key = cr3 & ~( 1ULL << 63 ) & ~0x1fULL;
+
+	std::lock_guard<std::mutex> guard( translations_.mutex_ );
+
+	auto as = translations_.tlb_.find( key );
+
+	if ( as == translations_.tlb_.end() )
+		return;
+
+	size_t dropped = as->second.translations_.size();
+
+	for ( auto &&gfn : as->second.walked_ ) {
+		auto deps = translations_.dependents_.find( gfn );
+
+		if ( deps == translations_.dependents_.end() )
+			continue;
+
+		auto &v   = deps->second;
+		auto  end = std::remove_if( v.begin(), v.end(), [key]( const std::pair<uint64_t, uint64_t> &dep ) {
+			return dep.first == key;
+		} );
+
+		dropped += v.end() - end;
+		v.erase( end, v.end() );
+
+		if ( v.empty() )
+			translations_.dependents_.erase( deps );
+	}
+
+	translations_.size_ -= std::min( translations_.size_, dropped );
+	translations_.tlb_.erase( as );
+}
+
+void Driver::invalidateTranslations( unsigned short vcpu, unsigned long long gfn )
+{
+	if ( pageHashes_.active_ ) {
+		std::lock_guard<std::mutex> guard( pageHashes_.mutex_ );
+
+		pageHashes_.digests_.erase( gfn );
+		++pageHashes_.writes_;
+
+		// Don't cache gfn again until the write is done
+		pageHashes_.pendingWrites_[vcpu] = gfn;
+	}
+
+	if ( !translations_.active_ )
+		return;
+
+	std::lock_guard<std::mutex> guard( translations_.mutex_ );
+
+	auto deps = translations_.dependents_.find( gfn );
+
+	if ( deps == translations_.dependents_.end() )
+		return;
+
+	size_t dropped = deps->second.size();
+
+	// Other gfns' dependents on these stay behind until their address space is flushed
+	for ( auto &&dep : deps->second ) {
+		auto as = translations_.tlb_.find( dep.first );
+
+		if ( as != translations_.tlb_.end() )
+			dropped += as->second.translations_.erase( dep.second );
+	}
+
+	translations_.size_ -= std::min( translations_.size_, dropped );
+	translations_.dependents_.erase( deps );
+
+	// The write only happens once vcpu is resumed
+	translations_.pendingWrites_[vcpu] = gfn;
+}
+
+void Driver::retireTranslationWrites( unsigned short vcpu )
+{
+	if ( pageHashes_.active_ ) {
+		std::lock_guard<std::mutex> guard( pageHashes_.mutex_ );
+
+		pageHashes_.pendingWrites_.erase( vcpu );
+	}
+
+	if ( !translations_.active_ )
+		return;
+
+	std::lock_guard<std::mutex> guard( translations_.mutex_ );
+
+	translations_.pendingWrites_.erase( vcpu );
+}
+
+#define MAX_GPA_SEARCH_COUNT 256
+
+// Walk upwards from gfn and return the last present gfn before the first hole of
+// MAX_GPA_SEARCH_COUNT non-present ones, or gfn if there's none.
+unsigned long long Driver::lastGfnBeforeHole( unsigned long long gfn )
+{
+	unsigned long long lastOk       = gfn;
+	unsigned long long next         = gfn + 1;
+	unsigned int       invalidCount = 0;
+
+	std::vector<bool> present;
+
+	while ( invalidCount < MAX_GPA_SEARCH_COUNT ) {
+		probeGfnsImpl( next, MAX_GPA_SEARCH_COUNT, present );
+
+		for ( size_t i = 0; i < MAX_GPA_SEARCH_COUNT && invalidCount < MAX_GPA_SEARCH_COUNT; ++i ) {
+			if ( i < present.size() && present[i] ) {
+				lastOk       = next + i;
+				invalidCount = 0;
+			} else
+				invalidCount++;
+		}
+
+		next += MAX_GPA_SEARCH_COUNT;
+	}
+
+	return lastOk;
+}
+
+bool Driver::maxGPFN( unsigned long long &gfn )
+{
+	std::lock_guard<std::mutex> guard( maxGPFNMutex_ );
+
+	// Integrators call this method before becoming multi-threaded relying on the fact
+	// that the result gets cached and the algorithm below never gets to run again
+	if ( maxGPFN_ ) {
+		gfn = maxGPFN_;
+		return true;
+	}
+
+	unsigned long long maxGpfn = 0;
+
+	if ( !maxGPFNImpl( maxGpfn ) )
+		return false;
+
+		//
+		// The code below resided in the introspection engine (introcore), but it was decided that
+		// it should be pushed down to the glue layer. While in its initial location the following
+		// explanation existed for it:
+		//
+		// although there is a GLUE_IFACE.QueryGuestInfo information class that returns this
+		// information, #IG_QUERY_INFO_CLASS_MAX_GPFN, in practice is has been observed to not
+		// always be accurate. Especially on XEN, for example, for guests with 1G of memory it
+		// would usually report back 4G of memory available, or for guests with more memory, the
+		// value would be slightly below the last page the guest could actually access. Since
+		// having this information is vital for some subsystems (such as the \#VE one), we try to
+		// figure it out ourselves. The algorithm is simple enough. Start with the page returned
+		// by #IG_QUERY_INFO_CLASS_MAX_GPFN query, and try to see if there is any memory available
+		// about it. If a physical page is mappable, we consider that it is available to the guest,
+		// since introcore should not be able to access memory that is not available to the guest.
+		// We do this search until a hole of 256 consecutive invalid pages is found. If during this
+		// search a valid page is found above the one returned by the hypervisor, we consider it to
+		// be the last physical page which the guest can access. If no page is found about the hint
+		// value, we may be in the case in which the hypervisor reported more than the guest has
+		// access to. While this is not as critical as the case in which the value is lower, it may
+		// still lead to unnecessary memory consumption. In this case we go below the page returned
+		// by the hypervisor until we find a page that we can map. The first page that can be
+		// mapped is treated as the last physical page the guest can access. Since this value will
+		// not change while introcore is running, it is cached inside the #gGuest variable and
+		// subsequent calls to this function will return the cached value, in order to avoid long
+		// pauses every time the query is done.
+		//
+		// Both searches probe MAX_GPA_SEARCH_COUNT pages at a time (one hypercall on Xen).
+		//
+
+	// Sometimes max GPFN does not actually tell us what is the last GPA that the guest can
+	// access, so we try to find it by mapping some pages above it and see where we are
+	// forced to stop. We've observed that for some VMs, GPFNs above max GPFN are sometimes
+	// used by a guest (for PTs, for example).
+	unsigned long long lastOk = lastGfnBeforeHole( maxGpfn );
+
+	if ( lastOk == maxGpfn ) {
+		// Nothing above the hint: the first present page at or below it is the last one
+		unsigned long long next  = maxGpfn;
+		bool               found = false;
+
+		std::vector<bool> present;
+
+		while ( !found && next ) {
+			unsigned long long first = next > MAX_GPA_SEARCH_COUNT ? next - MAX_GPA_SEARCH_COUNT + 1 : 1;
+			size_t             count = next - first + 1;
+
+			probeGfnsImpl( first, count, present );
+
+			for ( size_t i = count; i > 0 && !found; --i ) {
+				if ( i - 1 < present.size() && present[i - 1] ) {
+					lastOk = first + i - 1;
+					found  = true;
+				}
+			}
+
+			next = first - 1;
+		}
+
+		if ( !found ) {
+			logger << ERROR << "No valid GPA was found" << std::flush;
+			return false;
+		}
+	}
+
+	maxGPFN_ = gfn = lastOk;
+
+	logger << DEBUG << "MaxGPFN: " << std::hex << std::showbase << maxGPFN_ << std::flush;
+
+	return true;
+}
+
+#undef MAX_GPA_SEARCH_COUNT
+
+bool Driver::startDirtyTracking()
+{
+	std::lock_guard<std::mutex> guard( dirtyLog_.mutex_ );
+
+	if ( dirtyLog_.active_ )
+		return true;
+
+	if ( !startDirtyLogImpl() )
+		return false;
+
+	dirtyLog_.active_ = true;
+	dirtyLog_.pending_.clear();
+
+	return true;
+}
+
+bool Driver::stopDirtyTracking()
+{
+	std::lock_guard<std::mutex> guard( dirtyLog_.mutex_ );
+
+	if ( !dirtyLog_.active_ )
+		return true;
+
+	dirtyLog_.active_ = false;
+
+	// Release the memory
+	decltype( dirtyLog_.pending_ ) notUsingMemory;
+	std::swap( dirtyLog_.pending_, notUsingMemory );
+
+	// Writes to pages that aren't write-protected won't be seen anymore
+	flushPageHashes();
+
+	return stopDirtyLogImpl();
+}
+
+bool Driver::collectDirtyLogLocked()
+{
+	unsigned long long maxGfn = 0;
+
+	if ( !maxGPFN( maxGfn ) )
+		return false;
+
+	unsigned long long     pages   = maxGfn + 1;
+	size_t                 words   = ( pages + 63 ) / 64;
+	std::vector<uint64_t> &scratch = dirtyLog_.scratch_;
+
+	scratch.assign( words, 0 );
+
+	if ( !fetchDirtyLogImpl( pages, scratch ) )
+		return false;
+
+	if ( pageHashes_.active_ ) {
+		std::lock_guard<std::mutex> guard( pageHashes_.mutex_ );
+
+		++pageHashes_.writes_;
+
+		if ( !pageHashes_.digests_.empty() )
+			for ( size_t w = 0; w < words; ++w )
+				for ( uint64_t bits = scratch[w]; bits; bits &= bits - 1 )
+					pageHashes_.digests_.erase( w * 64 + __builtin_ctzll( bits ) );
+	}
+
+	std::vector<uint64_t> &pending = dirtyLog_.pending_;
+
+	if ( pending.size() < words )
+		pending.resize( words, 0 );
+
+	for ( size_t w = 0; w < words; ++w )
+		pending[w] |= scratch[w];
+
+	return true;
+}
+
+bool Driver::fetchDirtyBitmap( unsigned long long firstGfn, size_t count, std::vector<uint64_t> &bitmap )
+{
+	std::lock_guard<std::mutex> guard( dirtyLog_.mutex_ );
+
+	bitmap.assign( ( count + 63 ) / 64, 0 );
+
+	if ( !dirtyLog_.active_ ) {
+		logger << ERROR << "fetchDirtyBitmap(): dirty page tracking has not been started" << std::flush;
+		return false;
+	}
+
+	if ( !collectDirtyLogLocked() )
+		return false;
+
+	std::vector<uint64_t> &pending = dirtyLog_.pending_;
+
+	// Move the range's bits from pending to bitmap, a word of pending at a time
+	unsigned long long end = std::min<unsigned long long>( firstGfn + count, pending.size() * 64 );
+
+	for ( unsigned long long gfn = firstGfn; gfn < end; ) {
+		size_t   w    = gfn / 64;
+		uint64_t mask = ~0ULL << ( gfn % 64 );
+
+		if ( end - w * 64 < 64 )
+			mask &= ( 1ULL << ( end - w * 64 ) ) - 1;
+
+		uint64_t bits = pending[w] & mask;
+		pending[w] &= ~mask;
+
+		while ( bits ) {
+			size_t i = w * 64 + __builtin_ctzll( bits ) - firstGfn;
+			bits &= bits - 1;
+
+			bitmap[i / 64] |= 1ULL << ( i % 64 );
+		}
+
+		gfn = ( w + 1 ) * 64;
+	}
+
+	return true;
+}
+
+bool Driver::writeProtectedLocked( unsigned long long gfn ) const
+{
+	// The default view always exists, other views get an entry from createEPT() / cloneEPT()
+	if ( memAccessCache_.find( 0 ) == memAccessCache_.end() )
+		return false;
+
+	for ( auto &&item : memAccessCache_ ) {
+		uint8_t attr = item.second.get( gfn );
+
+		if ( attr == PageAttributeTable::UNKNOWN || ( attr & PAGE_WRITE ) || item.second.dirty( gfn ) )
+			return false;
+	}
+
+	return true;
+}
+
+void Driver::dropPageHashes( unsigned long long firstGfn, unsigned long long lastGfn )
+{
+	if ( !pageHashes_.active_ )
+		return;
+
+	std::lock_guard<std::mutex> guard( pageHashes_.mutex_ );
+
+	auto &digests = pageHashes_.digests_;
+
+	++pageHashes_.writes_;
+
+	if ( lastGfn - firstGfn < digests.size() ) {
+		for ( unsigned long long gfn = firstGfn; gfn <= lastGfn; ++gfn )
+			digests.erase( gfn );
+
+		return;
+	}
+
+	for ( auto it = digests.begin(); it != digests.end(); ) {
+		if ( it->first >= firstGfn && it->first <= lastGfn )
+			it = digests.erase( it );
+		else
+			++it;
+	}
+}
+
+void Driver::flushPageHashes()
+{
+	std::lock_guard<std::mutex> guard( pageHashes_.mutex_ );
+
+	pageHashes_.digests_.clear();
+	++pageHashes_.writes_;
+}
+
+bool Driver::hashPages( const unsigned long long *gfns, size_t count, uint64_t *digests )
+{
+	if ( count && ( !gfns || !digests ) )
+		return false;
+
+	// From now on, writes get reported to the cache
+	pageHashes_.active_ = true;
+
+	bool tracking = false;
+
+	{
+		std::lock_guard<std::mutex> guard( dirtyLog_.mutex_ );
+
+		if ( dirtyLog_.active_ && !collectDirtyLogLocked() )
+			return false;
+
+		tracking = dirtyLog_.active_;
+	}
+
+	std::vector<size_t> misses; // indices into gfns
+	uint64_t            writes = 0;
+
+	{
+		std::lock_guard<std::mutex> guard( pageHashes_.mutex_ );
+
+		writes = pageHashes_.writes_;
+
+		for ( size_t i = 0; i < count; ++i ) {
+			auto it = pageHashes_.digests_.find( gfns[i] );
+
+			if ( it != pageHashes_.digests_.end() )
+				digests[i] = it->second;
+			else
+				misses.push_back( i );
+		}
+	}
+
+	if ( misses.empty() )
+		return true;
+
+	std::vector<unsigned long long> batch;
+
+	for ( size_t first = 0; first < misses.size(); first += HASH_BATCH ) {
+		size_t n = misses.size() - first < HASH_BATCH ? misses.size() - first : HASH_BATCH;
+
+		batch.clear();
+
+		for ( size_t j = first; j < first + n; ++j )
+			batch.push_back( gfns[misses[j]] );
+
+		void *mapped = nullptr;
+
+		if ( mapGfns( batch.data(), n, PHYSMAP_NO_CACHE, mapped ) == MAP_SUCCESS ) {
+			const char *pages = static_cast<const char *>( mapped );
+
+			for ( size_t j = 0; j < n; ++j )
+				digests[misses[first + j]] = pageHash( pages + j * PAGE_SIZE );
+
+			unmapGfns( mapped, n );
+			continue;
+		}
+
+		// Find out which one can't be mapped
+		for ( size_t j = 0; j < n; ++j ) {
+			if ( mapPhysMemToHost( gfn_to_gpa( batch[j] ), PAGE_SIZE, PHYSMAP_NO_CACHE, mapped ) !=
+			     MAP_SUCCESS ) {
+				logger << ERROR << "hashPages(): could not map gfn " << std::hex << std::showbase
+				       << batch[j] << std::flush;
+				return false;
+			}
+
+			digests[misses[first + j]] = pageHash( mapped );
+			unmapPhysMem( mapped );
+		}
+	}
+
+	std::vector<bool> cacheable( misses.size(), tracking );
+
+	if ( !tracking ) {
+		std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
+
+		for ( size_t j = 0; j < misses.size(); ++j )
+			cacheable[j] = writeProtectedLocked( gfns[misses[j]] );
+	}
+
+	std::lock_guard<std::mutex> guard( pageHashes_.mutex_ );
+
+	// Something may have been written to since the pages were read
+	if ( pageHashes_.writes_ != writes )
+		return true;
+
+	for ( size_t j = 0; j < misses.size(); ++j ) {
+		if ( !cacheable[j] )
+			continue;
+
+		unsigned long long gfn     = gfns[misses[j]];
+		bool               pending = false;
+
+		for ( auto &&item : pageHashes_.pendingWrites_ )
+			if ( item.second == gfn )
+				pending = true;
+
+		if ( pending )
+			continue;
+
+		if ( pageHashes_.digests_.size() >= MAX_PAGE_HASHES )
+			pageHashes_.digests_.clear();
+
+		pageHashes_.digests_[gfn] = digests[misses[j]];
+	}
+
+	return true;
+}
+
+bool Driver::pauseVcpus( uint64_t mask )
+{
+	unsigned int count = 0;
+
+	if ( !cpuCount( count ) )
+		return false;
+
+	if ( count < MAX_PAUSE_VCPUS && ( mask >> count ) ) {
+		logger << ERROR << "pauseVcpus(): no such vCPU in " << HEXLOG( mask ) << " (" << std::dec << count
+		       << " vCPUs)" << std::flush;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> guard( vcpuPause_.mutex_ );
+
+	uint64_t stopped = mask & ~vcpuPause_.paused_;
+
+	if ( stopped && !pauseVcpusImpl( stopped, vcpuPause_.paused_ | stopped ) )
+		return false;
+
+	vcpuPause_.paused_ |= stopped;
+
+	for ( uint64_t bits = mask; bits; bits &= bits - 1 )
+		++vcpuPause_.counts_[__builtin_ctzll( bits )];
+
+	return true;
+}
+
+bool Driver::unpauseVcpus( uint64_t mask )
+{
+	std::lock_guard<std::mutex> guard( vcpuPause_.mutex_ );
+
+	if ( mask & ~vcpuPause_.paused_ ) {
+		logger << ERROR << "unpauseVcpus(): " << HEXLOG( ( mask & ~vcpuPause_.paused_ ) ) << " not paused"
+		       << std::flush;
+		mask &= vcpuPause_.paused_;
+	}
+
+	uint64_t released = 0;
+
+	for ( uint64_t bits = mask; bits; bits &= bits - 1 ) {
+		unsigned int vcpu = __builtin_ctzll( bits );
+
+		if ( !--vcpuPause_.counts_[vcpu] )
+			released |= 1ULL << vcpu;
+	}
+
+	if ( !released )
+		return true;
+
+	vcpuPause_.paused_ &= ~released;
+
+	return unpauseVcpusImpl( released, vcpuPause_.paused_ );
+}
+
+uint64_t Driver::pausedVcpus()
+{
+	std::lock_guard<std::mutex> guard( vcpuPause_.mutex_ );
+
+	return vcpuPause_.paused_;
+}
+
+void Driver::recordPage( unsigned long long gfn, const void *page ) const
+{
+	EventRecorder *r = recorder_;
+
+	if ( r )
+		r->addPage( gfn, page );
+}
+
+void Driver::recordRegisters( unsigned short vcpu, const Registers &regs ) const
+{
+	EventRecorder *r = recorder_;
+
+	if ( r )
+		r->addRegisters( vcpu, regs );
+}
+
+void Driver::fatalError()
+{
+	eventTrace_.fatalError();
+
+	// Whatever the handler does next, the lines leading up to this should make it out
+	logger.drain();
+
+	if ( handler_ )
+		handler_->handleFatalError();
+}
+
 } // namespace bdvmi
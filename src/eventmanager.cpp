@@ -14,9 +14,28 @@
 // License along with this library.
 
 #include "bdvmi/eventmanager.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/logger.h"
+#include "bdvmi/statscollector.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <new>
 
 namespace bdvmi {
 
+namespace {
+
+// The event the current thread is in a deferrable callback for
+struct DeferContext {
+	const EventManager *manager_{ nullptr };
+	uint64_t            token_{ 0 };
+};
+
+thread_local DeferContext deferContext;
+
+} // namespace
+
 EventManager::EventManager( sig_atomic_t &sigStop )
     : sigStop_{ sigStop }
 {
@@ -158,4 +177,298 @@ bool EventManager::disableDescriptorEvents()
 	return !descriptorEnabled_;
 }
 
+bool EventManager::addCrFilter( unsigned int cr, uint64_t mask, uint64_t value, HVAction action, bool relative )
+{
+	if ( action != NONE && action != SKIP_INSTRUCTION && action != EMULATE_NOWRITE ) {
+		logger << ERROR << "Unsupported action for a CR" << cr << " filter: " << action << std::flush;
+		return false;
+	}
+
+	crFilters_.push_back( { cr, mask, value, relative, action } );
+
+	return true;
+}
+
+bool EventManager::addMsrFilter( unsigned int msr, uint64_t mask, uint64_t value, HVAction action, bool relative )
+{
+	if ( action != NONE && action != SKIP_INSTRUCTION && action != EMULATE_NOWRITE ) {
+		logger << ERROR << "Unsupported action for an MSR 0x" << std::hex << msr << std::dec
+		       << " filter: " << action << std::flush;
+		return false;
+	}
+
+	msrFilters_.push_back( { msr, mask, value, relative, action } );
+
+	return true;
+}
+
+bool EventManager::addPageFaultFilter( unsigned long long firstGfn, unsigned long long lastGfn, uint8_t access,
+                                       HVAction action )
+{
+	if ( action != NONE && action != ALLOW_VIRTUAL ) {
+		logger << ERROR << "Unsupported action for a page fault filter: " << action << std::flush;
+		return false;
+	}
+
+	if ( firstGfn > lastGfn ) {
+		logger << ERROR << "Invalid page fault filter range" << std::flush;
+		return false;
+	}
+
+	PageFaultFilter filter{ firstGfn, lastGfn, access, action };
+
+	auto pos = std::upper_bound(
+	    pageFaultFilters_.begin(), pageFaultFilters_.end(), firstGfn,
+	    []( unsigned long long gfn, const PageFaultFilter &f ) { return gfn < f.firstGfn_; } );
+
+	pageFaultFilters_.insert( pos, filter );
+	maxPageFaultSpan_ = std::max( maxPageFaultSpan_, lastGfn - firstGfn );
+
+	return true;
+}
+
+void EventManager::clearFilters()
+{
+	crFilters_.clear();
+	msrFilters_.clear();
+	pageFaultFilters_.clear();
+	maxPageFaultSpan_ = 0;
+}
+
+bool EventManager::matchValue( const std::vector<ValueFilter> &filters, unsigned int index, uint64_t oldValue,
+                               uint64_t newValue, HVAction &action )
+{
+	for ( auto &&f : filters ) {
+		if ( f.index_ != index )
+			continue;
+
+		uint64_t bits = f.relative_ ? ( newValue ^ oldValue ) : newValue;
+
+		if ( ( bits & f.mask_ ) == f.value_ ) {
+			action = f.action_;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool EventManager::filterCr( unsigned int cr, uint64_t oldValue, uint64_t newValue, HVAction &action ) const
+{
+	return !crFilters_.empty() && matchValue( crFilters_, cr, oldValue, newValue, action );
+}
+
+bool EventManager::filterMsr( unsigned int msr, uint64_t oldValue, uint64_t newValue, HVAction &action ) const
+{
+	return !msrFilters_.empty() && matchValue( msrFilters_, msr, oldValue, newValue, action );
+}
+
+bool EventManager::filterPageFault( unsigned long long gfn, bool read, bool write, bool execute,
+                                    HVAction &action ) const
+{
+	if ( pageFaultFilters_.empty() )
+		return false;
+
+	uint8_t access = ( read ? Driver::PAGE_READ : 0 ) | ( write ? Driver::PAGE_WRITE : 0 ) |
+	    ( execute ? Driver::PAGE_EXECUTE : 0 );
+
+	// The candidates are the filters starting at or before gfn, no more than the widest
+	// span away
+	auto it = std::upper_bound(
+	    pageFaultFilters_.begin(), pageFaultFilters_.end(), gfn,
+	    []( unsigned long long g, const PageFaultFilter &f ) { return g < f.firstGfn_; } );
+
+	while ( it != pageFaultFilters_.begin() ) {
+		--it;
+
+		if ( gfn - it->firstGfn_ > maxPageFaultSpan_ )
+			break;
+
+		if ( gfn <= it->lastGfn_ && ( access & ~it->access_ ) == 0 ) {
+			action = it->action_;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint64_t EventManager::defer()
+{
+	if ( deferContext.manager_ != this )
+		return 0;
+
+	if ( deferContext.token_ )
+		return deferContext.token_;
+
+	std::lock_guard<std::mutex> lock( deferredMutex_ );
+
+	uint64_t token = nextToken_++;
+
+	deferred_[token];
+	deferContext.token_ = token;
+
+	return token;
+}
+
+bool EventManager::complete( uint64_t token, HVAction action, unsigned short instructionSize,
+                             const EmulatorContext *emulatorCtx )
+{
+	Completion completion;
+
+	completion.action_          = action;
+	completion.instructionSize_ = instructionSize;
+
+	if ( emulatorCtx )
+		completion.emulatorCtx_ = *emulatorCtx;
+
+	DeferredReply reply;
+
+	{
+		std::lock_guard<std::mutex> lock( deferredMutex_ );
+
+		auto it = deferred_.find( token );
+
+		if ( it == deferred_.end() || it->second.completed_ ) {
+			logger << ERROR << "Unknown (or already completed) deferred event " << token << std::flush;
+			return false;
+		}
+
+		if ( !it->second.reply_ ) {
+			// The callback that deferred it hasn't even returned yet, deferReply() will do it
+			it->second.completed_  = true;
+			it->second.completion_ = completion;
+			return true;
+		}
+
+		reply = std::move( it->second.reply_ );
+		deferred_.erase( it );
+	}
+
+	return reply( completion );
+}
+
+void EventManager::beginDeferrable()
+{
+	deferContext.manager_ = this;
+	deferContext.token_   = 0;
+}
+
+uint64_t EventManager::endDeferrable()
+{
+	uint64_t token = deferContext.token_;
+
+	deferContext = DeferContext();
+
+	return token;
+}
+
+void EventManager::deferReply( uint64_t token, DeferredReply reply )
+{
+	Completion completion;
+
+	{
+		std::lock_guard<std::mutex> lock( deferredMutex_ );
+
+		auto it = deferred_.find( token );
+
+		if ( it == deferred_.end() )
+			return;
+
+		if ( !it->second.completed_ ) {
+			it->second.reply_ = std::move( reply );
+			return;
+		}
+
+		completion = it->second.completion_;
+		deferred_.erase( it );
+	}
+
+	reply( completion );
+}
+
+void EventManager::completeDeferred()
+{
+	std::vector<DeferredReply> replies;
+
+	{
+		std::lock_guard<std::mutex> lock( deferredMutex_ );
+
+		for ( auto it = deferred_.begin(); it != deferred_.end(); ) {
+			if ( it->second.reply_ ) {
+				replies.push_back( std::move( it->second.reply_ ) );
+				it = deferred_.erase( it );
+			} else
+				++it;
+		}
+	}
+
+	Completion completion;
+
+	for ( auto &&reply : replies )
+		reply( completion );
+}
+
+void EventManager::EventContextDeleter::operator()( EventContext *ctx ) const
+{
+	ctx->~EventContext();
+	free( ctx );
+}
+
+void EventManager::reserveEventContexts( unsigned int count )
+{
+	eventContexts_.reserve( count );
+
+	while ( eventContexts_.size() < count ) {
+		void *mem = nullptr;
+
+		// C++14's new doesn't do over-aligned types
+		if ( posix_memalign( &mem, alignof( EventContext ), sizeof( EventContext ) ) ) {
+			logger << ERROR << "posix_memalign() has failed" << std::flush;
+			return;
+		}
+
+		eventContexts_.emplace_back( new ( mem ) EventContext );
+	}
+}
+
+EventManager::EventContext &EventManager::eventContext( unsigned short vcpu )
+{
+	if ( vcpu < eventContexts_.size() )
+		return *eventContexts_[vcpu];
+
+	static thread_local EventContext fallback;
+
+	return fallback;
+}
+
+bool EventManager::spin( const std::function<bool()> &ready ) const
+{
+	using clock = std::chrono::steady_clock;
+
+	const clock::time_point start    = clock::now();
+	const clock::time_point deadline = start + std::chrono::microseconds( busyPollUs_ );
+
+	bool found = false;
+
+	for ( ;; ) {
+		if ( ready() ) {
+			found = true;
+			break;
+		}
+
+		if ( clock::now() >= deadline )
+			break;
+
+		__builtin_ia32_pause();
+	}
+
+	StatsCollector &stats = StatsCollector::instance();
+
+	if ( stats.enabled() )
+		stats.count( stats.literal( found ? "busyPollHits" : "busyPollMisses" ), clock::now() - start );
+
+	return found;
+}
+
 } // namespace bdvmi
@@ -0,0 +1,290 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/eventreactor.h"
+#include "bdvmi/eventmanager.h"
+#include "bdvmi/logger.h"
+#include <sys/epoll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+namespace bdvmi {
+
+namespace {
+
+constexpr int POLL_TIMEOUT_MS = 100; // how often sigStop gets looked at, same as the Xen event loop
+constexpr int MAX_POLL_EVENTS = 64;
+
+} // namespace
+
+EventReactor::EventReactor( sig_atomic_t &sigStop, size_t threads, size_t budget )
+    : sigStop_{ sigStop }
+    , threads_{ threads ? threads : 1 }
+    , budget_{ budget }
+{
+	epollFd_ = epoll_create1( EPOLL_CLOEXEC );
+
+	if ( epollFd_ == -1 )
+		throw std::runtime_error( std::string( "[EventReactor] epoll_create1() failed: " ) +
+		                          strerror( errno ) );
+}
+
+EventReactor::~EventReactor()
+{
+	close( epollFd_ );
+}
+
+bool EventReactor::add( EventManager &em, FinishedCallback finished )
+{
+	std::unique_ptr<Entry> entry( new Entry );
+
+	entry->em_       = &em;
+	entry->finished_ = std::move( finished );
+	entry->fds_      = em.pollFds();
+
+	if ( entry->fds_.empty() ) {
+		logger << ERROR << "[EventReactor] domain " << em.uuid() << " has nothing to poll" << std::flush;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	entry->id_ = nextId_++;
+
+	for ( size_t i = 0; i < entry->fds_.size(); ++i ) {
+		struct epoll_event ev = {};
+
+		ev.events   = EPOLLIN | EPOLLONESHOT;
+		ev.data.u64 = entry->id_;
+
+		if ( epoll_ctl( epollFd_, EPOLL_CTL_ADD, entry->fds_[i], &ev ) == -1 ) {
+			logger << ERROR << "[EventReactor] epoll_ctl() failed for domain " << em.uuid() << ": "
+			       << strerror( errno ) << std::flush;
+
+			while ( i-- > 0 )
+				epoll_ctl( epollFd_, EPOLL_CTL_DEL, entry->fds_[i], nullptr );
+
+			return false;
+		}
+	}
+
+	Entry *e = entry.get();
+
+	entries_[e->id_] = std::move( entry );
+
+	// Whatever came in before the fds were being polled
+	queue( e );
+	workAvailable_.notify_one();
+
+	return true;
+}
+
+void EventReactor::remove( EventManager &em )
+{
+	std::unique_lock<std::mutex> lock( mutex_ );
+
+	auto i = std::find_if( entries_.begin(), entries_.end(),
+	                       [&em]( const decltype( entries_ )::value_type &e ) { return e.second->em_ == &em; } );
+
+	if ( i == entries_.end() )
+		return;
+
+	Entry *entry = i->second.get();
+
+	idle_.wait( lock, [entry]() { return !entry->busy_; } );
+
+	drop( entry );
+}
+
+size_t EventReactor::domains() const
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	return entries_.size();
+}
+
+void EventReactor::run()
+{
+	std::vector<std::thread> helpers;
+
+	for ( size_t i = 1; i < threads_; ++i )
+		helpers.emplace_back( &EventReactor::loop, this );
+
+	loop();
+
+	for ( auto &&t : helpers )
+		t.join();
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	stopping_ = false;
+	stop_     = false;
+}
+
+void EventReactor::loop()
+{
+	std::unique_lock<std::mutex> lock( mutex_ );
+
+	for ( ;; ) {
+		if ( ( sigStop_ || stop_ ) && !stopping_ ) {
+			stopping_ = true;
+
+			for ( auto &&e : entries_ )
+				queue( e.second.get() );
+
+			workAvailable_.notify_all();
+		}
+
+		if ( stopping_ && entries_.empty() ) {
+			workAvailable_.notify_all();
+			return;
+		}
+
+		// One thread at a time waits on the epoll set (without sleeping if there's work queued,
+		// so busy domains don't keep the others from being looked at), the rest wait for it.
+		if ( !polling_ )
+			poll( lock, ready_.empty() ? POLL_TIMEOUT_MS : 0 );
+		else if ( ready_.empty() )
+			workAvailable_.wait_for( lock, std::chrono::milliseconds( POLL_TIMEOUT_MS ) );
+
+		if ( ready_.empty() )
+			continue;
+
+		Entry *entry = ready_.front();
+		ready_.pop_front();
+
+		entry->queued_ = false;
+		entry->busy_   = true;
+
+		bool stopping = stopping_;
+
+		lock.unlock();
+
+		size_t events = 0;
+		bool   failed = false;
+
+		try {
+			// Here instead of in the stopping_ block above, so that nothing happens to a domain
+			// while another thread is handling its events
+			if ( stopping )
+				entry->em_->stop();
+
+			events = entry->em_->processPending( budget_ );
+		} catch ( const std::exception &e ) {
+			logger << ERROR << "[EventReactor] domain " << entry->em_->uuid() << ": " << e.what()
+			       << std::flush;
+			failed = true;
+		}
+
+		lock.lock();
+
+		entry->busy_ = false;
+		idle_.notify_all();
+
+		if ( failed || entry->em_->finished() ) {
+			EventManager &   em       = *entry->em_;
+			FinishedCallback finished = std::move( entry->finished_ );
+
+			drop( entry );
+
+			if ( finished ) {
+				lock.unlock();
+				finished( em );
+				lock.lock();
+			}
+
+			continue;
+		}
+
+		// Used up its budget, so likely more to do: back of the queue
+		if ( stopping_ || ( budget_ && events == budget_ ) ) {
+			queue( entry );
+			workAvailable_.notify_one();
+		} else
+			rearm( *entry );
+	}
+}
+
+void EventReactor::poll( std::unique_lock<std::mutex> &lock, int ms )
+{
+	struct epoll_event events[MAX_POLL_EVENTS];
+
+	polling_ = true;
+	lock.unlock();
+
+	int n = epoll_wait( epollFd_, events, MAX_POLL_EVENTS, ms );
+
+	if ( n == -1 && errno != EINTR )
+		logger << ERROR << "[EventReactor] epoll_wait() failed: " << strerror( errno ) << std::flush;
+
+	lock.lock();
+	polling_ = false;
+
+	bool queued = false;
+
+	for ( int i = 0; i < n; ++i ) {
+		auto e = entries_.find( events[i].data.u64 );
+
+		// Removed in the meantime, or its other fd got here first
+		if ( e == entries_.end() || e->second->queued_ || e->second->busy_ )
+			continue;
+
+		queue( e->second.get() );
+		queued = true;
+	}
+
+	if ( queued )
+		workAvailable_.notify_all();
+}
+
+void EventReactor::rearm( const Entry &entry )
+{
+	for ( auto &&fd : entry.fds_ ) {
+		struct epoll_event ev = {};
+
+		ev.events   = EPOLLIN | EPOLLONESHOT;
+		ev.data.u64 = entry.id_;
+
+		if ( epoll_ctl( epollFd_, EPOLL_CTL_MOD, fd, &ev ) == -1 )
+			logger << ERROR << "[EventReactor] epoll_ctl() failed: " << strerror( errno ) << std::flush;
+	}
+}
+
+void EventReactor::queue( Entry *entry )
+{
+	if ( entry->queued_ || entry->busy_ )
+		return;
+
+	entry->queued_ = true;
+	ready_.push_back( entry );
+}
+
+void EventReactor::drop( Entry *entry )
+{
+	for ( auto &&fd : entry->fds_ )
+		epoll_ctl( epollFd_, EPOLL_CTL_DEL, fd, nullptr );
+
+	if ( entry->queued_ )
+		ready_.erase( std::find( ready_.begin(), ready_.end(), entry ) );
+
+	entries_.erase( entry->id_ );
+}
+
+} // namespace bdvmi
@@ -0,0 +1,356 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/eventrecorder.h"
+#include "bdvmi/driver.h"
+#include "bdvmi/logger.h"
+#include "tracefile.h"
+#include <cstring>
+#include <unordered_set>
+#include <vector>
+
+namespace bdvmi {
+
+struct EventRecorder::Pending {
+	Pending( EventRecorder &recorder, trace::RecordType type, unsigned short vcpu, const Registers *regs );
+
+	~Pending();
+
+	EventRecorder &                    recorder_;
+	Pending *                          previous_;
+	trace::RecordHeader                header_;
+	std::vector<trace::RegistersEntry> registers_;
+	std::vector<uint64_t>              gfns_;
+	std::vector<char>                  data_;
+	std::unordered_set<uint64_t>       seen_;
+};
+
+thread_local EventRecorder::Pending *EventRecorder::current_ = nullptr;
+
+namespace {
+
+const char zeroes[PAGE_SIZE] = {};
+
+} // namespace
+
+EventRecorder::Pending::Pending( EventRecorder &recorder, trace::RecordType type, unsigned short vcpu,
+                                 const Registers *regs )
+    : recorder_{ recorder }
+    , previous_{ current_ }
+{
+	header_.type_ = type;
+	header_.vcpu_ = vcpu;
+
+	if ( regs ) {
+		header_.regs_ = *regs;
+		header_.flags_ |= trace::FLAG_REGISTERS;
+	}
+
+	current_ = this;
+}
+
+EventRecorder::Pending::~Pending()
+{
+	current_ = previous_;
+}
+
+EventRecorder::EventRecorder( Driver &driver, EventHandler *handler )
+    : driver_{ driver }
+    , handler_{ handler }
+{
+}
+
+EventRecorder::~EventRecorder()
+{
+	close();
+}
+
+bool EventRecorder::open( const std::string &path )
+{
+	close();
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	file_.open( path.c_str(), std::ios_base::out | std::ios_base::trunc | std::ios_base::binary );
+
+	if ( !file_ ) {
+		logger << ERROR << "Could not open " << path << " for recording" << std::flush;
+		return false;
+	}
+
+	trace::FileHeader header;
+
+	memcpy( header.magic_, trace::MAGIC, sizeof( header.magic_ ) );
+
+	header.version_       = trace::VERSION;
+	header.pageSize_      = PAGE_SIZE;
+	header.registersSize_ = sizeof( Registers );
+
+	file_.write( reinterpret_cast<const char *>( &header ), sizeof( header ) );
+
+	offset_ = sizeof( header );
+	failed_ = false;
+
+	driver_.recorder( this );
+
+	logger << INFO << "Recording events to " << path << std::flush;
+
+	return true;
+}
+
+void EventRecorder::close()
+{
+	driver_.recorder( nullptr );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( file_.is_open() )
+		file_.close();
+}
+
+void EventRecorder::addPage( unsigned long long gfn, const void *page )
+{
+	Pending *pending = current_;
+
+	if ( !pending || &pending->recorder_ != this ) {
+		Pending loose( *this, trace::RECORD_PAGES, 0, nullptr );
+
+		loose.gfns_.push_back( gfn );
+		loose.data_.assign( static_cast<const char *>( page ), static_cast<const char *>( page ) + PAGE_SIZE );
+
+		write( loose );
+		return;
+	}
+
+	if ( !pending->seen_.insert( gfn ).second )
+		return;
+
+	pending->gfns_.push_back( gfn );
+	pending->data_.insert( pending->data_.end(), static_cast<const char *>( page ),
+	                       static_cast<const char *>( page ) + PAGE_SIZE );
+}
+
+void EventRecorder::addRegisters( unsigned short vcpu, const Registers &regs )
+{
+	Pending *pending = current_;
+
+	// Outside of an event the replay driver's idea of the registers is as good as any
+	if ( !pending || &pending->recorder_ != this )
+		return;
+
+	for ( auto &&entry : pending->registers_ )
+		if ( entry.vcpu_ == vcpu ) {
+			entry.regs_ = regs;
+			return;
+		}
+
+	trace::RegistersEntry entry;
+
+	entry.vcpu_ = vcpu;
+	entry.regs_ = regs;
+
+	pending->registers_.push_back( entry );
+}
+
+void EventRecorder::write( const Pending &pending )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( !file_.is_open() || failed_ )
+		return;
+
+	trace::RecordHeader header = pending.header_;
+
+	header.regsCount_ = pending.registers_.size();
+	header.pageCount_ = pending.gfns_.size();
+
+	uint64_t metaSize = sizeof( header ) + pending.registers_.size() * sizeof( trace::RegistersEntry ) +
+	    pending.gfns_.size() * sizeof( uint64_t );
+	uint64_t padding = 0;
+
+	if ( header.pageCount_ )
+		padding = ( PAGE_SIZE - ( offset_ + metaSize ) % PAGE_SIZE ) % PAGE_SIZE;
+
+	header.dataOffset_ = metaSize + padding;
+	header.size_       = header.dataOffset_ + pending.data_.size();
+
+	file_.write( reinterpret_cast<const char *>( &header ), sizeof( header ) );
+	file_.write( reinterpret_cast<const char *>( pending.registers_.data() ),
+	             pending.registers_.size() * sizeof( trace::RegistersEntry ) );
+	file_.write( reinterpret_cast<const char *>( pending.gfns_.data() ),
+	             pending.gfns_.size() * sizeof( uint64_t ) );
+	file_.write( zeroes, padding );
+	file_.write( pending.data_.data(), pending.data_.size() );
+
+	if ( !file_ ) {
+		logger << ERROR << "Writing the event trace has failed, recording stopped" << std::flush;
+		failed_ = true;
+		return;
+	}
+
+	offset_ += header.size_;
+}
+
+void EventRecorder::handleCR( unsigned short vcpu, unsigned short crNumber, const Registers &regs,
+                              uint64_t oldValue, uint64_t newValue, HVAction &action )
+{
+	Pending pending( *this, trace::RECORD_CR, vcpu, &regs );
+
+	pending.header_.args_[0] = crNumber;
+	pending.header_.args_[1] = oldValue;
+	pending.header_.args_[2] = newValue;
+
+	handler_->handleCR( vcpu, crNumber, regs, oldValue, newValue, action );
+
+	pending.header_.action_ = action;
+
+	write( pending );
+}
+
+void EventRecorder::handleMSR( unsigned short vcpu, uint32_t msr, uint64_t oldValue, uint64_t newValue,
+                               HVAction &action )
+{
+	Pending pending( *this, trace::RECORD_MSR, vcpu, nullptr );
+
+	pending.header_.args_[0] = msr;
+	pending.header_.args_[1] = oldValue;
+	pending.header_.args_[2] = newValue;
+
+	handler_->handleMSR( vcpu, msr, oldValue, newValue, action );
+
+	pending.header_.action_ = action;
+
+	write( pending );
+}
+
+void EventRecorder::handlePageFault( unsigned short vcpu, const Registers &regs, uint64_t physAddress,
+                                     uint64_t virtAddress, bool read, bool write, bool execute, bool inGpt,
+                                     HVAction &action, EmulatorContext &emulatorCtx,
+                                     unsigned short &instructionSize )
+{
+	Pending pending( *this, trace::RECORD_PAGE_FAULT, vcpu, &regs );
+
+	pending.header_.args_[0] = physAddress;
+	pending.header_.args_[1] = virtAddress;
+
+	if ( read )
+		pending.header_.flags_ |= trace::FLAG_READ;
+	if ( write )
+		pending.header_.flags_ |= trace::FLAG_WRITE;
+	if ( execute )
+		pending.header_.flags_ |= trace::FLAG_EXECUTE;
+	if ( inGpt )
+		pending.header_.flags_ |= trace::FLAG_IN_GPT;
+
+	// A deferred reply (EventManager::defer()) is recorded with whatever action is set here
+	handler_->handlePageFault( vcpu, regs, physAddress, virtAddress, read, write, execute, inGpt, action,
+	                           emulatorCtx, instructionSize );
+
+	pending.header_.action_          = action;
+	pending.header_.instructionSize_ = instructionSize;
+
+	this->write( pending );
+}
+
+void EventRecorder::handleVMCALL( unsigned short vcpu, const Registers &regs )
+{
+	Pending pending( *this, trace::RECORD_VMCALL, vcpu, &regs );
+
+	handler_->handleVMCALL( vcpu, regs );
+
+	write( pending );
+}
+
+void EventRecorder::handleXSETBV( unsigned short vcpu )
+{
+	Pending pending( *this, trace::RECORD_XSETBV, vcpu, nullptr );
+
+	handler_->handleXSETBV( vcpu );
+
+	write( pending );
+}
+
+bool EventRecorder::handleBreakpoint( unsigned short vcpu, const Registers &regs, uint64_t gpa )
+{
+	Pending pending( *this, trace::RECORD_BREAKPOINT, vcpu, &regs );
+
+	pending.header_.args_[0] = gpa;
+
+	bool handled = handler_->handleBreakpoint( vcpu, regs, gpa );
+
+	if ( handled )
+		pending.header_.flags_ |= trace::FLAG_HANDLED;
+
+	write( pending );
+
+	return handled;
+}
+
+void EventRecorder::handleInterrupt( unsigned short vcpu, const Registers &regs, uint32_t vector,
+                                     uint64_t errorCode, uint64_t cr2 )
+{
+	Pending pending( *this, trace::RECORD_INTERRUPT, vcpu, &regs );
+
+	pending.header_.args_[0] = vector;
+	pending.header_.args_[1] = errorCode;
+	pending.header_.args_[2] = cr2;
+
+	handler_->handleInterrupt( vcpu, regs, vector, errorCode, cr2 );
+
+	write( pending );
+}
+
+void EventRecorder::handleDescriptorAccess( unsigned short vcpu, const Registers &regs, unsigned int flags,
+                                            unsigned short &instructionLength, HVAction &action )
+{
+	Pending pending( *this, trace::RECORD_DESCRIPTOR, vcpu, &regs );
+
+	pending.header_.args_[0] = flags;
+
+	handler_->handleDescriptorAccess( vcpu, regs, flags, instructionLength, action );
+
+	pending.header_.action_          = action;
+	pending.header_.instructionSize_ = instructionLength;
+
+	write( pending );
+}
+
+void EventRecorder::handleSessionOver( GuestState state )
+{
+	Pending pending( *this, trace::RECORD_SESSION_OVER, 0, nullptr );
+
+	pending.header_.args_[0] = state;
+
+	write( pending );
+
+	handler_->handleSessionOver( state );
+}
+
+void EventRecorder::handleFatalError()
+{
+	handler_->handleFatalError();
+}
+
+void EventRecorder::runPreEvent()
+{
+	handler_->runPreEvent();
+}
+
+void EventRecorder::runPostEvent()
+{
+	handler_->runPostEvent();
+}
+
+} // namespace bdvmi
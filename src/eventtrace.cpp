@@ -0,0 +1,324 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/eventtrace.h"
+#include "bdvmi/logger.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+
+namespace bdvmi {
+
+namespace {
+
+const char *typeName( uint8_t type )
+{
+	static const char *names[] = { "CR",        "MSR",        "PAGE_FAULT", "VMCALL", "XSETBV",
+	                               "BREAKPOINT", "INTERRUPT", "DESCRIPTOR", "SINGLESTEP", "OTHER" };
+
+	return type < sizeof( names ) / sizeof( names[0] ) ? names[type] : "UNKNOWN";
+}
+
+} // namespace
+
+constexpr char     EventTrace::MAGIC[8];
+constexpr uint32_t EventTrace::VERSION;
+constexpr uint8_t  EventTrace::FLAG_DEFERRED;
+constexpr size_t   EventTrace::MAX_VCPUS;
+constexpr size_t   EventTrace::DEFAULT_RECORDS;
+
+thread_local uint32_t           EventTrace::hypercalls_      = 0;
+thread_local uint32_t           EventTrace::pageCacheMisses_ = 0;
+thread_local EventTrace::Scope *EventTrace::current_         = nullptr;
+
+void EventTrace::Scope::begin( EventTrace &trace, unsigned short vcpu, EventType type, uint64_t arg,
+                               uint64_t received )
+{
+	trace_    = &trace;
+	previous_ = current_;
+	current_  = this;
+
+	hypercalls_      = EventTrace::hypercalls_;
+	pageCacheMisses_ = EventTrace::pageCacheMisses_;
+
+	record_.received_ = received ? received : StatsCollector::timestamp();
+	record_.arg_      = arg;
+	record_.vcpu_     = vcpu;
+	record_.type_     = type;
+}
+
+void EventTrace::Scope::end()
+{
+	if ( !record_.replied_ )
+		record_.replied_ = StatsCollector::timestamp();
+
+	record_.hypercalls_      = EventTrace::hypercalls_ - hypercalls_;
+	record_.pageCacheMisses_ = EventTrace::pageCacheMisses_ - pageCacheMisses_;
+
+	current_ = previous_;
+
+	trace_->write( record_ );
+}
+
+EventTrace::Ring::Ring( size_t size )
+    : mask_{ size - 1 }
+    , slots_{ new Slot[size] }
+{
+	for ( size_t i = 0; i < size; ++i )
+		for ( auto &&word : slots_[i].words_ )
+			word.store( 0, std::memory_order_relaxed );
+}
+
+EventTrace::~EventTrace()
+{
+	for ( auto &&r : rings_ )
+		delete r.load();
+}
+
+void EventTrace::enable( bool value, size_t records )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	bool allocated = std::any_of( rings_.begin(), rings_.end(), []( const std::atomic<Ring *> &r ) {
+		return r.load( std::memory_order_relaxed ) != nullptr;
+	} );
+
+	if ( !allocated ) {
+		records_ = 2;
+
+		while ( records_ < records )
+			records_ <<= 1;
+	}
+
+	enable_ = value;
+}
+
+void EventTrace::fatalDumpPath( const std::string &path )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	fatalDumpPath_ = path;
+}
+
+EventTrace::Ring *EventTrace::ring( unsigned short vcpu )
+{
+	if ( vcpu >= MAX_VCPUS )
+		return nullptr;
+
+	Ring *r = rings_[vcpu].load( std::memory_order_acquire );
+
+	if ( r )
+		return r;
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	r = rings_[vcpu].load( std::memory_order_relaxed );
+
+	if ( !r ) {
+		r = new Ring( records_ );
+		rings_[vcpu].store( r, std::memory_order_release );
+	}
+
+	return r;
+}
+
+void EventTrace::write( const Record &record )
+{
+	Ring *r = ring( record.vcpu_ );
+
+	if ( !r )
+		return;
+
+	// The events of a vCPU are handled one at a time (if not always on the same thread, then with
+	// the dispatcher's locking in between), so there's only ever one writer per ring
+	uint64_t position = r->head_.load( std::memory_order_relaxed );
+	Slot &   slot     = r->slots_[position & r->mask_];
+
+	r->head_.store( position + 1, std::memory_order_relaxed );
+
+	uint64_t words[WORDS];
+
+	memcpy( words, &record, sizeof( words ) );
+	words[0] = position + 1;
+
+	// Same protocol as a seqlock, with the sequence number doubling as the version
+	slot.words_[0].store( 0, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+
+	for ( size_t i = 1; i < WORDS; ++i )
+		slot.words_[i].store( words[i], std::memory_order_relaxed );
+
+	slot.words_[0].store( words[0], std::memory_order_release );
+}
+
+bool EventTrace::dump( const std::string &path ) const
+{
+	std::vector<Record> records;
+
+	for ( auto &&ring : rings_ ) {
+		const Ring *r = ring.load( std::memory_order_acquire );
+
+		if ( !r )
+			continue;
+
+		for ( size_t i = 0; i <= r->mask_; ++i ) {
+			const Slot &slot = r->slots_[i];
+			uint64_t    words[WORDS];
+
+			words[0] = slot.words_[0].load( std::memory_order_acquire );
+
+			if ( !words[0] )
+				continue;
+
+			for ( size_t j = 1; j < WORDS; ++j )
+				words[j] = slot.words_[j].load( std::memory_order_relaxed );
+
+			std::atomic_thread_fence( std::memory_order_acquire );
+
+			if ( slot.words_[0].load( std::memory_order_relaxed ) != words[0] )
+				continue; // overwritten while we were copying it
+
+			Record record;
+
+			memcpy( &record, words, sizeof( record ) );
+			records.push_back( record );
+		}
+	}
+
+	std::sort( records.begin(), records.end(),
+	           []( const Record &a, const Record &b ) { return a.received_ < b.received_; } );
+
+	std::ofstream file( path.c_str(), std::ios_base::out | std::ios_base::trunc | std::ios_base::binary );
+
+	if ( !file ) {
+		logger << ERROR << "Could not open " << path << " for the event trace" << std::flush;
+		return false;
+	}
+
+	FileHeader header;
+
+	memcpy( header.magic_, MAGIC, sizeof( header.magic_ ) );
+
+	header.version_    = VERSION;
+	header.recordSize_ = sizeof( Record );
+	header.nsPerTick_  = StatsCollector::instance().nsPerTick();
+	header.records_    = records.size();
+
+	file.write( reinterpret_cast<const char *>( &header ), sizeof( header ) );
+
+	if ( !records.empty() )
+		file.write( reinterpret_cast<const char *>( records.data() ), records.size() * sizeof( Record ) );
+
+	if ( !file ) {
+		logger << ERROR << "Could not write the event trace to " << path << std::flush;
+		return false;
+	}
+
+	logger << INFO << "Dumped " << records.size() << " trace records to " << path << std::flush;
+
+	return true;
+}
+
+void EventTrace::fatalError() const
+{
+	std::string path;
+
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+		path = fatalDumpPath_;
+	}
+
+	if ( !path.empty() )
+		dump( path );
+}
+
+bool EventTrace::toChromeTrace( const std::string &dumpPath, const std::string &jsonPath )
+{
+	std::ifstream in( dumpPath.c_str(), std::ios_base::in | std::ios_base::binary );
+	FileHeader    header;
+
+	if ( !in.read( reinterpret_cast<char *>( &header ), sizeof( header ) ) ||
+	     memcmp( header.magic_, MAGIC, sizeof( header.magic_ ) ) || header.version_ != VERSION ||
+	     header.recordSize_ != sizeof( Record ) ) {
+		logger << ERROR << dumpPath << " is not an event trace" << std::flush;
+		return false;
+	}
+
+	std::vector<Record> records( header.records_ );
+
+	if ( !records.empty() &&
+	     !in.read( reinterpret_cast<char *>( records.data() ), records.size() * sizeof( Record ) ) ) {
+		logger << ERROR << dumpPath << " is truncated" << std::flush;
+		return false;
+	}
+
+	std::ofstream out( jsonPath.c_str(), std::ios_base::out | std::ios_base::trunc );
+
+	if ( !out ) {
+		logger << ERROR << "Could not open " << jsonPath << std::flush;
+		return false;
+	}
+
+	const uint64_t base = records.empty() ? 0 : records.front().received_;
+
+	// Trace Event timestamps are in microseconds
+	auto us = [&]( uint64_t ticks ) {
+		return static_cast<double>( static_cast<unsigned __int128>( ticks - base ) * header.nsPerTick_ >> 32 ) /
+		    1000;
+	};
+
+	out << std::fixed << std::setprecision( 3 ) << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+	bool              first = true;
+	std::vector<bool> named( MAX_VCPUS );
+
+	for ( auto &&r : records ) {
+		if ( r.vcpu_ < MAX_VCPUS && !named[r.vcpu_] ) {
+			named[r.vcpu_] = true;
+
+			out << ( first ? "\n" : ",\n" ) << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":"
+			    << r.vcpu_ << ",\"args\":{\"name\":\"vCPU " << r.vcpu_ << "\"}}";
+			first = false;
+		}
+
+		// Slices on the same thread have to nest, and the handler may outlast the reply
+		uint64_t end = std::max( { r.received_, r.replied_, r.handlerEnd_ } );
+
+		out << ( first ? "\n" : ",\n" ) << "{\"name\":\"" << typeName( r.type_ )
+		    << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << r.vcpu_ << ",\"ts\":" << us( r.received_ )
+		    << ",\"dur\":" << us( end ) - us( r.received_ )
+		    << ",\"args\":{\"sequence\":" << r.sequence_ << ",\"arg\":\"0x" << std::hex << r.arg_ << std::dec
+		    << "\",\"hypercalls\":" << r.hypercalls_ << ",\"pageCacheMisses\":" << r.pageCacheMisses_
+		    << ",\"deferred\":" << ( ( r.flags_ & FLAG_DEFERRED ) ? "true" : "false" ) << "}}";
+		first = false;
+
+		if ( r.handlerStart_ && r.handlerEnd_ >= r.handlerStart_ && r.handlerStart_ >= r.received_ )
+			out << ",\n{\"name\":\"handler\",\"ph\":\"X\",\"pid\":0,\"tid\":" << r.vcpu_
+			    << ",\"ts\":" << us( r.handlerStart_ )
+			    << ",\"dur\":" << us( r.handlerEnd_ ) - us( r.handlerStart_ ) << "}";
+	}
+
+	out << "\n]}\n";
+
+	if ( !out ) {
+		logger << ERROR << "Could not write " << jsonPath << std::flush;
+		return false;
+	}
+
+	return true;
+}
+
+} // namespace bdvmi
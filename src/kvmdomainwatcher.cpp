@@ -29,6 +29,18 @@ namespace {
 
 constexpr char UUID_PROVIDER[] = "/sys/devices/virtual/dmi/id/product_uuid";
 
+std::string sha1( const std::string &s )
+{
+	unsigned char hash[SHA_DIGEST_LENGTH];
+	SHA_CTX       sha;
+
+	SHA1_Init( &sha );
+	SHA1_Update( &sha, s.c_str(), s.size() );
+	SHA1_Final( hash, &sha );
+
+	return std::string( reinterpret_cast<const char *>( hash ), sizeof( hash ) );
+}
+
 bool getSvaUuid( std::string &uuid )
 {
 	std::ifstream in( UUID_PROVIDER );
@@ -47,6 +59,7 @@ bool getSvaUuid( std::string &uuid )
 namespace bdvmi {
 
 KvmDomainWatcher::name2dom_t KvmDomainWatcher::knownDomains_;
+constexpr int                KvmDomainWatcher::RECONNECT_TIMEOUT_MS;
 
 std::string UuidToString( const unsigned char ( *uuid )[16] )
 {
@@ -93,6 +106,7 @@ bool KvmDomainWatcher::loadLibkvmiOnce()
 
 KvmDomainWatcher::KvmDomainWatcher( sig_atomic_t &sigStop )
     : DomainWatcher{ sigStop }
+    , cookieHash_{ sha1( "" ) }
 {
 	if ( !getSvaUuid( ownUuid_ ) )
 		logger << ERROR << "Can't get our own UUID!" << std::flush;
@@ -114,6 +128,9 @@ KvmDomainWatcher::~KvmDomainWatcher()
 {
 	kvmi_uninit( kvmi_ );
 
+	for ( auto &&queued : queuedConnections_ )
+		kvmi_domain_close( queued.ctx_, true );
+
 	kvmi_set_log_cb( nullptr, nullptr );
 }
 
@@ -123,15 +140,16 @@ int KvmDomainWatcher::newConnection( void *dom, unsigned char ( *uuid )[16], voi
 	KvmDomainWatcher *kdw        = static_cast<KvmDomainWatcher *>( ctx );
 	const std::string clientUuid = UuidToString( uuid );
 
-	if ( !kdw->queueConnection( clientUuid, dom ) )
-		return -1;
-
+	kdw->queueConnection( clientUuid, dom );
 	kdw->signalNewConnection();
 
 	return 0;
 }
 
-// This is a callback invoked by libkvmi
+// This is a callback invoked by libkvmi, on its accept thread. The handshake itself (reading
+// and validating QEMU's half, sending ours back) also runs there, one guest at a time, and
+// can't be moved off it without a libkvmi that hands accepted sockets over. So this only
+// copies out the hash precomputed by setAuthCookie().
 int KvmDomainWatcher::newHandshake( const void *_qemu, void *_intro, void *ctx )
 {
 	KvmDomainWatcher *kdw = static_cast<KvmDomainWatcher *>( ctx );
@@ -145,16 +163,14 @@ int KvmDomainWatcher::newHandshake( const void *_qemu, void *_intro, void *ctx )
 	}
 
 	std::string cookie;
+	std::string hash;
 
-	kdw->getAuthCookie( cookie );
+	kdw->getAuthCookie( cookie, hash );
 	logger << DEBUG << "[" << uuid << "] Handshake authCookie: '" << cookie << "'" << std::flush;
 
 	kvmi_introspector2qemu *intro = static_cast<kvmi_introspector2qemu *>( _intro );
 
-	SHA_CTX sha;
-	SHA1_Init( &sha );
-	SHA1_Update( &sha, cookie.c_str(), cookie.size() );
-	SHA1_Final( intro->cookie_hash, &sha );
+	memcpy( intro->cookie_hash, hash.data(), std::min( hash.size(), sizeof( intro->cookie_hash ) ) );
 
 	return 0;
 }
@@ -164,32 +180,50 @@ void KvmDomainWatcher::signalNewConnection()
 	ringQueue_.notify_one();
 }
 
-bool KvmDomainWatcher::queueConnection( const std::string &name, void *domCtx )
+// Runs on libkvmi's accept thread, so that's all it does: the next guest's handshake can't
+// start until this returns
+void KvmDomainWatcher::queueConnection( const std::string &name, void *domCtx )
 {
-	std::unique_lock<std::mutex> lock( mutexQueue_ );
+	std::lock_guard<std::mutex> lock( mutexQueue_ );
+
+	queuedConnections_.push_back(
+	    { name, domCtx, std::chrono::steady_clock::now() + std::chrono::milliseconds( RECONNECT_TIMEOUT_MS ) } );
+}
 
-	auto found = knownDomains_.find( name );
+void KvmDomainWatcher::connectQueued()
+{
+	auto now = std::chrono::steady_clock::now();
 
-	KvmDomainWatcher::KvmDomain *dom;
+	for ( auto i = queuedConnections_.begin(); i != queuedConnections_.end(); ) {
+		auto found = knownDomains_.find( i->name_ );
 
-	if ( found != knownDomains_.end() ) {
-		dom = &found->second;
-		if ( !dom->resetSafely() ) {
-			logger << WARNING << "[" << name
-			       << "] Drop the connection. The child didn't finish the old one." << std::flush;
-			lock.unlock();
-			// Allow diedHandler() to park() the domain
-			sleep( 1 ); // :D
-			return false;
-		}
-	} else {
-		auto res = knownDomains_.emplace( name, KvmDomain() );
-		dom      = &res.first->second;
-	}
+		KvmDomainWatcher::KvmDomain *dom;
+
+		if ( found != knownDomains_.end() ) {
+			dom = &found->second;
 
-	dom->connect( domCtx );
+			// Retried until diedHandler() parks the domain
+			if ( !dom->resetSafely() ) {
+				if ( now < i->deadline_ ) {
+					++i;
+					continue;
+				}
+
+				logger << WARNING << "[" << i->name_
+				       << "] Drop the connection. The child didn't finish the old one." << std::flush;
+
+				kvmi_domain_close( i->ctx_, true );
+				i = queuedConnections_.erase( i );
+				continue;
+			}
+		} else {
+			auto res = knownDomains_.emplace( i->name_, KvmDomain() );
+			dom      = &res.first->second;
+		}
 
-	return true;
+		dom->connect( i->ctx_ );
+		i = queuedConnections_.erase( i );
+	}
 }
 
 void KvmDomainWatcher::handleDomainEvent( const struct kvmi_dom_event *ev, const std::string &uuid ) const
@@ -239,7 +273,9 @@ void KvmDomainWatcher::handleDomainEvent( const struct kvmi_dom_event *ev, const
 // TODO:
 //    a) KvmDomainWatcher should watch PowerOn/Off events through libvirt
 //    b) KvmDriver should start the accepting thread (kvmi_init())
-//       (currenly, any connect()/handshake blocks the hooking of other guests).
+//       (the handshake still runs on libkvmi's accept thread, one guest at a time, since
+//       libkvmi does it before it calls us; the callbacks only queue the connection, and
+//       connectQueued() does the rest on the watcher thread).
 //    c) Use the connection time as "Guest start time"
 //       and drop kvmi_qemu2introspector.start_time
 //
@@ -255,6 +291,8 @@ bool KvmDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains,
 
 	std::unique_lock<std::mutex> lock( mutexQueue_ );
 
+	connectQueued();
+
 	for ( auto &&known : knownDomains_ ) {
 		const std::string &uuid = known.first;
 		KvmDomain &        dom  = known.second;
@@ -308,6 +346,10 @@ bool KvmDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains,
 	if ( !domains.empty() )
 		return true;
 
+	// Don't sit on a reconnection longer than needed
+	if ( !queuedConnections_.empty() )
+		ms = std::min( ms, 100 );
+
 	std::cv_status rc = ringQueue_.wait_for( lock, std::chrono::milliseconds( ms ) );
 
 	return rc != std::cv_status::timeout;
@@ -345,6 +387,12 @@ void KvmDomainWatcher::forkedHandler( const std::string &name, bool parent )
 				++dom;
 		}
 
+		// Not ours to handle, and the parent still has them
+		for ( auto &&queued : queuedConnections_ )
+			kvmi_domain_close( queued.ctx_, false );
+
+		queuedConnections_.clear();
+
 		kvmi_close( kvmi_ );
 
 		return;
@@ -364,9 +412,12 @@ void *KvmDomainWatcher::domainContext( const std::string &name )
 
 void KvmDomainWatcher::setAuthCookie( const std::string &authCookie )
 {
+	std::string hash = sha1( authCookie );
+
 	std::lock_guard<std::mutex> guard( authCookieMutex_ );
 
 	authCookie_ = authCookie;
+	cookieHash_ = hash;
 }
 
 void KvmDomainWatcher::diedHandler( const std::string &uuid )
@@ -379,6 +430,10 @@ void KvmDomainWatcher::diedHandler( const std::string &uuid )
 		dom->second.park();
 		logger << DEBUG << "[" << uuid << "] Parked" << std::flush;
 	}
+
+	// A reconnection may be waiting for this
+	if ( !queuedConnections_.empty() )
+		signalNewConnection();
 }
 
 } // namespace bdvmi
@@ -19,6 +19,8 @@
 #include <unordered_map>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <deque>
 #include <libkvmi.h>
 
 #include "bdvmi/domainwatcher.h"
@@ -154,17 +156,22 @@ private:
 
 	KvmDomainWatcher &operator=( const KvmDomainWatcher & );
 
-	bool queueConnection( const std::string &name, void *dom );
+	void queueConnection( const std::string &name, void *dom );
+
+	// Move the queued connections to knownDomains_, with mutexQueue_ held. A reconnection waits
+	// (until RECONNECT_TIMEOUT_MS) for the child handling the old connection to be done with it.
+	void connectQueued();
 
 	void signalNewConnection();
 
 	void handleDomainEvent( const struct kvmi_dom_event *ev, const std::string &uuid ) const;
 
-	void getAuthCookie( std::string &authCookie ) const
+	void getAuthCookie( std::string &authCookie, std::string &cookieHash ) const
 	{
 		std::lock_guard<std::mutex> guard( authCookieMutex_ );
 
 		authCookie = authCookie_;
+		cookieHash = cookieHash_;
 	}
 
 	bool loadLibkvmiOnce();
@@ -179,15 +186,26 @@ protected:
 private:
 	using name2dom_t = std::unordered_map<std::string, KvmDomain>;
 
+	// Accepted by libkvmi, not in knownDomains_ yet
+	struct QueuedConnection {
+		std::string                           name_;
+		void *                                ctx_;
+		std::chrono::steady_clock::time_point deadline_;
+	};
+
+	static constexpr int RECONNECT_TIMEOUT_MS = 5000;
+
 	void *kvmi_{ nullptr };
 
-	std::mutex              mutexQueue_;
-	std::condition_variable ringQueue_;
+	std::mutex                   mutexQueue_;
+	std::condition_variable      ringQueue_;
+	std::deque<QueuedConnection> queuedConnections_;
 
 	static name2dom_t knownDomains_;
 
 	mutable std::mutex authCookieMutex_;
 	std::string        authCookie_;
+	std::string        cookieHash_; // SHA1( authCookie_ ), so handshakes don't have to
 
 	std::string ownUuid_;
 };
@@ -19,6 +19,7 @@
 #include "bdvmi/statscollector.h"
 #include "kvmdriver.h"
 #include "kvmdomainwatcher.h"
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <cerrno>
@@ -71,13 +72,23 @@ std::string accessString( int access )
 namespace bdvmi {
 
 KvmDriver::BatchMessages::BatchMessages( void *dom, KvmDriver *driver )
-    : driver_{ driver }
+    : dom_{ dom }
+    , driver_{ driver }
 {
 	grp_ = kvmi_batch_alloc( dom );
 	if ( !grp_ )
 		logger << ERROR << "kvmi_batch_alloc() => " << strerror( errno ) << std::flush;
 }
 
+void KvmDriver::BatchMessages::reset()
+{
+	kvmi_batch_free( grp_ );
+
+	grp_ = kvmi_batch_alloc( dom_ );
+	if ( !grp_ )
+		logger << ERROR << "kvmi_batch_alloc() => " << strerror( errno ) << std::flush;
+}
+
 KvmDriver::BatchMessages::~BatchMessages()
 {
 	kvmi_batch_free( grp_ );
@@ -85,6 +96,8 @@ KvmDriver::BatchMessages::~BatchMessages()
 
 bool KvmDriver::BatchMessages::commit()
 {
+	EventTrace::countHypercall();
+
 	if ( kvmi_batch_commit( grp_ ) < 0 ) {
 		logger << ERROR << "kvmi_batch_commit() => " << strerror( errno ) << std::flush;
 		return false;
@@ -100,7 +113,46 @@ bool KvmDriver::BatchMessages::addPauseVcpu( unsigned short vcpu ) const
 		return false;
 	}
 
-	logger << TRACE << "kvmi_queue_pause_vcpu(" << vcpu << ")" << std::flush;
+	BDVMI_LOG( TRACE ) << "kvmi_queue_pause_vcpu(" << vcpu << ")" << std::flush;
+	return true;
+}
+
+bool KvmDriver::BatchMessages::addControlEvent( unsigned short vcpu, unsigned int id, bool enable ) const
+{
+	if ( kvmi_queue_control_events( grp_, vcpu, id, enable ) < 0 ) {
+		logger << ERROR << "kvmi_queue_control_events(vcpu=" << vcpu << ", id=" << id << ", enable=" << enable
+		       << ") => " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	BDVMI_LOG( TRACE ) << "kvmi_queue_control_events(vcpu=" << vcpu << ", id=" << id << ", enable=" << enable
+	                   << ")" << std::flush;
+	return true;
+}
+
+bool KvmDriver::BatchMessages::addControlCr( unsigned short vcpu, unsigned int cr, bool enable ) const
+{
+	if ( kvmi_queue_control_cr( grp_, vcpu, cr, enable ) < 0 ) {
+		logger << ERROR << "kvmi_queue_control_cr(vcpu=" << vcpu << ", cr=" << cr << ", enable=" << enable
+		       << ") => " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	BDVMI_LOG( TRACE ) << "kvmi_queue_control_cr(vcpu=" << vcpu << ", cr=" << cr << ", enable=" << enable << ")"
+	                   << std::flush;
+	return true;
+}
+
+bool KvmDriver::BatchMessages::addControlMsr( unsigned short vcpu, unsigned int msr, bool enable ) const
+{
+	if ( kvmi_queue_control_msr( grp_, vcpu, msr, enable ) < 0 ) {
+		logger << ERROR << "kvmi_queue_control_msr(vcpu=" << vcpu << ", msr=" << HEXLOG( msr )
+		       << ", enable=" << enable << ") => " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	BDVMI_LOG( TRACE ) << "kvmi_queue_control_msr(vcpu=" << vcpu << ", msr=" << HEXLOG( msr )
+	                   << ", enable=" << enable << ")" << std::flush;
 	return true;
 }
 
@@ -125,8 +177,8 @@ KvmDriver::KvmDriver( const std::string &domain, bool useVE )
 
 	startTime_ = kvmi_get_starttime( domCtx_ );
 
-	logger << TRACE << "kvmi_get_starttime() => " << static_cast<int64_t>( startTime_ ) << " ms "
-	       << static_cast<uint32_t>( startTime_ / 1000 ) << " secs" << std::flush;
+	BDVMI_LOG( TRACE ) << "kvmi_get_starttime() => " << static_cast<int64_t>( startTime_ ) << " ms "
+	                   << static_cast<uint32_t>( startTime_ / 1000 ) << " secs" << std::flush;
 
 	if ( useVE ) {
 		kvmi_eptp_support( domCtx_, &eptpSupported_ );
@@ -146,6 +198,9 @@ KvmDriver::~KvmDriver()
 {
 	logger << DEBUG << "Unmap all" << std::flush;
 
+	// Even when disconnected, read-ahead may still be mapping through us
+	pageCache_.stopReadAhead();
+
 	if ( isConnected() )
 		pageCache_.reset();
 
@@ -171,6 +226,7 @@ bool KvmDriver::cpuCount( unsigned int &count ) const
 
 	{
 		StatsCounter counter( "kvmi_get_vcpu_count" );
+		EventTrace::countHypercall();
 		err = kvmi_get_vcpu_count( domCtx_, &count );
 	}
 
@@ -179,7 +235,7 @@ bool KvmDriver::cpuCount( unsigned int &count ) const
 	else {
 		vcpuCount_ = count;
 
-		logger << TRACE << "kvmi_get_vcpu_count() => " << count << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_vcpu_count() => " << count << std::flush;
 	}
 
 	return !err;
@@ -191,13 +247,14 @@ bool KvmDriver::tscSpeed( unsigned long long &speed ) const
 
 	{
 		StatsCounter counter( "kvmi_get_tsc_speed" );
+		EventTrace::countHypercall();
 		err = kvmi_get_tsc_speed( domCtx_, &speed );
 	}
 
 	if ( err < 0 )
 		logger << ERROR << "kvmi_get_tsc_speed() has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_get_tsc_speed() => " << speed << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_tsc_speed() => " << speed << std::flush;
 
 	return !err;
 }
@@ -213,9 +270,9 @@ bool KvmDriver::BatchMessages::addPageAccess( unsigned long long int &gpa, unsig
 		logger << ERROR << "kvmi_queue_page_access() has failed: " << strerror( errno ) << std::flush;
 	} else {
 		for ( int i = 0; i < count; i++ )
-			logger << TRACE << "kvmi_queue_page_access(gpa=" << HEXLOG( ( &gpa )[i] )
-			       << ", access=" << accessString( ( &access )[i] ) << ", view=" << view << ")"
-			       << std::flush;
+			BDVMI_LOG( TRACE ) << "kvmi_queue_page_access(gpa=" << HEXLOG( ( &gpa )[i] )
+			                   << ", access=" << accessString( ( &access )[i] ) << ", view=" << view << ")"
+			                   << std::flush;
 	}
 
 	return !err;
@@ -227,14 +284,15 @@ bool KvmDriver::mtrrType( unsigned long long guestAddress, uint8_t &type ) const
 
 	{
 		StatsCounter counter( "kvmi_get_mtrr_type" );
+		EventTrace::countHypercall();
 		err = kvmi_get_mtrr_type( domCtx_, guestAddress, &type );
 	}
 
 	if ( err < 0 )
 		logger << ERROR << "kvmi_get_mtrr_type() has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_get_mtrr_type(gpa=" << HEXLOG( guestAddress ) << ") => "
-		       << static_cast<unsigned>( type ) << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_mtrr_type(gpa=" << HEXLOG( guestAddress ) << ") => "
+		                   << static_cast<unsigned>( type ) << std::flush;
 
 	return !err;
 }
@@ -247,8 +305,11 @@ bool KvmDriver::setPageProtectionImpl( const MemAccessMap &accessMap, unsigned s
 	unsigned short chunk;
 	uint64_t       offset = 0;
 
-	std::vector<unsigned char>          access;
-	std::vector<unsigned long long int> gpa;
+	std::vector<unsigned char> &     access = accessScratch_;
+	std::vector<unsigned long long> &gpa    = gpaScratch_;
+
+	access.clear();
+	gpa.clear();
 
 	for ( auto &&item : accessMap ) {
 		unsigned char acc = ( ( item.second & PAGE_READ ) ? KVMI_PAGE_ACCESS_R : 0 ) |
@@ -263,6 +324,8 @@ bool KvmDriver::setPageProtectionImpl( const MemAccessMap &accessMap, unsigned s
 	while ( offset < size ) {
 		chunk = std::min( size - offset, MAX_PAGE_ACCESS_ENTRIES );
 
+		std::lock_guard<std::mutex> lock( batchMutex_ );
+
 		if ( !batch_->addPageAccess( gpa[offset], access[offset], chunk, view ) )
 			return false;
 
@@ -278,17 +341,104 @@ bool KvmDriver::getPageProtectionImpl( unsigned long long /* guestAddress */, bo
 	return read = write = execute = true;
 }
 
+bool KvmDriver::getPageProtectionRangeImpl( unsigned long long /* firstGfn */, size_t count, uint8_t *access,
+                                            unsigned short /* view */ )
+{
+	memset( access, PAGE_READ | PAGE_WRITE | PAGE_EXECUTE, count );
+
+	return true;
+}
+
 bool KvmDriver::registers( unsigned short vcpu, Registers &regs ) const
 {
-	{
-		std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	RegsCache::Entry *           e = regsCache_.entry( vcpu );
+	std::unique_lock<std::mutex> lock;
 
-		if ( regsCache_.valid( vcpu ) ) {
-			regs = regsCache_.registers_;
+	if ( e ) {
+		lock = std::unique_lock<std::mutex>( e->mutex_ );
+
+		if ( regsCache_.valid( *e ) ) {
+			regs = e->registers_;
+			recordRegisters( vcpu, regs );
 			return true;
 		}
 	}
 
+	if ( !queryRegisters( vcpu, regs ) )
+		return false;
+
+	if ( e && regsCache_.cacheable( *e ) )
+		regsCache_.fill( *e, regs );
+
+	recordRegisters( vcpu, regs );
+
+	return true;
+}
+
+bool KvmDriver::cachedRegisters( unsigned short vcpu, const Registers *&regs ) const
+{
+	RegsCache::Entry *e = regsCache_.entry( vcpu );
+
+	if ( !e )
+		return false;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	if ( !regsCache_.valid( *e ) ) {
+		if ( !regsCache_.cacheable( *e ) || !queryRegisters( vcpu, e->registers_ ) )
+			return false;
+
+		regsCache_.validate( *e );
+	}
+
+	regs = &e->registers_;
+
+	return true;
+}
+
+bool KvmDriver::readMsr( unsigned short vcpu, uint32_t msr, uint64_t &value ) const
+{
+	RegsCache::Entry *e = regsCache_.entry( vcpu );
+
+	if ( e ) {
+		std::lock_guard<std::mutex> lock( e->mutex_ );
+
+		if ( regsCache_.valid( *e ) && e->registers_.msr( msr, value ) )
+			return true;
+	}
+
+	// There's no MSR-only command, but at least only ask for the one MSR
+	struct kvm_regs kregs {
+	};
+	struct kvm_sregs sregs {
+	};
+	char                  buf[sizeof( struct kvm_msrs ) + sizeof( struct kvm_msr_entry )] = {};
+	struct kvm_msrs *     msrs = ( struct kvm_msrs * )buf;
+	unsigned int          mode = 0;
+	int                   err;
+
+	msrs->nmsrs            = 1;
+	msrs->entries[0].index = msr;
+
+	{
+		StatsCounter counter( "kvmi_get_registers" );
+		EventTrace::countHypercall();
+		err = kvmi_get_registers( domCtx_, vcpu, &kregs, &sregs, msrs, &mode );
+	}
+
+	if ( err < 0 ) {
+		logger << ERROR << "kvmi_get_registers(vcpu=" << vcpu << ", msr=" << HEXLOG( msr )
+		       << ") has failed: " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	value = msrs->entries[0].data;
+
+	return true;
+}
+
+bool KvmDriver::queryRegisters( unsigned short vcpu, Registers &regs ) const
+{
 	struct kvm_regs kregs {
 	};
 	struct kvm_sregs sregs {
@@ -312,6 +462,7 @@ bool KvmDriver::registers( unsigned short vcpu, Registers &regs ) const
 
 	{
 		StatsCounter counter( "kvmi_get_registers" );
+		EventTrace::countHypercall();
 		err = kvmi_get_registers( domCtx_, vcpu, &kregs, &sregs, msrs, &mode );
 	}
 
@@ -405,7 +556,7 @@ bool KvmDriver::registers( unsigned short vcpu, Registers &regs ) const
 
 		err = 0;
 
-		logger << TRACE << "kvmi_get_registers(vcpu=" << vcpu << ")" << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_registers(vcpu=" << vcpu << ")" << std::flush;
 	}
 
 	return !err;
@@ -413,13 +564,24 @@ bool KvmDriver::registers( unsigned short vcpu, Registers &regs ) const
 
 bool KvmDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool /* setEip */, bool delay )
 {
-	if ( delay ) {
-		std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	RegsCache::Entry *           e = regsCache_.entry( vcpu );
+	std::unique_lock<std::mutex> lock;
 
-		if ( regsCache_.valid( vcpu ) ) {
-			regsCache_.registers_ = regs;
-			regsCache_.dirty_     = true;
-			return true;
+	if ( e ) {
+		lock = std::unique_lock<std::mutex>( e->mutex_ );
+
+		if ( regsCache_.valid( *e ) ) {
+			uint32_t changed = e->registers_.changedGroups( regs ) & Registers::GROUP_WRITABLE;
+
+			if ( !changed )
+				return true;
+
+			// Only a vCPU that's in an event gets its registers written back with the reply
+			if ( delay && e->stopped_ ) {
+				e->registers_.assignGroups( regs, changed );
+				e->dirty_ |= changed;
+				return true;
+			}
 		}
 	}
 
@@ -449,13 +611,18 @@ bool KvmDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool /
 
 	{
 		StatsCounter counter( "kvmi_set_registers" );
+		EventTrace::countHypercall();
 		err = kvmi_set_registers( domCtx_, vcpu, &kregs );
 	}
 
 	if ( err < 0 )
 		logger << ERROR << "kvmi_set_registers() has failed: " << strerror( errno ) << std::flush;
-	else
-		logger << TRACE << "kvmi_set_registers(vcpu=" << vcpu << ")" << std::flush;
+	else {
+		BDVMI_LOG( TRACE ) << "kvmi_set_registers(vcpu=" << vcpu << ")" << std::flush;
+
+		if ( e && regsCache_.valid( *e ) )
+			e->registers_.assignGroups( regs, Registers::GROUP_WRITABLE );
+	}
 
 	return !err;
 }
@@ -494,6 +661,8 @@ MapReturnCode KvmDriver::mapPhysMemToHost( unsigned long long address, size_t le
 		if ( !mapped )
 			return MAP_FAILED_GENERIC;
 
+		recordPage( gfn, mapped );
+
 		pointer = static_cast<char *>( mapped ) + ( address & ~PAGE_MASK );
 	} catch ( const std::exception &e ) {
 		logger << ERROR << "mapPhysMemToHost has failed: " << e.what() << std::flush;
@@ -524,21 +693,110 @@ bool KvmDriver::unmapPhysMem( void *hostPtr )
 	return true;
 }
 
+MapReturnCode KvmDriver::mapGfns( const unsigned long long *gfns, size_t count, uint32_t flags, void *&pointer )
+{
+	pointer = nullptr;
+
+	if ( !gfns || !count ) {
+		logger << ERROR << "invalid parameter" << std::flush;
+		return MAP_INVALID_PARAMETER;
+	}
+
+	if ( count == 1 )
+		return mapPhysMemToHost( gfn_to_gpa( gfns[0] ), PAGE_SIZE, flags, pointer );
+
+	try {
+		// Multi-page views are snapshots, so they are never cached (an idle cached
+		// snapshot would go stale)
+		pointer = mapGuestPagesImpl( gfns, count );
+	} catch ( const std::exception &e ) {
+		logger << ERROR << "mapGfns has failed: " << e.what() << std::flush;
+		return MAP_FAILED_GENERIC;
+	}
+
+	if ( !pointer )
+		return MAP_FAILED_GENERIC;
+
+	for ( size_t i = 0; i < count; ++i )
+		recordPage( gfns[i], static_cast<char *>( pointer ) + i * PAGE_SIZE );
+
+	return MAP_SUCCESS;
+}
+
+bool KvmDriver::unmapGfns( void *hostPtr, size_t count )
+{
+	if ( count == 1 )
+		return unmapPhysMem( hostPtr );
+
+	unmapGuestPagesImpl( ( void * )( ( uintptr_t )hostPtr & PAGE_MASK ), count );
+
+	return true;
+}
+
+bool KvmDriver::readPhysicalImpl( unsigned long long gpa, void *buffer, size_t length )
+{
+	int err;
+
+	{
+		StatsCounter counter( "kvmi_read_physical" );
+		EventTrace::countHypercall();
+		err = kvmi_read_physical( domCtx_, gpa, buffer, length );
+	}
+
+	if ( err < 0 ) {
+		logger << WARNING << "kvmi_read_physical() for gpa " << std::hex << std::showbase << gpa
+		       << " has failed: " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	return true;
+}
+
+bool KvmDriver::writePhysicalImpl( unsigned long long gpa, const void *buffer, size_t length )
+{
+	int err;
+
+	{
+		StatsCounter counter( "kvmi_write_physical" );
+		EventTrace::countHypercall();
+		err = kvmi_write_physical( domCtx_, gpa, buffer, length );
+	}
+
+	if ( err < 0 ) {
+		logger << ERROR << "kvmi_write_physical() for gpa " << std::hex << std::showbase << gpa
+		       << " has failed: " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	return true;
+}
+
+bool KvmDriver::isPageCached( unsigned long long gfn )
+{
+#ifdef DISABLE_PAGE_CACHE
+	( void )gfn;
+	return false;
+#else
+	return pageCache_.contains( gfn );
+#endif
+}
+
 bool KvmDriver::injectTrap( unsigned short vcpu, uint8_t trapNumber, uint32_t errorCode, uint64_t cr2 )
 {
 	int err;
 
 	{
 		StatsCounter counter( "kvmi_inject_exception" );
+		EventTrace::countHypercall();
 		err = kvmi_inject_exception( domCtx_, vcpu, cr2, errorCode, trapNumber );
 	}
 
 	if ( err < 0 )
 		logger << ERROR << "kvmi_inject_exception() has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_inject_exception(vcpu=" << vcpu << ", cr2=" << HEXLOG( cr2 )
-		       << ", exception=" << HEXLOG( int( trapNumber ) ) << ", error=" << HEXLOG( errorCode ) << ")"
-		       << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_inject_exception(vcpu=" << vcpu << ", cr2=" << HEXLOG( cr2 )
+		                   << ", exception=" << HEXLOG( int( trapNumber ) ) << ", error=" << HEXLOG( errorCode )
+		                   << ")" << std::flush;
 
 	return !err;
 }
@@ -592,7 +850,13 @@ bool KvmDriver::pause()
 
 	eventProcessingMutex_.lock();
 
-	return pauseAllVcpus();
+	if ( !pauseAllVcpus() )
+		return false;
+
+	// Every vCPU is now stuck waiting for its pause event to be replied to
+	regsCache_.stopAll();
+
+	return true;
 }
 
 bool KvmDriver::kickAllVcpus()
@@ -629,13 +893,124 @@ bool KvmDriver::unpause()
 		logger << ERROR << "Pause/unpause mismatch" << std::flush;
 	else {
 		pauseCount_--;
-		if ( pauseCount_ == 0 )
+		if ( pauseCount_ == 0 ) {
+			regsCache_.resumeAll();
 			eventProcessingMutex_.unlock();
+		}
+	}
+
+	return true;
+}
+
+bool KvmDriver::pauseVcpusImpl( uint64_t vcpus, uint64_t paused )
+{
+	StatsCounter counter( "pauseVcpus" );
+
+	BatchMessages grp( domCtx_, this );
+	size_t        count = 0;
+
+	for ( uint64_t bits = vcpus; bits; bits &= bits - 1, ++count )
+		if ( !grp.addPauseVcpu( __builtin_ctzll( bits ) ) )
+			return false;
+
+	// Same as kickAllVcpus(), and the pause events mustn't get to parkPauseEvent() before
+	// heldVcpus_ says what to do with them
+	std::lock_guard<std::mutex> guard( pauseMutex_ );
+
+	if ( !grp.commit() )
+		return false;
+
+	pendingPauseEvents_ += count;
+	heldVcpus_ = paused;
+
+	return true;
+}
+
+bool KvmDriver::unpauseVcpusImpl( uint64_t vcpus, uint64_t paused )
+{
+	std::vector<EventReply> replies;
+
+	{
+		std::lock_guard<std::mutex> guard( pauseMutex_ );
+
+		heldVcpus_ = paused;
+
+		// The ones whose pause events haven't come in yet simply won't be parked
+		auto it = std::partition( parkedReplies_.begin(), parkedReplies_.end(), [vcpus]( const EventReply &r ) {
+			return !( vcpus & ( 1ULL << r.reply_.vcpu_.vcpu ) );
+		} );
+
+		replies.assign( it, parkedReplies_.end() );
+		parkedReplies_.erase( it, parkedReplies_.end() );
 	}
 
+	return replyParked( replies );
+}
+
+bool KvmDriver::parkPauseEvent( const struct kvmi_dom_event &msg )
+{
+	unsigned short vcpu = msg.event.common.vcpu;
+
+	std::lock_guard<std::mutex> guard( pauseMutex_ );
+
+	if ( vcpu >= MAX_PAUSE_VCPUS || !( heldVcpus_ & ( 1ULL << vcpu ) ) )
+		return false;
+
+	if ( pendingPauseEvents_ )
+		pendingPauseEvents_--;
+	else
+		logger << ERROR << "Pause event without a pause command?" << std::flush;
+
+	// Registers can be read and changed while the vCPU is parked, just like in any other event.
+	// Control event changes wait for its next event.
+	Registers regs;
+	beginEvent( regs, msg.event.common );
+
+	parkedReplies_.emplace_back( &msg );
+
 	return true;
 }
 
+bool KvmDriver::releaseParkedVcpus()
+{
+	std::vector<EventReply> replies;
+
+	{
+		std::lock_guard<std::mutex> guard( pauseMutex_ );
+
+		heldVcpus_ = 0;
+		replies.swap( parkedReplies_ );
+	}
+
+	return replyParked( replies );
+}
+
+bool KvmDriver::replyParked( std::vector<EventReply> &replies )
+{
+	if ( replies.empty() )
+		return true;
+
+	flushPageProtections();
+
+	std::lock_guard<std::mutex> lock( batchMutex_ );
+
+	bool ok = true;
+
+	for ( auto &&reply : replies ) {
+		unsigned short vcpu = reply.reply_.vcpu_.vcpu;
+
+		ok = batch_->addRegisters( vcpu ) && batch_->addEventReply( reply ) && ok;
+
+		disableCache( vcpu );
+	}
+
+	ok = batch_->commit() && ok;
+
+	batch_->reset();
+
+	return ok;
+}
+
 bool KvmDriver::pauseAllVcpus()
 {
 	unsigned int count = vcpuCount_;
@@ -648,6 +1023,7 @@ bool KvmDriver::pauseAllVcpus()
 
 	{
 		StatsCounter counter( "kvmi_pause_all_vcpus" );
+		EventTrace::countHypercall();
 		err = kvmi_pause_all_vcpus( domCtx_, count );
 	}
 
@@ -657,7 +1033,7 @@ bool KvmDriver::pauseAllVcpus()
 		return false;
 	}
 
-	logger << TRACE << "kvmi_pause_all_vcpus(" << count << ")" << std::flush;
+	BDVMI_LOG( TRACE ) << "kvmi_pause_all_vcpus(" << count << ")" << std::flush;
 
 	pendingPauseEvents_ += count;
 
@@ -669,6 +1045,32 @@ size_t KvmDriver::setPageCacheLimit( size_t limit )
 	return pageCache_.setLimit( limit );
 }
 
+bool KvmDriver::setPageCacheLimitRange( size_t minLimit, size_t maxLimit )
+{
+	return pageCache_.setLimitRange( minLimit, maxLimit );
+}
+
+bool KvmDriver::pageCacheStats( PageCacheStats &stats )
+{
+#ifdef DISABLE_PAGE_CACHE
+	stats = PageCacheStats();
+	return false;
+#else
+	pageCache_.stats( stats );
+	return true;
+#endif
+}
+
+size_t KvmDriver::setPageCacheReadAhead( size_t pages )
+{
+	return pageCache_.setReadAhead( pages );
+}
+
+void KvmDriver::prefetchGfns( const unsigned long long *gfns, size_t count )
+{
+	pageCache_.prefetch( gfns, count );
+}
+
 #define DEFAULT_XSAVE_SIZE XSAVE_HDR_SIZE + XSAVE_HDR_OFFSET
 #define XSAVE_HDR_SIZE     64
 #define XSAVE_HDR_OFFSET   FXSAVE_SIZE
@@ -681,6 +1083,7 @@ bool KvmDriver::getXSAVESize( unsigned short vcpu, size_t &size )
 
 	{
 		StatsCounter counter( "kvmi_get_cpuid" );
+		EventTrace::countHypercall();
 		err = kvmi_get_cpuid( domCtx_, vcpu, 0xD, 0, &eax, &ebx, &ecx, &edx );
 	}
 
@@ -690,9 +1093,9 @@ bool KvmDriver::getXSAVESize( unsigned short vcpu, size_t &size )
 	else {
 		size = ebx;
 
-		logger << TRACE << "kvmi_get_cpuid(vcpu=" << vcpu << ") => eax=" << HEXLOG( eax )
-		       << " ebx=" << HEXLOG( ebx ) << " ecx=" << HEXLOG( ecx ) << " edx=" << HEXLOG( edx )
-		       << " size=" << HEXLOG( size ) << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_cpuid(vcpu=" << vcpu << ") => eax=" << HEXLOG( eax )
+		                   << " ebx=" << HEXLOG( ebx ) << " ecx=" << HEXLOG( ecx ) << " edx=" << HEXLOG( edx )
+		                   << " size=" << HEXLOG( size ) << std::flush;
 	}
 
 	// cpuid might not reflect the state of kvm in the future; as a precaution, the underlying layers
@@ -708,13 +1111,14 @@ bool KvmDriver::getXSAVEArea( unsigned short vcpu, void *buffer, size_t bufSize
 
 	{
 		StatsCounter counter( "kvmi_get_xsave" );
+		EventTrace::countHypercall();
 		err = kvmi_get_xsave( domCtx_, vcpu, buffer, bufSize );
 	}
 
 	if ( err < 0 )
 		logger << ERROR << "kvmi_get_xsave() has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_get_xsave(vcpu=" << vcpu << ")" << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_xsave(vcpu=" << vcpu << ")" << std::flush;
 
 	return !err;
 }
@@ -736,18 +1140,28 @@ unsigned int KvmDriver::id() const
 
 void KvmDriver::enableVcpuCache( unsigned short vcpu, unsigned short view, const Registers &regs )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	regsCache_.stop( vcpu, view );
+
+	RegsCache::Entry *e = regsCache_.entry( vcpu );
+
+	if ( !e )
+		return;
 
-	regsCache_.vcpu_      = vcpu;
-	regsCache_.valid_     = true;
-	regsCache_.dirty_     = false;
-	regsCache_.registers_ = regs;
-	regsCache_.view_      = view;
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	regsCache_.fill( *e, regs );
 }
 
-void KvmDriver::updateVcpuCache( unsigned short view )
+void KvmDriver::updateVcpuCache( unsigned short vcpu, unsigned short view )
 {
-	regsCache_.view_ = view;
+	RegsCache::Entry *e = regsCache_.entry( vcpu );
+
+	if ( !e )
+		return;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	e->view_ = view;
 }
 
 void KvmDriver::enablePendingVcpusCache()
@@ -792,23 +1206,24 @@ bool KvmDriver::isPendingVcpusCacheEnabled( unsigned short vcpu ) const
 	return true;
 }
 
-void KvmDriver::disableCache()
+void KvmDriver::disableCache( unsigned short vcpu )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
-
-	regsCache_.vcpu_  = -1;
-	regsCache_.valid_ = false;
-	regsCache_.view_  = 0;
+	regsCache_.resume( vcpu );
 }
 
 bool KvmDriver::isViewCacheEnabled( unsigned short vcpu, unsigned short &view ) const
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	RegsCache::Entry *e = regsCache_.entry( vcpu );
+
+	if ( !e )
+		return false;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
 
-	if ( !regsCache_.valid( vcpu ) )
+	if ( !e->stopped_ )
 		return false;
 
-	view = regsCache_.view_;
+	view = e->view_;
 
 	return true;
 }
@@ -820,6 +1235,7 @@ void *KvmDriver::mapGuestPageImpl( unsigned long long gfn )
 #ifndef DISABLE_PAGE_MAP
 	{
 		StatsCounter counter( "kvmi_map_physical_page" );
+		EventTrace::countHypercall();
 		addr = kvmi_map_physical_page( domCtx_, gfn_to_gpa( gfn ) );
 	}
 
@@ -830,7 +1246,7 @@ void *KvmDriver::mapGuestPageImpl( unsigned long long gfn )
 		}
 		return nullptr;
 	}
-	logger << TRACE << "kvmi_map_physical_page(gfn=" << HEXLOG( gfn ) << ") => " << addr << std::flush;
+	BDVMI_LOG( TRACE ) << "kvmi_map_physical_page(gfn=" << HEXLOG( gfn ) << ") => " << addr << std::flush;
 #else
 	if ( posix_memalign( &addr, PAGE_SIZE, 2 * PAGE_SIZE ) ) {
 		logger << ERROR << "posix_memalign() has failed" << std::flush;
@@ -856,6 +1272,7 @@ void KvmDriver::unmapGuestPageImpl( void *hostPtr, unsigned long long gfn )
 
 	{
 		StatsCounter counter( "kvmi_unmap_physical_page" );
+		EventTrace::countHypercall();
 		err = kvmi_unmap_physical_page( domCtx_, hostPtr );
 	}
 
@@ -863,8 +1280,8 @@ void KvmDriver::unmapGuestPageImpl( void *hostPtr, unsigned long long gfn )
 		logger << ERROR << "kvmi_unmap_physical_page() of " << hostPtr << " has failed: " << strerror( errno )
 		       << std::flush;
 	else
-		logger << TRACE << "kvmi_unmap_physical_page(gfn=" << HEXLOG( gfn ) << ", addr=" << hostPtr << ")"
-		       << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_unmap_physical_page(gfn=" << HEXLOG( gfn ) << ", addr=" << hostPtr << ")"
+		                   << std::flush;
 #else
 void KvmDriver::unmapGuestPageImpl( void *hostPtr, unsigned long long gfn )
 {
@@ -876,19 +1293,135 @@ void KvmDriver::unmapGuestPageImpl( void *hostPtr, unsigned long long gfn )
 #endif
 }
 
-void KvmDriver::skipInstruction( const short instructionSize )
+void *KvmDriver::mapGuestPagesImpl( const unsigned long long *gfns, size_t count )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	void *addr = nullptr;
+
+	if ( posix_memalign( &addr, PAGE_SIZE, count * PAGE_SIZE ) ) {
+		logger << ERROR << "posix_memalign() has failed" << std::flush;
+		return nullptr;
+	}
+
+	BounceBuffer bb;
+
+	bb.gfns_.assign( gfns, gfns + count );
+
+	for ( size_t i = 0; i < count; ++i ) {
+		int err;
+
+		{
+			StatsCounter counter( "kvmi_read_physical" );
+			EventTrace::countHypercall();
+			err = kvmi_read_physical( domCtx_, gfn_to_gpa( gfns[i] ), static_cast<char *>( addr ) + i * PAGE_SIZE,
+			                          PAGE_SIZE );
+		}
 
-	regsCache_.registers_.rip += instructionSize;
-	regsCache_.dirty_ = true;
+		if ( err < 0 ) {
+			if ( errno != EFAULT )
+				logger << WARNING << "kvmi_read_physical() for gfn " << std::hex << std::showbase
+				       << gfns[i] << " has failed: " << strerror( errno ) << std::flush;
+			free( addr );
+			return nullptr;
+		}
+	}
+
+	bb.pristine_.assign( static_cast<uint8_t *>( addr ), static_cast<uint8_t *>( addr ) + count * PAGE_SIZE );
+
+	std::lock_guard<std::mutex> lock( bounceBuffersMutex_ );
+	bounceBuffers_[addr] = std::move( bb );
+
+	return addr;
 }
 
-unsigned long long KvmDriver::getNextRip() const
+void KvmDriver::unmapGuestPagesImpl( void *hostPtr, size_t count )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	BounceBuffer bb;
+
+	{
+		std::lock_guard<std::mutex> lock( bounceBuffersMutex_ );
+
+		auto i = bounceBuffers_.find( hostPtr );
+
+		if ( i == bounceBuffers_.end() ) {
+			logger << ERROR << "Unknown multi-page mapping " << hostPtr << std::flush;
+			return;
+		}
 
-	return regsCache_.registers_.rip;
+		bb = std::move( i->second );
+		bounceBuffers_.erase( i );
+	}
+
+	if ( count != bb.gfns_.size() )
+		logger << WARNING << "Multi-page mapping " << hostPtr << " has " << bb.gfns_.size()
+		       << " pages, not " << count << std::flush;
+
+	// Only write back what has been changed through the view, whole pages would undo whatever
+	// the guest wrote to them since they've been read
+	for ( size_t i = 0; i < bb.gfns_.size(); ++i ) {
+		uint8_t *      page     = static_cast<uint8_t *>( hostPtr ) + i * PAGE_SIZE;
+		const uint8_t *pristine = &bb.pristine_[i * PAGE_SIZE];
+
+		if ( !memcmp( page, pristine, PAGE_SIZE ) )
+			continue;
+
+		for ( size_t start = 0; start < PAGE_SIZE; ) {
+			if ( page[start] == pristine[start] ) {
+				++start;
+				continue;
+			}
+
+			// Not even unchanged bytes between two runs, the guest may have written those
+			size_t end = start + 1;
+
+			while ( end < PAGE_SIZE && page[end] != pristine[end] )
+				++end;
+
+			int err;
+
+			{
+				StatsCounter counter( "kvmi_write_physical" );
+				EventTrace::countHypercall();
+				err = kvmi_write_physical( domCtx_, gfn_to_gpa( bb.gfns_[i] ) + start, page + start,
+				                           end - start );
+			}
+
+			if ( err < 0 )
+				logger << ERROR << "kvmi_write_physical() for gfn " << std::hex << std::showbase
+				       << bb.gfns_[i] << " has failed: " << strerror( errno ) << std::flush;
+
+			start = end;
+		}
+	}
+
+	free( hostPtr );
+}
+
+void KvmDriver::skipInstruction( unsigned short vcpu, const short instructionSize )
+{
+	RegsCache::Entry *e = regsCache_.entry( vcpu );
+
+	if ( !e )
+		return;
+
+	if ( !instructionSize )
+		return;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	e->registers_.rip += instructionSize;
+	e->dirty_ |= Registers::GROUP_RIP_RFLAGS;
+}
+
+unsigned long long KvmDriver::getNextRip( unsigned short vcpu ) const
+{
+	RegsCache::Entry *e = regsCache_.entry( vcpu );
+
+	if ( !e )
+		return 0;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	return e->registers_.rip;
 }
 
 bool KvmDriver::getEventMsg( struct kvmi_dom_event *&event, int ms, bool &abort )
@@ -912,6 +1445,11 @@ bool KvmDriver::getEventMsg( struct kvmi_dom_event *&event, int ms, bool &abort
 	return true;
 }
 
+int KvmDriver::connectionFd() const
+{
+	return kvmi_connection_fd( domCtx_ );
+}
+
 bool KvmDriver::BatchMessages::addEventReply( EventReply &reply ) const
 {
 	int err;
@@ -932,6 +1470,7 @@ bool KvmDriver::registerVMEvent( unsigned int id, bool enable ) const
 
 	{
 		StatsCounter counter( "kvmi_control_vm_events" );
+		EventTrace::countHypercall();
 		err = kvmi_control_vm_events( domCtx_, id, enable );
 	}
 
@@ -939,7 +1478,7 @@ bool KvmDriver::registerVMEvent( unsigned int id, bool enable ) const
 		logger << ERROR << "kvmi_control_vm_events(" << id << ", " << enable
 		       << ") has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_control_vm_events(" << id << ", " << enable << ")" << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_control_vm_events(" << id << ", " << enable << ")" << std::flush;
 
 	return !err;
 }
@@ -950,6 +1489,7 @@ bool KvmDriver::registerEvent( unsigned short vcpu, unsigned int id, bool enable
 
 	{
 		StatsCounter counter( "kvmi_control_events" );
+		EventTrace::countHypercall();
 		err = kvmi_control_events( domCtx_, vcpu, id, enable );
 	}
 
@@ -957,8 +1497,8 @@ bool KvmDriver::registerEvent( unsigned short vcpu, unsigned int id, bool enable
 		logger << ERROR << "kvmi_control_events(vcpu=" << vcpu << ", id=" << id << ", enable=" << enable
 		       << ") has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_control_events(vcpu=" << vcpu << ", id=" << id << ", enable=" << enable << ")"
-		       << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_control_events(vcpu=" << vcpu << ", id=" << id << ", enable=" << enable
+		                   << ")" << std::flush;
 
 	return !err;
 }
@@ -969,6 +1509,7 @@ bool KvmDriver::registerMSREvents( unsigned short vcpu, unsigned int msr, bool e
 
 	{
 		StatsCounter counter( "kvmi_control_msr" );
+		EventTrace::countHypercall();
 		err = kvmi_control_msr( domCtx_, vcpu, msr, enable );
 	}
 
@@ -976,8 +1517,8 @@ bool KvmDriver::registerMSREvents( unsigned short vcpu, unsigned int msr, bool e
 		logger << ERROR << "kvmi_control_msr(vcpu=" << vcpu << ", msr=" << HEXLOG( msr )
 		       << ", enable=" << enable << ") failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_control_msr(vcpu=" << vcpu << ", msr=" << HEXLOG( msr )
-		       << ", enable=" << enable << ")" << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_control_msr(vcpu=" << vcpu << ", msr=" << HEXLOG( msr )
+		                   << ", enable=" << enable << ")" << std::flush;
 
 	return !err;
 }
@@ -988,14 +1529,15 @@ bool KvmDriver::registerCREvents( unsigned short vcpu, unsigned int cr, bool ena
 
 	{
 		StatsCounter counter( "kvmi_control_cr" );
+		EventTrace::countHypercall();
 		err = kvmi_control_cr( domCtx_, vcpu, cr, enable );
 	}
 
 	if ( err < 0 )
 		logger << ERROR << "kvmi_control_cr() has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_control_cr(vcpu=" << vcpu << ", cr=" << cr << ", enable=" << enable << ")"
-		       << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_control_cr(vcpu=" << vcpu << ", cr=" << cr << ", enable=" << enable << ")"
+		                   << std::flush;
 
 	return !err;
 }
@@ -1090,42 +1632,49 @@ void KvmDriver::loadRegisters( Registers &regs, const struct kvmi_event &eventCo
 	}
 }
 
-bool KvmDriver::BatchMessages::addRegisters() const
+bool KvmDriver::BatchMessages::addRegisters( unsigned short vcpu ) const
 {
-	RegsCache &regsCache_ = driver_->regsCache_;
+	RegsCache::Entry *e = driver_->regsCache_.entry( vcpu );
 
-	if ( !regsCache_.dirty_ )
+	if ( !e )
+		return true;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	// KVMI has no command smaller than a full kvm_regs write, so all the dirty
+	// groups buy us is skipping it altogether when nothing has changed
+	if ( !e->dirty_ )
 		return true;
 
 	int             err;
 	struct kvm_regs kregs;
 	memset( &kregs, 0, sizeof( kregs ) );
 
-	kregs.rax    = regsCache_.registers_.rax;
-	kregs.rbx    = regsCache_.registers_.rbx;
-	kregs.rcx    = regsCache_.registers_.rcx;
-	kregs.rdx    = regsCache_.registers_.rdx;
-	kregs.rsi    = regsCache_.registers_.rsi;
-	kregs.rdi    = regsCache_.registers_.rdi;
-	kregs.rsp    = regsCache_.registers_.rsp;
-	kregs.rbp    = regsCache_.registers_.rbp;
-	kregs.r8     = regsCache_.registers_.r8;
-	kregs.r9     = regsCache_.registers_.r9;
-	kregs.r10    = regsCache_.registers_.r10;
-	kregs.r11    = regsCache_.registers_.r11;
-	kregs.r12    = regsCache_.registers_.r12;
-	kregs.r13    = regsCache_.registers_.r13;
-	kregs.r14    = regsCache_.registers_.r14;
-	kregs.r15    = regsCache_.registers_.r15;
-	kregs.rip    = regsCache_.registers_.rip;
-	kregs.rflags = regsCache_.registers_.rflags;
-
-	err = kvmi_queue_registers( grp_, regsCache_.vcpu_, &kregs );
+	kregs.rax    = e->registers_.rax;
+	kregs.rbx    = e->registers_.rbx;
+	kregs.rcx    = e->registers_.rcx;
+	kregs.rdx    = e->registers_.rdx;
+	kregs.rsi    = e->registers_.rsi;
+	kregs.rdi    = e->registers_.rdi;
+	kregs.rsp    = e->registers_.rsp;
+	kregs.rbp    = e->registers_.rbp;
+	kregs.r8     = e->registers_.r8;
+	kregs.r9     = e->registers_.r9;
+	kregs.r10    = e->registers_.r10;
+	kregs.r11    = e->registers_.r11;
+	kregs.r12    = e->registers_.r12;
+	kregs.r13    = e->registers_.r13;
+	kregs.r14    = e->registers_.r14;
+	kregs.r15    = e->registers_.r15;
+	kregs.rip    = e->registers_.rip;
+	kregs.rflags = e->registers_.rflags;
+
+	err = kvmi_queue_registers( grp_, vcpu, &kregs );
 
 	if ( err < 0 )
 		logger << ERROR << "kvmi_queue_set_registers() has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_queue_set_registers(vcpu=" << regsCache_.vcpu_ << ")" << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_queue_set_registers(vcpu=" << vcpu << ")" << std::flush;
 
 	return !err;
 }
@@ -1137,7 +1686,9 @@ bool KvmDriver::initialViewSetup( unsigned short vcpu )
 	if ( !vcpuPendingSwitchCount_ )
 		return true;
 
-	if ( regsCache_.view_ != 0 )
+	unsigned short view = 0;
+
+	if ( isViewCacheEnabled( vcpu, view ) && view != 0 )
 		return true;
 
 	if ( !controlEPTview( vcpu, untrustedView_, true ) )
@@ -1148,7 +1699,7 @@ bool KvmDriver::initialViewSetup( unsigned short vcpu )
 
 	// Update the view cache for the current vcpu before clearing
 	// the vcpu in pendingCache_
-	updateVcpuCache( untrustedView_ );
+	updateVcpuCache( vcpu, untrustedView_ );
 
 	// At this point, it's safe to remove the current vcpu from
 	// pendingCache_; any future call of eptpIndex(vcpu) will use the
@@ -1169,19 +1720,26 @@ bool KvmDriver::flushCtrlEvents( unsigned short vcpu, const std::set<unsigned in
 		return false;
 	}
 
-	if ( !vcpuEvents_[vcpu].dirty_ )
-		return true;
+	{
+		std::lock_guard<std::mutex> lock( batchMutex_ );
+
+		if ( !vcpuEvents_[vcpu].dirty_ )
+			return true;
+	}
 
 	if ( !initialViewSetup( vcpu ) )
 		return false;
 
-	if ( !flushEvents( vcpu ) )
+	// Nothing is sent here, replyEvent() commits all of this together with the reply
+	std::lock_guard<std::mutex> lock( batchMutex_ );
+
+	if ( !flushEvents( *batch_, vcpu ) )
 		return false;
 
-	if ( !flushCREvents( vcpu, enabledCrs ) )
+	if ( !flushCREvents( *batch_, vcpu, enabledCrs ) )
 		return false;
 
-	if ( !flushMSREvents( vcpu, enabledMsrs ) )
+	if ( !flushMSREvents( *batch_, vcpu, enabledMsrs ) )
 		return false;
 
 	vcpuEvents_[vcpu].dirty_ = false;
@@ -1189,7 +1747,7 @@ bool KvmDriver::flushCtrlEvents( unsigned short vcpu, const std::set<unsigned in
 	return true;
 }
 
-bool KvmDriver::flushEvents( unsigned short vcpu )
+bool KvmDriver::flushEvents( BatchMessages &grp, unsigned short vcpu )
 {
 	const auto currentEvents = vcpuEvents_[vcpu].enabled_;
 	const auto newEvents     = enabledEvents_;
@@ -1197,8 +1755,8 @@ bool KvmDriver::flushEvents( unsigned short vcpu )
 
 	if ( changed.any() ) {
 		for ( unsigned int id = 0; id < changed.size(); id++ )
-			if ( changed.test( id ) )
-				registerEvent( vcpu, id, newEvents.test( id ) );
+			if ( changed.test( id ) && !grp.addControlEvent( vcpu, id, newEvents.test( id ) ) )
+				return false;
 
 		vcpuEvents_[vcpu].enabled_ = newEvents;
 	}
@@ -1206,11 +1764,11 @@ bool KvmDriver::flushEvents( unsigned short vcpu )
 	return true;
 }
 
-bool KvmDriver::flushCREvents( unsigned short vcpu, const std::set<unsigned int> &enabledCrs )
+bool KvmDriver::flushCREvents( BatchMessages &grp, unsigned short vcpu, const std::set<unsigned int> &enabledCrs )
 {
 	for ( auto i = enabledCrs.begin(); i != enabledCrs.end(); ++i ) {
 		if ( vcpuEvents_[vcpu].enabledCrs_.find( *i ) == vcpuEvents_[vcpu].enabledCrs_.end() ) {
-			if ( !registerCREvents( vcpu, *i, true ) )
+			if ( !grp.addControlCr( vcpu, *i, true ) )
 				return false;
 			vcpuEvents_[vcpu].enabledCrs_.insert( *i );
 		}
@@ -1219,7 +1777,7 @@ bool KvmDriver::flushCREvents( unsigned short vcpu, const std::set<unsigned int>
 	auto j = vcpuEvents_[vcpu].enabledCrs_.begin();
 	while ( j != vcpuEvents_[vcpu].enabledCrs_.end() ) {
 		if ( enabledCrs.find( *j ) == enabledCrs.end() ) {
-			if ( !registerCREvents( vcpu, *j, false ) )
+			if ( !grp.addControlCr( vcpu, *j, false ) )
 				return false;
 			j = vcpuEvents_[vcpu].enabledCrs_.erase( j );
 		} else
@@ -1229,11 +1787,11 @@ bool KvmDriver::flushCREvents( unsigned short vcpu, const std::set<unsigned int>
 	return true;
 }
 
-bool KvmDriver::flushMSREvents( unsigned short vcpu, const std::set<unsigned int> &enabledMsrs )
+bool KvmDriver::flushMSREvents( BatchMessages &grp, unsigned short vcpu, const std::set<unsigned int> &enabledMsrs )
 {
 	for ( auto i = enabledMsrs.begin(); i != enabledMsrs.end(); ++i ) {
 		if ( vcpuEvents_[vcpu].enabledMsrs_.find( *i ) == vcpuEvents_[vcpu].enabledMsrs_.end() ) {
-			if ( !registerMSREvents( vcpu, *i, true ) )
+			if ( !grp.addControlMsr( vcpu, *i, true ) )
 				return false;
 			vcpuEvents_[vcpu].enabledMsrs_.insert( *i );
 		}
@@ -1242,7 +1800,7 @@ bool KvmDriver::flushMSREvents( unsigned short vcpu, const std::set<unsigned int
 	auto j = vcpuEvents_[vcpu].enabledMsrs_.begin();
 	while ( j != vcpuEvents_[vcpu].enabledMsrs_.end() ) {
 		if ( enabledMsrs.find( *j ) == enabledMsrs.end() ) {
-			if ( !registerMSREvents( vcpu, *j, false ) )
+			if ( !grp.addControlMsr( vcpu, *j, false ) )
 				return false;
 			j = vcpuEvents_[vcpu].enabledMsrs_.erase( j );
 		} else
@@ -1301,22 +1859,27 @@ void KvmDriver::beginEvent( Registers &regs, const struct kvmi_event &event )
 
 bool KvmDriver::replyEvent( EventReply &reply )
 {
+	unsigned short vcpu = reply.reply_.vcpu_.vcpu;
+
+	// Whatever other vCPUs have queued up on batch_ in the meantime goes out with this one
+	// too, which is fine: page protections can only be applied earlier than asked for.
 	flushPageProtections();
 
-	if ( !batch_->addRegisters() )
+	std::lock_guard<std::mutex> lock( batchMutex_ );
+
+	if ( !batch_->addRegisters( vcpu ) )
 		return false;
 
 	if ( !batch_->addEventReply( reply ) )
 		return false;
 
-	disableCache();
+	disableCache( vcpu );
 
-	if ( !batch_->commit() )
-		return false;
+	bool ok = batch_->commit();
 
-	batch_ = std::make_unique<BatchMessages>( domCtx_, this );
+	batch_->reset();
 
-	return true;
+	return ok;
 }
 
 void KvmDriver::setVcpuVectorSize()
@@ -1326,6 +1889,8 @@ void KvmDriver::setVcpuVectorSize()
 
 void KvmDriver::setVcpuEventsDirty()
 {
+	std::lock_guard<std::mutex> lock( batchMutex_ );
+
 	for ( auto &&i : vcpuEvents_ )
 		i.dirty_ = true;
 }
@@ -1356,6 +1921,45 @@ bool KvmDriver::setVcpuEvents( unsigned int id )
 	return kickAllVcpus();
 }
 
+bool KvmDriver::setVcpuEvents( unsigned int id, const std::set<unsigned int> &enabledCrs,
+                               const std::set<unsigned int> &enabledMsrs )
+{
+	StatsCounter counter( "setVcpuEvents" );
+
+	BatchMessages grp( domCtx_, this );
+
+	enabledEvents_.set( id );
+
+	const unsigned int count = vcpuCount_;
+
+	{
+		std::lock_guard<std::mutex> lock( batchMutex_ );
+
+		// Each vCPU's commands come before its pause, so the pause event already sees them
+		for ( unsigned short vcpu = 0; vcpu < count && vcpu < vcpuEvents_.size(); vcpu++ ) {
+			if ( !flushEvents( grp, vcpu ) || !flushCREvents( grp, vcpu, enabledCrs ) ||
+			     !flushMSREvents( grp, vcpu, enabledMsrs ) )
+				return false;
+
+			// Still needs its flushCtrlEvents() if it hasn't moved to untrustedView_ yet
+			vcpuEvents_[vcpu].dirty_ = isPendingVcpusCacheEnabled( vcpu );
+		}
+	}
+
+	for ( unsigned short vcpu = 0; vcpu < count; vcpu++ )
+		if ( !grp.addPauseVcpu( vcpu ) )
+			return false;
+
+	std::lock_guard<std::mutex> guard( pauseMutex_ );
+
+	if ( !grp.commit() )
+		return false;
+
+	pendingPauseEvents_ += count;
+
+	return true;
+}
+
 bool KvmDriver::clearVcpuEvents( unsigned int id )
 {
 	enabledEvents_.reset( id );
@@ -1378,13 +1982,14 @@ bool KvmDriver::maxGPFNImpl( unsigned long long &gfn )
 
 	{
 		StatsCounter counter( "kvmi_get_maximum_gfn" );
+		EventTrace::countHypercall();
 		err = kvmi_get_maximum_gfn( domCtx_, &gfn );
 	}
 
 	if ( err < 0 )
 		logger << ERROR << "kvmi_get_maximum_gfn() has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_get_maximum_gfn() => " << HEXLOG( gfn ) << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_maximum_gfn() => " << HEXLOG( gfn ) << std::flush;
 
 	// introcore expects to receive the last accesible GFN, see
 	// introspection/introcore/guests.c (hvmi.git)
@@ -1393,6 +1998,28 @@ bool KvmDriver::maxGPFNImpl( unsigned long long &gfn )
 	return !err;
 }
 
+void KvmDriver::probeGfnsImpl( unsigned long long firstGfn, size_t count, std::vector<bool> &present )
+{
+	present.assign( count, false );
+
+	// No batched mapping in KVMI
+	for ( size_t i = 0; i < count; ++i ) {
+		void *ptr = mapGuestPageImpl( firstGfn + i );
+
+		if ( !ptr )
+			continue;
+
+		present[i] = true;
+		unmapGuestPageImpl( ptr, firstGfn + i );
+	}
+}
+
+bool KvmDriver::startDirtyLogImpl()
+{
+	logger << ERROR << "Dirty page tracking is not supported by KVMI" << std::flush;
+	return false;
+}
+
 unsigned short KvmDriver::eptpIndex( unsigned short vcpu ) const
 {
 	unsigned short view = 0;
@@ -1409,13 +2036,14 @@ unsigned short KvmDriver::eptpIndex( unsigned short vcpu ) const
 
 	{
 		StatsCounter counter( "kvmi_get_ept_view" );
+		EventTrace::countHypercall();
 		err = kvmi_get_ept_view( domCtx_, vcpu, &view );
 	}
 
 	if ( err )
 		logger << ERROR << "kvmi_get_ept_view(vcpu=" << vcpu << ") failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_get_ept_view(vcpu=" << vcpu << ") => " << view << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_ept_view(vcpu=" << vcpu << ") => " << view << std::flush;
 
 	return view;
 }
@@ -1426,6 +2054,7 @@ bool KvmDriver::setVEInfoPage( unsigned short vcpu, unsigned long long gpa )
 
 	{
 		StatsCounter counter( "kvmi_set_ve_info_page" );
+		EventTrace::countHypercall();
 		err = kvmi_set_ve_info_page( domCtx_, vcpu, gpa );
 	}
 
@@ -1433,8 +2062,8 @@ bool KvmDriver::setVEInfoPage( unsigned short vcpu, unsigned long long gpa )
 		logger << ERROR << "kvmi_set_ve_info_page(vcpu=" << vcpu << ", gpa=" << HEXLOG( gpa )
 		       << ") has failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_set_ve_info_page(vcpu=" << vcpu << ", gpa=" << HEXLOG( gpa ) << ")"
-		       << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_set_ve_info_page(vcpu=" << vcpu << ", gpa=" << HEXLOG( gpa ) << ")"
+		                   << std::flush;
 
 	return !err;
 }
@@ -1461,6 +2090,7 @@ bool KvmDriver::controlEPTview( unsigned short vcpu, unsigned short view, bool v
 
 	{
 		StatsCounter counter( "kvmi_control_ept_view" );
+		EventTrace::countHypercall();
 		rc = kvmi_control_ept_view( domCtx_, vcpu, view, visible );
 	}
 
@@ -1470,13 +2100,13 @@ bool KvmDriver::controlEPTview( unsigned short vcpu, unsigned short view, bool v
 		return false;
 	}
 
-	logger << TRACE << "kvmi_control_ept_view(vcpu=" << vcpu << ", view=" << view << ", visible=" << std::boolalpha
-	       << visible << ") => 0" << std::flush;
+	BDVMI_LOG( TRACE ) << "kvmi_control_ept_view(vcpu=" << vcpu << ", view=" << view
+	                   << ", visible=" << std::boolalpha << visible << ") => 0" << std::flush;
 
 	return true;
 }
 
-bool KvmDriver::createEPT( unsigned short &index )
+bool KvmDriver::createEPTImpl( unsigned short &index )
 {
 	unsigned short vcpu;
 
@@ -1494,7 +2124,7 @@ bool KvmDriver::createEPT( unsigned short &index )
 	return true;
 }
 
-bool KvmDriver::destroyEPT( unsigned short index )
+bool KvmDriver::destroyEPTImpl( unsigned short index )
 {
 	unsigned short vcpu;
 
@@ -1522,6 +2152,7 @@ bool KvmDriver::vcpuSwitchView( unsigned short vcpu, unsigned short index )
 
 	{
 		StatsCounter counter( "kvmi_switch_ept_view" );
+		EventTrace::countHypercall();
 		rc = kvmi_switch_ept_view( domCtx_, vcpu, index );
 	}
 
@@ -1531,7 +2162,8 @@ bool KvmDriver::vcpuSwitchView( unsigned short vcpu, unsigned short index )
 		return false;
 	}
 
-	logger << TRACE << "kvmi_switch_ept_view(vcpu=" << vcpu << ", index=" << index << ") succeeded" << std::flush;
+	BDVMI_LOG( TRACE ) << "kvmi_switch_ept_view(vcpu=" << vcpu << ", index=" << index << ") succeeded"
+	                   << std::flush;
 
 	return true;
 }
@@ -1553,6 +2185,7 @@ bool KvmDriver::getEPTPageConvertible( unsigned short index, unsigned long long
 
 	{
 		StatsCounter counter( "kvmi_get_ept_page_conv" );
+		EventTrace::countHypercall();
 		err = kvmi_get_ept_page_conv( domCtx_, index, address, &convertible );
 	}
 
@@ -1560,8 +2193,8 @@ bool KvmDriver::getEPTPageConvertible( unsigned short index, unsigned long long
 		logger << ERROR << "kvmi_get_ept_page_conv(index= " << index << ", gpa= " << HEXLOG( address )
 		       << ") failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_get_ept_page_conv(index= " << index << ", gpa= " << HEXLOG( address )
-		       << ") => " << std::boolalpha << convertible << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_get_ept_page_conv(index= " << index << ", gpa= " << HEXLOG( address )
+		                   << ") => " << std::boolalpha << convertible << std::flush;
 
 	return !err;
 }
@@ -1579,6 +2212,7 @@ bool KvmDriver::setPageConvertibleImpl( const ConvertibleMap &convMap, unsigned
 
 		{
 			StatsCounter counter( "kvmi_set_ept_page_conv" );
+			EventTrace::countHypercall();
 			err = kvmi_set_ept_page_conv( domCtx_, view, gpa, sve );
 			rc |= err;
 		}
@@ -1587,8 +2221,8 @@ bool KvmDriver::setPageConvertibleImpl( const ConvertibleMap &convMap, unsigned
 			logger << ERROR << "kvmi_set_ept_page_conv(view= " << view << ", gpa= " << HEXLOG( gpa )
 			       << ", sve= " << std::boolalpha << sve << ") failed: " << strerror( errno ) << std::flush;
 		else
-			logger << TRACE << "kvmi_set_ept_page_conv(view= " << view << ", gpa= " << HEXLOG( gpa )
-			       << ", sve= " << std::boolalpha << sve << ")" << std::flush;
+			BDVMI_LOG( TRACE ) << "kvmi_set_ept_page_conv(view= " << view << ", gpa= " << HEXLOG( gpa )
+			                   << ", sve= " << std::boolalpha << sve << ")" << std::flush;
 	}
 
 	return !rc;
@@ -1600,13 +2234,14 @@ bool KvmDriver::disableVE( unsigned short vcpu )
 
 	{
 		StatsCounter counter( "kvmi_disable_ve" );
+		EventTrace::countHypercall();
 		err = kvmi_disable_ve( domCtx_, vcpu );
 	}
 
 	if ( err )
 		logger << ERROR << "kvmi_disable_ve(vcpu=" << vcpu << ") failed: " << strerror( errno ) << std::flush;
 	else
-		logger << TRACE << "kvmi_disable_ve(vcpu=" << vcpu << ") => true" << std::flush;
+		BDVMI_LOG( TRACE ) << "kvmi_disable_ve(vcpu=" << vcpu << ") => true" << std::flush;
 
 	return !err;
 }
@@ -28,6 +28,7 @@
 #include <libkvmi.h>
 #include "bdvmi/driver.h"
 #include "bdvmi/pagecache.h"
+#include "regscache.h"
 
 namespace bdvmi {
 
@@ -39,19 +40,6 @@ class KvmDriver : public Driver {
 	using EventBitset = std::bitset<KVMI_NUM_EVENTS>;
 
 public:
-	struct RegsCache {
-		Registers  registers_;
-		int        vcpu_{ -1 };
-		bool       valid_{ false };
-		bool       dirty_{ false };
-		uint16_t   view_{ 0 };
-		std::mutex mutex_;
-		bool       valid( unsigned short vcpu )
-		{
-			return valid_ && vcpu_ == static_cast<int>( vcpu );
-		}
-	};
-
 	struct PendingVcpusCache {
 		std::set<unsigned short> pendingVcpus_;
 		std::mutex mutex_;
@@ -60,13 +48,8 @@ public:
 	struct EventReply {
 		explicit EventReply( const struct kvmi_dom_event *msg )
 		{
-			memset( &reply_, 0, sizeof( reply_ ) );
-			reply_.vcpu_.vcpu     = msg->event.common.vcpu;
-			reply_.common_.event  = msg->event.common.event;
-			reply_.common_.action = KVMI_EVENT_ACTION_CONTINUE;
-			seq_                  = msg->seq;
-			size_                 = sizeof( reply_.vcpu_ ) + sizeof( reply_.common_ );
-			switch ( reply_.common_.event ) {
+			size_ = sizeof( reply_.vcpu_ ) + sizeof( reply_.common_ );
+			switch ( msg->event.common.event ) {
 				case KVMI_EVENT_CR:
 					size_ += sizeof( reply_.event_.cr );
 					break;
@@ -77,6 +60,12 @@ public:
 					size_ += sizeof( reply_.event_.pf );
 					break;
 			}
+			// Only the part that gets sent, most events don't need the (large) PF reply
+			memset( &reply_, 0, size_ );
+			reply_.vcpu_.vcpu     = msg->event.common.vcpu;
+			reply_.common_.event  = msg->event.common.event;
+			reply_.common_.action = KVMI_EVENT_ACTION_CONTINUE;
+			seq_                  = msg->seq;
 		}
 		struct {
 			struct kvmi_vcpu_hdr    vcpu_;
@@ -101,13 +90,20 @@ private:
 		BatchMessages( void *dom, KvmDriver *driver );
 		~BatchMessages();
 		bool commit();
-		bool addRegisters() const;
+		// Start over with an empty group. libkvmi can't empty a committed group, so this
+		// swaps in a new one, but the BatchMessages object itself is kept.
+		void reset();
+		bool addRegisters( unsigned short vcpu ) const;
 		bool addEventReply( EventReply &reply ) const;
 		bool addPageAccess( unsigned long long int &gpa, unsigned char &access, unsigned short count,
 		                    unsigned short view ) const;
 		bool addPauseVcpu( unsigned short vcpu ) const;
+		bool addControlEvent( unsigned short vcpu, unsigned int id, bool enable ) const;
+		bool addControlCr( unsigned short vcpu, unsigned int cr, bool enable ) const;
+		bool addControlMsr( unsigned short vcpu, unsigned int msr, bool enable ) const;
 
 	private:
+		void *     dom_;
 		void *     grp_{ nullptr };
 		KvmDriver *driver_;
 	};
@@ -123,6 +119,10 @@ public:
 
 	bool registers( unsigned short vcpu, Registers &regs ) const override;
 
+	bool cachedRegisters( unsigned short vcpu, const Registers *&regs ) const override;
+
+	bool readMsr( unsigned short vcpu, uint32_t msr, uint64_t &value ) const override;
+
 	bool setRegisters( unsigned short vcpu, const Registers &regs, bool setEip, bool delay ) override;
 
 	MapReturnCode mapPhysMemToHost( unsigned long long address, size_t length, uint32_t flags,
@@ -130,6 +130,10 @@ public:
 
 	bool unmapPhysMem( void *hostPtr ) override;
 
+	MapReturnCode mapGfns( const unsigned long long *gfns, size_t count, uint32_t flags, void *&pointer ) override;
+
+	bool unmapGfns( void *hostPtr, size_t count ) override;
+
 	bool injectTrap( unsigned short vcpu, uint8_t trapNumber, uint32_t errorCode, uint64_t cr2 ) override;
 
 	bool setRepOptimizations( bool enable ) override;
@@ -150,6 +154,14 @@ public:
 
 	size_t setPageCacheLimit( size_t limit ) override;
 
+	bool setPageCacheLimitRange( size_t minLimit, size_t maxLimit ) override;
+
+	bool pageCacheStats( PageCacheStats &stats ) override;
+
+	size_t setPageCacheReadAhead( size_t pages ) override;
+
+	void prefetchGfns( const unsigned long long *gfns, size_t count ) override;
+
 	unsigned short eptpIndex( unsigned short vcpu ) const override;
 
 	bool getEPTPageConvertible( unsigned short index, unsigned long long address, bool &convertible ) override;
@@ -160,10 +172,6 @@ public:
 
 	bool getNextAvailableView( unsigned short &index );
 
-	bool createEPT( unsigned short &index ) override;
-
-	bool destroyEPT( unsigned short index ) override;
-
 	bool vcpuSwitchView( unsigned short vcpu, unsigned short index );
 
 	bool switchEPT( unsigned short index ) override;
@@ -187,7 +195,7 @@ public:
 		// useless
 	}
 
-	void disableCache() override;
+	void disableCache( unsigned short vcpu ) override;
 
 	bool registerVMEvent( unsigned int id, bool enable ) const;
 
@@ -197,15 +205,10 @@ public:
 
 	bool registerCREvents( unsigned short vcpu, unsigned int cr, bool enable ) const;
 
+	// Queues vcpu's pending control event changes on batch_, they go out with the next reply
 	bool flushCtrlEvents( unsigned short vcpu, const std::set<unsigned int> &enabledCrs,
 	                      const std::set<unsigned int> &enabledMsrs );
 
-	bool flushEvents( unsigned short vcpu );
-
-	bool flushCREvents( unsigned short vcpu, const std::set<unsigned int> &enabledCrs );
-
-	bool flushMSREvents( unsigned short vcpu, const std::set<unsigned int> &enabledMsrs );
-
 	uint32_t startTime() override;
 
 	bool isMsrCached( uint64_t msr ) const override;
@@ -234,14 +237,17 @@ public:
 		return true;
 	}
 
-	void skipInstruction( const short instructionSize );
+	void skipInstruction( unsigned short vcpu, const short instructionSize );
 
 	void loadRegisters( Registers &regs, const struct kvmi_event &event ) const;
 
-	unsigned long long getNextRip() const;
+	unsigned long long getNextRip( unsigned short vcpu ) const;
 
 	bool getEventMsg( struct kvmi_dom_event *&event, int ms, bool &abort );
 
+	// The introspection socket, readable when getEventMsg() has something
+	int connectionFd() const;
+
 	void pauseEventReceived();
 
 	size_t pendingPauseEvents() const
@@ -254,6 +260,13 @@ public:
 		std::lock_guard<std::mutex> lock( eventProcessingMutex_ );
 	}
 
+	// Keep msg's vCPU stopped in its pause event if pauseVcpus() is holding it: the handler never
+	// sees the event and the reply waits for unpauseVcpus(). False: handle the event as usual.
+	bool parkPauseEvent( const struct kvmi_dom_event &msg );
+
+	// Let all the parked vCPUs go, whatever pauseVcpus() says (the session is over)
+	bool releaseParkedVcpus();
+
 	bool isConnected();
 
 	void suspending( bool value );
@@ -272,6 +285,11 @@ public:
 
 	bool setVcpuEvents( unsigned int id );
 
+	// Also brings every vCPU's CR and MSR events in line with enabledCrs and enabledMsrs,
+	// all in the same batch as the kick
+	bool setVcpuEvents( unsigned int id, const std::set<unsigned int> &enabledCrs,
+	                    const std::set<unsigned int> &enabledMsrs );
+
 	void setVcpuEventsLater( unsigned int id );
 
 	bool clearVcpuEvents( unsigned int id );
@@ -285,23 +303,48 @@ public:
 		return false;
 	}
 
+	bool physCopySupported() const override
+	{
+		return true;
+	}
+
 private:
 	void *mapGuestPageImpl( unsigned long long gfn ) override;
 
 	void unmapGuestPageImpl( void *hostPtr, unsigned long long gfn ) override;
 
+	void *mapGuestPagesImpl( const unsigned long long *gfns, size_t count ) override;
+
+	void unmapGuestPagesImpl( void *hostPtr, size_t count ) override;
+
+	bool createEPTImpl( unsigned short &index ) override;
+
+	bool destroyEPTImpl( unsigned short index ) override;
+
 	bool setPageProtectionImpl( const MemAccessMap &accessMap, unsigned short view ) override;
 
 	bool getPageProtectionImpl( unsigned long long guestAddress, bool &read, bool &write, bool &execute,
 	                            unsigned short view ) override;
 
+	bool getPageProtectionRangeImpl( unsigned long long firstGfn, size_t count, uint8_t *access,
+	                                 unsigned short view ) override;
+
 	bool setPageConvertibleImpl( const ConvertibleMap &convMap, unsigned short view ) override;
 
+	bool queryRegisters( unsigned short vcpu, Registers &regs ) const;
+
+	// These only queue the commands on grp, and expect batchMutex_ to be held
+	bool flushEvents( BatchMessages &grp, unsigned short vcpu );
+
+	bool flushCREvents( BatchMessages &grp, unsigned short vcpu, const std::set<unsigned int> &enabledCrs );
+
+	bool flushMSREvents( BatchMessages &grp, unsigned short vcpu, const std::set<unsigned int> &enabledMsrs );
+
 	bool isViewCacheEnabled( unsigned short vcpu, unsigned short &view ) const;
 
 	void enableVcpuCache( unsigned short vcpu, unsigned short view, const Registers &regs );
 
-	void updateVcpuCache( unsigned short view );
+	void updateVcpuCache( unsigned short vcpu, unsigned short view );
 
 	bool isPendingVcpusCacheEnabled( unsigned short vcpu ) const;
 
@@ -309,12 +352,47 @@ private:
 
 	bool maxGPFNImpl( unsigned long long &gfn ) override;
 
+	void probeGfnsImpl( unsigned long long firstGfn, size_t count, std::vector<bool> &present ) override;
+
+	// KVM's dirty log belongs to the VMM, KVMI has no way to get at it
+	bool startDirtyLogImpl() override;
+
+	bool stopDirtyLogImpl() override
+	{
+		return true;
+	}
+
+	bool fetchDirtyLogImpl( unsigned long long /* pages */, std::vector<uint64_t> & /* bitmap */ ) override
+	{
+		return false;
+	}
+
+	bool readPhysicalImpl( unsigned long long gpa, void *buffer, size_t length ) override;
+
+	bool writePhysicalImpl( unsigned long long gpa, const void *buffer, size_t length ) override;
+
+	bool isPageCached( unsigned long long gfn ) override;
+
+	bool pauseVcpusImpl( uint64_t vcpus, uint64_t paused ) override;
+
+	bool unpauseVcpusImpl( uint64_t vcpus, uint64_t paused ) override;
+
+	// Send the replies of parked pause events, all in one batch
+	bool replyParked( std::vector<EventReply> &replies );
+
 private:
 	KvmDriver( const KvmDriver & );
 
 	KvmDriver &operator=( const KvmDriver & );
 
 private:
+	// KVMI can't map several guest pages at consecutive host addresses, so multi-page
+	// views are bounce buffers. The pristine copy lets us only write back the bytes that changed.
+	struct BounceBuffer {
+		std::vector<unsigned long long> gfns_;
+		std::vector<uint8_t>            pristine_;
+	};
+
 	struct vcpuEvents {
 		bool                   dirty_{ true };
 		EventBitset            enabled_;
@@ -332,16 +410,24 @@ private:
 	size_t                            pauseCount_{ 0 };
 	std::mutex                        pauseMutex_;
 	size_t                            pendingPauseEvents_{ 0 };
+	uint64_t                          heldVcpus_{ 0 }; // pauseVcpus(), with pauseMutex_
+	std::vector<EventReply>           parkedReplies_;  // pause events of heldVcpus_, pauseMutex_
 	std::mutex                        eventProcessingMutex_;
 	mutable std::atomic<unsigned int> vcpuCount_{ 0 };
 	std::vector<struct vcpuEvents>    vcpuEvents_;
 	EventBitset                       enabledEvents_;
 	std::unique_ptr<BatchMessages>    batch_;
+	// Only used by setPageProtectionImpl(), i.e. with Driver::memAccessCacheMutex_ held
+	std::vector<unsigned char>        accessScratch_;
+	std::vector<unsigned long long>   gpaScratch_;
+	std::mutex                        batchMutex_; // batch_, events may be replied to in parallel
 	bool                              eptpSupported_{ false };
 	bool                              veSupported_{ false };
 	unsigned short                    untrustedView_{ 0 };
 	mutable PendingVcpusCache         pendingCache_;
-	unsigned short                    vcpuPendingSwitchCount_{ 0 };
+	std::atomic<unsigned short>       vcpuPendingSwitchCount_{ 0 };
+	std::unordered_map<void *, BounceBuffer> bounceBuffers_;
+	std::mutex                               bounceBuffersMutex_;
 
 	/* EPT views available for VMFUNC */
 	std::array<bool, KVMI_MAX_EPT_VIEWS> guestVisibleEPTviews_{ };
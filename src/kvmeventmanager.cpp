@@ -21,10 +21,12 @@
 #include "bdvmi/logger.h"
 #include "bdvmi/statscollector.h"
 #include "utils.h"
+#include "vcpudispatcher.h"
 #include <stdexcept>
 #include <cstring>
 #include <cerrno>
 #include <iomanip>
+#include <memory>
 #include <unistd.h>
 
 namespace {
@@ -76,6 +78,50 @@ const char *descriptor_to_string( __u8 descriptor )
 	}
 }
 
+bdvmi::EventTrace::EventType trace_type( __u32 event )
+{
+	switch ( event ) {
+		case KVMI_EVENT_CR:
+			return bdvmi::EventTrace::CR;
+		case KVMI_EVENT_MSR:
+			return bdvmi::EventTrace::MSR;
+		case KVMI_EVENT_XSETBV:
+			return bdvmi::EventTrace::XSETBV;
+		case KVMI_EVENT_BREAKPOINT:
+			return bdvmi::EventTrace::BREAKPOINT;
+		case KVMI_EVENT_HYPERCALL:
+			return bdvmi::EventTrace::VMCALL;
+		case KVMI_EVENT_PF:
+			return bdvmi::EventTrace::PAGE_FAULT;
+		case KVMI_EVENT_TRAP:
+			return bdvmi::EventTrace::INTERRUPT;
+		case KVMI_EVENT_DESCRIPTOR:
+			return bdvmi::EventTrace::DESCRIPTOR;
+		case KVMI_EVENT_SINGLESTEP:
+			return bdvmi::EventTrace::SINGLESTEP;
+		default:
+			return bdvmi::EventTrace::OTHER;
+	}
+}
+
+uint64_t trace_arg( const struct kvmi_dom_event &msg )
+{
+	switch ( msg.event.common.event ) {
+		case KVMI_EVENT_CR:
+			return msg.event.cr.cr;
+		case KVMI_EVENT_MSR:
+			return msg.event.msr.msr;
+		case KVMI_EVENT_BREAKPOINT:
+			return msg.event.breakpoint.gpa;
+		case KVMI_EVENT_PF:
+			return msg.event.page_fault.gpa;
+		case KVMI_EVENT_TRAP:
+			return msg.event.trap.vector;
+		default:
+			return 0;
+	}
+}
+
 } // namespace
 
 namespace bdvmi {
@@ -115,6 +161,8 @@ KvmEventManager::KvmEventManager( KvmDriver &driver, sig_atomic_t &sigStop )
 
 	if ( !initVcpuEvents() )
 		throw std::runtime_error( "[KVM events] could not init the vcpu events" );
+
+	reserveVcpuContexts();
 }
 
 KvmEventManager::~KvmEventManager()
@@ -123,9 +171,22 @@ KvmEventManager::~KvmEventManager()
 		flushEventQueue();
 }
 
-bool KvmEventManager::enableMsrEventsImpl( unsigned int /* msr */ )
+void KvmEventManager::reserveVcpuContexts()
 {
-	return driver_.setVcpuEvents( KVMI_EVENT_MSR );
+	unsigned int count = 0;
+
+	// Only called before the workers start and with them drained (CREATE_VCPU)
+	if ( driver_.cpuCount( count ) )
+		reserveEventContexts( count );
+}
+
+bool KvmEventManager::enableMsrEventsImpl( unsigned int msr )
+{
+	// EventManager only adds msr to enabledMsrs_ once this succeeds
+	std::set<unsigned int> enabledMsrs = enabledMsrs_;
+	enabledMsrs.insert( msr );
+
+	return driver_.setVcpuEvents( KVMI_EVENT_MSR, enabledCrs_, enabledMsrs );
 }
 
 bool KvmEventManager::disableMsrEventsImpl( unsigned int /* msr */ )
@@ -133,9 +194,12 @@ bool KvmEventManager::disableMsrEventsImpl( unsigned int /* msr */ )
 	return true;
 }
 
-bool KvmEventManager::enableCrEventsImpl( unsigned int /* cr */ )
+bool KvmEventManager::enableCrEventsImpl( unsigned int cr )
 {
-	return driver_.setVcpuEvents( KVMI_EVENT_CR );
+	std::set<unsigned int> enabledCrs = enabledCrs_;
+	enabledCrs.insert( cr );
+
+	return driver_.setVcpuEvents( KVMI_EVENT_CR, enabledCrs, enabledMsrs_ );
 }
 
 bool KvmEventManager::disableCrEventsImpl( unsigned int /* cr */ )
@@ -185,7 +249,7 @@ bool KvmEventManager::disableDescriptorEventsImpl()
 
 void KvmEventManager::traceEventMessage( const struct kvmi_dom_event &msg )
 {
-	if ( !logger.trace() )
+	if ( !logger.enabled( LogStreambuf::TRACE ) )
 		return;
 
 	logger << TRACE << event_to_string( msg.event.common.event ) << ": vcpu " << msg.event.common.vcpu;
@@ -237,7 +301,7 @@ void KvmEventManager::traceEventMessage( const struct kvmi_dom_event &msg )
 
 void KvmEventManager::traceEventReply( const struct kvmi_dom_event &msg, const struct KvmDriver::EventReply &rpl )
 {
-	if ( !logger.trace() )
+	if ( !logger.enabled( LogStreambuf::TRACE ) )
 		return;
 
 	logger << TRACE << event_to_string( msg.event.common.event ) << ": vcpu " << msg.event.common.vcpu << " "
@@ -251,10 +315,10 @@ void KvmEventManager::traceEventReply( const struct kvmi_dom_event &msg, const s
 			logger << " new " << HEXLOG( rpl.reply_.event_.msr.new_val );
 			break;
 		case KVMI_EVENT_BREAKPOINT:
-			logger << " rip " << HEXLOG( driver_.getNextRip() );
+			logger << " rip " << HEXLOG( driver_.getNextRip( msg.event.common.vcpu ) );
 			break;
 		case KVMI_EVENT_PF:
-			logger << " rip " << HEXLOG( driver_.getNextRip() );
+			logger << " rip " << HEXLOG( driver_.getNextRip( msg.event.common.vcpu ) );
 			if ( rpl.reply_.event_.pf.ctx_size ) {
 				logger << " ctx_data:" << std::noshowbase;
 				for ( size_t i = 0; i < rpl.reply_.event_.pf.ctx_size; i++ )
@@ -264,7 +328,7 @@ void KvmEventManager::traceEventReply( const struct kvmi_dom_event &msg, const s
 			logger << std::dec;
 			break;
 		case KVMI_EVENT_DESCRIPTOR:
-			logger << " rip " << HEXLOG( driver_.getNextRip() );
+			logger << " rip " << HEXLOG( driver_.getNextRip( msg.event.common.vcpu ) );
 			break;
 		default:
 			break;
@@ -275,17 +339,26 @@ void KvmEventManager::traceEventReply( const struct kvmi_dom_event &msg, const s
 
 void KvmEventManager::waitForEvents()
 {
-	while ( !disconnected_ ) {
-		HVAction  action = NONE;
-		Registers regs;
+	std::unique_ptr<VcpuDispatcher> dispatcher;
+	bool                            handled = false; // so another event is likely to follow
 
+	if ( workers_ )
+		dispatcher.reset( new VcpuDispatcher( workers_ ) );
+
+	while ( !disconnected_ && !replyFailed_ ) {
 		if ( sigStop_ )
 			stop();
 
-		kvmi_dom_event *           msg = nullptr;
-		CUniquePtr<kvmi_dom_event> eventPtr;
+		kvmi_dom_event *msg = nullptr;
+
+		if ( handled && busyPollUs_ )
+			spin( [&]() {
+				return driver_.getEventMsg( msg, KVMI_NOWAIT, disconnected_ ) || disconnected_;
+			} );
+
+		handled = false;
 
-		if ( !driver_.getEventMsg( msg, KVMI_WAIT, disconnected_ ) ) {
+		if ( !msg && ( disconnected_ || !driver_.getEventMsg( msg, KVMI_WAIT, disconnected_ ) ) ) {
 			if ( disconnected_ )
 				stop();
 			// The check is placed here to allow at least one event to be processed
@@ -295,230 +368,448 @@ void KvmEventManager::waitForEvents()
 			continue;
 		}
 
-		eventPtr.reset( msg );
+		handled = true;
 
-		EventHandler *h = handler();
+		if ( !dispatchEvent( msg, dispatcher.get() ) )
+			break;
 
-		if ( !h )
-			throw std::runtime_error( "We don't know how to handle the missing handler" );
+		// The check is placed here to allow at least one event to be processed
+		// when Introcore tries to unhook
+		if ( stop_ )
+			break;
+	}
 
-		StatsCounter counter( event_to_string( msg->event.common.event ) );
+	if ( dispatcher )
+		dispatcher->drain();
 
-		traceEventMessage( *msg );
+	completeDeferred();
+}
 
-		// VM event (+ no reply)
-		if ( msg->event.common.event == KVMI_EVENT_UNHOOK ) {
-			logger << DEBUG << "Unhook signal from QEMU" << std::flush;
-			driver_.suspending( true );
+std::vector<int> KvmEventManager::pollFds()
+{
+	return { driver_.connectionFd() };
+}
+
+size_t KvmEventManager::processPending( size_t budget )
+{
+	size_t events = 0;
+	bool   over   = false;
+
+	if ( finished_ )
+		return 0;
+
+	while ( !disconnected_ && !replyFailed_ && ( !budget || events < budget ) ) {
+		if ( sigStop_ )
 			stop();
+
+		kvmi_dom_event *msg = nullptr;
+
+		if ( !driver_.getEventMsg( msg, KVMI_NOWAIT, disconnected_ ) ) {
+			if ( disconnected_ )
+				stop();
 			break;
 		}
 
-		if ( h )
-			h->runPreEvent();
+		++events;
 
-		driver_.beginEvent( regs, msg->event.common );
+		// Same as waitForEvents(), one more event gets handled after stop()
+		if ( !dispatchEvent( msg, nullptr ) || stop_ ) {
+			over = true;
+			break;
+		}
+	}
 
-		struct KvmDriver::EventReply reply( msg );
+	if ( over || stop_ || disconnected_ || replyFailed_ ) {
+		completeDeferred();
+		finished_ = true;
+	}
 
-		switch ( msg->event.common.event ) {
-			case KVMI_EVENT_CR: {
-				StatsCounter counter( "eventsCr" );
-				h->handleCR( msg->event.common.vcpu, msg->event.cr.cr, regs, msg->event.cr.old_value,
-				             msg->event.cr.new_value, action );
+	return events;
+}
 
-				if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
-					reply.reply_.event_.cr.new_val = msg->event.cr.old_value;
-				else
-					reply.reply_.event_.cr.new_val = msg->event.cr.new_value;
+bool KvmEventManager::dispatchEvent( struct kvmi_dom_event *msg, VcpuDispatcher *dispatcher )
+{
+	CUniquePtr<kvmi_dom_event> eventPtr( msg );
 
-				break;
-			}
-			case KVMI_EVENT_MSR: {
-				StatsCounter counter( "eventsMsr" );
-				h->handleMSR( msg->event.common.vcpu, msg->event.msr.msr, msg->event.msr.old_value,
-				              msg->event.msr.new_value, action );
+	if ( !handler() )
+		throw std::runtime_error( "We don't know how to handle the missing handler" );
 
-				if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
-					reply.reply_.event_.msr.new_val = msg->event.msr.old_value;
-				else
-					reply.reply_.event_.msr.new_val = msg->event.msr.new_value;
+	// VM event (+ no reply)
+	if ( msg->event.common.event == KVMI_EVENT_UNHOOK ) {
+		// Let the vCPUs still being handled get their replies first
+		if ( dispatcher )
+			dispatcher->drain();
 
-				break;
-			}
-			case KVMI_EVENT_XSETBV: {
-				StatsCounter counter( "eventsXsetbv" );
-				h->handleXSETBV( msg->event.common.vcpu );
+		driver_.releaseParkedVcpus();
 
-				break;
-			}
-			case KVMI_EVENT_BREAKPOINT: {
-				bool handled;
+		StatsCounter counter( event_to_string( msg->event.common.event ) );
 
-				StatsCounter counter( "eventsBreakpoint" );
-				handled =
-				    h->handleBreakpoint( msg->event.common.vcpu, regs, msg->event.breakpoint.gpa );
+		traceEventMessage( *msg );
 
-				if ( handled )
-					// the breakpoint has been handled by the introspector
-					reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
+		logger << DEBUG << "Unhook signal from QEMU" << std::flush;
+		driver_.suspending( true );
+		stop();
+		return false;
+	}
 
-				break;
-			}
-			case KVMI_EVENT_HYPERCALL: {
-				StatsCounter counter( "eventsHypercall" );
-				h->handleVMCALL( msg->event.common.vcpu, regs );
+	// vCPUs held by pauseVcpus() stay in their pause events, no need to bother a worker or the handler
+	if ( msg->event.common.event == KVMI_EVENT_PAUSE_VCPU && driver_.parkPauseEvent( *msg ) ) {
+		StatsCounter counter( "eventsPauseVcpuParked" );
 
-				break;
-			}
-			case KVMI_EVENT_PF: {
-				bool            read, write, execute;
-				unsigned short  instructionSize = 0;
-				EmulatorContext emulatorCtx;
-
-				if ( msg->event.page_fault.gva == ~0ull )
-					msg->event.page_fault.gva = 0;
-
-				// Xen's page fault handler carries this comment:
-				//
-				// Treat all write violations also as read violations.
-				// The reason why this is required is the following warning:
-				// "An EPT violation that occurs during as a result of execution of a
-				// read-modify-write operation sets bit 1 (data write). Whether it also
-				// sets bit 0 (data read) is implementation-specific and, for a given
-				// implementation, may differ for different kinds of read-modify-write
-				// operations."
-				//  - Intel(R) 64 and IA-32 Architectures Software Developer's Manual
-				//    Volume 3C: System Programming Guide, Part 3
-				if ( msg->event.page_fault.access & KVMI_PAGE_ACCESS_W )
-					msg->event.page_fault.access |= KVMI_PAGE_ACCESS_R;
-
-				read    = !!( msg->event.page_fault.access & KVMI_PAGE_ACCESS_R );
-				write   = !!( msg->event.page_fault.access & KVMI_PAGE_ACCESS_W );
-				execute = !!( msg->event.page_fault.access & KVMI_PAGE_ACCESS_X );
-
-				{
-					StatsCounter counter( "eventsPf" );
-					h->handlePageFault( msg->event.common.vcpu, regs, msg->event.page_fault.gpa,
-					                    msg->event.page_fault.gva, read, write, execute, false,
-					                    action, emulatorCtx, instructionSize );
-				}
-
-				switch ( action ) {
-					case SKIP_INSTRUCTION:
-						driver_.skipInstruction( instructionSize );
-						reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
-						break;
-					case ALLOW_VIRTUAL:
-						reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
-						break;
-					case EMULATE_SET_CTXT:
-						memcpy( reply.reply_.event_.pf.ctx_data, emulatorCtx.data_,
-						        std::min( ( std::size_t )emulatorCtx.size_,
-						                  sizeof( reply.reply_.event_.pf.ctx_data ) ) );
-						reply.reply_.event_.pf.ctx_addr = emulatorCtx.address_;
-						reply.reply_.event_.pf.ctx_size = emulatorCtx.size_;
-						break;
-					default:
-						break;
-				}
-
-				reply.reply_.event_.pf.rep_complete = driver_.getRepOptimizations();
+		traceEventMessage( *msg );
 
-				break;
-			}
-			case KVMI_EVENT_TRAP: {
-				StatsCounter counter( "eventsTrap" );
-				h->handleInterrupt( msg->event.common.vcpu, regs, msg->event.trap.vector,
-				                    msg->event.trap.error_code, msg->event.trap.cr2 );
+		return true;
+	}
 
-				break;
-			}
-			case KVMI_EVENT_DESCRIPTOR: {
-				unsigned short instructionSize = 0;
-				unsigned int   flags           = 0;
-
-				switch ( msg->event.desc.descriptor ) {
-					case KVMI_DESC_IDTR:
-						flags |= BDVMI_DESC_ACCESS_IDTR;
-						break;
-					case KVMI_DESC_GDTR:
-						flags |= BDVMI_DESC_ACCESS_GDTR;
-						break;
-					case KVMI_DESC_LDTR:
-						flags |= BDVMI_DESC_ACCESS_LDTR;
-						break;
-					case KVMI_DESC_TR:
-						flags |= BDVMI_DESC_ACCESS_TR;
-						break;
-				}
-
-				flags |= ( msg->event.desc.write ? BDVMI_DESC_ACCESS_WRITE : BDVMI_DESC_ACCESS_READ );
-
-				{
-					StatsCounter counter( "eventsDtr" );
-					h->handleDescriptorAccess( msg->event.common.vcpu, regs, flags, instructionSize,
-					                           action );
-				}
-
-				switch ( action ) {
-					case SKIP_INSTRUCTION:
-						// fallthrough
-					case EMULATE_NOWRITE:
-						driver_.skipInstruction( instructionSize );
-						// fallthrough
-					case ALLOW_VIRTUAL:
-						reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
-						break;
-					default:
-						break;
-				}
+	if ( dispatcher && msg->event.common.event != KVMI_EVENT_CREATE_VCPU ) {
+		std::shared_ptr<kvmi_dom_event> event( eventPtr.release(), ::free );
+		uint64_t                        received = driver_.eventTrace().receivedTimestamp();
 
-				break;
+		dispatcher->dispatch( event->event.common.vcpu, [this, event, received]() {
+			if ( !handleEvent( event.get(), received ) )
+				replyFailed_ = true;
+		} );
+
+		return true;
+	}
+
+	// CREATE_VCPU resizes the per-vCPU state the workers use
+	if ( dispatcher )
+		dispatcher->drain();
+
+	return handleEvent( msg );
+}
+
+bool KvmEventManager::handleEvent( struct kvmi_dom_event *msg, uint64_t received )
+{
+	HVAction      action   = NONE;
+	EventContext &ctx      = eventContext( msg->event.common.vcpu );
+	Registers &   regs     = ctx.regs_; // beginEvent() fills in all of it
+	EventHandler *h        = handler();
+	uint64_t      deferred = 0;
+
+	StatsCounter      counter( event_to_string( msg->event.common.event ) );
+	EventTrace::Scope scope( driver_.eventTrace(), msg->event.common.vcpu, trace_type( msg->event.common.event ),
+	                         trace_arg( *msg ), received );
+
+	traceEventMessage( *msg );
+
+	HVAction filterAction = NONE;
+
+	if ( filterEvent( *msg, filterAction ) )
+		return replyFiltered( msg, filterAction );
+
+	EventTrace::handlerStart();
+
+	if ( h )
+		h->runPreEvent();
+
+	driver_.beginEvent( regs, msg->event.common );
+	driver_.retireTranslationWrites( msg->event.common.vcpu );
+
+	struct KvmDriver::EventReply reply( msg );
+
+	switch ( msg->event.common.event ) {
+		case KVMI_EVENT_CR: {
+			StatsCounter counter( "eventsCr" );
+
+			if ( msg->event.cr.cr == 3 )
+				driver_.flushTranslations( msg->event.cr.new_value );
+			else
+				driver_.flushTranslations();
+
+			h->handleCR( msg->event.common.vcpu, msg->event.cr.cr, regs, msg->event.cr.old_value,
+			             msg->event.cr.new_value, action );
+
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
+				reply.reply_.event_.cr.new_val = msg->event.cr.old_value;
+			else
+				reply.reply_.event_.cr.new_val = msg->event.cr.new_value;
+
+			break;
+		}
+		case KVMI_EVENT_MSR: {
+			StatsCounter counter( "eventsMsr" );
+			h->handleMSR( msg->event.common.vcpu, msg->event.msr.msr, msg->event.msr.old_value,
+			              msg->event.msr.new_value, action );
+
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
+				reply.reply_.event_.msr.new_val = msg->event.msr.old_value;
+			else
+				reply.reply_.event_.msr.new_val = msg->event.msr.new_value;
+
+			break;
+		}
+		case KVMI_EVENT_XSETBV: {
+			StatsCounter counter( "eventsXsetbv" );
+			h->handleXSETBV( msg->event.common.vcpu );
+
+			break;
+		}
+		case KVMI_EVENT_BREAKPOINT: {
+			bool handled;
+
+			StatsCounter counter( "eventsBreakpoint" );
+			handled =
+			    h->handleBreakpoint( msg->event.common.vcpu, regs, msg->event.breakpoint.gpa );
+
+			if ( handled )
+				// the breakpoint has been handled by the introspector
+				reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
+
+			break;
+		}
+		case KVMI_EVENT_HYPERCALL: {
+			StatsCounter counter( "eventsHypercall" );
+			h->handleVMCALL( msg->event.common.vcpu, regs );
+
+			break;
+		}
+		case KVMI_EVENT_PF: {
+			bool             read, write, execute;
+			unsigned short   instructionSize = 0;
+			EmulatorContext &emulatorCtx     = ctx.emulatorCtx_;
+
+			emulatorCtx.reset();
+
+			if ( msg->event.page_fault.gva == ~0ull )
+				msg->event.page_fault.gva = 0;
+
+			// Xen's page fault handler carries this comment:
+			//
+			// Treat all write violations also as read violations.
+			// The reason why this is required is the following warning:
+			// "An EPT violation that occurs during as a result of execution of a
+			// read-modify-write operation sets bit 1 (data write). Whether it also
+			// sets bit 0 (data read) is implementation-specific and, for a given
+			// implementation, may differ for different kinds of read-modify-write
+			// operations."
+			//  - Intel(R) 64 and IA-32 Architectures Software Developer's Manual
+			//    Volume 3C: System Programming Guide, Part 3
+			if ( msg->event.page_fault.access & KVMI_PAGE_ACCESS_W )
+				msg->event.page_fault.access |= KVMI_PAGE_ACCESS_R;
+
+			read    = !!( msg->event.page_fault.access & KVMI_PAGE_ACCESS_R );
+			write   = !!( msg->event.page_fault.access & KVMI_PAGE_ACCESS_W );
+			execute = !!( msg->event.page_fault.access & KVMI_PAGE_ACCESS_X );
+
+			if ( write )
+				driver_.invalidateTranslations( msg->event.common.vcpu,
+				                                gpa_to_gfn( msg->event.page_fault.gpa ) );
+
+			{
+				StatsCounter counter( "eventsPf" );
+
+				beginDeferrable();
+
+				h->handlePageFault( msg->event.common.vcpu, regs, msg->event.page_fault.gpa,
+				                    msg->event.page_fault.gva, read, write, execute, false,
+				                    action, emulatorCtx, instructionSize );
+
+				deferred = endDeferrable();
 			}
-			case KVMI_EVENT_CREATE_VCPU: {
-				StatsCounter counter( "eventsCreateVcpu" );
-				driver_.updateVcpuCount();
-				driver_.waitForUnpause();
-				break;
+
+			if ( !deferred )
+				applyPageFaultAction( reply, action, instructionSize, emulatorCtx );
+
+			break;
+		}
+		case KVMI_EVENT_TRAP: {
+			StatsCounter counter( "eventsTrap" );
+			h->handleInterrupt( msg->event.common.vcpu, regs, msg->event.trap.vector,
+			                    msg->event.trap.error_code, msg->event.trap.cr2 );
+
+			break;
+		}
+		case KVMI_EVENT_DESCRIPTOR: {
+			unsigned short instructionSize = 0;
+			unsigned int   flags           = 0;
+
+			switch ( msg->event.desc.descriptor ) {
+				case KVMI_DESC_IDTR:
+					flags |= BDVMI_DESC_ACCESS_IDTR;
+					break;
+				case KVMI_DESC_GDTR:
+					flags |= BDVMI_DESC_ACCESS_GDTR;
+					break;
+				case KVMI_DESC_LDTR:
+					flags |= BDVMI_DESC_ACCESS_LDTR;
+					break;
+				case KVMI_DESC_TR:
+					flags |= BDVMI_DESC_ACCESS_TR;
+					break;
 			}
-			case KVMI_EVENT_PAUSE_VCPU: {
-				StatsCounter counter( "eventsPauseVcpu" );
-				driver_.pauseEventReceived();
-				driver_.waitForUnpause();
-				break;
+
+			flags |= ( msg->event.desc.write ? BDVMI_DESC_ACCESS_WRITE : BDVMI_DESC_ACCESS_READ );
+
+			{
+				StatsCounter counter( "eventsDtr" );
+				h->handleDescriptorAccess( msg->event.common.vcpu, regs, flags, instructionSize,
+				                           action );
 			}
-			case KVMI_EVENT_SINGLESTEP: {
-				StatsCounter counter( "eventsSinglestep" );
-				break;
+
+			switch ( action ) {
+				case SKIP_INSTRUCTION:
+					// fallthrough
+				case EMULATE_NOWRITE:
+					driver_.skipInstruction( msg->event.common.vcpu, instructionSize );
+					// fallthrough
+				case ALLOW_VIRTUAL:
+					reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
+					break;
+				default:
+					break;
 			}
-			default:
-				logger << ERROR << "Unsupported event: 0x" << std::setfill( '0' ) << std::setw( 8 )
-				       << std::hex << msg->event.common.event << std::flush;
-				break;
+
+			break;
+		}
+		case KVMI_EVENT_CREATE_VCPU: {
+			StatsCounter counter( "eventsCreateVcpu" );
+			driver_.updateVcpuCount();
+			reserveVcpuContexts();
+			driver_.waitForUnpause();
+			break;
+		}
+		case KVMI_EVENT_PAUSE_VCPU: {
+			StatsCounter counter( "eventsPauseVcpu" );
+			driver_.pauseEventReceived();
+			driver_.waitForUnpause();
+			break;
 		}
+		case KVMI_EVENT_SINGLESTEP: {
+			StatsCounter counter( "eventsSinglestep" );
+			break;
+		}
+		default:
+			logger << ERROR << "Unsupported event: 0x" << std::setfill( '0' ) << std::setw( 8 )
+			       << std::hex << msg->event.common.event << std::flush;
+			break;
+	}
 
-		// move this to batch
-		driver_.flushCtrlEvents( msg->event.common.vcpu, enabledCrs_, enabledMsrs_ );
+	// Only queued, the commands go out with the reply
+	driver_.flushCtrlEvents( msg->event.common.vcpu, enabledCrs_, enabledMsrs_ );
 
+	if ( deferred ) {
+		scope.flags( EventTrace::FLAG_DEFERRED );
+
+		// msg is gone by the time the reply is sent, so deferred replies aren't traced
+		deferReply( deferred, [this, reply]( const Completion &completion ) mutable {
+			applyPageFaultAction( reply, completion.action_, completion.instructionSize_,
+			                      completion.emulatorCtx_ );
+
+			if ( driver_.replyEvent( reply ) )
+				return true;
+
+			replyFailed_ = true;
+			return false;
+		} );
+	} else {
 		if ( !driver_.replyEvent( reply ) )
-			break;
+			return false;
 
+		scope.replied();
 		traceEventReply( *msg, reply );
+	}
 
-		if ( h )
-			h->runPostEvent();
+	if ( h )
+		h->runPostEvent();
 
-		// The check is placed here to allow at least one event to be processed
-		// when Introcore tries to unhook
-		if ( stop_ )
+	EventTrace::handlerEnd();
+
+	return true;
+}
+
+void KvmEventManager::applyPageFaultAction( struct KvmDriver::EventReply &reply, HVAction action,
+                                            unsigned short instructionSize, const EmulatorContext &emulatorCtx )
+{
+	switch ( action ) {
+		case SKIP_INSTRUCTION:
+			driver_.skipInstruction( reply.reply_.vcpu_.vcpu, instructionSize );
+			reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
+			break;
+		case ALLOW_VIRTUAL:
+			reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
+			break;
+		case EMULATE_SET_CTXT:
+			memcpy( reply.reply_.event_.pf.ctx_data, emulatorCtx.data_,
+			        std::min( ( std::size_t )emulatorCtx.size_, sizeof( reply.reply_.event_.pf.ctx_data ) ) );
+			reply.reply_.event_.pf.ctx_addr = emulatorCtx.address_;
+			reply.reply_.event_.pf.ctx_size = emulatorCtx.size_;
+			break;
+		default:
+			break;
+	}
+
+	reply.reply_.event_.pf.rep_complete = driver_.getRepOptimizations();
+}
+
+bool KvmEventManager::filterEvent( const struct kvmi_dom_event &msg, HVAction &action ) const
+{
+	switch ( msg.event.common.event ) {
+		case KVMI_EVENT_CR:
+			return filterCr( msg.event.cr.cr, msg.event.cr.old_value, msg.event.cr.new_value, action );
+		case KVMI_EVENT_MSR:
+			return filterMsr( msg.event.msr.msr, msg.event.msr.old_value, msg.event.msr.new_value, action );
+		case KVMI_EVENT_PF: {
+			// Writes are also reads, see handleEvent()
+			bool write   = !!( msg.event.page_fault.access & KVMI_PAGE_ACCESS_W );
+			bool read    = write || ( msg.event.page_fault.access & KVMI_PAGE_ACCESS_R );
+			bool execute = !!( msg.event.page_fault.access & KVMI_PAGE_ACCESS_X );
+
+			return filterPageFault( gpa_to_gfn( msg.event.page_fault.gpa ), read, write, execute, action );
+		}
+		default:
+			return false;
+	}
+}
+
+bool KvmEventManager::replyFiltered( struct kvmi_dom_event *msg, HVAction action )
+{
+	StatsCounter counter( "eventsFiltered" );
+
+	unsigned short               vcpu = msg->event.common.vcpu;
+	bool                         deny = ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE );
+	struct KvmDriver::EventReply reply( msg );
+
+	// The handler doesn't get to see these, but the translation cache still has to
+	driver_.retireTranslationWrites( vcpu );
+
+	switch ( msg->event.common.event ) {
+		case KVMI_EVENT_CR:
+			if ( msg->event.cr.cr == 3 )
+				driver_.flushTranslations( msg->event.cr.new_value );
+			else
+				driver_.flushTranslations();
+
+			reply.reply_.event_.cr.new_val = deny ? msg->event.cr.old_value : msg->event.cr.new_value;
+			break;
+		case KVMI_EVENT_MSR:
+			reply.reply_.event_.msr.new_val = deny ? msg->event.msr.old_value : msg->event.msr.new_value;
+			break;
+		case KVMI_EVENT_PF:
+			if ( msg->event.page_fault.access & KVMI_PAGE_ACCESS_W )
+				driver_.invalidateTranslations( vcpu, gpa_to_gfn( msg->event.page_fault.gpa ) );
+
+			if ( action == ALLOW_VIRTUAL )
+				reply.reply_.common_.action = KVMI_EVENT_ACTION_RETRY;
+
+			reply.reply_.event_.pf.rep_complete = driver_.getRepOptimizations();
+			break;
+		default:
 			break;
 	}
+
+	if ( !driver_.replyEvent( reply ) )
+		return false;
+
+	traceEventReply( *msg, reply );
+
+	return true;
 }
 
 void KvmEventManager::stop()
 {
-	if ( stop_ )
+	if ( stop_.exchange( true ) ) // maybe from an event worker
 		return;
 
 	EventHandler *h = handler();
@@ -531,8 +822,6 @@ void KvmEventManager::stop()
 
 		h->handleSessionOver( alive ? RUNNING : POST_SHUTDOWN );
 	}
-
-	stop_ = true;
 }
 
 std::string KvmEventManager::uuid()
@@ -547,6 +836,8 @@ void KvmEventManager::flushEventQueue()
 
 	driver_.registerVMEvent( KVMI_EVENT_CREATE_VCPU, false );
 
+	driver_.releaseParkedVcpus();
+
 	driver_.clearVcpuEvents();
 
 	logger << DEBUG << "Events to wait for " << driver_.pendingPauseEvents() << std::flush;
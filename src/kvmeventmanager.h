@@ -16,14 +16,17 @@
 #ifndef __BDVMIKVMEVENTMANAGER_H_INCLUDED__
 #define __BDVMIKVMEVENTMANAGER_H_INCLUDED__
 
+#include <atomic>
 #include <string>
 #include <fstream>
 #include <bitset>
+#include <vector>
 #include "bdvmi/eventmanager.h"
 
 namespace bdvmi {
 
 class KvmDriver;
+class VcpuDispatcher;
 
 class KvmEventManager : public EventManager {
 public:
@@ -36,6 +39,11 @@ public:
 
 	void stop() override;
 
+	// The introspection socket
+	std::vector<int> pollFds() override;
+
+	size_t processPending( size_t budget ) override;
+
 	std::string uuid() override;
 
 private:
@@ -74,14 +82,34 @@ private:
 
 	bool initVcpuEvents();
 
+	// An EventContext for every vCPU the driver knows about
+	void reserveVcpuContexts();
+
+	// Everything from the event message to the reply; false if replying failed. received: when msg
+	// was read, for the event trace (0: now)
+	bool handleEvent( struct kvmi_dom_event *msg, uint64_t received = 0 );
+
+	// Takes ownership of msg, handles it right away or hands it to dispatcher (if not null).
+	// false if the event loop is over.
+	bool dispatchEvent( struct kvmi_dom_event *msg, VcpuDispatcher *dispatcher );
+
+	bool filterEvent( const struct kvmi_dom_event &msg, HVAction &action ) const;
+
+	// Reply to an event a filter has matched, without involving the EventHandler
+	bool replyFiltered( struct kvmi_dom_event *msg, HVAction action );
+
+	void applyPageFaultAction( struct KvmDriver::EventReply &reply, HVAction action, unsigned short instructionSize,
+	                           const EmulatorContext &emulatorCtx );
+
 	void traceEventMessage( const struct kvmi_dom_event &msg );
 
 	void traceEventReply( const struct kvmi_dom_event &msg, const struct KvmDriver::EventReply &rpl );
 
 private:
-	KvmDriver &driver_;
-	bool       stop_{ false };
-	bool       disconnected_{ false };
+	KvmDriver &       driver_;
+	std::atomic<bool> stop_{ false };
+	bool              disconnected_{ false };
+	std::atomic<bool> replyFailed_{ false }; // by an event worker
 };
 } // namespace bdvmi
 
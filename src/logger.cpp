@@ -14,6 +14,10 @@
 // License along with this library.
 
 #include <bdvmi/logger.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <thread>
 
 namespace {
 
@@ -30,8 +34,122 @@ std::ostream &setLevel( std::ostream &os, bdvmi::LogStreambuf::LogLevel level )
 
 namespace bdvmi {
 
-thread_local std::unordered_map<long, LogStreambuf::Buffer> LogStreambuf::buffers_;
-std::atomic_long                                            LogStreambuf::indexGenerator_{ 0 };
+// Bounded MPSC queue (Vyukov's): a record's sequence_ tells whose turn it is. It's free for the
+// producer that reserves position p when sequence_ == p, and ready for the consumer when
+// sequence_ == p + 1. Only the background thread consumes.
+struct LogStreambuf::AsyncQueue {
+	struct Record {
+		std::atomic<size_t> sequence_{ 0 };
+		LogLevel            level_{ DEBUG };
+		std::string         line_;
+	};
+
+	explicit AsyncQueue( size_t capacity );
+
+	// false if the queue is full
+	bool push( LogLevel level, const std::string &prefix, const std::string &contents );
+
+	Record *front()
+	{
+		Record &r = records_[dequeuePos_ & mask_];
+
+		return r.sequence_.load( std::memory_order_acquire ) == dequeuePos_ + 1 ? &r : nullptr;
+	}
+
+	void pop( Record &r )
+	{
+		r.sequence_.store( dequeuePos_ + mask_ + 1, std::memory_order_release );
+		++dequeuePos_;
+	}
+
+	// If the background thread misses this (it's just about to wait), it'll still wake up on its
+	// own soon enough
+	void wake()
+	{
+		if ( waiting_ ) {
+			std::lock_guard<std::mutex> lock( mutex_ );
+			wake_.notify_one();
+		}
+	}
+
+	size_t                          mask_;
+	std::unique_ptr<Record[]>       records_;
+	std::atomic<size_t>             enqueuePos_{ 0 };
+	size_t                          dequeuePos_{ 0 }; // background thread only (or async( false ), once it's gone)
+	std::atomic<size_t>             delivered_{ 0 };
+	std::atomic<unsigned long long> dropped_{ 0 };
+	unsigned long long              reportedDrops_{ 0 };
+	std::atomic<AsyncOverflow>      overflow_{ ASYNC_DROP };
+	std::atomic<unsigned int>       producers_{ 0 }; // sync() calls between the asyncOn_ check and the push
+	std::atomic_bool                running_{ false };
+	std::atomic_bool                waiting_{ false };
+	bool                            stop_{ false };
+	std::mutex                      mutex_;
+	std::condition_variable         wake_;
+	std::condition_variable         drained_;
+	std::thread                     thread_;
+};
+
+LogStreambuf::AsyncQueue::AsyncQueue( size_t capacity )
+{
+	size_t size = 2;
+
+	while ( size < capacity )
+		size <<= 1;
+
+	mask_    = size - 1;
+	records_.reset( new Record[size] );
+
+	for ( size_t i = 0; i < size; ++i ) {
+		records_[i].sequence_.store( i, std::memory_order_relaxed );
+		records_[i].line_.reserve( ASYNC_LINE_RESERVE );
+	}
+}
+
+bool LogStreambuf::AsyncQueue::push( LogLevel level, const std::string &prefix, const std::string &contents )
+{
+	size_t  pos = enqueuePos_.load( std::memory_order_relaxed );
+	Record *r;
+
+	for ( ;; ) {
+		r = &records_[pos & mask_];
+
+		size_t    seq  = r->sequence_.load( std::memory_order_acquire );
+		ptrdiff_t diff = static_cast<ptrdiff_t>( seq - pos );
+
+		if ( diff == 0 ) {
+			if ( enqueuePos_.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+				break;
+		} else if ( diff < 0 )
+			return false;
+		else
+			pos = enqueuePos_.load( std::memory_order_relaxed );
+	}
+
+	// No allocations as long as the line fits what's been reserved (or a previous, longer line)
+	r->level_ = level;
+	r->line_.assign( prefix );
+	r->line_.append( contents );
+	r->sequence_.store( pos + 1, std::memory_order_release );
+
+	return true;
+}
+
+thread_local LogStreambuf::Buffers  LogStreambuf::buffers_;
+thread_local bool                   LogStreambuf::buffersGone_  = false;
+thread_local long                   LogStreambuf::cachedIndex_  = 0;
+thread_local LogStreambuf::Buffer * LogStreambuf::cachedBuffer_ = nullptr;
+std::atomic_long                    LogStreambuf::indexGenerator_{ 0 };
+thread_local bool                   LogStreambuf::inAsyncThread_ = false;
+constexpr size_t                    LogStreambuf::ASYNC_CAPACITY_DEFAULT;
+constexpr size_t                    LogStreambuf::ASYNC_LINE_RESERVE;
+
+LogStreambuf::Buffers::~Buffers()
+{
+	buffersGone_  = true;
+	cachedIndex_  = 0;
+	cachedBuffer_ = nullptr;
+}
 
 LogStreambuf::LogStreambuf()
 {
@@ -42,6 +160,9 @@ LogStreambuf::~LogStreambuf()
 {
 	sync();
 
+	async( false, 0, ASYNC_DROP );
+	delete queue_;
+
 	// You'd think we'd buffers_.erase( index_ ) here, but a logger is often a global
 	// object, and there are legitimate cases where that means that buffers_ is destroyed
 	// _before_ it (especially with all the thread_local magic).
@@ -50,65 +171,260 @@ LogStreambuf::~LogStreambuf()
 	// application be interested in?
 }
 
+LogStreambuf::Buffer *LogStreambuf::lookupBuffer()
+{
+	if ( buffersGone_ )
+		return nullptr;
+
+	// Elements of an unordered_map stay put when it rehashes
+	cachedBuffer_ = &buffers_.map_[index_];
+	cachedIndex_  = index_;
+
+	return cachedBuffer_;
+}
+
+void LogStreambuf::updateEnabledLevels()
+{
+	unsigned int levels = 0;
+
+	if ( debug_ )
+		levels |= 1U << DEBUG;
+	if ( debug_ && trace_ )
+		levels |= 1U << TRACE;
+	if ( error_ )
+		levels |= 1U << ERROR;
+	if ( info_ )
+		levels |= 1U << INFO;
+	if ( warning_ )
+		levels |= 1U << WARNING;
+
+	enabledLevels_ = levels;
+}
+
 void LogStreambuf::level( LogLevel level )
 {
 	sync();
-	buffers_[index_].level_ = level;
+
+	Buffer *b = buffer();
+
+	if ( b )
+		b->level_ = level;
 }
 
 LogStreambuf::int_type LogStreambuf::overflow( int_type c )
 {
-	if ( c != EOF )
-		buffers_[index_].contents_ += static_cast<char>( c );
+	Buffer *b = buffer();
+
+	// Lines that nobody is going to see aren't even buffered
+	if ( c != EOF && b && enabled( b->level_ ) )
+		b->contents_ += static_cast<char>( c );
 
 	return c;
 }
 
 std::streamsize LogStreambuf::xsputn( const char_type *s, std::streamsize n )
 {
-	buffers_[index_].contents_.append( s, n );
+	Buffer *b = buffer();
+
+	if ( b && enabled( b->level_ ) )
+		b->contents_.append( s, n );
 
 	return n;
 }
 
 LogStreambuf::int_type LogStreambuf::sync()
 {
-	if ( buffers_[index_].contents_.empty() )
+	Buffer *b = buffer();
+
+	if ( !b || b->contents_.empty() )
 		return 0;
 
-	auto &buffer = buffers_[index_];
+	auto &buffer = *b;
+
+	// The background thread's own lines (logged by a sink, say) can't wait for it
+	if ( asyncOn_.load( std::memory_order_acquire ) && !inAsyncThread_ ) {
+		AsyncQueue &q = *queue_; // never deleted while asyncOn_ is set
+
+		// async( false ) waits for producers_ to drop to 0 before it stops the thread, so once
+		// asyncOn_ is still set after this, the line can't get stranded in the queue
+		++q.producers_;
+
+		bool queued = asyncOn_ && pushAsync( buffer );
+
+		--q.producers_;
+
+		if ( queued ) {
+			buffer.contents_.clear();
+			return 0;
+		}
+	}
 
 	if ( !prefix_.empty() )
 		buffer.contents_ = prefix_ + buffer.contents_;
 
-	switch ( buffer.level_ ) {
+	bool known = deliver( buffer.level_, buffer.contents_ );
+
+	buffer.contents_.clear();
+	return known ? 0 : -1;
+}
+
+bool LogStreambuf::pushAsync( const Buffer &buffer )
+{
+	if ( !enabled( buffer.level_ ) )
+		return true;
+
+	while ( !queue_->push( buffer.level_, prefix_, buffer.contents_ ) ) {
+		if ( queue_->overflow_.load( std::memory_order_relaxed ) == ASYNC_DROP ) {
+			++queue_->dropped_;
+			return true;
+		}
+
+		// Nobody is left to make room
+		if ( !queue_->running_ )
+			return false;
+
+		queue_->wake();
+		std::this_thread::yield();
+	}
+
+	queue_->wake();
+	return true;
+}
+
+bool LogStreambuf::deliver( LogLevel level, const std::string &line ) const
+{
+	switch ( level ) {
 		case DEBUG:
 			if ( debug_ )
-				debug_( buffer.contents_ );
+				debug_( line );
 			break;
 		case TRACE: // TRACE is a special case of DEBUG
 			if ( debug_ && trace_ )
-				debug_( buffer.contents_ );
+				debug_( line );
 			break;
 		case ERROR:
 			if ( error_ )
-				error_( buffer.contents_ );
+				error_( line );
 			break;
 		case INFO:
 			if ( info_ )
-				info_( buffer.contents_ );
+				info_( line );
 			break;
 		case WARNING:
 			if ( warning_ )
-				warning_( buffer.contents_ );
+				warning_( line );
 			break;
 		default:
-			buffer.contents_.clear();
-			return -1;
+			return false;
 	}
 
-	buffer.contents_.clear();
-	return 0;
+	return true;
+}
+
+void LogStreambuf::async( bool value, size_t capacity, AsyncOverflow overflow )
+{
+	std::lock_guard<std::mutex> lock( asyncMutex_ );
+
+	if ( value ) {
+		if ( !queue_ )
+			queue_ = new AsyncQueue( capacity );
+
+		queue_->overflow_ = overflow;
+
+		if ( !queue_->thread_.joinable() ) {
+			queue_->stop_    = false;
+			queue_->running_ = true;
+			queue_->thread_  = std::thread( &LogStreambuf::runAsync, this );
+		}
+
+		asyncOn_ = true;
+		return;
+	}
+
+	asyncOn_ = false;
+
+	if ( !queue_ )
+		return;
+
+	// Let the lines that made it past the asyncOn_ check in sync() be queued first
+	while ( queue_->producers_ )
+		std::this_thread::yield();
+
+	if ( queue_->thread_.joinable() ) {
+		{
+			std::lock_guard<std::mutex> queueLock( queue_->mutex_ );
+			queue_->stop_ = true;
+			queue_->wake_.notify_one();
+		}
+
+		// The thread delivers everything that's been queued before it exits
+		queue_->thread_.join();
+	}
+
+	// Nothing should be left by now, but a line in the queue would otherwise wait for the next async( true )
+	while ( AsyncQueue::Record *r = queue_->front() ) {
+		deliver( r->level_, r->line_ );
+		queue_->pop( *r );
+	}
+
+	queue_->delivered_ = queue_->dequeuePos_;
+}
+
+void LogStreambuf::drain()
+{
+	if ( !asyncOn_ || inAsyncThread_ )
+		return;
+
+	size_t target = queue_->enqueuePos_.load();
+
+	std::unique_lock<std::mutex> lock( queue_->mutex_ );
+
+	queue_->wake_.notify_one();
+	queue_->drained_.wait( lock, [&]() { return queue_->delivered_ >= target || !asyncOn_; } );
+}
+
+unsigned long long LogStreambuf::dropped() const
+{
+	return queue_ ? queue_->dropped_.load() : 0;
+}
+
+void LogStreambuf::runAsync()
+{
+	inAsyncThread_ = true;
+
+	AsyncQueue &q = *queue_;
+
+	for ( ;; ) {
+		while ( AsyncQueue::Record *r = q.front() ) {
+			deliver( r->level_, r->line_ );
+			q.pop( *r );
+		}
+
+		q.delivered_ = q.dequeuePos_;
+
+		unsigned long long dropped = q.dropped_;
+
+		if ( dropped != q.reportedDrops_ ) {
+			std::string lost = std::to_string( dropped - q.reportedDrops_ );
+
+			deliver( WARNING, prefix_ + "The log queue was full, " + lost + " lines have been dropped" );
+			q.reportedDrops_ = dropped;
+		}
+
+		std::unique_lock<std::mutex> lock( q.mutex_ );
+
+		q.drained_.notify_all();
+
+		// A line may still be getting written to, stopping waits for that too
+		if ( q.stop_ && q.enqueuePos_ == q.dequeuePos_ ) {
+			q.running_ = false;
+			return;
+		}
+
+		q.waiting_ = true;
+		q.wake_.wait_for( lock, std::chrono::milliseconds( 100 ), [&]() { return q.stop_ || q.front(); } );
+		q.waiting_ = false;
+	}
 }
 
 // Singleton, but not enforced (there's no harm in several instances)
@@ -0,0 +1,50 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "mockdomainwatcher.h"
+#include <chrono>
+#include <thread>
+
+namespace bdvmi {
+
+MockDomainWatcher::MockDomainWatcher( sig_atomic_t &sigStop, const std::vector<std::string> &domains )
+    : DomainWatcher{ sigStop }
+    , domains_{ domains }
+{
+}
+
+bool MockDomainWatcher::ownUuid( std::string &uuid ) const
+{
+	uuid = "00000000-0000-0000-0000-000000000000";
+	return true;
+}
+
+bool MockDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains, int ms )
+{
+	if ( !reported_ ) {
+		reported_ = true;
+
+		for ( auto &&uuid : domains_ )
+			domains.emplace_back( uuid, DomainInfo::STATE_NEW, "mock" );
+
+		return !domains.empty();
+	}
+
+	std::this_thread::sleep_for( std::chrono::milliseconds( ms ) );
+
+	return false;
+}
+
+} // namespace bdvmi
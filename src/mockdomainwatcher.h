@@ -0,0 +1,49 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMOCKDOMAINWATCHER_H_INCLUDED__
+#define __BDVMIMOCKDOMAINWATCHER_H_INCLUDED__
+
+#include "bdvmi/domainwatcher.h"
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+
+// Reports MockConfig::domains_ as new the first time it's asked, and nothing after that
+class MockDomainWatcher : public DomainWatcher {
+
+public:
+	MockDomainWatcher( sig_atomic_t &sigStop, const std::vector<std::string> &domains );
+
+public:
+	bool accessGranted() override
+	{
+		return true;
+	}
+
+	bool ownUuid( std::string &uuid ) const override;
+
+protected:
+	bool waitForDomainsOrTimeout( std::list<DomainInfo> &domains, int ms ) override;
+
+private:
+	std::vector<std::string> domains_;
+	bool                     reported_{ false };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMOCKDOMAINWATCHER_H_INCLUDED__
@@ -0,0 +1,601 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "mockdriver.h"
+#include "bdvmi/logger.h"
+#include "pagehash.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+
+namespace bdvmi {
+
+MockDriver::MockDriver( const std::string &uuid, const MockConfig &config )
+    : uuid_{ uuid }
+    , config_{ config }
+    , pageCount_{ config.memorySize_ / PAGE_SIZE }
+    , pageCache_{ this }
+{
+	if ( !pageCount_ || !config_.vcpus_ )
+		throw std::runtime_error( "A mock guest needs some memory and at least one vCPU" );
+
+	void *memory = mmap( nullptr, pageCount_ * PAGE_SIZE, PROT_READ | PROT_WRITE,
+	                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+
+	if ( memory == MAP_FAILED )
+		throw std::runtime_error( std::string( "Could not allocate the mock guest's memory: " ) +
+		                          strerror( errno ) );
+
+	memory_ = static_cast<char *>( memory );
+
+	registers_.resize( config_.vcpus_ );
+	views_[0];
+
+	logger << INFO << "Mock guest " << uuid_ << ": " << pageCount_ << " pages, " << config_.vcpus_ << " vCPUs"
+	       << std::flush;
+}
+
+MockDriver::~MockDriver()
+{
+	pageCache_.reset();
+	pageCache_.driver( nullptr );
+
+	munmap( memory_, pageCount_ * PAGE_SIZE );
+}
+
+void MockDriver::simulateLatency( unsigned long long ns )
+{
+	if ( !ns )
+		return;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds( ns );
+
+	while ( std::chrono::steady_clock::now() < deadline )
+		__builtin_ia32_pause();
+}
+
+void MockDriver::loadRegisters( unsigned short vcpu, const Registers &regs )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( vcpu < registers_.size() )
+		registers_[vcpu] = regs;
+}
+
+char *MockDriver::page( unsigned long long gfn ) const
+{
+	return gfn < pageCount_ ? memory_ + gfn * PAGE_SIZE : nullptr;
+}
+
+bool MockDriver::cpuCount( unsigned int &count ) const
+{
+	count = config_.vcpus_;
+	return true;
+}
+
+bool MockDriver::tscSpeed( unsigned long long &speed ) const
+{
+	speed = 2000000000ULL; // 2 GHz, as good as any
+	return true;
+}
+
+bool MockDriver::mtrrType( unsigned long long /* guestAddress */, uint8_t &type ) const
+{
+	type = 0x06; // write-back
+	return true;
+}
+
+bool MockDriver::registers( unsigned short vcpu, Registers &regs ) const
+{
+	simulateLatency( config_.registersLatency_ );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( vcpu >= registers_.size() )
+		return false;
+
+	regs = registers_[vcpu];
+	return true;
+}
+
+bool MockDriver::cachedRegisters( unsigned short vcpu, const Registers *&regs ) const
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( vcpu >= registers_.size() )
+		return false;
+
+	regs = &registers_[vcpu];
+	return true;
+}
+
+bool MockDriver::readMsr( unsigned short vcpu, uint32_t msr, uint64_t &value ) const
+{
+	Registers regs;
+
+	return registers( vcpu, regs ) && regs.msr( msr, value );
+}
+
+bool MockDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool setEip, bool /* delay */ )
+{
+	simulateLatency( config_.registersLatency_ );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( vcpu >= registers_.size() )
+		return false;
+
+	Registers &current = registers_[vcpu];
+	uint64_t   rip     = current.rip;
+
+	current.assignGroups( regs, Registers::GROUP_WRITABLE );
+
+	if ( !setEip )
+		current.rip = rip;
+
+	return true;
+}
+
+MapReturnCode MockDriver::mapPhysMemToHost( unsigned long long address, size_t length, uint32_t flags,
+                                            void *&pointer )
+{
+	pointer = nullptr;
+
+	if ( ( address & PAGE_MASK ) != ( ( address + length - 1 ) & PAGE_MASK ) )
+		return MAP_INVALID_PARAMETER;
+
+	unsigned long gfn    = gpa_to_gfn( address );
+	void *        mapped = nullptr;
+
+	if ( flags & PHYSMAP_NO_CACHE )
+		mapped = mapGuestPageImpl( gfn );
+	else {
+		MapReturnCode mrc = pageCache_.update( gfn, mapped );
+
+		if ( mrc != MAP_SUCCESS )
+			return mrc;
+	}
+
+	if ( !mapped )
+		return MAP_PAGE_NOT_PRESENT;
+
+	recordPage( gfn, mapped );
+
+	pointer = static_cast<char *>( mapped ) + ( address & ~PAGE_MASK );
+
+	return MAP_SUCCESS;
+}
+
+bool MockDriver::unmapPhysMem( void *hostPtr )
+{
+	void *map = reinterpret_cast<void *>( reinterpret_cast<uintptr_t>( hostPtr ) & PAGE_MASK );
+
+	if ( !pageCache_.release( map ) )
+		unmapGuestPageImpl( map, ~0ull );
+
+	return true;
+}
+
+MapReturnCode MockDriver::mapGfns( const unsigned long long *gfns, size_t count, uint32_t flags, void *&pointer )
+{
+	pointer = nullptr;
+
+	if ( !gfns || !count )
+		return MAP_INVALID_PARAMETER;
+
+	if ( count == 1 )
+		return mapPhysMemToHost( gfn_to_gpa( gfns[0] ), PAGE_SIZE, flags, pointer );
+
+	void *mapped = nullptr;
+
+	if ( flags & PHYSMAP_NO_CACHE )
+		mapped = mapGuestPagesImpl( gfns, count );
+	else {
+		MapReturnCode mrc = pageCache_.updateRange( gfns, count, mapped );
+
+		if ( mrc != MAP_SUCCESS )
+			return mrc;
+	}
+
+	if ( !mapped )
+		return MAP_PAGE_NOT_PRESENT;
+
+	for ( size_t i = 0; i < count; ++i )
+		recordPage( gfns[i], static_cast<char *>( mapped ) + i * PAGE_SIZE );
+
+	pointer = mapped;
+
+	return MAP_SUCCESS;
+}
+
+bool MockDriver::unmapGfns( void *hostPtr, size_t count )
+{
+	if ( count == 1 )
+		return unmapPhysMem( hostPtr );
+
+	if ( !pageCache_.releaseRange( hostPtr ) )
+		unmapGuestPagesImpl( hostPtr, count );
+
+	return true;
+}
+
+bool MockDriver::injectTrap( unsigned short /* vcpu */, uint8_t /* trapNumber */, uint32_t /* errorCode */,
+                             uint64_t /* cr2 */ )
+{
+	return true;
+}
+
+bool MockDriver::setRepOptimizations( bool /* enable */ )
+{
+	return true;
+}
+
+bool MockDriver::shutdown()
+{
+	return true;
+}
+
+bool MockDriver::pause()
+{
+	return true;
+}
+
+bool MockDriver::unpause()
+{
+	return true;
+}
+
+size_t MockDriver::setPageCacheLimit( size_t limit )
+{
+	return pageCache_.setLimit( limit );
+}
+
+bool MockDriver::setPageCacheLimitRange( size_t minLimit, size_t maxLimit )
+{
+	return pageCache_.setLimitRange( minLimit, maxLimit );
+}
+
+bool MockDriver::pageCacheStats( PageCacheStats &stats )
+{
+	pageCache_.stats( stats );
+	return true;
+}
+
+size_t MockDriver::setPageCacheReadAhead( size_t pages )
+{
+	return pageCache_.setReadAhead( pages );
+}
+
+void MockDriver::prefetchGfns( const unsigned long long *gfns, size_t count )
+{
+	pageCache_.prefetch( gfns, count );
+}
+
+bool MockDriver::getXSAVESize( unsigned short /* vcpu */, size_t & /* size */ )
+{
+	return false;
+}
+
+bool MockDriver::getXSAVEArea( unsigned short /* vcpu */, void * /* buffer */, size_t /* bufSize */ )
+{
+	return false;
+}
+
+bool MockDriver::getEPTPageConvertible( unsigned short /* index */, unsigned long long /* guestAddress */,
+                                        bool &convertible )
+{
+	convertible = false;
+	return true;
+}
+
+bool MockDriver::createEPTImpl( unsigned short &index )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	index = nextView_++;
+	views_[index];
+
+	return true;
+}
+
+bool MockDriver::cloneEPTImpl( unsigned short srcView, unsigned short &dstView, bool &copied )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	auto it = views_.find( srcView );
+
+	if ( it == views_.end() )
+		return false;
+
+	dstView         = nextView_++;
+	views_[dstView] = it->second;
+	copied          = true;
+
+	return true;
+}
+
+bool MockDriver::destroyEPTImpl( unsigned short index )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( !index || index == currentView_ )
+		return false;
+
+	return views_.erase( index ) != 0;
+}
+
+bool MockDriver::switchEPT( unsigned short index )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( views_.find( index ) == views_.end() )
+		return false;
+
+	currentView_ = index;
+	return true;
+}
+
+bool MockDriver::setVEInfoPage( unsigned short /* vcpu */, unsigned long long /* gpa */ )
+{
+	return false;
+}
+
+bool MockDriver::disableVE( unsigned short /* vcpu */ )
+{
+	return false;
+}
+
+unsigned short MockDriver::eptpIndex( unsigned short /* vcpu */ ) const
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	return currentView_;
+}
+
+bool MockDriver::update()
+{
+	return true;
+}
+
+std::string MockDriver::uuid() const
+{
+	return uuid_;
+}
+
+unsigned int MockDriver::id() const
+{
+	return 1;
+}
+
+uint32_t MockDriver::startTime()
+{
+	return 0;
+}
+
+bool MockDriver::isMsrCached( uint64_t msr ) const
+{
+	uint64_t value;
+
+	return Registers().msr( msr, value );
+}
+
+bool MockDriver::getXCR0( unsigned short /* vcpu */, uint64_t &xcr0 ) const
+{
+	xcr0 = 0x07; // x87, SSE, AVX
+	return true;
+}
+
+void *MockDriver::mapGuestPageImpl( unsigned long long gfn )
+{
+	simulateLatency( config_.mapLatency_ );
+
+	return page( gfn );
+}
+
+void MockDriver::unmapGuestPageImpl( void * /* hostPtr */, unsigned long long /* gfn */ )
+{
+	simulateLatency( config_.mapLatency_ );
+}
+
+void *MockDriver::mapGuestPagesImpl( const unsigned long long *gfns, size_t count )
+{
+	simulateLatency( static_cast<unsigned long long>( config_.mapLatency_ ) * count );
+
+	// The pages have to be contiguous, and the mock guest's memory isn't remapped for each
+	// view, so this is a snapshot (as on KVM)
+	void *copy = nullptr;
+
+	if ( posix_memalign( &copy, PAGE_SIZE, count * PAGE_SIZE ) )
+		return nullptr;
+
+	PageCopy holder( static_cast<char *>( copy ), ::free );
+
+	for ( size_t i = 0; i < count; ++i ) {
+		char *p = page( gfns[i] );
+
+		if ( !p )
+			return nullptr;
+
+		memcpy( holder.get() + i * PAGE_SIZE, p, PAGE_SIZE );
+	}
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	ranges_.emplace( copy, std::move( holder ) );
+
+	return copy;
+}
+
+void MockDriver::unmapGuestPagesImpl( void *hostPtr, size_t count )
+{
+	simulateLatency( static_cast<unsigned long long>( config_.mapLatency_ ) * count );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	ranges_.erase( hostPtr );
+}
+
+bool MockDriver::setPageProtectionImpl( const MemAccessMap &accessMap, unsigned short view )
+{
+	simulateLatency( static_cast<unsigned long long>( config_.protectionLatency_ ) * accessMap.size() );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	auto it = views_.find( view );
+
+	if ( it == views_.end() )
+		return false;
+
+	for ( auto &&item : accessMap ) {
+		if ( item.first >= pageCount_ )
+			return false;
+
+		it->second[item.first] = item.second;
+	}
+
+	return true;
+}
+
+bool MockDriver::setPageConvertibleImpl( const ConvertibleMap & /* convMap */, unsigned short /* view */ )
+{
+	return false;
+}
+
+bool MockDriver::getPageProtectionImpl( unsigned long long guestAddress, bool &read, bool &write, bool &execute,
+                                        unsigned short view )
+{
+	uint8_t access = 0;
+
+	if ( !getPageProtectionRangeImpl( gpa_to_gfn( guestAddress ), 1, &access, view ) )
+		return false;
+
+	read    = !!( access & PAGE_READ );
+	write   = !!( access & PAGE_WRITE );
+	execute = !!( access & PAGE_EXECUTE );
+
+	return true;
+}
+
+bool MockDriver::getPageProtectionRangeImpl( unsigned long long firstGfn, size_t count, uint8_t *access,
+                                             unsigned short view )
+{
+	simulateLatency( static_cast<unsigned long long>( config_.protectionLatency_ ) * count );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	auto it = views_.find( view );
+
+	if ( it == views_.end() )
+		return false;
+
+	for ( size_t i = 0; i < count; ++i ) {
+		auto pi = it->second.find( firstGfn + i );
+
+		access[i] = pi != it->second.end() ? pi->second : PAGE_READ | PAGE_WRITE | PAGE_EXECUTE;
+	}
+
+	return true;
+}
+
+bool MockDriver::maxGPFNImpl( unsigned long long &gfn )
+{
+	gfn = pageCount_ - 1;
+	return true;
+}
+
+void MockDriver::probeGfnsImpl( unsigned long long firstGfn, size_t count, std::vector<bool> &present )
+{
+	present.assign( count, false );
+
+	for ( size_t i = 0; i < count; ++i )
+		present[i] = firstGfn + i < pageCount_;
+}
+
+bool MockDriver::startDirtyLogImpl()
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	pageHashes_.resize( pageCount_ );
+
+	for ( unsigned long long gfn = 0; gfn < pageCount_; ++gfn )
+		pageHashes_[gfn] = pageHash( page( gfn ) );
+
+	return true;
+}
+
+bool MockDriver::stopDirtyLogImpl()
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	pageHashes_.clear();
+	pageHashes_.shrink_to_fit();
+
+	return true;
+}
+
+bool MockDriver::fetchDirtyLogImpl( unsigned long long pages, std::vector<uint64_t> &bitmap )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( pageHashes_.empty() )
+		return false;
+
+	for ( unsigned long long gfn = 0; gfn < pages && gfn < pageCount_; ++gfn ) {
+		uint64_t hash = pageHash( page( gfn ) );
+
+		if ( hash == pageHashes_[gfn] )
+			continue;
+
+		pageHashes_[gfn] = hash;
+		bitmap[gfn / 64] |= 1ULL << ( gfn % 64 );
+	}
+
+	return true;
+}
+
+bool MockDriver::readPhysicalImpl( unsigned long long gpa, void *buffer, size_t length )
+{
+	simulateLatency( config_.mapLatency_ );
+
+	char *p = page( gpa_to_gfn( gpa ) );
+
+	if ( !p || ( gpa & ~PAGE_MASK ) + length > PAGE_SIZE )
+		return false;
+
+	memcpy( buffer, p + ( gpa & ~PAGE_MASK ), length );
+	return true;
+}
+
+bool MockDriver::writePhysicalImpl( unsigned long long gpa, const void *buffer, size_t length )
+{
+	simulateLatency( config_.mapLatency_ );
+
+	char *p = page( gpa_to_gfn( gpa ) );
+
+	if ( !p || ( gpa & ~PAGE_MASK ) + length > PAGE_SIZE )
+		return false;
+
+	memcpy( p + ( gpa & ~PAGE_MASK ), buffer, length );
+	return true;
+}
+
+bool MockDriver::isPageCached( unsigned long long gfn )
+{
+	return pageCache_.contains( gfn );
+}
+
+} // namespace bdvmi
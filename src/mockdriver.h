@@ -0,0 +1,239 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMOCKDRIVER_H_INCLUDED__
+#define __BDVMIMOCKDRIVER_H_INCLUDED__
+
+#include "bdvmi/driver.h"
+#include "bdvmi/mockbackend.h"
+#include "bdvmi/pagecache.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bdvmi {
+
+// BACKEND_MOCK's Driver: guest memory is an anonymous mapping of MockConfig::memorySize_
+// bytes, going through the real PageCache, "hypercalls" cost whatever latency MockConfig
+// says, page protections and EPT views are only bookkeeping. Good for measuring the
+// library itself, without the hypervisor's share.
+class MockDriver : public Driver {
+
+public:
+	MockDriver( const std::string &uuid, const MockConfig &config );
+
+	~MockDriver();
+
+public:
+	const MockConfig &config() const
+	{
+		return config_;
+	}
+
+	// What registers() returns for vcpu from now on (MockEventManager calls it for every event)
+	void loadRegisters( unsigned short vcpu, const Registers &regs );
+
+	// Busy-wait for ns nanoseconds
+	static void simulateLatency( unsigned long long ns );
+
+public:
+	bool cpuCount( unsigned int &count ) const override;
+
+	bool tscSpeed( unsigned long long &speed ) const override;
+
+	bool mtrrType( unsigned long long guestAddress, uint8_t &type ) const override;
+
+	bool registers( unsigned short vcpu, Registers &regs ) const override;
+
+	bool cachedRegisters( unsigned short vcpu, const Registers *&regs ) const override;
+
+	bool readMsr( unsigned short vcpu, uint32_t msr, uint64_t &value ) const override;
+
+	bool setRegisters( unsigned short vcpu, const Registers &regs, bool setEip, bool delay ) override;
+
+	MapReturnCode mapPhysMemToHost( unsigned long long address, size_t length, uint32_t flags,
+	                                void *&pointer ) override;
+
+	bool unmapPhysMem( void *hostPtr ) override;
+
+	MapReturnCode mapGfns( const unsigned long long *gfns, size_t count, uint32_t flags, void *&pointer ) override;
+
+	bool unmapGfns( void *hostPtr, size_t count ) override;
+
+	bool injectTrap( unsigned short vcpu, uint8_t trapNumber, uint32_t errorCode, uint64_t cr2 ) override;
+
+	bool setRepOptimizations( bool enable ) override;
+
+	bool shutdown() override;
+
+	bool pause() override;
+
+	bool unpause() override;
+
+	size_t setPageCacheLimit( size_t limit ) override;
+
+	bool setPageCacheLimitRange( size_t minLimit, size_t maxLimit ) override;
+
+	bool pageCacheStats( PageCacheStats &stats ) override;
+
+	size_t setPageCacheReadAhead( size_t pages ) override;
+
+	void prefetchGfns( const unsigned long long *gfns, size_t count ) override;
+
+	bool getXSAVESize( unsigned short vcpu, size_t &size ) override;
+
+	bool getXSAVEArea( unsigned short vcpu, void *buffer, size_t bufSize ) override;
+
+	bool getEPTPageConvertible( unsigned short index, unsigned long long guestAddress, bool &convertible ) override;
+
+	bool switchEPT( unsigned short index ) override;
+
+	bool setVEInfoPage( unsigned short vcpu, unsigned long long gpa ) override;
+
+	bool disableVE( unsigned short vcpu ) override;
+
+	unsigned short eptpIndex( unsigned short vcpu ) const override;
+
+	bool update() override;
+
+	std::string uuid() const override;
+
+	unsigned int id() const override;
+
+	void enableCache( unsigned short /* vcpu */ ) override
+	{
+	}
+
+	void disableCache( unsigned short /* vcpu */ ) override
+	{
+	}
+
+	uint32_t startTime() override;
+
+	bool isMsrCached( uint64_t msr ) const override;
+
+	bool veSupported() const override
+	{
+		return false;
+	}
+
+	bool vmfuncSupported() const override
+	{
+		return false;
+	}
+
+	bool sppSupported() const override
+	{
+		return false;
+	}
+
+	bool dtrEventsSupported() const override
+	{
+		return true;
+	}
+
+	bool getXCR0( unsigned short vcpu, uint64_t &xcr0 ) const override;
+
+	bool physCopySupported() const override
+	{
+		return true;
+	}
+
+private:
+	void *mapGuestPageImpl( unsigned long long gfn ) override;
+
+	void unmapGuestPageImpl( void *hostPtr, unsigned long long gfn ) override;
+
+	void *mapGuestPagesImpl( const unsigned long long *gfns, size_t count ) override;
+
+	void unmapGuestPagesImpl( void *hostPtr, size_t count ) override;
+
+	bool createEPTImpl( unsigned short &index ) override;
+
+	bool destroyEPTImpl( unsigned short index ) override;
+
+	bool setPageProtectionImpl( const MemAccessMap &accessMap, unsigned short view ) override;
+
+	bool setPageConvertibleImpl( const ConvertibleMap &convMap, unsigned short view ) override;
+
+	bool cloneEPTImpl( unsigned short srcView, unsigned short &dstView, bool &copied ) override;
+
+	bool getPageProtectionImpl( unsigned long long guestAddress, bool &read, bool &write, bool &execute,
+	                            unsigned short view ) override;
+
+	bool getPageProtectionRangeImpl( unsigned long long firstGfn, size_t count, uint8_t *access,
+	                                 unsigned short view ) override;
+
+	bool maxGPFNImpl( unsigned long long &gfn ) override;
+
+	void probeGfnsImpl( unsigned long long firstGfn, size_t count, std::vector<bool> &present ) override;
+
+	bool startDirtyLogImpl() override;
+
+	bool stopDirtyLogImpl() override;
+
+	bool fetchDirtyLogImpl( unsigned long long pages, std::vector<uint64_t> &bitmap ) override;
+
+	bool readPhysicalImpl( unsigned long long gpa, void *buffer, size_t length ) override;
+
+	bool writePhysicalImpl( unsigned long long gpa, const void *buffer, size_t length ) override;
+
+	bool isPageCached( unsigned long long gfn ) override;
+
+	// Mock vCPUs don't run
+	bool pauseVcpusImpl( uint64_t /* vcpus */, uint64_t /* paused */ ) override
+	{
+		return true;
+	}
+
+	bool unpauseVcpusImpl( uint64_t /* vcpus */, uint64_t /* paused */ ) override
+	{
+		return true;
+	}
+
+private:
+	char *page( unsigned long long gfn ) const;
+
+public: // no copying around
+	MockDriver( const MockDriver & ) = delete;
+	MockDriver &operator=( const MockDriver & ) = delete;
+
+private:
+	using PageCopy    = std::unique_ptr<char, void ( * )( void * )>;
+	using Protections = std::unordered_map<unsigned long long, uint8_t>; // gfn -> Driver::PAGE_* bits
+
+	std::string        uuid_;
+	MockConfig         config_;
+	char *             memory_{ nullptr };
+	unsigned long long pageCount_{ 0 };
+	PageCache          pageCache_;
+
+	mutable std::mutex                    mutex_;
+	std::vector<Registers>                registers_;
+	std::map<unsigned short, Protections> views_;
+	unsigned short                        nextView_{ 1 };
+	unsigned short                        currentView_{ 0 };
+	std::unordered_map<void *, PageCopy>  ranges_; // mapGfns() copies
+
+	// The dirty log compares page hashes, so it also sees writes made straight to the memory
+	std::vector<uint64_t> pageHashes_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMOCKDRIVER_H_INCLUDED__
@@ -0,0 +1,342 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "mockeventmanager.h"
+#include "bdvmi/eventhandler.h"
+#include "bdvmi/statscollector.h"
+#include "mockdriver.h"
+#include "vcpudispatcher.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <memory>
+
+namespace bdvmi {
+
+namespace {
+
+EventTrace::EventType traceType( MockEvent::Type type )
+{
+	switch ( type ) {
+		case MockEvent::CR:
+			return EventTrace::CR;
+		case MockEvent::MSR:
+			return EventTrace::MSR;
+		case MockEvent::PAGE_FAULT:
+			return EventTrace::PAGE_FAULT;
+		case MockEvent::VMCALL:
+			return EventTrace::VMCALL;
+		case MockEvent::XSETBV:
+			return EventTrace::XSETBV;
+		case MockEvent::BREAKPOINT:
+			return EventTrace::BREAKPOINT;
+		case MockEvent::INTERRUPT:
+			return EventTrace::INTERRUPT;
+		case MockEvent::DESCRIPTOR:
+			return EventTrace::DESCRIPTOR;
+	}
+
+	return EventTrace::OTHER;
+}
+
+} // namespace
+
+MockEventManager::MockEventManager( MockDriver &driver, sig_atomic_t &sigStop )
+    : EventManager{ sigStop }
+    , driver_{ driver }
+{
+}
+
+MockEventManager::~MockEventManager()
+{
+	if ( eventFd_ != -1 )
+		close( eventFd_ );
+}
+
+std::string MockEventManager::uuid()
+{
+	return driver_.uuid();
+}
+
+bool MockEventManager::nextEvent( MockEvent &event, size_t &index, size_t &loop )
+{
+	const MockConfig &config = driver_.config();
+
+	if ( config.generator_ )
+		return config.generator_( event );
+
+	if ( config.events_.empty() )
+		return false;
+
+	if ( index == config.events_.size() ) {
+		index = 0;
+
+		if ( config.loops_ && ++loop == config.loops_ )
+			return false;
+	}
+
+	event = config.events_[index++];
+
+	return true;
+}
+
+void MockEventManager::waitForEvents()
+{
+	std::unique_ptr<VcpuDispatcher> dispatcher;
+
+	if ( workers_ )
+		dispatcher.reset( new VcpuDispatcher( workers_ ) );
+
+	MockEvent event;
+	size_t    index = 0;
+	size_t    loop  = 0;
+
+	while ( !stop_ ) {
+		if ( sigStop_ )
+			stop();
+
+		if ( !nextEvent( event, index, loop ) )
+			break;
+
+		if ( dispatcher )
+			dispatcher->dispatch( event.vcpu_, [this, event]() { handleEvent( event ); } );
+		else
+			handleEvent( event );
+	}
+
+	if ( dispatcher )
+		dispatcher->drain();
+
+	completeDeferred();
+}
+
+std::vector<int> MockEventManager::pollFds()
+{
+	if ( eventFd_ == -1 ) {
+		eventFd_ = eventfd( 1, EFD_CLOEXEC );
+
+		if ( eventFd_ == -1 )
+			return {};
+	}
+
+	return { eventFd_ };
+}
+
+size_t MockEventManager::processPending( size_t budget )
+{
+	MockEvent event;
+	size_t    events = 0;
+	bool      over   = false;
+
+	if ( finished_ )
+		return 0;
+
+	while ( !stop_ && ( !budget || events < budget ) ) {
+		if ( sigStop_ )
+			stop();
+
+		if ( !nextEvent( event, pendingIndex_, pendingLoop_ ) ) {
+			over = true;
+			break;
+		}
+
+		handleEvent( event );
+		++events;
+	}
+
+	if ( over || stop_ ) {
+		completeDeferred();
+		finished_ = true;
+	}
+
+	return events;
+}
+
+void MockEventManager::handleEvent( const MockEvent &event )
+{
+	EventHandler *h = handler();
+
+	StatsCounter      counter( "eventCount" );
+	EventTrace::Scope scope( driver_.eventTrace(), event.vcpu_, traceType( event.type_ ),
+	                         event.type_ == MockEvent::PAGE_FAULT ? event.gpa_ : event.index_ );
+
+	HVAction       action          = NONE;
+	unsigned short instructionSize = 0;
+	unsigned short vcpu            = event.vcpu_;
+
+	const Registers &regs = event.regs_;
+
+	driver_.loadRegisters( vcpu, regs );
+	driver_.retireTranslationWrites( vcpu );
+
+	if ( !h )
+		return;
+
+	EventTrace::handlerStart();
+
+	switch ( event.type_ ) {
+		case MockEvent::CR:
+			if ( filterCr( event.index_, event.oldValue_, event.newValue_, action ) )
+				break;
+
+			if ( event.index_ == 3 )
+				driver_.flushTranslations( event.newValue_ );
+			else
+				driver_.flushTranslations();
+
+			h->runPreEvent();
+			h->handleCR( vcpu, event.index_, regs, event.oldValue_, event.newValue_, action );
+			h->runPostEvent();
+			break;
+
+		case MockEvent::MSR:
+			if ( filterMsr( event.index_, event.oldValue_, event.newValue_, action ) )
+				break;
+
+			h->runPreEvent();
+			h->handleMSR( vcpu, event.index_, event.oldValue_, event.newValue_, action );
+			h->runPostEvent();
+			break;
+
+		case MockEvent::PAGE_FAULT: {
+			// Writes count as reads too, as on real hardware (see KvmEventManager)
+			const bool write   = event.access_ & Driver::PAGE_WRITE;
+			const bool read    = write || ( event.access_ & Driver::PAGE_READ );
+			const bool execute = event.access_ & Driver::PAGE_EXECUTE;
+
+			if ( filterPageFault( gpa_to_gfn( event.gpa_ ), read, write, execute, action ) )
+				break;
+
+			EmulatorContext emulatorCtx;
+
+			if ( write )
+				driver_.invalidateTranslations( vcpu, gpa_to_gfn( event.gpa_ ) );
+
+			h->runPreEvent();
+
+			beginDeferrable();
+
+			h->handlePageFault( vcpu, regs, event.gpa_, event.gva_, read, write, execute, false, action,
+			                    emulatorCtx, instructionSize );
+
+			uint64_t deferred = endDeferrable();
+
+			if ( deferred ) {
+				scope.flags( EventTrace::FLAG_DEFERRED );
+				deferReply( deferred, []( const Completion & ) { return true; } );
+			}
+
+			h->runPostEvent();
+			break;
+		}
+
+		case MockEvent::VMCALL:
+			h->runPreEvent();
+			h->handleVMCALL( vcpu, regs );
+			h->runPostEvent();
+			break;
+
+		case MockEvent::XSETBV:
+			h->runPreEvent();
+			h->handleXSETBV( vcpu );
+			h->runPostEvent();
+			break;
+
+		case MockEvent::BREAKPOINT:
+			h->runPreEvent();
+			h->handleBreakpoint( vcpu, regs, event.gpa_ );
+			h->runPostEvent();
+			break;
+
+		case MockEvent::INTERRUPT:
+			h->runPreEvent();
+			h->handleInterrupt( vcpu, regs, event.index_, event.errorCode_, event.cr2_ );
+			h->runPostEvent();
+			break;
+
+		case MockEvent::DESCRIPTOR:
+			h->runPreEvent();
+			h->handleDescriptorAccess( vcpu, regs, event.index_, instructionSize, action );
+			h->runPostEvent();
+			break;
+	}
+
+	EventTrace::handlerEnd();
+
+	driver_.flushPageProtections();
+
+	MockDriver::simulateLatency( driver_.config().eventLatency_ );
+}
+
+bool MockEventManager::enableMsrEventsImpl( unsigned int /* msr */ )
+{
+	return true;
+}
+
+bool MockEventManager::disableMsrEventsImpl( unsigned int /* msr */ )
+{
+	return true;
+}
+
+bool MockEventManager::enableCrEventsImpl( unsigned int /* cr */ )
+{
+	return true;
+}
+
+bool MockEventManager::disableCrEventsImpl( unsigned int /* cr */ )
+{
+	return true;
+}
+
+bool MockEventManager::enableXSETBVEventsImpl()
+{
+	return true;
+}
+
+bool MockEventManager::disableXSETBVEventsImpl()
+{
+	return true;
+}
+
+bool MockEventManager::enableBreakpointEventsImpl()
+{
+	return true;
+}
+
+bool MockEventManager::disableBreakpointEventsImpl()
+{
+	return true;
+}
+
+bool MockEventManager::enableVMCALLEventsImpl()
+{
+	return true;
+}
+
+bool MockEventManager::disableVMCALLEventsImpl()
+{
+	return true;
+}
+
+bool MockEventManager::enableDescriptorEventsImpl()
+{
+	return true;
+}
+
+bool MockEventManager::disableDescriptorEventsImpl()
+{
+	return true;
+}
+
+} // namespace bdvmi
@@ -0,0 +1,100 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMOCKEVENTMANAGER_H_INCLUDED__
+#define __BDVMIMOCKEVENTMANAGER_H_INCLUDED__
+
+#include "bdvmi/eventmanager.h"
+#include "bdvmi/mockbackend.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+
+class MockDriver;
+
+// Delivers MockConfig's events (or whatever its generator comes up with) as fast as the
+// EventHandler takes them, going through the same steps as the real backends: filters,
+// page protection flushes, parallelEvents(), defer()
+class MockEventManager : public EventManager {
+
+public:
+	MockEventManager( MockDriver &driver, sig_atomic_t &sigStop );
+
+	virtual ~MockEventManager();
+
+public:
+	// Returns when the events run out
+	void waitForEvents() override;
+
+	// An eventfd that's always readable, there's always something to do until the events run out
+	std::vector<int> pollFds() override;
+
+	size_t processPending( size_t budget ) override;
+
+	void stop() override
+	{
+		stop_ = true;
+	}
+
+	std::string uuid() override;
+
+private:
+	bool enableMsrEventsImpl( unsigned int msr ) override;
+
+	bool disableMsrEventsImpl( unsigned int msr ) override;
+
+	bool enableCrEventsImpl( unsigned int cr ) override;
+
+	bool disableCrEventsImpl( unsigned int cr ) override;
+
+	bool enableXSETBVEventsImpl() override;
+
+	bool disableXSETBVEventsImpl() override;
+
+	bool enableBreakpointEventsImpl() override;
+
+	bool disableBreakpointEventsImpl() override;
+
+	bool enableVMCALLEventsImpl() override;
+
+	bool disableVMCALLEventsImpl() override;
+
+	bool enableDescriptorEventsImpl() override;
+
+	bool disableDescriptorEventsImpl() override;
+
+private:
+	// false once there are no more events
+	bool nextEvent( MockEvent &event, size_t &index, size_t &loop );
+
+	void handleEvent( const MockEvent &event );
+
+public: // no copying around
+	MockEventManager( const MockEventManager & ) = delete;
+	MockEventManager &operator=( const MockEventManager & ) = delete;
+
+private:
+	MockDriver &      driver_;
+	std::atomic<bool> stop_{ false };
+	int               eventFd_{ -1 };
+	size_t            pendingIndex_{ 0 }; // nextEvent() state for processPending()
+	size_t            pendingLoop_{ 0 };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMOCKEVENTMANAGER_H_INCLUDED__
@@ -0,0 +1,243 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/pageattributes.h"
+#include <algorithm>
+
+namespace bdvmi {
+
+void PageAttributeTable::reserve( unsigned long long maxGfn )
+{
+	size_t count = maxGfn / CHUNK_GFNS + 1;
+
+	if ( count > MAX_DIRECT )
+		count = MAX_DIRECT;
+
+	if ( count > chunks_.size() )
+		chunks_.resize( count );
+}
+
+PageAttributeTable::Chunk *PageAttributeTable::chunk( size_t index ) const
+{
+	if ( index < chunks_.size() )
+		return chunks_[index].get();
+
+	auto it = farChunks_.find( index );
+
+	return it != farChunks_.end() ? it->second.get() : nullptr;
+}
+
+PageAttributeTable::Chunk *PageAttributeTable::chunk( size_t index, bool create )
+{
+	std::shared_ptr<Chunk> *ref = nullptr;
+
+	if ( index < chunks_.size() )
+		ref = &chunks_[index];
+	else {
+		auto it = farChunks_.find( index );
+
+		if ( it != farChunks_.end() )
+			ref = &it->second;
+	}
+
+	if ( ref && *ref ) {
+		// Copy-on-write, shared chunks are clean so the copy is too
+		if ( ref->use_count() > 1 )
+			*ref = std::make_shared<Chunk>( **ref );
+
+		return ref->get();
+	}
+
+	if ( !create )
+		return nullptr;
+
+	std::shared_ptr<Chunk> newChunk = std::make_shared<Chunk>();
+	Chunk *                c        = newChunk.get();
+
+	if ( index < MAX_DIRECT ) {
+		if ( index >= chunks_.size() )
+			chunks_.resize( index + 1 );
+
+		chunks_[index] = std::move( newChunk );
+	} else
+		farChunks_[index] = std::move( newChunk );
+
+	return c;
+}
+
+uint8_t PageAttributeTable::get( unsigned long long gfn ) const
+{
+	const Chunk *c = chunk( gfn / CHUNK_GFNS );
+
+	if ( !c )
+		return UNKNOWN;
+
+	size_t slot = gfn % CHUNK_GFNS;
+
+	return ( ( c->attrs_[slot / SLOTS_PER_WORD] >> ( ( slot % SLOTS_PER_WORD ) * 3 ) ) & 0x07 ) ^ UNKNOWN;
+}
+
+void PageAttributeTable::set( unsigned long long gfn, uint8_t attr, bool dirty )
+{
+	size_t index = gfn / CHUNK_GFNS;
+	Chunk *c     = chunk( index, true );
+
+	size_t   slot  = gfn % CHUNK_GFNS;
+	uint64_t shift = ( slot % SLOTS_PER_WORD ) * 3;
+	uint64_t &word = c->attrs_[slot / SLOTS_PER_WORD];
+
+	word = ( word & ~( 0x07ULL << shift ) ) | ( static_cast<uint64_t>( ( attr ^ UNKNOWN ) & 0x07 ) << shift );
+
+	if ( !dirty )
+		return;
+
+	uint64_t &dirtyWord = c->dirty_[slot / 64];
+	uint64_t  bit       = 1ULL << ( slot % 64 );
+
+	if ( dirtyWord & bit )
+		return;
+
+	dirtyWord |= bit;
+	++dirtyCount_;
+
+	if ( !c->onDirtyList_ ) {
+		c->onDirtyList_ = true;
+		dirtyChunks_.push_back( index );
+	}
+}
+
+bool PageAttributeTable::dirty( unsigned long long gfn ) const
+{
+	const Chunk *c = chunk( gfn / CHUNK_GFNS );
+
+	if ( !c )
+		return false;
+
+	size_t slot = gfn % CHUNK_GFNS;
+
+	return ( c->dirty_[slot / 64] >> ( slot % 64 ) ) & 1;
+}
+
+void PageAttributeTable::takeDirty( AccessMap &accessMap )
+{
+	if ( dirtyChunks_.empty() )
+		return;
+
+	std::sort( dirtyChunks_.begin(), dirtyChunks_.end() );
+
+	accessMap.reserve( accessMap.size() + dirtyCount_ );
+
+	for ( auto &&index : dirtyChunks_ ) {
+		Chunk *  c    = chunk( index );
+		uint64_t base = static_cast<uint64_t>( index ) * CHUNK_GFNS;
+
+		for ( size_t w = 0; w < sizeof( c->dirty_ ) / sizeof( c->dirty_[0] ); ++w ) {
+			uint64_t bits = c->dirty_[w];
+
+			if ( !bits )
+				continue;
+
+			c->dirty_[w] = 0;
+
+			while ( bits ) {
+				size_t slot = w * 64 + __builtin_ctzll( bits );
+				bits &= bits - 1;
+
+				uint8_t attr =
+				    ( ( c->attrs_[slot / SLOTS_PER_WORD] >> ( ( slot % SLOTS_PER_WORD ) * 3 ) ) & 0x07 ) ^
+				    UNKNOWN;
+
+				// Ascending order, so this is an append
+				accessMap.emplace_hint( accessMap.end(), base + slot, attr );
+			}
+		}
+
+		c->onDirtyList_ = false;
+	}
+
+	dirtyChunks_.clear();
+	dirtyCount_ = 0;
+}
+
+void PageAttributeTable::collect( AccessMap &accessMap, uint8_t skip ) const
+{
+	auto collectChunk = [&accessMap, skip]( size_t index, const Chunk &c ) {
+		uint64_t base = static_cast<uint64_t>( index ) * CHUNK_GFNS;
+
+		for ( size_t w = 0; w < WORDS_PER_CHUNK; ++w ) {
+			uint64_t word = c.attrs_[w];
+
+			// Nothing known in this word
+			if ( !word )
+				continue;
+
+			for ( size_t i = 0; i < SLOTS_PER_WORD; ++i ) {
+				uint8_t attr = ( ( word >> ( i * 3 ) ) & 0x07 ) ^ UNKNOWN;
+
+				if ( attr != UNKNOWN && attr != skip )
+					accessMap.emplace_hint( accessMap.end(), base + w * SLOTS_PER_WORD + i, attr );
+			}
+		}
+	};
+
+	for ( size_t index = 0; index < chunks_.size(); ++index )
+		if ( chunks_[index] )
+			collectChunk( index, *chunks_[index] );
+
+	if ( farChunks_.empty() )
+		return;
+
+	std::vector<size_t> farIndices;
+	farIndices.reserve( farChunks_.size() );
+
+	for ( auto &&item : farChunks_ )
+		farIndices.push_back( item.first );
+
+	std::sort( farIndices.begin(), farIndices.end() );
+
+	for ( auto &&index : farIndices )
+		collectChunk( index, *farChunks_.at( index ) );
+}
+
+void PageAttributeTable::cloneFrom( const PageAttributeTable &other )
+{
+	if ( &other == this )
+		return;
+
+	chunks_     = other.chunks_;
+	farChunks_  = other.farChunks_;
+	dirtyCount_ = 0;
+	dirtyChunks_.clear();
+
+	// Dirty chunks are never shared, they get copied right away (and forget what's dirty)
+	for ( auto &&index : other.dirtyChunks_ ) {
+		std::shared_ptr<Chunk> &ref = index < chunks_.size() ? chunks_[index] : farChunks_[index];
+
+		ref = std::make_shared<Chunk>( *ref );
+
+		std::fill( std::begin( ref->dirty_ ), std::end( ref->dirty_ ), 0 );
+		ref->onDirtyList_ = false;
+	}
+}
+
+void PageAttributeTable::clear()
+{
+	chunks_.clear();
+	farChunks_.clear();
+	dirtyChunks_.clear();
+	dirtyCount_ = 0;
+}
+
+} // namespace bdvmi
@@ -16,15 +16,29 @@
 #include <algorithm>
 #include "bdvmi/logger.h"
 #include "bdvmi/pagecache.h"
+#include "bdvmi/statscollector.h"
 #include <sys/mman.h>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
+#include <tuple>
 #include <errno.h>
 #include <vector>
 
 namespace bdvmi {
 
+namespace {
+
+void countStat( const char *name )
+{
+	StatsCollector &sc = StatsCollector::instance();
+
+	if ( sc.enabled() )
+		sc.count( sc.literal( name ) );
+}
+
+} // namespace
+
 PageCache::PageCache( Driver *driver )
     : driver_{ driver }
 {
@@ -38,92 +52,461 @@ PageCache::PageCache( Driver *driver )
 
 bool PageCache::checkPages( void *addr, size_t size ) const
 {
-	unsigned char vec[1] = {};
+	if ( linuxMajVersion_ >= 4 )
+		return true;
+
+	std::vector<unsigned char> vec( ( size + PAGE_SIZE - 1 ) / PAGE_SIZE );
 
-	// The page is not present or otherwise unavailable
-	if ( linuxMajVersion_ < 4 && ( mincore( addr, size, vec ) < 0 || !( vec[0] & 0x01 ) ) )
+	if ( mincore( addr, size, vec.data() ) < 0 )
 		return false;
 
+	// A page is not present or otherwise unavailable
+	for ( auto &&v : vec )
+		if ( !( v & 0x01 ) )
+			return false;
+
 	return true;
 }
 
 size_t PageCache::setLimit( size_t limit )
 {
-	if ( limit >= 50 ) // magic number!
+	if ( limit >= MIN_CACHE_SIZE )
 		cacheLimit_ = limit;
 
 	return cacheLimit_;
 }
 
+bool PageCache::setLimitRange( size_t minLimit, size_t maxLimit )
+{
+	if ( !minLimit && !maxLimit ) {
+		maxLimit_ = 0;
+		minLimit_ = 0;
+		return true;
+	}
+
+	if ( minLimit < MIN_CACHE_SIZE || maxLimit < minLimit )
+		return false;
+
+	// Adapting stays off while maxLimit_ is 0, so set it last
+	maxLimit_ = 0;
+	minLimit_ = minLimit;
+
+	size_t limit = cacheLimit_;
+	cacheLimit_  = limit < minLimit ? minLimit : ( limit > maxLimit ? maxLimit : limit );
+
+	windowLookups_   = 0;
+	windowMisses_    = 0;
+	windowEvictions_ = 0;
+	maxLimit_        = maxLimit;
+
+	return true;
+}
+
+void PageCache::stats( PageCacheStats &stats )
+{
+	stats             = PageCacheStats();
+	stats.hits        = hits_;
+	stats.misses      = misses_;
+	stats.evictions   = evictions_;
+	stats.notPresent  = notPresent_;
+	stats.mapFailures = mapFailures_;
+	stats.limit       = cacheLimit_;
+
+	for ( auto &&s : shards_ ) {
+		std::lock_guard<std::mutex> guard( s.mutex_ );
+
+		stats.mapped += s.cache_.size();
+		stats.pinned += s.cache_.size() - s.lru_.size();
+	}
+}
+
+void PageCache::countLookup( bool hit )
+{
+	if ( hit ) {
+		++hits_;
+		countStat( "pageCacheHit" );
+	} else {
+		++misses_;
+		countStat( "pageCacheMiss" );
+		EventTrace::countPageCacheMiss();
+	}
+
+	if ( !maxLimit_ )
+		return;
+
+	if ( !hit )
+		++windowMisses_;
+
+	// Exactly one thread sees the window fill up
+	if ( ++windowLookups_ == ADAPT_WINDOW )
+		adaptLimit();
+}
+
+void PageCache::adaptLimit()
+{
+	size_t misses    = windowMisses_.exchange( 0 );
+	size_t evictions = windowEvictions_.exchange( 0 );
+	windowLookups_   = 0;
+
+	size_t minLimit = minLimit_;
+	size_t maxLimit = maxLimit_;
+	size_t window   = ADAPT_WINDOW;
+	size_t limit    = cacheLimit_;
+	size_t oldLimit = limit;
+
+	if ( !maxLimit )
+		return;
+
+	// Misses that didn't push anything out wouldn't go away with a bigger cache
+	if ( misses * 100 > window * ADAPT_GROW_MISS_PERCENT && evictions ) {
+		limit += limit / 4;
+		if ( limit > maxLimit )
+			limit = maxLimit;
+
+		shrinkDelay_ = ADAPT_SHRINK_DELAY; // don't immediately undo this
+	} else if ( misses * 100 < window * ADAPT_SHRINK_MISS_PERCENT ) {
+		if ( shrinkDelay_ ) {
+			--shrinkDelay_;
+			return;
+		}
+
+		limit -= limit / 8;
+		if ( limit < minLimit )
+			limit = minLimit;
+	}
+
+	if ( limit == oldLimit )
+		return;
+
+	logger << DEBUG << "Page cache limit: " << oldLimit << " -> " << limit << " (" << misses << "/" << window
+	       << " misses, " << evictions << " evictions)" << std::flush;
+
+	cacheLimit_ = limit;
+
+	if ( limit > oldLimit )
+		return;
+
+	// Give the memory back now, eviction would otherwise only happen on the next misses
+	for ( auto &&s : shards_ ) {
+		std::lock_guard<std::mutex> guard( s.mutex_ );
+		cleanup( s );
+	}
+
+	windowEvictions_ = 0; // these weren't caused by misses
+}
+
+size_t PageCache::setReadAhead( size_t pages )
+{
+	readAhead_ = pages > MAX_READ_AHEAD ? MAX_READ_AHEAD : pages;
+
+	return readAhead_;
+}
+
 void PageCache::reset()
 {
+	// It maps through driver_, which is usually about to go away
+	stopReadAhead();
+
+	// Reverse entries go first, release() relies on them to tell whether a page is still cached
+	for ( auto &&rs : reverseShards_ ) {
+		std::lock_guard<std::mutex> guard( rs.mutex_ );
+		rs.reverseCache_.clear();
+	}
+
+	for ( auto &&s : shards_ ) {
+		std::lock_guard<std::mutex> guard( s.mutex_ );
+
+		if ( driver_ ) {
+			for ( auto &&item : s.cache_ ) {
+				if ( item.second.inUse )
+					logger << TRACE << "Address " << item.second.pointer << " (gfn " << std::hex
+					       << item.first << std::dec << ") is still mapped (" << item.second.inUse
+					       << ") ?!" << std::flush;
+
+				driver_->unmapGuestPageImpl( item.second.pointer, item.first );
+			}
+		}
+
+		mapped_ -= s.cache_.size();
+		s.cache_.clear();
+		s.lru_.clear();
+	}
+
+	std::lock_guard<std::mutex> guard( rangeMutex_ );
+
 	if ( driver_ ) {
-		for ( auto &&item : cache_ ) {
+		for ( auto &&item : rangeCache_ ) {
 			if ( item.second.inUse )
-				logger << TRACE << "Address " << item.second.pointer << " (gfn " << std::hex
-				       << reverseCache_[item.second.pointer] << std::dec << ") is still mapped ("
-				       << item.second.inUse << ") ?!" << std::flush;
+				logger << TRACE << "Address " << item.second.pointer << " (" << item.first.size()
+				       << " gfns starting at " << std::hex << item.first.front() << std::dec
+				       << ") is still mapped (" << item.second.inUse << ") ?!" << std::flush;
 
-			driver_->unmapGuestPageImpl( item.second.pointer, item.first );
+			driver_->unmapGuestPagesImpl( item.second.pointer, item.first.size() );
 		}
 	}
 
-	cache_.clear();
+	rangeCache_.clear();
+	reverseRangeCache_.clear();
+	rangeLru_.clear();
 }
 
 PageCache::~PageCache()
 {
+	stopReadAhead();
+
+	if ( driver_ && ( hits_ || misses_ ) )
+		logger << DEBUG << "Page cache: " << hits_ << " hits, " << misses_ << " misses, " << evictions_
+		       << " evictions, " << notPresent_ << " not present, " << mapFailures_ << " failed maps"
+		       << std::flush;
+
 	reset();
 }
 
 MapReturnCode PageCache::update( unsigned long gfn, void *&pointer )
 {
-	auto i = cache_.find( gfn );
+	MapReturnCode mrc = MAP_SUCCESS;
+	bool          hit = false;
 
-	if ( i == cache_.end() ) // not found
-		return insertNew( gfn, pointer );
+	{
+		Shard &                     s = shard( gfn );
+		std::lock_guard<std::mutex> guard( s.mutex_ );
 
-	i->second.accessed = generateIndex();
-	++i->second.inUse;
+		auto i = s.cache_.find( gfn );
 
-	pointer = i->second.pointer;
-	return MAP_SUCCESS;
+		if ( i != s.cache_.end() ) {
+			if ( i->second.onLru ) { // idle page, no longer an eviction candidate
+				s.lru_.erase( i->second.lruPos );
+				i->second.onLru = false;
+			}
+
+			++i->second.inUse;
+
+			pointer = i->second.pointer;
+			hit     = true;
+		} else
+			mrc = insertNew( s, gfn, pointer );
+	}
+
+	// Outside the shard lock, adapting the limit may trim all shards
+	countLookup( hit );
+
+	if ( hit )
+		return MAP_SUCCESS;
+
+	// The pages that follow live in other shards
+	if ( mrc == MAP_SUCCESS )
+		readAheadAfterMiss( gfn );
+
+	return mrc;
+}
+
+bool PageCache::contains( unsigned long gfn )
+{
+	Shard &                     s = shard( gfn );
+	std::lock_guard<std::mutex> guard( s.mutex_ );
+
+	return s.cache_.find( gfn ) != s.cache_.end();
+}
+
+void PageCache::readAheadAfterMiss( unsigned long gfn )
+{
+	size_t count = readAhead_;
+
+	if ( !count )
+		return;
+
+	// Approximate when several threads miss at the same time, which is fine for a hint
+	if ( nextExpectedGfn_.exchange( gfn + 1 ) != gfn ) {
+		sequentialMisses_ = 0;
+		return;
+	}
+
+	if ( ++sequentialMisses_ < READ_AHEAD_THRESHOLD )
+		return;
+
+	// The stream continues right after what we're about to map
+	nextExpectedGfn_ = gfn + count + 1;
+
+	ReadAheadWorker &           w = readAheadWorker_;
+	std::lock_guard<std::mutex> guard( w.mutex_ );
+
+	if ( w.stop_ )
+		return;
+
+	for ( size_t i = 1; i <= count; ++i )
+		w.gfns_.push_back( gfn + i );
+
+	// A thread that can't keep up would otherwise be mapping pages nobody wants anymore
+	if ( w.gfns_.size() > MAX_READ_AHEAD_BACKLOG )
+		w.gfns_.erase( w.gfns_.begin(), w.gfns_.end() - MAX_READ_AHEAD_BACKLOG );
+
+	if ( !w.thread_.joinable() )
+		w.thread_ = std::thread( &PageCache::runReadAhead, this );
+	else
+		w.wake_.notify_one();
+}
+
+void PageCache::runReadAhead()
+{
+	ReadAheadWorker &               w = readAheadWorker_;
+	std::vector<unsigned long long> gfns;
+
+	for ( ;; ) {
+		{
+			std::unique_lock<std::mutex> lock( w.mutex_ );
+
+			w.wake_.wait( lock, [&w]() { return w.stop_ || !w.gfns_.empty(); } );
+
+			if ( w.stop_ )
+				return;
+
+			gfns.swap( w.gfns_ );
+		}
+
+		prefetch( gfns.data(), gfns.size() );
+		gfns.clear();
+	}
+}
+
+void PageCache::stopReadAhead()
+{
+	ReadAheadWorker &w = readAheadWorker_;
+
+	{
+		std::lock_guard<std::mutex> guard( w.mutex_ );
+
+		if ( !w.thread_.joinable() )
+			return;
+
+		w.stop_ = true;
+		w.gfns_.clear();
+	}
+
+	w.wake_.notify_one();
+	w.thread_.join();
+
+	// The next read-ahead starts a new one
+	std::lock_guard<std::mutex> guard( w.mutex_ );
+	w.stop_ = false;
+}
+
+void PageCache::prefetch( const unsigned long long *gfns, size_t count )
+{
+	if ( !driver_ )
+		return;
+
+	for ( size_t i = 0; i < count; ++i ) {
+		if ( contains( gfns[i] ) )
+			continue;
+
+		void *mapped = nullptr;
+
+		if ( mapNew( gfns[i], mapped ) != MAP_SUCCESS )
+			continue;
+
+		Shard &                     s = shard( gfns[i] );
+		std::lock_guard<std::mutex> guard( s.mutex_ );
+
+		// Somebody else has mapped it in the meantime
+		if ( s.cache_.find( gfns[i] ) != s.cache_.end() ) {
+			driver_->unmapGuestPageImpl( mapped, gfns[i] );
+			continue;
+		}
+
+		if ( mapped_ >= cacheLimit_ )
+			cleanup( s );
+
+		insertMapped( s, gfns[i], mapped, false );
+	}
 }
 
 bool PageCache::release( void *pointer )
 {
-	auto ri = reverseCache_.find( pointer );
+	unsigned long gfn;
 
-	if ( ri == reverseCache_.end() )
-		return false; // nothing to do, not in cache
+	{
+		ReverseShard &              rs = reverseShard( pointer );
+		std::lock_guard<std::mutex> guard( rs.mutex_ );
 
-	auto ci = cache_.find( ri->second );
+		auto i = rs.reverseCache_.find( pointer );
 
-	if ( ci == cache_.end() )
-		return false;
+		if ( i == rs.reverseCache_.end() )
+			return false; // nothing to do, not in cache
+
+		// Evicting the page drops its reverse entry first, so it's alive while we hold the lock.
+		// Dropping one of several references doesn't need the shard lock.
+		std::atomic<int> &inUse = i->second.info->inUse;
+		int               old   = inUse;
+
+		while ( old > 1 )
+			if ( inUse.compare_exchange_weak( old, old - 1 ) )
+				return true;
+
+		gfn = i->second.gfn;
+	}
+
+	// The last reference (or an unbalanced release): only update() can add references, and
+	// only evict() can drop the entry, both under the shard lock
+	Shard &                     s = shard( gfn );
+	std::lock_guard<std::mutex> guard( s.mutex_ );
 
-	--ci->second.inUse; // decrease refcount
+	auto ci = s.cache_.find( gfn );
+
+	// Only an unreferenced page can be evicted in the meantime, and that one's been unmapped
+	// by the cache already, so the caller mustn't unmap it either
+	if ( ci == s.cache_.end() || ci->second.pointer != pointer ) {
+		logger << WARNING << "Unbalanced release of " << pointer << " (gfn " << std::hex << gfn << std::dec
+		       << ")" << std::flush;
+		return true;
+	}
+
+	std::atomic<int> &inUse = ci->second.inUse;
+	int               old   = inUse;
+
+	// Other threads may still be dropping references of their own
+	do {
+		// Unbalanced release: the page is still cached, so it mustn't be unmapped
+		if ( old < 1 ) {
+			logger << WARNING << "Unbalanced release of " << pointer << " (gfn " << std::hex << gfn
+			       << std::dec << ")" << std::flush;
+			return true;
+		}
+	} while ( !inUse.compare_exchange_weak( old, old - 1 ) );
+
+	if ( old == 1 && !ci->second.onLru ) {
+		ci->second.lruPos = s.lru_.insert( s.lru_.begin(), ci->first );
+		ci->second.onLru  = true;
+	}
 
 	return true;
 }
 
-MapReturnCode PageCache::insertNew( unsigned long gfn, void *&pointer )
+MapReturnCode PageCache::insertNew( Shard &s, unsigned long gfn, void *&pointer )
 {
 	if ( !driver_ ) {
 		pointer = nullptr;
 		return MAP_FAILED_GENERIC;
 	}
 
-	if ( cache_.size() >= cacheLimit_ )
-		cleanup();
+	if ( mapped_ >= cacheLimit_ )
+		cleanup( s );
 
-	CacheInfo ci;
+	MapReturnCode mrc = mapNew( gfn, pointer );
 
-	ci.accessed = generateIndex();
-	ci.inUse    = 1;
-	ci.pointer  = driver_->mapGuestPageImpl( gfn );
+	if ( mrc == MAP_SUCCESS )
+		insertMapped( s, gfn, pointer, true );
+
+	return mrc;
+}
+
+MapReturnCode PageCache::mapNew( unsigned long gfn, void *&pointer )
+{
+	void *mapped = driver_->mapGuestPageImpl( gfn );
+
+	if ( !mapped ) {
+		++mapFailures_;
+		countStat( "pageCacheMapFailure" );
 
-	if ( !ci.pointer ) {
 		/*
 		logger << ERROR << "xc_map_foreign_range(0x" << std::setfill( '0' ) << std::setw( 16 )
 		        << std::hex << gfn << ") failed: " << strerror( errno ) << std::flush;
@@ -133,59 +516,202 @@ MapReturnCode PageCache::insertNew( unsigned long gfn, void *&pointer )
 		return MAP_FAILED_GENERIC;
 	}
 
-	if ( !checkPages( ci.pointer, PAGE_SIZE ) ) {
+	if ( !checkPages( mapped, PAGE_SIZE ) ) {
 		logger << ERROR << "check_pages(0x" << std::setfill( '0' ) << std::setw( 16 ) << std::hex << gfn
 		       << ") failed: " << strerror( errno ) << std::flush;
 
-		driver_->unmapGuestPageImpl( ci.pointer, gfn );
+		driver_->unmapGuestPageImpl( mapped, gfn );
+
+		++notPresent_;
+		countStat( "pageCacheNotPresent" );
 
 		pointer = nullptr;
 		return MAP_PAGE_NOT_PRESENT;
 	}
 
-	cache_[gfn]               = ci;
-	reverseCache_[ci.pointer] = gfn;
-
-	pointer = ci.pointer;
+	pointer = mapped;
 	return MAP_SUCCESS;
 }
 
-void PageCache::cleanup()
+void PageCache::insertMapped( Shard &s, unsigned long gfn, void *mapped, bool pin )
 {
-	std::vector<std::pair<unsigned long, unsigned long>> timeOrderedGFNs;
+	auto ci = s.cache_.emplace( std::piecewise_construct, std::forward_as_tuple( gfn ), std::forward_as_tuple() )
+	              .first;
 
-	for ( auto &&item : cache_ )
-		if ( item.second.inUse < 1 )
-			timeOrderedGFNs.push_back(
-			    std::pair<unsigned long, unsigned long>( item.second.accessed, item.first ) );
+	ci->second.pointer = mapped;
+	++mapped_;
 
-	if ( timeOrderedGFNs.empty() ) // All mapped pages are in use.
-		return;
+	if ( !pin ) { // prefetched, idle until somebody asks for it
+		ci->second.inUse  = 0;
+		ci->second.lruPos = s.lru_.insert( s.lru_.begin(), gfn );
+		ci->second.onLru  = true;
+	}
 
-	std::sort( timeOrderedGFNs.begin(), timeOrderedGFNs.end(),
-	           []( const auto &lhs, const auto &rhs ) { return lhs.first < rhs.first; } );
+	{
+		ReverseShard &              rs = reverseShard( mapped );
+		std::lock_guard<std::mutex> guard( rs.mutex_ );
 
-	size_t count = 0;
+		ReverseInfo &ri = rs.reverseCache_[mapped];
 
-	for ( auto &&item : timeOrderedGFNs ) {
-		if ( count++ >= cacheLimit_ / 2 )
+		ri.gfn  = gfn;
+		ri.info = &ci->second;
+	}
+}
+
+void PageCache::cleanup( Shard &s )
+{
+	// Evict just enough least recently used idle pages to make room for one
+	// more, so that the cost of keeping the cache bounded is paid a little at
+	// a time instead of in one big burst when the limit is hit. If all mapped
+	// pages are in use, the cache is allowed to temporarily grow past the limit.
+	size_t limit = cacheLimit_;
+	size_t share = std::max<size_t>( limit / SHARD_COUNT, 1 );
+
+	while ( mapped_ >= limit ) {
+		// Under its share, s takes room back from a shard that has borrowed it
+		if ( s.cache_.size() < share && reclaim( s, share ) )
+			continue;
+
+		if ( !evictOldest( s ) )
 			break;
+	}
+}
+
+bool PageCache::reclaim( Shard &s, size_t share )
+{
+	for ( auto &&other : shards_ ) {
+		if ( &other == &s )
+			continue;
 
-		auto ci = cache_.find( item.second );
+		// s is locked already, waiting for another shard here could deadlock
+		std::unique_lock<std::mutex> lock( other.mutex_, std::try_to_lock );
 
-		if ( ci == cache_.end() )
+		if ( lock && other.cache_.size() > share && evictOldest( other ) )
+			return true;
+	}
+
+	return false;
+}
+
+bool PageCache::evictOldest( Shard &s )
+{
+	while ( !s.lru_.empty() ) {
+		auto ci = s.cache_.find( s.lru_.back() );
+
+		if ( ci == s.cache_.end() ) {
+			s.lru_.pop_back();
 			continue;
+		}
+
+		evict( s, ci );
+		return true;
+	}
+
+	return false;
+}
+
+void PageCache::evict( Shard &s, CacheMap::iterator ci )
+{
+	if ( ci->second.onLru )
+		s.lru_.erase( ci->second.lruPos );
+
+	driver_->unmapGuestPageImpl( ci->second.pointer, ci->first );
+
+	{
+		ReverseShard &              rs = reverseShard( ci->second.pointer );
+		std::lock_guard<std::mutex> guard( rs.mutex_ );
+
+		rs.reverseCache_.erase( ci->second.pointer );
+	}
+
+	s.cache_.erase( ci );
+	--mapped_;
+
+	++evictions_;
+	++windowEvictions_;
+	countStat( "pageCacheEviction" );
+}
+
+MapReturnCode PageCache::updateRange( const unsigned long long *gfns, size_t count, void *&pointer )
+{
+	pointer = nullptr;
+
+	if ( !driver_ )
+		return MAP_FAILED_GENERIC;
+
+	std::vector<unsigned long long> key( gfns, gfns + count );
+	std::lock_guard<std::mutex>     guard( rangeMutex_ );
+
+	auto i = rangeCache_.find( key );
+
+	if ( i != rangeCache_.end() ) {
+		if ( i->second.inUse < 1 ) // idle view, no longer an eviction candidate
+			rangeLru_.erase( i->second.lruPos );
 
-		driver_->unmapGuestPageImpl( ci->second.pointer, ci->first );
-		reverseCache_.erase( ci->second.pointer );
-		cache_.erase( ci );
+		++i->second.inUse;
+
+		pointer = i->second.pointer;
+		return MAP_SUCCESS;
+	}
+
+	if ( rangeCache_.size() >= MAX_RANGE_CACHE_SIZE_DEFAULT )
+		cleanupRanges();
+
+	void *mapped = driver_->mapGuestPagesImpl( gfns, count );
+
+	if ( !mapped )
+		return MAP_FAILED_GENERIC;
+
+	if ( !checkPages( mapped, count * PAGE_SIZE ) ) {
+		logger << ERROR << "check_pages(0x" << std::setfill( '0' ) << std::setw( 16 ) << std::hex << gfns[0]
+		       << ", " << std::dec << count << ") failed: " << strerror( errno ) << std::flush;
+
+		driver_->unmapGuestPagesImpl( mapped, count );
+		return MAP_PAGE_NOT_PRESENT;
 	}
+
+	auto ri = rangeCache_.emplace( std::move( key ), RangeInfo() ).first;
+
+	ri->second.pointer         = mapped;
+	reverseRangeCache_[mapped] = ri;
+
+	pointer = mapped;
+	return MAP_SUCCESS;
 }
 
-unsigned long PageCache::generateIndex() const
+bool PageCache::releaseRange( void *pointer )
 {
-	static unsigned long index = 0;
-	return index++;
+	std::lock_guard<std::mutex> guard( rangeMutex_ );
+
+	auto ri = reverseRangeCache_.find( pointer );
+
+	if ( ri == reverseRangeCache_.end() )
+		return false; // nothing to do, not in cache
+
+	RangeInfo &info = ri->second->second;
+
+	// Unbalanced release: the range is still cached, so it mustn't be unmapped
+	if ( info.inUse < 1 ) {
+		logger << WARNING << "Unbalanced release of range " << pointer << std::flush;
+		return true;
+	}
+
+	if ( --info.inUse < 1 ) // decrease refcount
+		info.lruPos = rangeLru_.insert( rangeLru_.begin(), ri->second );
+
+	return true;
+}
+
+void PageCache::cleanupRanges()
+{
+	while ( rangeCache_.size() >= MAX_RANGE_CACHE_SIZE_DEFAULT && !rangeLru_.empty() ) {
+		auto ri = rangeLru_.back();
+
+		rangeLru_.pop_back();
+		driver_->unmapGuestPagesImpl( ri->second.pointer, ri->first.size() );
+		reverseRangeCache_.erase( ri->second.pointer );
+		rangeCache_.erase( ri );
+	}
 }
 
 } // namespace bdvmi
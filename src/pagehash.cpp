@@ -0,0 +1,191 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "pagehash.h"
+#include "bdvmi/driver.h"
+#include <cstring>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define BDVMI_HASH_X86
+#endif
+
+namespace bdvmi {
+
+namespace {
+
+constexpr size_t   LANES         = 8;  // 64-bit accumulators, one stripe word each
+constexpr size_t   STRIPE_WORDS  = LANES; // 64 bytes
+constexpr size_t   BLOCK_STRIPES = 16; // stripes between scrambles (1 KiB)
+constexpr size_t   PAGE_WORDS    = PAGE_SIZE / sizeof( uint64_t );
+constexpr size_t   PAGE_BLOCKS   = PAGE_WORDS / ( STRIPE_WORDS * BLOCK_STRIPES );
+constexpr size_t   SCRAMBLE_KEY  = 24; // where the scramble key starts in SECRET
+constexpr uint32_t PRIME32_1     = 0x9e3779b1U;
+constexpr uint64_t PRIME64_1     = 0x9e3779b185ebca87ULL;
+constexpr uint64_t PRIME64_2     = 0xc2b2ae3d27d4eb4fULL;
+
+// Stripe s of a block is keyed with SECRET[s, s + LANES), like XXH3's sliding secret
+const uint64_t SECRET[32] __attribute__( ( aligned( 32 ) ) ) = {
+	0x6e789e6aa1b965f4ULL, 0x06c45d188009454fULL, 0xf88bb8a8724c81ecULL, 0x1b39896a51a8749bULL,
+	0x53cb9f0c747ea2eaULL, 0x2c829abe1f4532e1ULL, 0xc584133ac916ab3cULL, 0x3ee5789041c98ac3ULL,
+	0xf3b8488c368cb0a6ULL, 0x657eecdd3cb13d09ULL, 0xc2d326e0055bdef6ULL, 0x8621a03fe0bbdb7bULL,
+	0x8e1f7555983aa92fULL, 0xb54e0f1600cc4d19ULL, 0x84bb3f97971d80abULL, 0x7d29825c75521255ULL,
+	0xc3cf17102b7f7f86ULL, 0x3466e9a083914f64ULL, 0xd81a8d2b5a4485acULL, 0xdb01602b100b9ed7ULL,
+	0xa9038a921825f10dULL, 0xedf5f1d90dca2f6aULL, 0x54496ad67bd2634cULL, 0xdd7c01d4f5407269ULL,
+	0x935e82f1db4c4f7bULL, 0x69b82ebc92233300ULL, 0x40d29eb57de1d510ULL, 0xa2f09dabb45c6316ULL,
+	0xee521d7a0f4d3872ULL, 0xf16952ee72f3454fULL, 0x377d35dea8e40225ULL, 0x0c7de8064963bab0ULL,
+};
+
+static_assert( BLOCK_STRIPES - 1 + LANES <= SCRAMBLE_KEY, "stripe keys overlap the scramble key" );
+
+using Kernel = void ( * )( const uint8_t *page, uint64_t *acc );
+
+void accumulateScalar( const uint8_t *page, uint64_t *acc )
+{
+	for ( size_t b = 0; b < PAGE_BLOCKS; ++b ) {
+		for ( size_t s = 0; s < BLOCK_STRIPES; ++s ) {
+			const uint8_t *stripe = page + ( b * BLOCK_STRIPES + s ) * STRIPE_WORDS * sizeof( uint64_t );
+
+			for ( size_t i = 0; i < LANES; ++i ) {
+				uint64_t data;
+				memcpy( &data, stripe + i * sizeof( uint64_t ), sizeof( data ) );
+
+				uint64_t key = data ^ SECRET[s + i];
+
+				acc[i ^ 1] += data;
+				acc[i] += ( key & 0xffffffffULL ) * ( key >> 32 );
+			}
+		}
+
+		for ( size_t i = 0; i < LANES; ++i ) {
+			uint64_t a = acc[i];
+
+			a ^= a >> 47;
+			a ^= SECRET[SCRAMBLE_KEY + i];
+			acc[i] = a * PRIME32_1;
+		}
+	}
+}
+
+#ifdef BDVMI_HASH_X86
+
+__attribute__( ( target( "avx2" ) ) ) void accumulateAVX2( const uint8_t *page, uint64_t *acc )
+{
+	__m256i acc0 = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( acc ) );
+	__m256i acc1 = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( acc + 4 ) );
+
+	const __m256i prime = _mm256_set1_epi32( PRIME32_1 );
+
+	for ( size_t b = 0; b < PAGE_BLOCKS; ++b ) {
+		for ( size_t s = 0; s < BLOCK_STRIPES; ++s ) {
+			const __m256i *stripe = reinterpret_cast<const __m256i *>(
+			    page + ( b * BLOCK_STRIPES + s ) * STRIPE_WORDS * sizeof( uint64_t ) );
+
+			__m256i data0 = _mm256_loadu_si256( stripe );
+			__m256i data1 = _mm256_loadu_si256( stripe + 1 );
+			const __m256i *secret = reinterpret_cast<const __m256i *>( SECRET + s );
+
+			__m256i key0 = _mm256_xor_si256( data0, _mm256_loadu_si256( secret ) );
+			__m256i key1 = _mm256_xor_si256( data1, _mm256_loadu_si256( secret + 1 ) );
+
+			// acc[i ^ 1] += data: swap the 64-bit halves of every 128-bit lane
+			acc0 = _mm256_add_epi64( acc0, _mm256_shuffle_epi32( data0, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+			acc1 = _mm256_add_epi64( acc1, _mm256_shuffle_epi32( data1, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+
+			// acc[i] += low 32 bits of key * high 32 bits of key
+			acc0 = _mm256_add_epi64( acc0, _mm256_mul_epu32( key0, _mm256_srli_epi64( key0, 32 ) ) );
+			acc1 = _mm256_add_epi64( acc1, _mm256_mul_epu32( key1, _mm256_srli_epi64( key1, 32 ) ) );
+		}
+
+		__m256i *      accs[]   = { &acc0, &acc1 };
+		const __m256i *scramble = reinterpret_cast<const __m256i *>( SECRET + SCRAMBLE_KEY );
+
+		for ( size_t h = 0; h < 2; ++h ) {
+			__m256i a = *accs[h];
+
+			a = _mm256_xor_si256( a, _mm256_srli_epi64( a, 47 ) );
+			a = _mm256_xor_si256( a, _mm256_load_si256( scramble + h ) );
+
+			// 64 x 32 bit multiplication, as two 32 x 32 ones
+			__m256i lo = _mm256_mul_epu32( a, prime );
+			__m256i hi = _mm256_mul_epu32( _mm256_srli_epi64( a, 32 ), prime );
+
+			*accs[h] = _mm256_add_epi64( lo, _mm256_slli_epi64( hi, 32 ) );
+		}
+	}
+
+	_mm256_storeu_si256( reinterpret_cast<__m256i *>( acc ), acc0 );
+	_mm256_storeu_si256( reinterpret_cast<__m256i *>( acc + 4 ), acc1 );
+}
+
+#endif // BDVMI_HASH_X86
+
+struct KernelChoice {
+	Kernel      kernel;
+	const char *name;
+};
+
+KernelChoice chooseKernel()
+{
+#ifdef BDVMI_HASH_X86
+	__builtin_cpu_init();
+
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return { accumulateAVX2, "avx2" };
+#endif
+	return { accumulateScalar, "scalar" };
+}
+
+const KernelChoice &kernelChoice()
+{
+	static const KernelChoice choice = chooseKernel();
+
+	return choice;
+}
+
+uint64_t avalanche( uint64_t h )
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_1;
+	h ^= h >> 32;
+
+	return h;
+}
+
+} // anonymous namespace
+
+uint64_t pageHash( const void *page )
+{
+	uint64_t acc[LANES] = { PRIME32_1, PRIME64_1, PRIME64_2, PRIME64_1 ^ PRIME64_2,
+	                        ~PRIME64_1, ~PRIME64_2, PRIME64_1 + PRIME64_2, ~uint64_t( PRIME32_1 ) };
+
+	kernelChoice().kernel( static_cast<const uint8_t *>( page ), acc );
+
+	uint64_t h = PAGE_SIZE * PRIME64_1;
+
+	for ( size_t i = 0; i < LANES; ++i )
+		h = ( h ^ avalanche( acc[i] ^ SECRET[LANES + i] ) ) * PRIME64_2;
+
+	return avalanche( h );
+}
+
+const char *pageHashKernel()
+{
+	return kernelChoice().name;
+}
+
+} // namespace bdvmi
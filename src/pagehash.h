@@ -0,0 +1,34 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIPAGEHASH_H_INCLUDED__
+#define __BDVMIPAGEHASH_H_INCLUDED__
+
+#include <stdint.h>
+
+namespace bdvmi {
+
+// 64-bit digest of one 4 KiB page, for telling whether a page has changed (not cryptographic).
+// XXH3-style: eight independent 64-bit lanes take one 64 byte stripe per step, so the AVX2
+// kernel handles a stripe in two instructions' worth of lanes. The kernel is picked once, at
+// runtime, and every kernel returns the same digest for the same contents.
+uint64_t pageHash( const void *page );
+
+// "avx2" or "scalar"
+const char *pageHashKernel();
+
+} // namespace bdvmi
+
+#endif // __BDVMIPAGEHASH_H_INCLUDED__
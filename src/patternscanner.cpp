@@ -0,0 +1,189 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "patternscanner.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define BDVMI_SCAN_X86
+#endif
+
+namespace bdvmi {
+
+namespace {
+
+// Push index for every j < count where pattern occurs at data + j. The caller makes sure
+// that data[count - 1 + pattern.size() - 1] can be read.
+using Kernel = void ( * )( const uint8_t *data, size_t count, const std::string &pattern, size_t index,
+                           PatternScanner::Matches &matches );
+
+inline bool verify( const uint8_t *candidate, const std::string &pattern )
+{
+	// The first and last bytes are already known to match
+	return pattern.size() <= 2 || !memcmp( candidate + 1, pattern.data() + 1, pattern.size() - 2 );
+}
+
+// The scalar kernel from data + from on, also used for what's left over by the SIMD ones
+void scanFrom( const uint8_t *data, size_t count, const std::string &pattern, size_t index,
+               PatternScanner::Matches &matches, size_t from )
+{
+	const uint8_t  first = pattern.front();
+	const uint8_t  last  = pattern.back();
+	const size_t   tail  = pattern.size() - 1;
+	const uint8_t *p     = data + from;
+	const uint8_t *end   = data + count;
+
+	while ( p < end ) {
+		p = static_cast<const uint8_t *>( memchr( p, first, end - p ) );
+
+		if ( !p )
+			break;
+
+		if ( p[tail] == last && verify( p, pattern ) )
+			matches.push_back( { static_cast<size_t>( p - data ), index } );
+
+		++p;
+	}
+}
+
+void scanScalar( const uint8_t *data, size_t count, const std::string &pattern, size_t index,
+                 PatternScanner::Matches &matches )
+{
+	scanFrom( data, count, pattern, index, matches, 0 );
+}
+
+#ifdef BDVMI_SCAN_X86
+
+__attribute__( ( target( "sse2" ) ) ) void scanSSE2( const uint8_t *data, size_t count, const std::string &pattern,
+                                                     size_t index, PatternScanner::Matches &matches )
+{
+	const __m128i first = _mm_set1_epi8( pattern.front() );
+	const __m128i last  = _mm_set1_epi8( pattern.back() );
+	const size_t  tail  = pattern.size() - 1;
+	size_t        i     = 0;
+
+	for ( ; i + 16 <= count; i += 16 ) {
+		__m128i  a    = _mm_loadu_si128( reinterpret_cast<const __m128i *>( data + i ) );
+		__m128i  b    = _mm_loadu_si128( reinterpret_cast<const __m128i *>( data + i + tail ) );
+		uint32_t mask =
+		    _mm_movemask_epi8( _mm_and_si128( _mm_cmpeq_epi8( a, first ), _mm_cmpeq_epi8( b, last ) ) );
+
+		while ( mask ) {
+			size_t j = i + __builtin_ctz( mask );
+			mask &= mask - 1;
+
+			if ( verify( data + j, pattern ) )
+				matches.push_back( { j, index } );
+		}
+	}
+
+	scanFrom( data, count, pattern, index, matches, i );
+}
+
+__attribute__( ( target( "avx2" ) ) ) void scanAVX2( const uint8_t *data, size_t count, const std::string &pattern,
+                                                     size_t index, PatternScanner::Matches &matches )
+{
+	const __m256i first = _mm256_set1_epi8( pattern.front() );
+	const __m256i last  = _mm256_set1_epi8( pattern.back() );
+	const size_t  tail  = pattern.size() - 1;
+	size_t        i     = 0;
+
+	for ( ; i + 32 <= count; i += 32 ) {
+		__m256i  a    = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( data + i ) );
+		__m256i  b    = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( data + i + tail ) );
+		uint32_t mask = _mm256_movemask_epi8(
+		    _mm256_and_si256( _mm256_cmpeq_epi8( a, first ), _mm256_cmpeq_epi8( b, last ) ) );
+
+		while ( mask ) {
+			size_t j = i + __builtin_ctz( mask );
+			mask &= mask - 1;
+
+			if ( verify( data + j, pattern ) )
+				matches.push_back( { j, index } );
+		}
+	}
+
+	scanFrom( data, count, pattern, index, matches, i );
+}
+
+#endif // BDVMI_SCAN_X86
+
+struct KernelChoice {
+	Kernel      kernel;
+	const char *name;
+};
+
+KernelChoice chooseKernel()
+{
+#ifdef BDVMI_SCAN_X86
+	__builtin_cpu_init();
+
+	if ( __builtin_cpu_supports( "avx2" ) )
+		return { scanAVX2, "avx2" };
+
+	if ( __builtin_cpu_supports( "sse2" ) )
+		return { scanSSE2, "sse2" };
+#endif
+	return { scanScalar, "scalar" };
+}
+
+const KernelChoice &kernelChoice()
+{
+	static const KernelChoice choice = chooseKernel();
+
+	return choice;
+}
+
+} // anonymous namespace
+
+PatternScanner::PatternScanner( const std::vector<std::string> &patterns )
+    : patterns_{ patterns }
+{
+	for ( auto &&pattern : patterns_ )
+		maxLength_ = std::max( maxLength_, pattern.size() );
+}
+
+void PatternScanner::scan( const uint8_t *data, size_t length, size_t available, Matches &matches ) const
+{
+	Kernel kernel = kernelChoice().kernel;
+	size_t before = matches.size();
+
+	for ( size_t index = 0; index < patterns_.size(); ++index ) {
+		const std::string &pattern = patterns_[index];
+
+		if ( pattern.empty() || pattern.size() > available )
+			continue;
+
+		size_t count = std::min( length, available - pattern.size() + 1 );
+
+		if ( count )
+			kernel( data, count, pattern, index, matches );
+	}
+
+	// Every kernel run appends in offset order, merge them
+	if ( patterns_.size() > 1 )
+		std::sort( matches.begin() + before, matches.end(), []( const Match &a, const Match &b ) {
+			return a.offset_ < b.offset_ || ( a.offset_ == b.offset_ && a.pattern_ < b.pattern_ );
+		} );
+}
+
+const char *PatternScanner::kernelName()
+{
+	return kernelChoice().name;
+}
+
+} // namespace bdvmi
@@ -0,0 +1,66 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIPATTERNSCANNER_H_INCLUDED__
+#define __BDVMIPATTERNSCANNER_H_INCLUDED__
+
+#include <stdint.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+
+// Multi-pattern search over host memory (the guest pages mapped by Driver::scanPhysical()).
+// For every pattern, the positions where both its first and its last byte match are found 32
+// (AVX2) or 16 (SSE2) at a time, and only those get compared in full. The kernel is picked
+// once, at runtime, from what the CPU supports. Immutable after construction, so one scanner
+// can be shared by several threads.
+class PatternScanner {
+
+public:
+	struct Match {
+		size_t offset_;
+		size_t pattern_; // index into the patterns given to the constructor
+	};
+
+	using Matches = std::vector<Match>;
+
+public:
+	// Empty patterns never match
+	explicit PatternScanner( const std::vector<std::string> &patterns );
+
+public:
+	// Append the matches that start in [data, data + length) and end inside [data, data + available)
+	// to matches, ordered by offset (then by pattern). available >= length lets matches run past
+	// length, e.g. into the next page.
+	void scan( const uint8_t *data, size_t length, size_t available, Matches &matches ) const;
+
+	size_t maxLength() const
+	{
+		return maxLength_;
+	}
+
+	// "avx2", "sse2" or "scalar"
+	static const char *kernelName();
+
+private:
+	std::vector<std::string> patterns_;
+	size_t                   maxLength_{ 0 };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIPATTERNSCANNER_H_INCLUDED__
@@ -0,0 +1,96 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "regscache.h"
+#include <memory>
+
+namespace bdvmi {
+
+RegsCache::~RegsCache()
+{
+	for ( auto &&e : entries_ )
+		delete e.load();
+}
+
+RegsCache::Entry *RegsCache::entry( unsigned short vcpu ) const
+{
+	if ( vcpu >= MAX_VCPUS )
+		return nullptr;
+
+	Entry *e = entries_[vcpu].load( std::memory_order_acquire );
+
+	if ( e )
+		return e;
+
+	std::unique_ptr<Entry> newEntry( new Entry );
+
+	if ( entries_[vcpu].compare_exchange_strong( e, newEntry.get(), std::memory_order_acq_rel ) )
+		return newEntry.release();
+
+	return e; // another thread got there first
+}
+
+void RegsCache::stop( unsigned short vcpu, uint16_t view )
+{
+	Entry *e = entry( vcpu );
+
+	if ( !e )
+		return;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	e->stopped_ = true;
+	e->view_    = view;
+}
+
+void RegsCache::resume( unsigned short vcpu )
+{
+	Entry *e = entry( vcpu );
+
+	if ( !e )
+		return;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	e->stopped_ = false;
+	e->view_    = 0;
+	invalidate( *e );
+}
+
+void RegsCache::stopAll()
+{
+	allStopped_ = true;
+}
+
+void RegsCache::resumeAll()
+{
+	// Clear the flag first, so that nothing gets cached after the generation bump below
+	allStopped_ = false;
+
+	for ( auto &&slot : entries_ ) {
+		Entry *e = slot.load( std::memory_order_acquire );
+
+		if ( !e )
+			continue;
+
+		std::lock_guard<std::mutex> lock( e->mutex_ );
+
+		// vCPUs waiting for an event reply are still not going anywhere
+		if ( !e->stopped_ )
+			invalidate( *e );
+	}
+}
+
+} // namespace bdvmi
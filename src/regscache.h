@@ -0,0 +1,122 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIREGSCACHE_H_INCLUDED__
+#define __BDVMIREGSCACHE_H_INCLUDED__
+
+#include "bdvmi/driver.h"
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace bdvmi {
+
+// Per-vCPU register cache. A vCPU's registers are only cached while it can't run (it's waiting
+// for an event reply, or the whole domain is paused), and letting it run again bumps its
+// generation, which invalidates whatever had been cached at an older one. Entries are created
+// on first use and never move, so Registers pointers into them are good until the vCPU resumes.
+class RegsCache {
+
+public:
+	static constexpr size_t MAX_VCPUS = 4096;
+
+	struct Entry {
+		Registers  registers_;
+		uint64_t   generation_{ 0 };
+		uint64_t   cachedGeneration_{ ~0ULL }; // registers_ is good iff this == generation_
+		bool       stopped_{ false };          // in an event
+		uint32_t   dirty_{ 0 };                // Registers::Group bits that need to be written back
+		uint16_t   view_{ 0 };                 // the EPT view the vCPU was in when stopped
+		std::mutex mutex_;
+
+		// Backend-specific extended (XSAVE) state, cached the same way but filled separately.
+		// The buffer is kept around between uses.
+		std::vector<uint8_t> xsave_;
+		uint64_t             xsaveGeneration_{ ~0ULL };
+	};
+
+public:
+	RegsCache() = default;
+	~RegsCache();
+
+public:
+	// nullptr if vcpu >= MAX_VCPUS, i.e. that vCPU is simply never cached
+	Entry *entry( unsigned short vcpu ) const;
+
+	// The following are to be called with e.mutex_ held
+
+	bool cacheable( const Entry &e ) const
+	{
+		return e.stopped_ || allStopped_;
+	}
+
+	bool valid( const Entry &e ) const
+	{
+		return cacheable( e ) && e.cachedGeneration_ == e.generation_;
+	}
+
+	bool xsaveValid( const Entry &e ) const
+	{
+		return cacheable( e ) && e.xsaveGeneration_ == e.generation_;
+	}
+
+	// e.xsave_ has been filled in
+	void validateXsave( Entry &e ) const
+	{
+		e.xsaveGeneration_ = e.generation_;
+	}
+
+	// e.registers_ has been filled in
+	void validate( Entry &e ) const
+	{
+		e.cachedGeneration_ = e.generation_;
+		e.dirty_            = 0;
+	}
+
+	void fill( Entry &e, const Registers &regs ) const
+	{
+		e.registers_ = regs;
+		validate( e );
+	}
+
+	void invalidate( Entry &e ) const
+	{
+		++e.generation_;
+		e.dirty_ = 0;
+	}
+
+	// vcpu has stopped in an event, view is the EPT view it was running with
+	void stop( unsigned short vcpu, uint16_t view = 0 );
+
+	// vcpu is about to run again
+	void resume( unsigned short vcpu );
+
+	// The whole domain has been paused / is about to be unpaused
+	void stopAll();
+	void resumeAll();
+
+public: // no copying around
+	RegsCache( const RegsCache & ) = delete;
+	RegsCache &operator=( const RegsCache & ) = delete;
+
+private:
+	mutable std::array<std::atomic<Entry *>, MAX_VCPUS> entries_{};
+	std::atomic<bool>                                   allStopped_{ false };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIREGSCACHE_H_INCLUDED__
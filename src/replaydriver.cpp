@@ -0,0 +1,553 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "replaydriver.h"
+#include "bdvmi/logger.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bdvmi {
+
+ReplayDriver::ReplayDriver( const std::string &path )
+    : path_{ path }
+{
+	int fd = open( path.c_str(), O_RDONLY );
+
+	if ( fd < 0 )
+		throw std::runtime_error( "Could not open " + path + ": " + strerror( errno ) );
+
+	struct stat st;
+
+	if ( fstat( fd, &st ) < 0 || static_cast<size_t>( st.st_size ) < sizeof( trace::FileHeader ) ) {
+		::close( fd );
+		throw std::runtime_error( path + " is not an event trace" );
+	}
+
+	size_ = st.st_size;
+
+	// Private and writable, so the EventHandler can scribble on the pages as it would on a guest's
+	void *base = mmap( nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+
+	::close( fd );
+
+	if ( base == MAP_FAILED )
+		throw std::runtime_error( "Could not map " + path + ": " + strerror( errno ) );
+
+	base_ = static_cast<char *>( base );
+
+	const trace::FileHeader *header = reinterpret_cast<const trace::FileHeader *>( base_ );
+
+	if ( memcmp( header->magic_, trace::MAGIC, sizeof( header->magic_ ) ) || header->version_ != trace::VERSION ||
+	     header->pageSize_ != PAGE_SIZE || header->registersSize_ != sizeof( Registers ) ) {
+		munmap( base_, size_ );
+		throw std::runtime_error( path + " is not an event trace this build can replay" );
+	}
+
+	try {
+		scan();
+	} catch ( ... ) {
+		munmap( base_, size_ );
+		throw;
+	}
+
+	rewind();
+}
+
+ReplayDriver::~ReplayDriver()
+{
+	munmap( base_, size_ );
+}
+
+const trace::RecordHeader *ReplayDriver::record( uint64_t offset ) const
+{
+	if ( offset + sizeof( trace::RecordHeader ) > size_ )
+		return nullptr;
+
+	const trace::RecordHeader *rec = reinterpret_cast<const trace::RecordHeader *>( base_ + offset );
+
+	uint64_t metaSize = sizeof( trace::RecordHeader ) +
+	    static_cast<uint64_t>( rec->regsCount_ ) * sizeof( trace::RegistersEntry ) +
+	    static_cast<uint64_t>( rec->pageCount_ ) * sizeof( uint64_t );
+
+	if ( rec->dataOffset_ < metaSize || rec->size_ != rec->dataOffset_ + rec->pageCount_ * PAGE_SIZE ||
+	     rec->size_ > size_ - offset || ( rec->pageCount_ && ( offset + rec->dataOffset_ ) % PAGE_SIZE ) )
+		return nullptr;
+
+	return rec;
+}
+
+void ReplayDriver::scan()
+{
+	uint64_t offset = sizeof( trace::FileHeader );
+	size_t   count  = 0;
+
+	while ( offset < size_ ) {
+		const trace::RecordHeader *rec = record( offset );
+
+		if ( !rec ) {
+			// Most likely the recording process died mid-write, the rest is still good
+			logger << WARNING << path_ << ": corrupt record at offset " << offset << ", ignoring the rest"
+			       << std::flush;
+			break;
+		}
+
+		const auto *entries = reinterpret_cast<const trace::RegistersEntry *>( rec + 1 );
+		const auto *gfns    = reinterpret_cast<const uint64_t *>( entries + rec->regsCount_ );
+
+		if ( rec->flags_ & trace::FLAG_REGISTERS )
+			vcpuCount_ = std::max<unsigned int>( vcpuCount_, rec->vcpu_ + 1 );
+
+		for ( uint32_t i = 0; i < rec->regsCount_; ++i )
+			vcpuCount_ = std::max<unsigned int>( vcpuCount_, entries[i].vcpu_ + 1 );
+
+		for ( uint32_t i = 0; i < rec->pageCount_; ++i ) {
+			knownGfns_.insert( gfns[i] );
+			maxGfn_ = std::max<unsigned long long>( maxGfn_, gfns[i] );
+		}
+
+		offset += rec->size_;
+		++count;
+	}
+
+	end_ = offset;
+
+	if ( !count )
+		throw std::runtime_error( path_ + " has no events" );
+
+	if ( !vcpuCount_ )
+		vcpuCount_ = 1;
+
+	logger << INFO << "Replaying " << count << " records (" << knownGfns_.size() << " distinct pages, "
+	       << vcpuCount_ << " vCPUs) from " << path_ << std::flush;
+}
+
+void ReplayDriver::rewind()
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	offset_ = sizeof( trace::FileHeader );
+	pages_.clear();
+	registers_.clear();
+}
+
+const trace::RecordHeader *ReplayDriver::next()
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	if ( offset_ >= end_ )
+		return nullptr;
+
+	const trace::RecordHeader *rec     = record( offset_ );
+	const auto *               entries = reinterpret_cast<const trace::RegistersEntry *>( rec + 1 );
+	const auto *               gfns    = reinterpret_cast<const uint64_t *>( entries + rec->regsCount_ );
+	char *                     data    = base_ + offset_ + rec->dataOffset_;
+
+	if ( rec->flags_ & trace::FLAG_REGISTERS )
+		registers_[rec->vcpu_] = rec->regs_;
+
+	for ( uint32_t i = 0; i < rec->regsCount_; ++i )
+		registers_[entries[i].vcpu_] = entries[i].regs_;
+
+	for ( uint32_t i = 0; i < rec->pageCount_; ++i )
+		pages_[gfns[i]] = data + i * PAGE_SIZE;
+
+	offset_ += rec->size_;
+
+	return rec;
+}
+
+char *ReplayDriver::page( unsigned long long gfn ) const
+{
+	auto it = pages_.find( gfn );
+
+	return it != pages_.end() ? it->second : nullptr;
+}
+
+bool ReplayDriver::cpuCount( unsigned int &count ) const
+{
+	count = vcpuCount_;
+	return true;
+}
+
+bool ReplayDriver::tscSpeed( unsigned long long & /* speed */ ) const
+{
+	return false;
+}
+
+bool ReplayDriver::mtrrType( unsigned long long /* guestAddress */, uint8_t &type ) const
+{
+	type = 0x06; // write-back
+	return true;
+}
+
+bool ReplayDriver::registers( unsigned short vcpu, Registers &regs ) const
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	auto it = registers_.find( vcpu );
+
+	if ( it == registers_.end() )
+		return false;
+
+	regs = it->second;
+	return true;
+}
+
+bool ReplayDriver::cachedRegisters( unsigned short vcpu, const Registers *&regs ) const
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	auto it = registers_.find( vcpu );
+
+	if ( it == registers_.end() )
+		return false;
+
+	regs = &it->second;
+	return true;
+}
+
+bool ReplayDriver::readMsr( unsigned short vcpu, uint32_t msr, uint64_t &value ) const
+{
+	Registers regs;
+
+	return registers( vcpu, regs ) && regs.msr( msr, value );
+}
+
+bool ReplayDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool setEip, bool /* delay */ )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	Registers &current = registers_[vcpu];
+	uint64_t   rip     = current.rip;
+
+	current.assignGroups( regs, Registers::GROUP_WRITABLE );
+
+	if ( !setEip )
+		current.rip = rip;
+
+	return true;
+}
+
+MapReturnCode ReplayDriver::mapPhysMemToHost( unsigned long long address, size_t length, uint32_t /* flags */,
+                                              void *&pointer )
+{
+	pointer = nullptr;
+
+	if ( ( address & PAGE_MASK ) != ( ( address + length - 1 ) & PAGE_MASK ) )
+		return MAP_INVALID_PARAMETER;
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	char *p = page( gpa_to_gfn( address ) );
+
+	if ( !p )
+		return MAP_PAGE_NOT_PRESENT;
+
+	pointer = p + ( address & ~PAGE_MASK );
+
+	return MAP_SUCCESS;
+}
+
+bool ReplayDriver::unmapPhysMem( void * /* hostPtr */ )
+{
+	return true;
+}
+
+MapReturnCode ReplayDriver::mapGfns( const unsigned long long *gfns, size_t count, uint32_t flags, void *&pointer )
+{
+	pointer = nullptr;
+
+	if ( !gfns || !count )
+		return MAP_INVALID_PARAMETER;
+
+	if ( count == 1 )
+		return mapPhysMemToHost( gfn_to_gpa( gfns[0] ), PAGE_SIZE, flags, pointer );
+
+	// The pages aren't contiguous in the trace, so this is a copy (just like KVM's snapshots)
+	pointer = mapGuestPagesImpl( gfns, count );
+
+	return pointer ? MAP_SUCCESS : MAP_PAGE_NOT_PRESENT;
+}
+
+bool ReplayDriver::unmapGfns( void *hostPtr, size_t count )
+{
+	if ( count == 1 )
+		return unmapPhysMem( hostPtr );
+
+	unmapGuestPagesImpl( hostPtr, count );
+
+	return true;
+}
+
+bool ReplayDriver::injectTrap( unsigned short /* vcpu */, uint8_t /* trapNumber */, uint32_t /* errorCode */,
+                               uint64_t /* cr2 */ )
+{
+	return true;
+}
+
+bool ReplayDriver::setRepOptimizations( bool /* enable */ )
+{
+	return true;
+}
+
+bool ReplayDriver::shutdown()
+{
+	return true;
+}
+
+bool ReplayDriver::pause()
+{
+	return true;
+}
+
+bool ReplayDriver::unpause()
+{
+	return true;
+}
+
+size_t ReplayDriver::setPageCacheLimit( size_t limit )
+{
+	size_t old = pageCacheLimit_;
+
+	pageCacheLimit_ = limit;
+
+	return old;
+}
+
+bool ReplayDriver::setPageCacheLimitRange( size_t /* minLimit */, size_t /* maxLimit */ )
+{
+	return true;
+}
+
+bool ReplayDriver::pageCacheStats( PageCacheStats &stats )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	stats        = PageCacheStats();
+	stats.mapped = pages_.size();
+	stats.limit  = pageCacheLimit_;
+
+	return true;
+}
+
+size_t ReplayDriver::setPageCacheReadAhead( size_t /* pages */ )
+{
+	return 0;
+}
+
+void ReplayDriver::prefetchGfns( const unsigned long long * /* gfns */, size_t /* count */ )
+{
+}
+
+bool ReplayDriver::getXSAVESize( unsigned short /* vcpu */, size_t & /* size */ )
+{
+	return false;
+}
+
+bool ReplayDriver::getXSAVEArea( unsigned short /* vcpu */, void * /* buffer */, size_t /* bufSize */ )
+{
+	return false;
+}
+
+bool ReplayDriver::getEPTPageConvertible( unsigned short /* index */, unsigned long long /* guestAddress */,
+                                          bool &convertible )
+{
+	convertible = false;
+	return true;
+}
+
+bool ReplayDriver::createEPTImpl( unsigned short & /* index */ )
+{
+	return false;
+}
+
+bool ReplayDriver::destroyEPTImpl( unsigned short /* index */ )
+{
+	return false;
+}
+
+bool ReplayDriver::switchEPT( unsigned short /* index */ )
+{
+	return false;
+}
+
+bool ReplayDriver::setVEInfoPage( unsigned short /* vcpu */, unsigned long long /* gpa */ )
+{
+	return false;
+}
+
+bool ReplayDriver::disableVE( unsigned short /* vcpu */ )
+{
+	return false;
+}
+
+unsigned short ReplayDriver::eptpIndex( unsigned short /* vcpu */ ) const
+{
+	return 0;
+}
+
+bool ReplayDriver::update()
+{
+	return true;
+}
+
+std::string ReplayDriver::uuid() const
+{
+	return path_;
+}
+
+unsigned int ReplayDriver::id() const
+{
+	return 0;
+}
+
+uint32_t ReplayDriver::startTime()
+{
+	return 0;
+}
+
+bool ReplayDriver::isMsrCached( uint64_t msr ) const
+{
+	uint64_t value;
+
+	return Registers().msr( msr, value );
+}
+
+bool ReplayDriver::getXCR0( unsigned short /* vcpu */, uint64_t & /* xcr0 */ ) const
+{
+	return false;
+}
+
+void *ReplayDriver::mapGuestPageImpl( unsigned long long gfn )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	return page( gfn );
+}
+
+void ReplayDriver::unmapGuestPageImpl( void * /* hostPtr */, unsigned long long /* gfn */ )
+{
+}
+
+void *ReplayDriver::mapGuestPagesImpl( const unsigned long long *gfns, size_t count )
+{
+	void *copy = nullptr;
+
+	if ( posix_memalign( &copy, PAGE_SIZE, count * PAGE_SIZE ) )
+		return nullptr;
+
+	PageCopy holder( static_cast<char *>( copy ), ::free );
+
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	for ( size_t i = 0; i < count; ++i ) {
+		char *p = page( gfns[i] );
+
+		if ( !p )
+			return nullptr;
+
+		memcpy( holder.get() + i * PAGE_SIZE, p, PAGE_SIZE );
+	}
+
+	ranges_.emplace( copy, std::move( holder ) );
+
+	return copy;
+}
+
+void ReplayDriver::unmapGuestPagesImpl( void *hostPtr, size_t /* count */ )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	ranges_.erase( hostPtr );
+}
+
+bool ReplayDriver::setPageProtectionImpl( const MemAccessMap & /* accessMap */, unsigned short /* view */ )
+{
+	return true;
+}
+
+bool ReplayDriver::setPageConvertibleImpl( const ConvertibleMap & /* convMap */, unsigned short /* view */ )
+{
+	return true;
+}
+
+bool ReplayDriver::getPageProtectionImpl( unsigned long long /* guestAddress */, bool &read, bool &write,
+                                          bool &execute, unsigned short /* view */ )
+{
+	read = write = execute = true;
+	return true;
+}
+
+bool ReplayDriver::getPageProtectionRangeImpl( unsigned long long /* firstGfn */, size_t count, uint8_t *access,
+                                               unsigned short /* view */ )
+{
+	memset( access, PAGE_READ | PAGE_WRITE | PAGE_EXECUTE, count );
+	return true;
+}
+
+bool ReplayDriver::maxGPFNImpl( unsigned long long &gfn )
+{
+	gfn = maxGfn_;
+	return true;
+}
+
+void ReplayDriver::probeGfnsImpl( unsigned long long firstGfn, size_t count, std::vector<bool> &present )
+{
+	present.assign( count, false );
+
+	for ( size_t i = 0; i < count; ++i )
+		present[i] = knownGfns_.count( firstGfn + i ) != 0;
+}
+
+bool ReplayDriver::readPhysicalImpl( unsigned long long gpa, void *buffer, size_t length )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	char *p = page( gpa_to_gfn( gpa ) );
+
+	if ( !p || ( gpa & ~PAGE_MASK ) + length > PAGE_SIZE )
+		return false;
+
+	memcpy( buffer, p + ( gpa & ~PAGE_MASK ), length );
+	return true;
+}
+
+bool ReplayDriver::writePhysicalImpl( unsigned long long gpa, const void *buffer, size_t length )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	char *p = page( gpa_to_gfn( gpa ) );
+
+	if ( !p || ( gpa & ~PAGE_MASK ) + length > PAGE_SIZE )
+		return false;
+
+	memcpy( p + ( gpa & ~PAGE_MASK ), buffer, length );
+	return true;
+}
+
+bool ReplayDriver::isPageCached( unsigned long long gfn )
+{
+	std::lock_guard<std::mutex> lock( mutex_ );
+
+	return page( gfn ) != nullptr;
+}
+
+} // namespace bdvmi
@@ -0,0 +1,334 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "replayeventmanager.h"
+#include "bdvmi/eventhandler.h"
+#include "bdvmi/statscollector.h"
+#include "replaydriver.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace bdvmi {
+
+namespace {
+
+EventTrace::EventType traceType( uint32_t type )
+{
+	switch ( type ) {
+		case trace::RECORD_CR:
+			return EventTrace::CR;
+		case trace::RECORD_MSR:
+			return EventTrace::MSR;
+		case trace::RECORD_PAGE_FAULT:
+			return EventTrace::PAGE_FAULT;
+		case trace::RECORD_VMCALL:
+			return EventTrace::VMCALL;
+		case trace::RECORD_XSETBV:
+			return EventTrace::XSETBV;
+		case trace::RECORD_BREAKPOINT:
+			return EventTrace::BREAKPOINT;
+		case trace::RECORD_INTERRUPT:
+			return EventTrace::INTERRUPT;
+		case trace::RECORD_DESCRIPTOR:
+			return EventTrace::DESCRIPTOR;
+		default:
+			return EventTrace::OTHER;
+	}
+}
+
+} // namespace
+
+ReplayEventManager::ReplayEventManager( ReplayDriver &driver, sig_atomic_t &sigStop )
+    : EventManager{ sigStop }
+    , driver_{ driver }
+{
+}
+
+ReplayEventManager::~ReplayEventManager()
+{
+	if ( eventFd_ != -1 )
+		close( eventFd_ );
+}
+
+std::string ReplayEventManager::uuid()
+{
+	return driver_.uuid();
+}
+
+void ReplayEventManager::waitForEvents()
+{
+	while ( !stop_ ) {
+		if ( sigStop_ )
+			stop();
+
+		const trace::RecordHeader *rec = driver_.next();
+
+		if ( !rec )
+			break;
+
+		if ( rec->type_ != trace::RECORD_PAGES )
+			handleRecord( *rec );
+	}
+
+	completeDeferred();
+}
+
+std::vector<int> ReplayEventManager::pollFds()
+{
+	if ( eventFd_ == -1 ) {
+		eventFd_ = eventfd( 1, EFD_CLOEXEC );
+
+		if ( eventFd_ == -1 )
+			return {};
+	}
+
+	return { eventFd_ };
+}
+
+size_t ReplayEventManager::processPending( size_t budget )
+{
+	size_t events = 0;
+	bool   over   = false;
+
+	if ( finished_ )
+		return 0;
+
+	while ( !stop_ && ( !budget || events < budget ) ) {
+		if ( sigStop_ )
+			stop();
+
+		const trace::RecordHeader *rec = driver_.next();
+
+		if ( !rec ) {
+			over = true;
+			break;
+		}
+
+		if ( rec->type_ != trace::RECORD_PAGES ) {
+			handleRecord( *rec );
+			++events;
+		}
+	}
+
+	if ( over || stop_ ) {
+		completeDeferred();
+		finished_ = true;
+	}
+
+	return events;
+}
+
+void ReplayEventManager::handleRecord( const trace::RecordHeader &rec )
+{
+	EventHandler *h = handler();
+
+	if ( !h )
+		return;
+
+	if ( rec.type_ == trace::RECORD_SESSION_OVER ) {
+		h->handleSessionOver( static_cast<GuestState>( rec.args_[0] ) );
+		return;
+	}
+
+	StatsCounter      counter( "eventCount" );
+	EventTrace::Scope scope( driver_.eventTrace(), rec.vcpu_, traceType( rec.type_ ), rec.args_[0] );
+
+	HVAction        action          = NONE;
+	unsigned short  instructionSize = 0;
+	unsigned short  vcpu            = rec.vcpu_;
+	const Registers regs            = rec.regs_;
+
+	EventTrace::handlerStart();
+
+	switch ( rec.type_ ) {
+		case trace::RECORD_CR:
+			if ( filterCr( rec.args_[0], rec.args_[1], rec.args_[2], action ) )
+				break;
+
+			if ( rec.args_[0] == 3 )
+				driver_.flushTranslations( rec.args_[2] );
+			else
+				driver_.flushTranslations();
+
+			h->runPreEvent();
+			h->handleCR( vcpu, rec.args_[0], regs, rec.args_[1], rec.args_[2], action );
+			h->runPostEvent();
+
+			checkAnswer( rec, action, 0 );
+			break;
+
+		case trace::RECORD_MSR:
+			if ( filterMsr( rec.args_[0], rec.args_[1], rec.args_[2], action ) )
+				break;
+
+			h->runPreEvent();
+			h->handleMSR( vcpu, rec.args_[0], rec.args_[1], rec.args_[2], action );
+			h->runPostEvent();
+
+			checkAnswer( rec, action, 0 );
+			break;
+
+		case trace::RECORD_PAGE_FAULT: {
+			const bool read    = rec.flags_ & trace::FLAG_READ;
+			const bool write   = rec.flags_ & trace::FLAG_WRITE;
+			const bool execute = rec.flags_ & trace::FLAG_EXECUTE;
+
+			if ( filterPageFault( gpa_to_gfn( rec.args_[0] ), read, write, execute, action ) )
+				break;
+
+			EmulatorContext emulatorCtx;
+
+			driver_.retireTranslationWrites( vcpu );
+
+			if ( write )
+				driver_.invalidateTranslations( vcpu, gpa_to_gfn( rec.args_[0] ) );
+
+			h->runPreEvent();
+
+			beginDeferrable();
+
+			h->handlePageFault( vcpu, regs, rec.args_[0], rec.args_[1], read, write, execute,
+			                    rec.flags_ & trace::FLAG_IN_GPT, action, emulatorCtx, instructionSize );
+
+			uint64_t deferred = endDeferrable();
+
+			// There's no vCPU waiting for it
+			if ( deferred ) {
+				scope.flags( EventTrace::FLAG_DEFERRED );
+				deferReply( deferred, []( const Completion & ) { return true; } );
+			}
+
+			h->runPostEvent();
+
+			checkAnswer( rec, action, instructionSize );
+			break;
+		}
+
+		case trace::RECORD_VMCALL:
+			h->runPreEvent();
+			h->handleVMCALL( vcpu, regs );
+			h->runPostEvent();
+			break;
+
+		case trace::RECORD_XSETBV:
+			h->runPreEvent();
+			h->handleXSETBV( vcpu );
+			h->runPostEvent();
+			break;
+
+		case trace::RECORD_BREAKPOINT: {
+			h->runPreEvent();
+
+			bool handled = h->handleBreakpoint( vcpu, regs, rec.args_[0] );
+
+			h->runPostEvent();
+
+			if ( handled != !!( rec.flags_ & trace::FLAG_HANDLED ) ) {
+				StatsCounter mismatchCounter( "replayMismatches" );
+			}
+			break;
+		}
+
+		case trace::RECORD_INTERRUPT:
+			h->runPreEvent();
+			h->handleInterrupt( vcpu, regs, rec.args_[0], rec.args_[1], rec.args_[2] );
+			h->runPostEvent();
+			break;
+
+		case trace::RECORD_DESCRIPTOR:
+			h->runPreEvent();
+			h->handleDescriptorAccess( vcpu, regs, rec.args_[0], instructionSize, action );
+			h->runPostEvent();
+
+			checkAnswer( rec, action, instructionSize );
+			break;
+
+		default:
+			break;
+	}
+
+	EventTrace::handlerEnd();
+
+	driver_.flushPageProtections();
+}
+
+void ReplayEventManager::checkAnswer( const trace::RecordHeader &rec, HVAction action, unsigned short instructionSize )
+{
+	if ( rec.action_ != static_cast<uint32_t>( action ) || rec.instructionSize_ != instructionSize ) {
+		StatsCounter mismatchCounter( "replayMismatches" );
+	}
+}
+
+bool ReplayEventManager::enableMsrEventsImpl( unsigned int /* msr */ )
+{
+	return true;
+}
+
+bool ReplayEventManager::disableMsrEventsImpl( unsigned int /* msr */ )
+{
+	return true;
+}
+
+bool ReplayEventManager::enableCrEventsImpl( unsigned int /* cr */ )
+{
+	return true;
+}
+
+bool ReplayEventManager::disableCrEventsImpl( unsigned int /* cr */ )
+{
+	return true;
+}
+
+bool ReplayEventManager::enableXSETBVEventsImpl()
+{
+	return true;
+}
+
+bool ReplayEventManager::disableXSETBVEventsImpl()
+{
+	return true;
+}
+
+bool ReplayEventManager::enableBreakpointEventsImpl()
+{
+	return true;
+}
+
+bool ReplayEventManager::disableBreakpointEventsImpl()
+{
+	return true;
+}
+
+bool ReplayEventManager::enableVMCALLEventsImpl()
+{
+	return true;
+}
+
+bool ReplayEventManager::disableVMCALLEventsImpl()
+{
+	return true;
+}
+
+bool ReplayEventManager::enableDescriptorEventsImpl()
+{
+	return true;
+}
+
+bool ReplayEventManager::disableDescriptorEventsImpl()
+{
+	return true;
+}
+
+} // namespace bdvmi
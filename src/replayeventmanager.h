@@ -0,0 +1,99 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIREPLAYEVENTMANAGER_H_INCLUDED__
+#define __BDVMIREPLAYEVENTMANAGER_H_INCLUDED__
+
+#include "bdvmi/eventmanager.h"
+#include "tracefile.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace bdvmi {
+
+class ReplayDriver;
+
+// Feeds the events in a ReplayDriver's trace to the EventHandler, back to back, on the
+// thread calling waitForEvents(). The in-library filters apply as usual. Whenever the
+// handler answers differently than when the trace was recorded, "replayMismatches" is
+// bumped in StatsCollector, so a replay doubles as a (rough) regression check.
+class ReplayEventManager : public EventManager {
+
+public:
+	ReplayEventManager( ReplayDriver &driver, sig_atomic_t &sigStop );
+
+	virtual ~ReplayEventManager();
+
+public:
+	// Returns at the end of the trace
+	void waitForEvents() override;
+
+	// An eventfd that's always readable, the trace is there to be read
+	std::vector<int> pollFds() override;
+
+	size_t processPending( size_t budget ) override;
+
+	void stop() override
+	{
+		stop_ = true;
+	}
+
+	std::string uuid() override;
+
+private:
+	bool enableMsrEventsImpl( unsigned int msr ) override;
+
+	bool disableMsrEventsImpl( unsigned int msr ) override;
+
+	bool enableCrEventsImpl( unsigned int cr ) override;
+
+	bool disableCrEventsImpl( unsigned int cr ) override;
+
+	bool enableXSETBVEventsImpl() override;
+
+	bool disableXSETBVEventsImpl() override;
+
+	bool enableBreakpointEventsImpl() override;
+
+	bool disableBreakpointEventsImpl() override;
+
+	bool enableVMCALLEventsImpl() override;
+
+	bool disableVMCALLEventsImpl() override;
+
+	bool enableDescriptorEventsImpl() override;
+
+	bool disableDescriptorEventsImpl() override;
+
+private:
+	void handleRecord( const trace::RecordHeader &rec );
+
+	// Count the event if the handler has answered differently this time
+	static void checkAnswer( const trace::RecordHeader &rec, HVAction action, unsigned short instructionSize );
+
+public: // no copying around
+	ReplayEventManager( const ReplayEventManager & ) = delete;
+	ReplayEventManager &operator=( const ReplayEventManager & ) = delete;
+
+private:
+	ReplayDriver &    driver_;
+	std::atomic<bool> stop_{ false };
+	int               eventFd_{ -1 };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIREPLAYEVENTMANAGER_H_INCLUDED__
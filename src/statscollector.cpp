@@ -15,9 +15,60 @@
 
 #include "bdvmi/statscollector.h"
 #include "bdvmi/logger.h"
+#include <fstream>
+#include <sstream>
+#include <thread>
 
 namespace bdvmi {
 
+namespace {
+
+bool constantTsc()
+{
+	std::ifstream in( "/proc/cpuinfo" );
+	std::string   line;
+
+	while ( std::getline( in, line ) ) {
+		if ( line.compare( 0, 5, "flags" ) )
+			continue;
+
+		std::istringstream flags( line );
+		std::string        flag;
+
+		while ( flags >> flag )
+			if ( flag == "constant_tsc" )
+				return true;
+
+		return false;
+	}
+
+	return false;
+}
+
+} // anonymous namespace
+
+constexpr StatsCollector::CounterId StatsCollector::INVALID_COUNTER;
+constexpr size_t                    StatsCollector::MAX_COUNTERS;
+constexpr size_t                    StatsCollector::LITERAL_SLOTS;
+constexpr unsigned int              StatsCollector::SUB_BUCKET_BITS;
+constexpr unsigned int              StatsCollector::SUB_BUCKETS;
+constexpr unsigned int              StatsCollector::MAX_LOG2;
+constexpr unsigned int              StatsCollector::BUCKETS;
+
+bool StatsCollector::tsc_ = constantTsc();
+
+StatsCollector::Shard::~Shard()
+{
+	for ( auto &&slot : slots_ )
+		delete slot.histogram_.load( std::memory_order_relaxed );
+}
+
+StatsCollector::ShardHolder::~ShardHolder()
+{
+	if ( shard_ )
+		StatsCollector::instance().removeShard( shard_ );
+}
+
 StatsCollector &StatsCollector::instance()
 {
 	static StatsCollector theInstance;
@@ -26,40 +77,323 @@ StatsCollector &StatsCollector::instance()
 
 void StatsCollector::enable( bool value )
 {
+	std::lock_guard<std::mutex> lock( statsMutex_ );
+
+	if ( value && tsc_ && !calibrationTicks_ )
+		calibrate();
+
 	enable_ = value;
 
+	// Reset, without touching the shards that other threads are writing to
+	++epoch_;
+	retired_.clear();
+}
+
+void StatsCollector::calibrate()
+{
+	uint64_t ticks       = __rdtsc();
+	uint64_t nanoseconds = steadyNanoseconds();
+
+	// Good enough to start with, snapshot() refines it as time goes by
+	std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+
+	uint64_t elapsedTicks       = __rdtsc() - ticks;
+	uint64_t elapsedNanoseconds = steadyNanoseconds() - nanoseconds;
+
+	if ( !elapsedTicks )
+		return;
+
+	nsPerTick_              = ( static_cast<unsigned __int128>( elapsedNanoseconds ) << 32 ) / elapsedTicks;
+	calibrationTicks_       = ticks;
+	calibrationNanoseconds_ = nanoseconds;
+}
+
+void StatsCollector::refineCalibration()
+{
+	if ( !calibrationTicks_ )
+		return;
+
+	uint64_t elapsedTicks       = __rdtsc() - calibrationTicks_;
+	uint64_t elapsedNanoseconds = steadyNanoseconds() - calibrationNanoseconds_;
+
+	if ( elapsedTicks )
+		nsPerTick_ = ( static_cast<unsigned __int128>( elapsedNanoseconds ) << 32 ) / elapsedTicks;
+}
+
+uint64_t StatsCollector::nsPerTick()
+{
 	std::lock_guard<std::mutex> lock( statsMutex_ );
-	stats_.clear();
+
+	if ( tsc_ && !calibrationTicks_ )
+		calibrate();
+
+	refineCalibration();
+
+	return nsPerTick_;
+}
+
+StatsCollector::CounterId StatsCollector::intern( const std::string &name )
+{
+	std::lock_guard<std::mutex> lock( statsMutex_ );
+
+	auto it = ids_.find( name );
+
+	if ( it != ids_.end() )
+		return it->second;
+
+	if ( names_.size() >= MAX_COUNTERS ) {
+		logger << WARNING << "Too many stats counters, not counting " << name << std::flush;
+		return INVALID_COUNTER;
+	}
+
+	CounterId id = names_.size();
+
+	names_.push_back( name );
+	ids_.emplace( name, id );
+
+	return id;
+}
+
+StatsCollector::CounterId StatsCollector::literal( const char *name )
+{
+	size_t hash = ( ( reinterpret_cast<uintptr_t>( name ) >> 3 ) * 0x9e3779b97f4a7c15ULL ) >> 32;
+
+	for ( size_t i = 0; i < LITERAL_SLOTS; ++i ) {
+		const Literal &l = literals_[( hash + i ) & ( LITERAL_SLOTS - 1 )];
+		const char *   p = l.name_.load( std::memory_order_acquire );
+
+		if ( p == name )
+			return l.id_;
+
+		if ( !p )
+			break;
+	}
+
+	CounterId id = intern( name );
+
+	if ( id == INVALID_COUNTER )
+		return id;
+
+	std::lock_guard<std::mutex> lock( statsMutex_ );
+
+	for ( size_t i = 0; i < LITERAL_SLOTS; ++i ) {
+		Literal &   l = literals_[( hash + i ) & ( LITERAL_SLOTS - 1 )];
+		const char *p = l.name_.load( std::memory_order_relaxed );
+
+		if ( p == name )
+			break;
+
+		if ( !p ) {
+			l.id_ = id;
+			l.name_.store( name, std::memory_order_release );
+			break;
+		}
+	}
+
+	// If the table is full, name just keeps going through intern()
+	return id;
 }
 
 void StatsCollector::count( const std::string &st, const std::chrono::duration<double> &duration )
 {
-	if ( !enable_ )
+	if ( !enabled() )
 		return;
 
+	count( intern( st ), duration );
+}
+
+unsigned int StatsCollector::bucket( unsigned long long nanoseconds )
+{
+	if ( nanoseconds < SUB_BUCKETS )
+		return nanoseconds;
+
+	unsigned int log2 = 63 - __builtin_clzll( nanoseconds );
+
+	if ( log2 > MAX_LOG2 )
+		return BUCKETS - 1;
+
+	return ( log2 - SUB_BUCKET_BITS + 1 ) * SUB_BUCKETS +
+	    ( ( nanoseconds >> ( log2 - SUB_BUCKET_BITS ) ) & ( SUB_BUCKETS - 1 ) );
+}
+
+unsigned long long StatsCollector::bucketLimit( unsigned int index )
+{
+	if ( index < SUB_BUCKETS )
+		return index;
+
+	unsigned int shift = index / SUB_BUCKETS - 1;
+
+	return ( ( static_cast<unsigned long long>( SUB_BUCKETS + index % SUB_BUCKETS ) + 1 ) << shift ) - 1;
+}
+
+void StatsCollector::record( CounterId id, unsigned long long nanoseconds )
+{
+	// Relaxed loads and stores only: every slot has a single writer, so there's no need for
+	// (locked) read-modify-write operations
+	constexpr auto relaxed = std::memory_order_relaxed;
+
+	Slot &       slot  = localShard().slots_[id];
+	unsigned int epoch = epoch_.load( relaxed );
+	Histogram *  h     = slot.histogram_.load( relaxed );
+
+	if ( !h ) {
+		h = new Histogram();
+		slot.histogram_.store( h, std::memory_order_release );
+	}
+
+	if ( slot.epoch_.load( relaxed ) != epoch ) {
+		slot.count_.store( 0, relaxed );
+		slot.nanoseconds_.store( 0, relaxed );
+		slot.max_.store( 0, relaxed );
+
+		for ( auto &&b : *h )
+			b.store( 0, relaxed );
+
+		slot.epoch_.store( epoch, std::memory_order_release );
+	}
+
+	slot.count_.store( slot.count_.load( relaxed ) + 1, relaxed );
+	slot.nanoseconds_.store( slot.nanoseconds_.load( relaxed ) + nanoseconds, relaxed );
+
+	if ( nanoseconds > slot.max_.load( relaxed ) )
+		slot.max_.store( nanoseconds, relaxed );
+
+	std::atomic<unsigned long> &b = ( *h )[bucket( nanoseconds )];
+	b.store( b.load( relaxed ) + 1, relaxed );
+}
+
+StatsCollector::Shard *StatsCollector::addShard()
+{
+	Shard *shard = new Shard;
+
 	std::lock_guard<std::mutex> lock( statsMutex_ );
+	shards_.push_back( shard );
 
-	auto &value = stats_[st];
+	return shard;
+}
+
+void StatsCollector::removeShard( Shard *shard )
+{
+	{
+		std::lock_guard<std::mutex> lock( statsMutex_ );
+
+		if ( retired_.size() < names_.size() )
+			retired_.resize( names_.size() );
 
-	value.first++;
-	value.second += duration;
+		for ( size_t i = 0; i < names_.size(); ++i )
+			add( retired_[i], shard->slots_[i] );
+
+		for ( auto it = shards_.begin(); it != shards_.end(); ++it )
+			if ( *it == shard ) {
+				shards_.erase( it );
+				break;
+			}
+	}
+
+	delete shard;
 }
 
-void StatsCollector::dump() const
+void StatsCollector::add( Totals &totals, const Slot &slot ) const
 {
+	constexpr auto relaxed = std::memory_order_relaxed;
+
+	if ( slot.epoch_.load( std::memory_order_acquire ) != epoch_.load( relaxed ) )
+		return;
+
+	totals.count_ += slot.count_.load( relaxed );
+	totals.nanoseconds_ += slot.nanoseconds_.load( relaxed );
+	totals.max_ = std::max( totals.max_, slot.max_.load( relaxed ) );
+
+	const Histogram *h = slot.histogram_.load( std::memory_order_acquire );
+
+	if ( h )
+		for ( size_t i = 0; i < BUCKETS; ++i )
+			totals.buckets_[i] += ( *h )[i].load( relaxed );
+}
+
+std::vector<StatsCollector::Stat> StatsCollector::snapshot( bool reset )
+{
+	std::vector<Stat> stats;
+
 	std::lock_guard<std::mutex> lock( statsMutex_ );
 
+	refineCalibration();
+
+	std::vector<Totals> totals( retired_ );
+
+	totals.resize( names_.size() );
+
+	for ( auto &&shard : shards_ )
+		for ( size_t i = 0; i < names_.size(); ++i )
+			add( totals[i], shard->slots_[i] );
+
+	for ( size_t i = 0; i < names_.size(); ++i ) {
+		const Totals &t = totals[i];
+
+		if ( !t.count_ )
+			continue;
+
+		Stat stat;
+
+		stat.name_  = names_[i];
+		stat.count_ = t.count_;
+		stat.time_  = std::chrono::nanoseconds( t.nanoseconds_ );
+		stat.max_   = std::chrono::nanoseconds( t.max_ );
+
+		stat.buckets_.assign( t.buckets_.begin(), t.buckets_.end() );
+
+		std::pair<double, std::chrono::nanoseconds *> percentiles[] = {
+			{ 0.5, &stat.p50_ }, { 0.9, &stat.p90_ }, { 0.99, &stat.p99_ }, { 0.999, &stat.p999_ }
+		};
+
+		const size_t  count = sizeof( percentiles ) / sizeof( percentiles[0] );
+		unsigned long seen  = 0;
+		size_t        p     = 0;
+
+		for ( unsigned int b = 0; b < BUCKETS && p < count; ++b ) {
+			seen += t.buckets_[b];
+
+			// A percentile is reported as the upper limit of its bucket (at most the maximum)
+			std::chrono::nanoseconds limit( std::min( bucketLimit( b ), t.max_ ) );
+
+			while ( p < count && seen >= percentiles[p].first * t.count_ )
+				*percentiles[p++].second = limit;
+		}
+
+		stats.push_back( std::move( stat ) );
+	}
+
+	if ( reset ) {
+		++epoch_;
+		retired_.clear();
+	}
+
+	return stats;
+}
+
+void StatsCollector::dump()
+{
+	std::vector<Stat> stats = snapshot();
+
+	logger << DEBUG;
+
+	for ( auto &&s : stats )
+		logger << s.name_ << ": " << s.count_ << "; ";
+
+	logger << std::flush;
+
 	logger << DEBUG;
 
-	for ( auto &&s : stats_ )
-		logger << s.first << ": " << s.second.first << "; ";
+	for ( auto &&s : stats )
+		logger << s.name_ << ": " << s.time_.count() << " s; ";
 
 	logger << std::flush;
 
 	logger << DEBUG;
 
-	for ( auto &&s : stats_ )
-		logger << s.first << ": " << s.second.second.count() << " s; ";
+	for ( auto &&s : stats )
+		logger << s.name_ << ": p50 " << s.p50_.count() << " p99 " << s.p99_.count()
+		       << " p999 " << s.p999_.count() << " max " << s.max_.count() << " ns; ";
 
 	logger << std::flush;
 }
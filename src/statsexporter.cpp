@@ -0,0 +1,153 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/statsexporter.h"
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace bdvmi {
+
+StatsExporter::StatsExporter( const std::string &uuid, std::chrono::milliseconds interval )
+    : name_{ "bdvmi-" + uuid }
+    , interval_{ interval }
+{
+	const std::string path = "/" + name_;
+
+	// Only ever use a segment we've created ourselves, whoever else made one by that name
+	// (a previous process for the same domain, say) shouldn't get to see or feed our counters
+	int fd = shm_open( path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600 );
+
+	if ( fd < 0 && errno == EEXIST && shm_unlink( path.c_str() ) == 0 )
+		fd = shm_open( path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600 );
+
+	if ( fd < 0 )
+		throw std::runtime_error( "[Stats] could not create /dev/shm/" + name_ + ": " + strerror( errno ) );
+
+	size_ = sizeof( StatsSegmentHeader ) + StatsCollector::MAX_COUNTERS * sizeof( StatsSegmentCounter );
+
+	void *p = MAP_FAILED;
+
+	if ( ftruncate( fd, size_ ) == 0 )
+		p = mmap( nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+	int err = errno;
+
+	close( fd );
+
+	if ( p == MAP_FAILED ) {
+		shm_unlink( path.c_str() );
+		throw std::runtime_error( "[Stats] could not map /dev/shm/" + name_ + ": " + strerror( err ) );
+	}
+
+	memset( p, 0, size_ );
+
+	header_   = new ( p ) StatsSegmentHeader();
+	counters_ = reinterpret_cast<StatsSegmentCounter *>( header_ + 1 );
+
+	header_->version_     = STATS_SEGMENT_VERSION;
+	header_->headerSize_  = sizeof( StatsSegmentHeader );
+	header_->counterSize_ = sizeof( StatsSegmentCounter );
+	header_->maxCounters_ = StatsCollector::MAX_COUNTERS;
+	header_->buckets_     = StatsCollector::BUCKETS;
+	header_->pid_         = getpid();
+
+	for ( unsigned int i = 0; i < StatsCollector::BUCKETS; ++i )
+		header_->bucketLimits_[i] = StatsCollector::bucketLimit( i );
+
+	publish();
+
+	// Readers check the magic last, so they never see a half-initialized header
+	std::atomic_thread_fence( std::memory_order_release );
+	memcpy( header_->magic_, STATS_SEGMENT_MAGIC, sizeof( header_->magic_ ) );
+
+	if ( interval_.count() > 0 )
+		thread_ = std::thread( &StatsExporter::run, this );
+}
+
+StatsExporter::~StatsExporter()
+{
+	if ( thread_.joinable() ) {
+		{
+			std::lock_guard<std::mutex> lock( stopMutex_ );
+			stop_ = true;
+		}
+
+		stopped_.notify_one();
+		thread_.join();
+	}
+
+	munmap( header_, size_ );
+	shm_unlink( ( "/" + name_ ).c_str() );
+}
+
+void StatsExporter::run()
+{
+	std::unique_lock<std::mutex> lock( stopMutex_ );
+
+	while ( !stopped_.wait_for( lock, interval_, [this]() { return stop_; } ) )
+		publish();
+}
+
+void StatsExporter::publish()
+{
+	StatsCollector &                  collector = StatsCollector::instance();
+	std::vector<StatsCollector::Stat> stats     = collector.snapshot();
+
+	std::lock_guard<std::mutex> lock( publishMutex_ );
+
+	uint64_t sequence = header_->sequence_.load( std::memory_order_relaxed );
+
+	header_->sequence_.store( sequence + 1, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+
+	size_t count = std::min( stats.size(), StatsCollector::MAX_COUNTERS );
+
+	for ( size_t i = 0; i < count; ++i ) {
+		const StatsCollector::Stat &s = stats[i];
+		StatsSegmentCounter &       c = counters_[i];
+
+		strncpy( c.name_, s.name_.c_str(), sizeof( c.name_ ) - 1 );
+		c.name_[sizeof( c.name_ ) - 1] = '\0';
+
+		c.count_       = s.count_;
+		c.nanoseconds_ = std::chrono::duration_cast<std::chrono::nanoseconds>( s.time_ ).count();
+		c.p50_         = s.p50_.count();
+		c.p90_         = s.p90_.count();
+		c.p99_         = s.p99_.count();
+		c.p999_        = s.p999_.count();
+		c.max_         = s.max_.count();
+
+		for ( size_t b = 0; b < StatsCollector::BUCKETS; ++b )
+			c.buckets_[b] = b < s.buckets_.size() ? s.buckets_[b] : 0;
+	}
+
+	struct timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+
+	header_->counters_ = count;
+	header_->enabled_  = collector.enabled();
+	header_->updated_  = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	header_->sequence_.store( sequence + 2, std::memory_order_release );
+}
+
+} // namespace bdvmi
@@ -0,0 +1,100 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMITRACEFILE_H_INCLUDED__
+#define __BDVMITRACEFILE_H_INCLUDED__
+
+#include "bdvmi/driver.h"
+#include <stdint.h>
+
+namespace bdvmi {
+
+// On-disk layout of the files written by EventRecorder and read back by ReplayDriver.
+// A FileHeader is followed by records, each of them a RecordHeader, regsCount_
+// RegistersEntry structures, pageCount_ gfns and, starting at the first page boundary
+// (relative to the start of the file) after that, pageCount_ pages of guest memory.
+// Page data is thus aligned when the file is mmap()ed and can be handed out in place.
+// Registers are stored raw, so a trace can only be replayed by a build with the same
+// Registers layout (FileHeader::registersSize_ is there to catch the obvious mismatches).
+// None of the structures below have padding holes, they're written out as they are.
+namespace trace {
+
+constexpr char     MAGIC[8] = { 'B', 'D', 'V', 'M', 'I', 'T', 'R', 'C' };
+constexpr uint32_t VERSION  = 2; // 2: Registers fields reordered
+
+enum RecordType : uint32_t {
+	RECORD_PAGES, // guest memory touched outside of an event callback
+	RECORD_CR,
+	RECORD_MSR,
+	RECORD_PAGE_FAULT,
+	RECORD_VMCALL,
+	RECORD_XSETBV,
+	RECORD_BREAKPOINT,
+	RECORD_INTERRUPT,
+	RECORD_DESCRIPTOR,
+	RECORD_SESSION_OVER
+};
+
+// RecordHeader::flags_
+enum RecordFlags : uint16_t {
+	FLAG_REGISTERS = 0x01, // regs_ is valid
+	FLAG_READ      = 0x02,
+	FLAG_WRITE     = 0x04,
+	FLAG_EXECUTE   = 0x08,
+	FLAG_IN_GPT    = 0x10,
+	FLAG_HANDLED   = 0x20 // handleBreakpoint() has returned true
+};
+
+struct FileHeader {
+	char     magic_[8]{};
+	uint32_t version_{ 0 };
+	uint32_t pageSize_{ 0 }; // PAGE_SIZE
+	uint32_t registersSize_{ 0 };
+	uint32_t reserved_{ 0 };
+};
+
+struct RecordHeader {
+	uint64_t size_{ 0 };       // of the whole record, the next one starts right after it
+	uint64_t dataOffset_{ 0 }; // of the page data, from the start of the record
+	uint32_t type_{ 0 };
+	uint32_t regsCount_{ 0 };
+	uint32_t pageCount_{ 0 };
+	uint16_t vcpu_{ 0 };
+	uint16_t flags_{ 0 };
+
+	// Event arguments, in EventHandler callback order: CR (crNumber, oldValue, newValue),
+	// MSR (msr, oldValue, newValue), page fault (gpa, gva), breakpoint (gpa), interrupt
+	// (vector, errorCode, cr2), descriptor access (flags), session over (state).
+	uint64_t args_[3]{};
+
+	// What the EventHandler has answered
+	uint32_t action_{ 0 };
+	uint16_t instructionSize_{ 0 };
+	uint16_t reserved_{ 0 };
+
+	Registers regs_;
+};
+
+// Registers the EventHandler has asked for during the event
+struct RegistersEntry {
+	uint64_t  vcpu_{ 0 };
+	Registers regs_;
+};
+
+} // namespace trace
+
+} // namespace bdvmi
+
+#endif // __BDVMITRACEFILE_H_INCLUDED__
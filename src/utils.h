@@ -16,8 +16,10 @@
 #ifndef __BDVMIUTILS_H_INCLUDED__
 #define __BDVMIUTILS_H_INCLUDED__
 
+#include "bdvmi/eventtrace.h"
 #include <functional>
 #include <memory>
+#include <utility>
 
 namespace bdvmi {
 
@@ -46,6 +48,13 @@ public:
 		std::function<R( Args... )>::operator=( std::move( f ) );
 		return *this;
 	}
+
+	// These wrap libxc / libxenstore calls, so every call goes into the event trace
+	R operator()( Args... args ) const
+	{
+		EventTrace::countHypercall();
+		return std::function<R( Args... )>::operator()( std::forward<Args>( args )... );
+	}
 };
 
 template <typename A, typename F> struct PrependArg;
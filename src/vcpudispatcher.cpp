@@ -0,0 +1,134 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "vcpudispatcher.h"
+
+namespace bdvmi {
+
+VcpuDispatcher::VcpuDispatcher( size_t workers )
+{
+	if ( !workers )
+		workers = 1;
+
+	threads_.reserve( workers );
+
+	for ( size_t i = 0; i < workers; ++i )
+		threads_.emplace_back( &VcpuDispatcher::worker, this );
+}
+
+VcpuDispatcher::~VcpuDispatcher()
+{
+	{
+		std::unique_lock<std::mutex> lock( mutex_ );
+
+		idle_.wait( lock, [this] { return outstanding_ == 0; } );
+		stop_ = true;
+	}
+
+	workAvailable_.notify_all();
+
+	for ( auto &&t : threads_ )
+		t.join();
+}
+
+void VcpuDispatcher::dispatch( unsigned short vcpu, Task task )
+{
+	{
+		std::lock_guard<std::mutex> lock( mutex_ );
+
+		rethrow();
+
+		VcpuQueue &q = queues_[vcpu];
+
+		q.tasks_.push_back( std::move( task ) );
+		++outstanding_;
+
+		if ( q.scheduled_ )
+			return; // whoever is running vcpu's current task will get to this one
+
+		q.scheduled_ = true;
+		ready_.push_back( vcpu );
+	}
+
+	workAvailable_.notify_one();
+}
+
+void VcpuDispatcher::drain()
+{
+	std::unique_lock<std::mutex> lock( mutex_ );
+
+	idle_.wait( lock, [this] { return outstanding_ == 0; } );
+	rethrow();
+}
+
+void VcpuDispatcher::rethrow()
+{
+	if ( !error_ )
+		return;
+
+	std::exception_ptr error = error_;
+	error_                   = nullptr;
+
+	std::rethrow_exception( error );
+}
+
+void VcpuDispatcher::worker()
+{
+	std::unique_lock<std::mutex> lock( mutex_ );
+
+	for ( ;; ) {
+		workAvailable_.wait( lock, [this] { return stop_ || !ready_.empty(); } );
+
+		if ( ready_.empty() )
+			return; // stop_
+
+		unsigned short vcpu = ready_.front();
+		ready_.pop_front();
+
+		// Map elements don't move on insertion, so q stays good while the lock is dropped
+		VcpuQueue &q    = queues_[vcpu];
+		Task       task = std::move( q.tasks_.front() );
+
+		q.tasks_.pop_front();
+
+		lock.unlock();
+
+		std::exception_ptr error;
+
+		try {
+			task();
+		} catch ( ... ) {
+			error = std::current_exception();
+		}
+
+		lock.lock();
+
+		if ( error && !error_ )
+			error_ = error;
+
+		if ( q.tasks_.empty() )
+			q.scheduled_ = false;
+		else {
+			// Back of the line, so that one busy vCPU can't starve the others
+			ready_.push_back( vcpu );
+			workAvailable_.notify_one();
+		}
+
+		if ( --outstanding_ == 0 )
+			idle_.notify_all();
+	}
+}
+
+} // namespace bdvmi
@@ -0,0 +1,86 @@
+// Copyright (c) 2015-2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIVCPUDISPATCHER_H_INCLUDED__
+#define __BDVMIVCPUDISPATCHER_H_INCLUDED__
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace bdvmi {
+
+// Runs event handling tasks on a pool of worker threads. Tasks dispatched for the same vCPU
+// run one at a time, in the order they were dispatched, while different vCPUs are handled in
+// parallel. Whichever worker is idle takes the next vCPU that has work, so a slow handler only
+// ties up its own worker and the vCPUs queued behind it are picked up by the others.
+class VcpuDispatcher {
+
+public:
+	using Task = std::function<void()>;
+
+public:
+	explicit VcpuDispatcher( size_t workers );
+
+	// Waits for the tasks already dispatched, then stops the workers
+	~VcpuDispatcher();
+
+public:
+	// Rethrows (on the calling thread) the first exception a task has thrown since the last call
+	void dispatch( unsigned short vcpu, Task task );
+
+	// Block until every task dispatched so far has finished. Rethrows like dispatch().
+	void drain();
+
+	size_t workers() const
+	{
+		return threads_.size();
+	}
+
+public: // no copying around
+	VcpuDispatcher( const VcpuDispatcher & ) = delete;
+	VcpuDispatcher &operator=( const VcpuDispatcher & ) = delete;
+
+private:
+	struct VcpuQueue {
+		std::deque<Task> tasks_;
+		bool             scheduled_{ false }; // on ready_, or a worker is running one of its tasks
+	};
+
+private:
+	void worker();
+
+	void rethrow();
+
+private:
+	std::mutex                                    mutex_;
+	std::condition_variable                       workAvailable_;
+	std::condition_variable                       idle_;
+	std::unordered_map<unsigned short, VcpuQueue> queues_;
+	std::deque<unsigned short>                    ready_;
+	size_t                                        outstanding_{ 0 }; // dispatched but not finished
+	bool                                          stop_{ false };
+	std::exception_ptr                            error_;
+	std::vector<std::thread>                      threads_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIVCPUDISPATCHER_H_INCLUDED__
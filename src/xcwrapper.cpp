@@ -18,6 +18,7 @@
 #include "bdvmi/driver.h"
 #include "bdvmi/statscollector.h"
 
+#include <errno.h>
 #include <iomanip>
 #include <iostream>
 #include <cstring>
@@ -27,6 +28,18 @@
 #include <vector>
 
 extern "C" {
+#ifdef BDVMI_XEN_DIRECT
+// xenctrl.h is only read once, and xcwrapper.h needs its compat declarations (see there)
+#ifndef XC_WANT_COMPAT_MAP_FOREIGN_API
+#define XC_WANT_COMPAT_MAP_FOREIGN_API
+#endif
+#ifndef XC_WANT_COMPAT_EVTCHN_API
+#define XC_WANT_COMPAT_EVTCHN_API
+#endif
+#ifndef XC_WANT_COMPAT_DEVICEMODEL_API
+#define XC_WANT_COMPAT_DEVICEMODEL_API
+#endif
+#endif
 #include <xenctrl.h>
 #include <xen/xen.h>
 #define private rprivate /* private is a C++ keyword */
@@ -84,6 +97,7 @@ constexpr char xc_interface_close_fn_name[]             = "xc_interface_close";
 constexpr char xc_version_fn_name[]                     = "xc_version";
 constexpr char xc_set_mem_access_multi_fn_name[]        = "xc_set_mem_access_multi";
 constexpr char xc_altp2m_set_mem_access_multi_fn_name[] = "xc_altp2m_set_mem_access_multi";
+constexpr char xc_altp2m_set_supress_ve_multi_fn_name[] = "xc_altp2m_set_supress_ve_multi"; // sic
 constexpr char xc_evtchn_open_fn_name[]                 = "xc_evtchn_open";
 constexpr char xc_evtchn_close_fn_name[]                = "xc_evtchn_close";
 constexpr char xc_evtchn_fd_fn_name[]                   = "xc_evtchn_fd";
@@ -94,11 +108,17 @@ constexpr char xc_evtchn_unmask_fn_name[]               = "xc_evtchn_unmask";
 constexpr char xc_evtchn_notify_fn_name[]               = "xc_evtchn_notify";
 constexpr char xc_vcpu_getcontext_fn_name[]             = "xc_vcpu_getcontext";
 constexpr char xc_vcpu_setcontext_fn_name[]             = "xc_vcpu_setcontext";
+constexpr char xc_shadow_control_fn_name[]              = "xc_shadow_control";
+constexpr char xc_hcbuf_alloc_pages_fn_name[]           = "xc__hypercall_buffer_alloc_pages";
+constexpr char xc_hcbuf_free_pages_fn_name[]            = "xc__hypercall_buffer_free_pages";
 
 class XCFactory;
 
+// lookup() returns plain function pointers. Adapters are captureless lambdas, whatever they need
+// is kept in static variables that are set when the function is looked up (XCFactory is a
+// singleton, so that only happens once).
 template <typename T, const char name[]> struct XCFactoryImpl {
-	static std::function<T> lookup( const XCFactory *p, bool required );
+	static T *lookup( const XCFactory *p, bool required );
 };
 
 class XCFactory {
@@ -111,7 +131,7 @@ public:
 
 	std::unique_ptr<xc_interface, int ( * )( xc_interface * )> createInterface() const;
 
-	template <typename T, const char *name> std::function<T> lookup( bool required = true ) const
+	template <typename T, const char *name> T *lookup( bool required = true ) const
 	{
 		return XCFactoryImpl<T, name>::lookup( this, required );
 	}
@@ -120,56 +140,64 @@ public:
 	std::string caps;
 	std::string uuid;
 
-	std::function<xc_domain_pause_fn_t>                   domainPause;
-	std::function<xc_domain_unpause_fn_t>                 domainUnpause;
-	std::function<xc_domain_shutdown_fn_t>                domainShutdown;
-	std::function<xc_domain_getinfo_fn_t>                 domainGetInfo;
-	std::function<xc_domain_getinfolist_fn_t>             domainGetInfoList;
-	std::function<xc_domain_maximum_gpfn_fn_t>            domainMaximumGpfn;
-	std::function<xc_domain_debug_control_fn_t>           domainDebugControl;
-	std::function<xc_domain_get_tsc_info_fn_t>            domainGetTscInfo;
-	std::function<xc_domain_set_access_required_fn_t>     domainSetAccessRequired;
-	std::function<xc_domain_hvm_getcontext_fn_t>          domainHvmGetContext;
-	std::function<xc_domain_hvm_getcontext_partial_fn_t>  domainHvmGetContextPartial;
-	std::function<xc_domain_set_cores_per_socket_fn_t>    domainSetCoresPerSocket;
-	std::function<xc_set_mem_access_fn_t>                 setMemAccess;
-	std::function<xc_altp2m_get_mem_access_fn_t>          altp2mGetMemAccess;
-	std::function<xc_altp2m_set_mem_access_fn_t>          altp2mSetMemAccess;
-	std::function<xc_altp2m_set_domain_state_fn_t>        altp2mSetDomainState;
-	std::function<xc_altp2m_create_view_fn_t>             altp2mCreateView;
-	std::function<xc_altp2m_destroy_view_fn_t>            altp2mDestroyView;
-	std::function<xc_altp2m_switch_to_view_fn_t>          altp2mSwitchToView;
-	std::function<xc_altp2m_set_suppress_ve_fn_t>         altp2mSetSuppressVE;
-	std::function<xc_altp2m_get_suppress_ve_fn_t>         altp2mGetSuppressVE;
-	std::function<xc_altp2m_set_vcpu_enable_notify_fn_t>  altp2mSetVcpuEnableNotify;
-	std::function<xc_altp2m_set_vcpu_disable_notify_fn_t> altp2mSetVcpuDisableNotify;
-	std::function<xc_altp2m_get_vcpu_p2m_idx_fn_t>        altp2mGetVcpuP2mIdx;
-	std::function<xc_map_foreign_range_fn_t>              mapForeignRange;
-	std::function<xc_get_mem_access_fn_t>                 getMemAccess;
-	std::function<xc_hvm_inject_trap_fn_t>                hvmInjectTrap;
-	std::function<xc_vcpu_set_registers_fn_t>             vcpuSetRegisters;
-	std::function<xc_monitor_enable_fn_t>                 monitorEnable;
-	std::function<xc_monitor_disable_fn_t>                monitorDisable;
-	std::function<xc_monitor_singlestep_fn_t>             monitorSinglestep;
-	std::function<xc_monitor_software_breakpoint_fn_t>    monitorSoftwareBreakpoint;
-	std::function<xc_monitor_emulate_each_rep_fn_t>       monitorEmulateEachRep;
-	std::function<xc_monitor_mov_to_msr_fn_t>             monitorMovToMsr;
-	std::function<xc_monitor_guest_request_fn_t>          monitorGuestRequest;
-	std::function<xc_monitor_write_ctrlreg_fn_t>          monitorWriteCtrlreg;
-	std::function<xc_monitor_descriptor_access_fn_t>      monitorDescriptorAccess;
-	std::function<xc_monitor_inguest_pagefault_fn_t>      monitorInguestPagefault;
-	std::function<xc_monitor_emul_unimplemented_fn_t>     monitorEmulUnimplemented;
-
-	std::function<xc_vm_event_get_version_fn_t> vmEventGetVersion;
-
-	std::function<bdvmi_evtchn_open_fn_t>             evtchnOpen;
-	std::function<bdvmi_evtchn_close_fn_t>            evtchnClose;
-	std::function<bdvmi_evtchn_fd_fn_t>               evtchnFd;
-	std::function<bdvmi_evtchn_pending_fn_t>          evtchnPending;
-	std::function<bdvmi_evtchn_bind_interdomain_fn_t> evtchnBindInterdomain;
-	std::function<bdvmi_evtchn_unbind_fn_t>           evtchnUnbind;
-	std::function<bdvmi_evtchn_unmask_fn_t>           evtchnUnmask;
-	std::function<bdvmi_evtchn_notify_fn_t>           evtchnNotify;
+	xc_domain_getinfo_fn_t *                domainGetInfo;
+	xc_domain_getinfolist_fn_t *            domainGetInfoList;
+	xc_domain_getinfo_batch_fn_t *          domainGetInfoBatch;
+	xc_domain_set_cores_per_socket_fn_t *   domainSetCoresPerSocket;
+	xc_set_mem_access_fn_t *                setMemAccess;
+	xc_logdirty_control_fn_t *              logdirtyControl;
+	xc_altp2m_get_mem_access_fn_t *         altp2mGetMemAccess;
+	xc_altp2m_set_mem_access_fn_t *         altp2mSetMemAccess;
+	xc_altp2m_set_suppress_ve_fn_t *        altp2mSetSuppressVE;
+	xc_altp2m_get_suppress_ve_fn_t *        altp2mGetSuppressVE;
+	xc_altp2m_set_suppress_ve_multi_fn_t *  altp2mSetSuppressVEMulti;
+	xc_altp2m_set_vcpu_disable_notify_fn_t *altp2mSetVcpuDisableNotify;
+	xc_altp2m_get_vcpu_p2m_idx_fn_t *       altp2mGetVcpuP2mIdx;
+	xc_vcpu_set_registers_fn_t *            vcpuSetRegisters;
+	xc_monitor_emulate_each_rep_fn_t *      monitorEmulateEachRep;
+	xc_monitor_mov_to_msr_fn_t *            monitorMovToMsr;
+	xc_monitor_guest_request_fn_t *         monitorGuestRequest;
+	xc_monitor_write_ctrlreg_fn_t *         monitorWriteCtrlreg;
+	xc_monitor_descriptor_access_fn_t *     monitorDescriptorAccess;
+	xc_monitor_inguest_pagefault_fn_t *     monitorInguestPagefault;
+	xc_monitor_emul_unimplemented_fn_t *    monitorEmulUnimplemented;
+
+	xc_vm_event_get_version_fn_t *vmEventGetVersion;
+
+	bdvmi_evtchn_open_fn_t *evtchnOpen;
+
+#ifndef BDVMI_XEN_DIRECT
+	xc_domain_pause_fn_t *                 domainPause;
+	xc_domain_unpause_fn_t *               domainUnpause;
+	xc_domain_shutdown_fn_t *              domainShutdown;
+	xc_domain_maximum_gpfn_fn_t *          domainMaximumGpfn;
+	xc_domain_debug_control_fn_t *         domainDebugControl;
+	xc_domain_get_tsc_info_fn_t *          domainGetTscInfo;
+	xc_domain_set_access_required_fn_t *   domainSetAccessRequired;
+	xc_domain_hvm_getcontext_fn_t *        domainHvmGetContext;
+	xc_domain_hvm_getcontext_partial_fn_t *domainHvmGetContextPartial;
+	xc_altp2m_set_domain_state_fn_t *      altp2mSetDomainState;
+	xc_altp2m_create_view_fn_t *           altp2mCreateView;
+	xc_altp2m_destroy_view_fn_t *          altp2mDestroyView;
+	xc_altp2m_switch_to_view_fn_t *        altp2mSwitchToView;
+	xc_altp2m_set_vcpu_enable_notify_fn_t *altp2mSetVcpuEnableNotify;
+	xc_map_foreign_range_fn_t *            mapForeignRange;
+	xc_map_foreign_bulk_fn_t *             mapForeignBulk;
+	xc_get_mem_access_fn_t *               getMemAccess;
+	xc_hvm_inject_trap_fn_t *              hvmInjectTrap;
+	xc_monitor_enable_fn_t *               monitorEnable;
+	xc_monitor_disable_fn_t *              monitorDisable;
+	xc_monitor_singlestep_fn_t *           monitorSinglestep;
+	xc_monitor_software_breakpoint_fn_t *  monitorSoftwareBreakpoint;
+
+	bdvmi_evtchn_close_fn_t *           evtchnClose;
+	bdvmi_evtchn_fd_fn_t *              evtchnFd;
+	bdvmi_evtchn_pending_fn_t *         evtchnPending;
+	bdvmi_evtchn_bind_interdomain_fn_t *evtchnBindInterdomain;
+	bdvmi_evtchn_unbind_fn_t *          evtchnUnbind;
+	bdvmi_evtchn_unmask_fn_t *          evtchnUnmask;
+	bdvmi_evtchn_notify_fn_t *          evtchnNotify;
+#endif // BDVMI_XEN_DIRECT
 
 private:
 	XCFactory();
@@ -253,48 +281,55 @@ XCFactory::XCFactory()
 	uuid = ss.str();
 	close_fn( xci );
 
+	domainGetInfo              = LOOKUP_XC_FUNCTION_REQUIRED( domain_getinfo );
+	domainGetInfoList          = LOOKUP_XC_FUNCTION_REQUIRED( domain_getinfolist );
+	domainGetInfoBatch         = LOOKUP_XC_FUNCTION_REQUIRED( domain_getinfo_batch );
+	setMemAccess               = LOOKUP_XC_FUNCTION_REQUIRED( set_mem_access );
+	logdirtyControl            = LOOKUP_XC_FUNCTION_OPTIONAL( logdirty_control );
+	altp2mGetMemAccess         = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_get_mem_access );
+	domainSetCoresPerSocket    = LOOKUP_XC_FUNCTION_OPTIONAL( domain_set_cores_per_socket );
+	altp2mSetMemAccess         = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_set_mem_access );
+	altp2mSetSuppressVE        = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_set_suppress_ve );
+	altp2mGetSuppressVE        = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_get_suppress_ve );
+	altp2mSetSuppressVEMulti   = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_set_suppress_ve_multi );
+	altp2mSetVcpuDisableNotify = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_set_vcpu_disable_notify );
+	altp2mGetVcpuP2mIdx        = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_get_vcpu_p2m_idx );
+	vcpuSetRegisters           = LOOKUP_XC_FUNCTION_REQUIRED( vcpu_set_registers );
+	monitorEmulateEachRep      = LOOKUP_XC_FUNCTION_OPTIONAL( monitor_emulate_each_rep );
+	monitorMovToMsr            = LOOKUP_XC_FUNCTION_REQUIRED( monitor_mov_to_msr );
+	monitorGuestRequest        = LOOKUP_XC_FUNCTION_REQUIRED( monitor_guest_request );
+	monitorWriteCtrlreg        = LOOKUP_XC_FUNCTION_REQUIRED( monitor_write_ctrlreg );
+	monitorDescriptorAccess    = LOOKUP_XC_FUNCTION_OPTIONAL( monitor_descriptor_access );
+	monitorInguestPagefault    = LOOKUP_XC_FUNCTION_OPTIONAL( monitor_inguest_pagefault );
+	monitorEmulUnimplemented   = LOOKUP_XC_FUNCTION_OPTIONAL( monitor_emul_unimplemented );
+	vmEventGetVersion          = LOOKUP_XC_FUNCTION_REQUIRED( vm_event_get_version );
+
+	evtchnOpen = LOOKUP_BDVMI_FUNCTION_REQUIRED( evtchn_open );
+
+#ifndef BDVMI_XEN_DIRECT
 	domainPause                = LOOKUP_XC_FUNCTION_REQUIRED( domain_pause );
 	domainUnpause              = LOOKUP_XC_FUNCTION_REQUIRED( domain_unpause );
 	domainShutdown             = LOOKUP_XC_FUNCTION_REQUIRED( domain_shutdown );
-	domainGetInfo              = LOOKUP_XC_FUNCTION_REQUIRED( domain_getinfo );
-	domainGetInfoList          = LOOKUP_XC_FUNCTION_REQUIRED( domain_getinfolist );
 	domainMaximumGpfn          = LOOKUP_XC_FUNCTION_REQUIRED( domain_maximum_gpfn );
 	domainDebugControl         = LOOKUP_XC_FUNCTION_REQUIRED( domain_debug_control );
 	domainGetTscInfo           = LOOKUP_XC_FUNCTION_REQUIRED( domain_get_tsc_info );
 	domainSetAccessRequired    = LOOKUP_XC_FUNCTION_REQUIRED( domain_set_access_required );
 	domainHvmGetContext        = LOOKUP_XC_FUNCTION_REQUIRED( domain_hvm_getcontext );
 	domainHvmGetContextPartial = LOOKUP_XC_FUNCTION_REQUIRED( domain_hvm_getcontext_partial );
-	setMemAccess               = LOOKUP_XC_FUNCTION_REQUIRED( set_mem_access );
-	altp2mGetMemAccess         = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_get_mem_access );
-	domainSetCoresPerSocket    = LOOKUP_XC_FUNCTION_OPTIONAL( domain_set_cores_per_socket );
-	altp2mSetMemAccess         = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_set_mem_access );
 	altp2mSetDomainState       = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_set_domain_state );
 	altp2mCreateView           = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_create_view );
 	altp2mDestroyView          = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_destroy_view );
 	altp2mSwitchToView         = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_switch_to_view );
-	altp2mSetSuppressVE        = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_set_suppress_ve );
-	altp2mGetSuppressVE        = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_get_suppress_ve );
 	altp2mSetVcpuEnableNotify  = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_set_vcpu_enable_notify );
-	altp2mSetVcpuDisableNotify = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_set_vcpu_disable_notify );
-	altp2mGetVcpuP2mIdx        = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_get_vcpu_p2m_idx );
 	mapForeignRange            = LOOKUP_XC_FUNCTION_REQUIRED( map_foreign_range );
+	mapForeignBulk             = LOOKUP_XC_FUNCTION_REQUIRED( map_foreign_bulk );
 	getMemAccess               = LOOKUP_XC_FUNCTION_REQUIRED( get_mem_access );
 	hvmInjectTrap              = LOOKUP_XC_FUNCTION_REQUIRED( hvm_inject_trap );
-	vcpuSetRegisters           = LOOKUP_XC_FUNCTION_REQUIRED( vcpu_set_registers );
 	monitorEnable              = LOOKUP_XC_FUNCTION_REQUIRED( monitor_enable );
 	monitorDisable             = LOOKUP_XC_FUNCTION_REQUIRED( monitor_disable );
 	monitorSinglestep          = LOOKUP_XC_FUNCTION_REQUIRED( monitor_singlestep );
 	monitorSoftwareBreakpoint  = LOOKUP_XC_FUNCTION_REQUIRED( monitor_software_breakpoint );
-	monitorEmulateEachRep      = LOOKUP_XC_FUNCTION_OPTIONAL( monitor_emulate_each_rep );
-	monitorMovToMsr            = LOOKUP_XC_FUNCTION_REQUIRED( monitor_mov_to_msr );
-	monitorGuestRequest        = LOOKUP_XC_FUNCTION_REQUIRED( monitor_guest_request );
-	monitorWriteCtrlreg        = LOOKUP_XC_FUNCTION_REQUIRED( monitor_write_ctrlreg );
-	monitorDescriptorAccess    = LOOKUP_XC_FUNCTION_OPTIONAL( monitor_descriptor_access );
-	monitorInguestPagefault    = LOOKUP_XC_FUNCTION_OPTIONAL( monitor_inguest_pagefault );
-	monitorEmulUnimplemented   = LOOKUP_XC_FUNCTION_OPTIONAL( monitor_emul_unimplemented );
-	vmEventGetVersion          = LOOKUP_XC_FUNCTION_REQUIRED( vm_event_get_version );
 
-	evtchnOpen            = LOOKUP_BDVMI_FUNCTION_REQUIRED( evtchn_open );
 	evtchnClose           = LOOKUP_BDVMI_FUNCTION_REQUIRED( evtchn_close );
 	evtchnFd              = LOOKUP_BDVMI_FUNCTION_REQUIRED( evtchn_fd );
 	evtchnPending         = LOOKUP_BDVMI_FUNCTION_REQUIRED( evtchn_pending );
@@ -302,6 +337,7 @@ XCFactory::XCFactory()
 	evtchnUnbind          = LOOKUP_BDVMI_FUNCTION_REQUIRED( evtchn_unbind );
 	evtchnUnmask          = LOOKUP_BDVMI_FUNCTION_REQUIRED( evtchn_unmask );
 	evtchnNotify          = LOOKUP_BDVMI_FUNCTION_REQUIRED( evtchn_notify );
+#endif // BDVMI_XEN_DIRECT
 }
 
 std::unique_ptr<xc_interface, int ( * )( xc_interface * )> XCFactory::createInterface() const
@@ -315,21 +351,20 @@ std::unique_ptr<xc_interface, int ( * )( xc_interface * )> XCFactory::createInte
 	return std::unique_ptr<xc_interface, int ( * )( xc_interface * )>( xci, close_fn );
 }
 
-template <typename T, const char name[]>
-std::function<T> XCFactoryImpl<T, name>::lookup( const XCFactory *p, bool required )
+template <typename T, const char name[]> T *XCFactoryImpl<T, name>::lookup( const XCFactory *p, bool required )
 {
 	return p->lib_.lookup<T, name>( required );
 }
 
 template <> struct XCFactoryImpl<xc_domain_getinfo_fn_t, xc_domain_getinfo_fn_name> {
-	static std::function<xc_domain_getinfo_fn_t> lookup( const XCFactory *p, bool )
+	static xc_domain_getinfo_fn_t *lookup( const XCFactory *p, bool )
 	{
-		using fn_t = int( xc_interface *, uint32_t, unsigned int, xc_dominfo_t * );
-		fn_t *fun  = p->lib_.lookup<fn_t, xc_domain_getinfo_fn_name>();
+		using fn_t       = int( xc_interface *, uint32_t, unsigned int, xc_dominfo_t * );
+		static fn_t *fun = p->lib_.lookup<fn_t, xc_domain_getinfo_fn_name>();
 		if ( !fun )
 			return nullptr;
 
-		return [fun]( xc_interface *xci, uint32_t domid, XenDomainInfo &info ) {
+		return []( xc_interface *xci, uint32_t domid, XenDomainInfo &info ) {
 			xc_dominfo_t impl;
 			int          ret = fun( xci, domid, 1, &impl );
 			if ( ret != -1 ) {
@@ -346,12 +381,13 @@ template <> struct XCFactoryImpl<xc_domain_getinfo_fn_t, xc_domain_getinfo_fn_na
 };
 
 template <> struct XCFactoryImpl<xc_vm_event_get_version_fn_t, xc_vm_event_get_version_fn_name> {
-	static std::function<xc_vm_event_get_version_fn_t> lookup( const XCFactory *p, bool )
+	static xc_vm_event_get_version_fn_t *lookup( const XCFactory *p, bool )
 	{
-		using fn_t = int( xc_interface * );
-		fn_t *fun  = p->lib_.lookup<fn_t, xc_vm_event_get_version_fn_name>( false );
+		using fn_t            = int( xc_interface * );
+		static fn_t *fun      = p->lib_.lookup<fn_t, xc_vm_event_get_version_fn_name>( false );
+		static int   fallback = ( p->version >= Version( 4, 12 ) ) ? 4 : 3;
 
-		return [p, fun]( xc_interface *xci ) {
+		return []( xc_interface *xci ) {
 			int ret = -1;
 
 			if ( fun )
@@ -361,21 +397,18 @@ template <> struct XCFactoryImpl<xc_vm_event_get_version_fn_t, xc_vm_event_get_v
 			if ( ret > 0 )
 				return ret;
 
-			if ( p->version >= Version( 4, 12 ) )
-				return 4;
-
-			return 3;
+			return fallback;
 		};
 	}
 };
 
 template <> struct XCFactoryImpl<xc_domain_getinfolist_fn_t, xc_domain_getinfolist_fn_name> {
-	static std::function<xc_domain_getinfolist_fn_t> lookup( const XCFactory *p, bool )
+	static xc_domain_getinfolist_fn_t *lookup( const XCFactory *p, bool )
 	{
-		using fn_t = int( xc_interface *, uint32_t, unsigned int, xc_domaininfo_t * );
-		fn_t *fun  = p->lib_.lookup<fn_t, xc_domain_getinfolist_fn_name>();
+		using fn_t       = int( xc_interface *, uint32_t, unsigned int, xc_domaininfo_t * );
+		static fn_t *fun = p->lib_.lookup<fn_t, xc_domain_getinfolist_fn_name>();
 
-		return [fun]( xc_interface *xci, uint32_t domid, XenDomctlInfo &info ) {
+		return []( xc_interface *xci, uint32_t domid, XenDomctlInfo &info ) {
 			xen_domctl_getdomaininfo_extended_safe info_hotfix = {};
 			int                                    ret =
 			    fun( xci, domid, 1, reinterpret_cast<xen_domctl_getdomaininfo *>( &info_hotfix.extended ) );
@@ -391,48 +424,243 @@ template <> struct XCFactoryImpl<xc_domain_getinfolist_fn_t, xc_domain_getinfoli
 	}
 };
 
+// Up to max domains starting with first out of a single XEN_SYSCTL_getdomaininfolist hypercall,
+// instead of the one domctl per domain that xc_domain_getinfo() costs.
+template <> struct XCFactoryImpl<xc_domain_getinfo_batch_fn_t, xc_domain_getinfo_batch_fn_name> {
+	static xc_domain_getinfo_batch_fn_t *lookup( const XCFactory *p, bool required )
+	{
+		using fn_t       = int( xc_interface *, uint32_t, unsigned int, xc_domaininfo_t * );
+		static fn_t *fun = p->lib_.lookup<fn_t, xc_domain_getinfolist_fn_name>( required );
+		if ( !fun )
+			return nullptr;
+
+		return []( xc_interface *xci, uint32_t first, unsigned int max, XenDomainInfo *info ) {
+			std::vector<xc_domaininfo_t> impl( max );
+			int                          ret = fun( xci, first, max, impl.data() );
+
+			for ( int i = 0; i < ret; ++i ) {
+				// The hypervisor returns ascending domids. If it doesn't look that way, it's one of
+				// the hotfixed ones (see xen_domctl_getdomaininfo_extended above) where the entries
+				// don't have the size we've asked for, so let the caller go one domain at a time.
+				if ( impl[i].domain < first || ( i > 0 && impl[i].domain <= impl[i - 1].domain ) ) {
+					errno = EINVAL;
+					return -1;
+				}
+
+				info[i].domid       = impl[i].domain;
+				info[i].hvm         = ( impl[i].flags & XEN_DOMINF_hvm_guest ) != 0;
+				info[i].dying       = ( impl[i].flags & XEN_DOMINF_dying ) != 0;
+				info[i].shutdown    = ( impl[i].flags & XEN_DOMINF_shutdown ) != 0;
+				info[i].max_vcpu_id = impl[i].max_vcpu_id;
+				info[i].max_memkb   = impl[i].max_pages << ( XC_PAGE_SHIFT - 10 );
+			}
+
+			return ret;
+		};
+	}
+};
+
 template <> struct XCFactoryImpl<xc_set_mem_access_fn_t, xc_set_mem_access_fn_name> {
-	static std::function<xc_set_mem_access_fn_t> lookup( const XCFactory *p, bool )
+	// Runs of at least this many contiguous gfns with the same access get their own
+	// (ranged) xc_set_mem_access() call instead of going into the _multi() batch
+	static constexpr size_t MIN_RANGE_RUN = 16;
+
+	static xc_set_mem_access_fn_t *lookup( const XCFactory *p, bool )
 	{
 		using multi_fn_t = int( xc_interface *, uint32_t, uint8_t *, uint64_t *, uint32_t );
-		multi_fn_t *fun1 = p->lib_.lookup<multi_fn_t, xc_set_mem_access_multi_fn_name>( false );
+		using fn_t       = int( xc_interface *, uint32_t, xenmem_access_t, uint64_t, uint32_t );
+
+		static multi_fn_t *fun1 = p->lib_.lookup<multi_fn_t, xc_set_mem_access_multi_fn_name>( false );
+		static fn_t *      fun2 = p->lib_.lookup<fn_t, xc_set_mem_access_fn_name>( !fun1 );
+
 		if ( fun1 ) {
-			return [fun1]( xc_interface *xci, uint32_t domid, const Driver::MemAccessMap &access ) {
+			return []( xc_interface *xci, uint32_t domid, const Driver::MemAccessMap &access ) {
 				std::vector<uint8_t>  access_type;
 				std::vector<uint64_t> gfns;
+				int                   ret = 0;
 
 				access_type.reserve( access.size() );
 				gfns.reserve( access.size() );
 
-				for ( auto &&item : access ) {
-					access_type.push_back( XC::xenMemAccess( item.second ) );
-					gfns.push_back( item.first );
+				// The map is sorted, so contiguous gfns are next to each other
+				for ( auto it = access.cbegin(); it != access.cend(); ) {
+					auto     next = it + 1;
+					uint32_t run  = 1;
+
+					while ( next != access.cend() && next->first == it->first + run &&
+					        next->second == it->second ) {
+						++next;
+						++run;
+					}
+
+					if ( fun2 && run >= MIN_RANGE_RUN ) {
+						StatsCounter counter( "xcSetMemAccessRange" );
+						if ( fun2( xci, domid, XC::xenMemAccess( it->second ), it->first, run ) )
+							ret = -1;
+					} else
+						for ( ; it != next; ++it ) {
+							access_type.push_back( XC::xenMemAccess( it->second ) );
+							gfns.push_back( it->first );
+						}
+
+					it = next;
 				}
-				StatsCounter counter( "xcSetMemAccessMulti" );
-				return fun1( xci, domid, &access_type[0], &gfns[0], gfns.size() );
+
+				if ( !gfns.empty() ) {
+					StatsCounter counter( "xcSetMemAccessMulti" );
+					if ( fun1( xci, domid, &access_type[0], &gfns[0], gfns.size() ) )
+						ret = -1;
+				}
+
+				return ret;
 			};
 		}
 
-		using fn_t = int( xc_interface *, uint32_t, xenmem_access_t, uint64_t, uint32_t );
-		fn_t *fun2 = p->lib_.lookup<fn_t, xc_set_mem_access_fn_name>();
-		return [fun2]( xc_interface *xci, uint32_t domid, const Driver::MemAccessMap &access ) {
-			for ( auto &&item : access ) {
+		return []( xc_interface *xci, uint32_t domid, const Driver::MemAccessMap &access ) {
+			for ( auto it = access.cbegin(); it != access.cend(); ) {
+				auto     next = it + 1;
+				uint32_t run  = 1;
+
+				while ( next != access.cend() && next->first == it->first + run && next->second == it->second ) {
+					++next;
+					++run;
+				}
+
 				StatsCounter counter( "xcSetMemAccess" );
-				fun2( xci, domid, XC::xenMemAccess( item.second ), item.first, 1 );
+				fun2( xci, domid, XC::xenMemAccess( it->second ), it->first, run );
+
+				it = next;
 			}
 			return 0; // FIXME: value is ignored in the original code
 		};
 	}
 };
 
+// Xen 4.16 has moved the log-dirty operations from xc_shadow_control() to xc_logdirty_control().
+// Both want the bitmap in a hypercall buffer, so it gets copied out of one.
+template <> struct XCFactoryImpl<xc_logdirty_control_fn_t, xc_logdirty_control_fn_name> {
+	static xc_logdirty_control_fn_t *lookup( const XCFactory *p, bool required )
+	{
+		using fn_t     = long long( xc_interface *, uint32_t, unsigned int, xc_hypercall_buffer_t *,
+		                            unsigned long, unsigned int, xc_shadow_op_stats_t * );
+		using old_fn_t = int( xc_interface *, uint32_t, unsigned int, xc_hypercall_buffer_t *, unsigned long,
+		                      unsigned long *, uint32_t, xc_shadow_op_stats_t * );
+		using alloc_t  = void *( xc_interface *, xc_hypercall_buffer_t *, int );
+		using free_t   = void( xc_interface *, xc_hypercall_buffer_t *, int );
+
+		static fn_t *    fun1 = p->lib_.lookup<fn_t, xc_logdirty_control_fn_name>( false );
+		static old_fn_t *fun2 = p->lib_.lookup<old_fn_t, xc_shadow_control_fn_name>( !fun1 && required );
+
+		static alloc_t *allocFun = p->lib_.lookup<alloc_t, xc_hcbuf_alloc_pages_fn_name>( required );
+		static free_t * freeFun  = p->lib_.lookup<free_t, xc_hcbuf_free_pages_fn_name>( required );
+
+		if ( ( !fun1 && !fun2 ) || !allocFun || !freeFun )
+			return nullptr;
+
+		return []( xc_interface *xci, uint32_t domid, unsigned int sop, uint64_t *bitmap,
+		           unsigned long pages ) {
+			auto control = [xci, domid, sop, pages]( xc_hypercall_buffer_t *buffer ) {
+				StatsCounter counter( "xcLogDirtyControl" );
+
+				if ( fun1 )
+					return fun1( xci, domid, sop, buffer, pages, 0, nullptr ) < 0 ? -1 : 0;
+
+				return fun2( xci, domid, sop, buffer, pages, nullptr, 0, nullptr ) < 0 ? -1 : 0;
+			};
+
+			if ( !bitmap || !pages )
+				return control( nullptr );
+
+			size_t bytes = ( pages + 63 ) / 64 * sizeof( uint64_t );
+			int    count = ( bytes + XC_PAGE_SIZE - 1 ) >> XC_PAGE_SHIFT;
+
+			// What DECLARE_HYPERCALL_BUFFER() would have set up (not a bounce buffer)
+			xc_hypercall_buffer_t buffer;
+			memset( &buffer, 0, sizeof( buffer ) );
+			buffer.ubuf = reinterpret_cast<void *>( -1 );
+
+			if ( !allocFun( xci, &buffer, count ) )
+				return -1;
+
+			int ret = control( &buffer );
+
+			if ( !ret )
+				memcpy( bitmap, buffer.hbuf, bytes );
+
+			freeFun( xci, &buffer, count );
+
+			return ret;
+		};
+	}
+};
+
+// Xen 4.13+ sets the suppress #VE bit for a whole gfn range in one hypercall, so every run of
+// contiguous gfns with the same value gets one. Older versions get one call per gfn.
+template <>
+struct XCFactoryImpl<xc_altp2m_set_suppress_ve_multi_fn_t, xc_altp2m_set_suppress_ve_multi_fn_name> {
+	static xc_altp2m_set_suppress_ve_multi_fn_t *lookup( const XCFactory *p, bool )
+	{
+		using multi_fn_t =
+		    int( xc_interface *, uint32_t, uint16_t, xen_pfn_t, xen_pfn_t, bool, xen_pfn_t *, int32_t * );
+		using fn_t = int( xc_interface *, uint32_t, uint16_t, xen_pfn_t, bool );
+
+		static multi_fn_t *fun1 = p->lib_.lookup<multi_fn_t, xc_altp2m_set_supress_ve_multi_fn_name>( false );
+		static fn_t *      fun2 = p->lib_.lookup<fn_t, xc_altp2m_set_suppress_ve_fn_name>( false );
+
+		if ( !fun1 && !fun2 )
+			return nullptr;
+
+		return []( xc_interface *xci, uint32_t domid, uint16_t view, const Driver::ConvertibleMap &convMap ) {
+			// The map is sorted, so contiguous gfns are next to each other
+			for ( auto it = convMap.cbegin(); it != convMap.cend(); ) {
+				auto     next = it + 1;
+				uint64_t run  = 1;
+
+				while ( next != convMap.cend() && next->first == it->first + run &&
+				        next->second == it->second ) {
+					++next;
+					++run;
+				}
+
+				if ( fun1 ) {
+					StatsCounter counter( "xcSetSuppressVEMulti" );
+					xen_pfn_t    errorGfn  = 0;
+					int32_t      errorCode = 0;
+
+					int rc = fun1( xci, domid, view, it->first, it->first + run - 1, it->second,
+					               &errorGfn, &errorCode );
+
+					// Xen carries on past gfns it can't set and reports the first one
+					if ( rc < 0 )
+						return rc;
+					if ( errorCode < 0 )
+						return static_cast<int>( errorCode );
+				} else
+					for ( auto gfn = it; gfn != next; ++gfn ) {
+						StatsCounter counter( "xcSetSuppressVE" );
+
+						int rc = fun2( xci, domid, view, gfn->first, gfn->second );
+
+						if ( rc < 0 )
+							return rc;
+					}
+
+				it = next;
+			}
+
+			return 0;
+		};
+	}
+};
+
 template <> struct XCFactoryImpl<xc_altp2m_set_mem_access_fn_t, xc_altp2m_set_mem_access_fn_name> {
-	static std::function<xc_altp2m_set_mem_access_fn_t> lookup( const XCFactory *p, bool )
+	static xc_altp2m_set_mem_access_fn_t *lookup( const XCFactory *p, bool )
 	{
 		using multi_fn_t = int( xc_interface *, uint16_t, uint32_t, uint8_t *, uint64_t *, uint32_t );
-		multi_fn_t *fun1 = p->lib_.lookup<multi_fn_t, xc_altp2m_set_mem_access_multi_fn_name>( false );
+		static multi_fn_t *fun1 = p->lib_.lookup<multi_fn_t, xc_altp2m_set_mem_access_multi_fn_name>( false );
 		if ( fun1 ) {
-			return [fun1]( xc_interface *xci, uint32_t domid, uint16_t altp2mViewId,
-			               const Driver::MemAccessMap &access ) {
+			return []( xc_interface *xci, uint32_t domid, uint16_t altp2mViewId,
+			           const Driver::MemAccessMap &access ) {
 				std::vector<uint8_t>  access_type;
 				std::vector<uint64_t> gfns;
 
@@ -448,10 +676,10 @@ template <> struct XCFactoryImpl<xc_altp2m_set_mem_access_fn_t, xc_altp2m_set_me
 			};
 		}
 
-		using fn_t = int( xc_interface *, uint16_t, uint32_t, xenmem_access_t, uint64_t, uint32_t );
-		fn_t *fun2 = p->lib_.lookup<fn_t, xc_altp2m_set_mem_access_fn_name>();
-		return [fun2]( xc_interface *xci, uint32_t domid, uint16_t altp2mViewId,
-		               const Driver::MemAccessMap &access ) {
+		using fn_t        = int( xc_interface *, uint16_t, uint32_t, xenmem_access_t, uint64_t, uint32_t );
+		static fn_t *fun2 = p->lib_.lookup<fn_t, xc_altp2m_set_mem_access_fn_name>();
+		return []( xc_interface *xci, uint32_t domid, uint16_t altp2mViewId,
+		           const Driver::MemAccessMap &access ) {
 			for ( auto &&item : access ) {
 				StatsCounter counter( "xcSetMemAccess" );
 				fun2( xci, domid, altp2mViewId, XC::xenMemAccess( item.second ), item.first, 1 );
@@ -462,85 +690,84 @@ template <> struct XCFactoryImpl<xc_altp2m_set_mem_access_fn_t, xc_altp2m_set_me
 };
 
 template <> struct XCFactoryImpl<xc_monitor_mov_to_msr_fn_t, xc_monitor_mov_to_msr_fn_name> {
-	static std::function<xc_monitor_mov_to_msr_fn_t> lookup( const XCFactory *p, bool )
+	static xc_monitor_mov_to_msr_fn_t *lookup( const XCFactory *p, bool )
 	{
 		if ( p->version < Version( 4, 11 ) ) {
-			using fn_t = int( xc_interface *, uint32_t, uint32_t, bool );
-			fn_t *fun  = p->lib_.lookup<fn_t, xc_monitor_mov_to_msr_fn_name>();
-			return [fun]( xc_interface *xci, uint32_t domid, uint32_t msr, bool enable, bool ) {
+			using fn_t       = int( xc_interface *, uint32_t, uint32_t, bool );
+			static fn_t *fun = p->lib_.lookup<fn_t, xc_monitor_mov_to_msr_fn_name>();
+			return []( xc_interface *xci, uint32_t domid, uint32_t msr, bool enable, bool ) {
 				return fun( xci, domid, msr, enable );
 			};
 		}
 
-		using fn_t = int( xc_interface *, uint32_t, uint32_t, bool, bool );
-		fn_t *fun  = p->lib_.lookup<fn_t, xc_monitor_mov_to_msr_fn_name>();
-		return [fun]( xc_interface *xci, uint32_t domid, uint32_t msr, bool enable, bool onchangeonly ) {
+		using fn_t       = int( xc_interface *, uint32_t, uint32_t, bool, bool );
+		static fn_t *fun = p->lib_.lookup<fn_t, xc_monitor_mov_to_msr_fn_name>();
+		return []( xc_interface *xci, uint32_t domid, uint32_t msr, bool enable, bool onchangeonly ) {
 			return fun( xci, domid, msr, enable, onchangeonly );
 		};
 	}
 };
 
 template <> struct XCFactoryImpl<xc_monitor_guest_request_fn_t, xc_monitor_guest_request_fn_name> {
-	static std::function<xc_monitor_guest_request_fn_t> lookup( const XCFactory *p, bool )
+	static xc_monitor_guest_request_fn_t *lookup( const XCFactory *p, bool )
 	{
 		if ( p->version < Version( 4, 9 ) ) {
-			using fn_t = int( xc_interface *, uint32_t, bool, bool );
-			fn_t *fun  = p->lib_.lookup<fn_t, xc_monitor_guest_request_fn_name>();
-			return [fun]( xc_interface *xci, uint32_t domid, bool enable, bool sync, bool ) {
+			using fn_t       = int( xc_interface *, uint32_t, bool, bool );
+			static fn_t *fun = p->lib_.lookup<fn_t, xc_monitor_guest_request_fn_name>();
+			return []( xc_interface *xci, uint32_t domid, bool enable, bool sync, bool ) {
 				return fun( xci, domid, enable, sync );
 			};
 		}
 
-		using fn_t = int( xc_interface *, uint32_t, bool, bool, bool );
-		fn_t *fun  = p->lib_.lookup<fn_t, xc_monitor_guest_request_fn_name>();
-		return [fun]( xc_interface *xci, uint32_t domid, bool enable, bool sync, bool allow_userspace ) {
+		using fn_t       = int( xc_interface *, uint32_t, bool, bool, bool );
+		static fn_t *fun = p->lib_.lookup<fn_t, xc_monitor_guest_request_fn_name>();
+		return []( xc_interface *xci, uint32_t domid, bool enable, bool sync, bool allow_userspace ) {
 			return fun( xci, domid, enable, sync, allow_userspace );
 		};
 	}
 };
 
 template <> struct XCFactoryImpl<xc_monitor_write_ctrlreg_fn_t, xc_monitor_write_ctrlreg_fn_name> {
-	static std::function<xc_monitor_write_ctrlreg_fn_t> lookup( const XCFactory *p, bool )
+	static xc_monitor_write_ctrlreg_fn_t *lookup( const XCFactory *p, bool )
 	{
 		if ( p->version < Version( 4, 10 ) ) {
-			using fn_t = int( xc_interface *, uint32_t, uint16_t, bool, bool, bool );
-			fn_t *fun  = p->lib_.lookup<fn_t, xc_monitor_write_ctrlreg_fn_name>();
-			return
-			    [fun]( xc_interface *xci, uint32_t domid, uint16_t index, bool enable, bool sync, uint64_t,
+			using fn_t       = int( xc_interface *, uint32_t, uint16_t, bool, bool, bool );
+			static fn_t *fun = p->lib_.lookup<fn_t, xc_monitor_write_ctrlreg_fn_name>();
+			return []( xc_interface *xci, uint32_t domid, uint16_t index, bool enable, bool sync, uint64_t,
 			           bool onchangeonly ) { return fun( xci, domid, index, enable, sync, onchangeonly ); };
 		}
 
-		using fn_t = int( xc_interface *, uint32_t, uint16_t, bool, bool, uint64_t, bool );
-		fn_t *fun  = p->lib_.lookup<fn_t, xc_monitor_write_ctrlreg_fn_name>();
-		return [fun]( xc_interface *xci, uint32_t domid, uint16_t index, bool enable, bool sync,
-		              uint64_t bitmask, bool onchangeonly ) {
+		using fn_t       = int( xc_interface *, uint32_t, uint16_t, bool, bool, uint64_t, bool );
+		static fn_t *fun = p->lib_.lookup<fn_t, xc_monitor_write_ctrlreg_fn_name>();
+		return []( xc_interface *xci, uint32_t domid, uint16_t index, bool enable, bool sync, uint64_t bitmask,
+		           bool onchangeonly ) {
 			return fun( xci, domid, index, enable, sync, bitmask, onchangeonly );
 		};
 	}
 };
 
 template <> struct XCFactoryImpl<bdvmi_evtchn_open_fn_t, xc_evtchn_open_fn_name> {
-	static std::function<bdvmi_evtchn_open_fn_t> lookup( const XCFactory *p, bool )
+	static bdvmi_evtchn_open_fn_t *lookup( const XCFactory *p, bool )
 	{
-		using fn_t = xc_evtchn *( xentoollog_logger *, unsigned );
-		fn_t *fun  = p->lib_.lookup<fn_t, xc_evtchn_open_fn_name>();
-		return [fun]() { return fun( nullptr, 0 ); };
+		using fn_t       = xc_evtchn *( xentoollog_logger *, unsigned );
+		static fn_t *fun = p->lib_.lookup<fn_t, xc_evtchn_open_fn_name>();
+		return []() { return fun( nullptr, 0 ); };
 	}
 };
 
 template <> struct XCFactoryImpl<xc_vcpu_set_registers_fn_t, xc_vcpu_set_registers_fn_name> {
-	static std::function<xc_vcpu_set_registers_fn_t> lookup( const XCFactory *p, bool )
+	static xc_vcpu_set_registers_fn_t *lookup( const XCFactory *p, bool )
 	{
 		using getcontext_fn_t = int( xc_interface *, uint32_t, uint32_t, vcpu_guest_context_any_t * );
 		using setcontext_fn_t = int( xc_interface *, uint32_t, uint32_t, vcpu_guest_context_any_t * );
 
-		getcontext_fn_t *get_fun = p->lib_.lookup<getcontext_fn_t, xc_vcpu_getcontext_fn_name>();
-		setcontext_fn_t *set_fun = p->lib_.lookup<setcontext_fn_t, xc_vcpu_setcontext_fn_name>();
+		static getcontext_fn_t *get_fun = p->lib_.lookup<getcontext_fn_t, xc_vcpu_getcontext_fn_name>();
+		static setcontext_fn_t *set_fun = p->lib_.lookup<setcontext_fn_t, xc_vcpu_setcontext_fn_name>();
 
-		bool isX86_64 = p->caps.find( "x86_64" ) != std::string::npos;
+		static bool isX86_64 = p->caps.find( "x86_64" ) != std::string::npos;
 
-		return [get_fun, set_fun, isX86_64]( xc_interface *xci, uint32_t domid, unsigned short vcpu,
-		                                     const Registers &regs, bool setEip ) {
+		return []( xc_interface *xci, uint32_t domid, unsigned short vcpu, const Registers &regs,
+		           bool setEip ) {
 			vcpu_guest_context_any_t ctxt;
 			int                      ret = 0;
 
@@ -600,7 +827,15 @@ const unsigned long XC::pageMask         = XC_PAGE_MASK;
 const unsigned long XC::invalidMfn       = INVALID_MFN;
 const uint8_t       XC::shutdownPoweroff = SHUTDOWN_poweroff;
 
-using namespace std::placeholders;
+#define BIND_XC_FUNCTION( NAME ) NAME{ XCFactory::instance().NAME, xci_.get() }
+
+#ifdef BDVMI_XEN_DIRECT
+#define BIND_XC_DIRECT_FUNCTION( NAME ) NAME{ xci_.get() }
+#define BIND_XC_DIRECT_CALL( NAME ) NAME{}
+#else
+#define BIND_XC_DIRECT_FUNCTION( NAME ) BIND_XC_FUNCTION( NAME )
+#define BIND_XC_DIRECT_CALL( NAME ) NAME{ XCFactory::instance().NAME }
+#endif // BDVMI_XEN_DIRECT
 
 XC::XC()
     : xci_{ XCFactory::instance().createInterface() }
@@ -608,80 +843,59 @@ XC::XC()
     , isXenServer{ XCFactory::instance().isXenServer }
     , caps{ XCFactory::instance().caps }
     , uuid{ XCFactory::instance().uuid }
-    , domainPause{ std::bind( XCFactory::instance().domainPause, xci_.get(), _1 ) }
-    , domainUnpause{ std::bind( XCFactory::instance().domainUnpause, xci_.get(), _1 ) }
-    , domainShutdown{ std::bind( XCFactory::instance().domainShutdown, xci_.get(), _1, _2 ) }
-    , domainGetInfo{ std::bind( XCFactory::instance().domainGetInfo, xci_.get(), _1, _2 ) }
-    , domainGetInfoList{ std::bind( XCFactory::instance().domainGetInfoList, xci_.get(), _1, _2 ) }
-    , domainMaximumGpfn{ std::bind( XCFactory::instance().domainMaximumGpfn, xci_.get(), _1, _2 ) }
-    , domainDebugControl{ std::bind( XCFactory::instance().domainDebugControl, xci_.get(), _1, _2, _3 ) }
-    , domainGetTscInfo{ std::bind( XCFactory::instance().domainGetTscInfo, xci_.get(), _1, _2, _3, _4, _5 ) }
-    , domainSetAccessRequired{ std::bind( XCFactory::instance().domainSetAccessRequired, xci_.get(), _1, _2 ) }
-    , domainHvmGetContext{ std::bind( XCFactory::instance().domainHvmGetContext, xci_.get(), _1, _2, _3 ) }
-    , domainHvmGetContextPartial{ std::bind( XCFactory::instance().domainHvmGetContextPartial, xci_.get(), _1, _2, _3,
-	                                     _4, _5 ) }
-    , setMemAccess{ std::bind( XCFactory::instance().setMemAccess, xci_.get(), _1, _2 ) }
-    , altp2mGetMemAccess{ std::bind( XCFactory::instance().altp2mGetMemAccess, xci_.get(), _1, _2, _3, _4 ) }
-    , altp2mSetMemAccess{ std::bind( XCFactory::instance().altp2mSetMemAccess, xci_.get(), _1, _2, _3 ) }
-    , altp2mSetDomainState{ std::bind( XCFactory::instance().altp2mSetDomainState, xci_.get(), _1, _2 ) }
-    , altp2mCreateView{ std::bind( XCFactory::instance().altp2mCreateView, xci_.get(), _1, _2, _3 ) }
-    , altp2mDestroyView{ std::bind( XCFactory::instance().altp2mDestroyView, xci_.get(), _1, _2 ) }
-    , altp2mSwitchToView{ std::bind( XCFactory::instance().altp2mSwitchToView, xci_.get(), _1, _2 ) }
-    , altp2mSetVcpuEnableNotify{ std::bind( XCFactory::instance().altp2mSetVcpuEnableNotify, xci_.get(), _1, _2, _3 ) }
-    , mapForeignRange{ std::bind( XCFactory::instance().mapForeignRange, xci_.get(), _1, _2, _3, _4 ) }
-    , getMemAccess{ std::bind( XCFactory::instance().getMemAccess, xci_.get(), _1, _2, _3 ) }
-    , hvmInjectTrap{ std::bind( XCFactory::instance().hvmInjectTrap, xci_.get(), _1, _2, _3, _4, _5, _6, _7 ) }
-    , vcpuSetRegisters{ std::bind( XCFactory::instance().vcpuSetRegisters, xci_.get(), _1, _2, _3, _4 ) }
-    , monitorEnable{ std::bind( XCFactory::instance().monitorEnable, xci_.get(), _1, _2 ) }
-    , monitorDisable{ std::bind( XCFactory::instance().monitorDisable, xci_.get(), _1 ) }
-    , monitorSinglestep{ std::bind( XCFactory::instance().monitorSinglestep, xci_.get(), _1, _2 ) }
-    , monitorSoftwareBreakpoint{ std::bind( XCFactory::instance().monitorSoftwareBreakpoint, xci_.get(), _1, _2 ) }
-    , monitorMovToMsr{ std::bind( XCFactory::instance().monitorMovToMsr, xci_.get(), _1, _2, _3, _4 ) }
-    , monitorGuestRequest{ std::bind( XCFactory::instance().monitorGuestRequest, xci_.get(), _1, _2, _3, _4 ) }
-    , monitorWriteCtrlreg{ std::bind( XCFactory::instance().monitorWriteCtrlreg, xci_.get(), _1, _2, _3, _4, _5, _6 ) }
-    , vmEventGetVersion{ std::bind( XCFactory::instance().vmEventGetVersion, xci_.get() ) }
+    , BIND_XC_DIRECT_FUNCTION( domainPause )
+    , BIND_XC_DIRECT_FUNCTION( domainUnpause )
+    , BIND_XC_DIRECT_FUNCTION( domainShutdown )
+    , BIND_XC_FUNCTION( domainGetInfo )
+    , BIND_XC_FUNCTION( domainGetInfoList )
+    , BIND_XC_FUNCTION( domainGetInfoBatch )
+    , BIND_XC_DIRECT_FUNCTION( domainMaximumGpfn )
+    , BIND_XC_DIRECT_FUNCTION( domainDebugControl )
+    , BIND_XC_DIRECT_FUNCTION( domainGetTscInfo )
+    , BIND_XC_DIRECT_FUNCTION( domainSetAccessRequired )
+    , BIND_XC_DIRECT_FUNCTION( domainHvmGetContext )
+    , BIND_XC_DIRECT_FUNCTION( domainHvmGetContextPartial )
+    , BIND_XC_FUNCTION( setMemAccess )
+    , BIND_XC_FUNCTION( logdirtyControl )
+    , BIND_XC_FUNCTION( altp2mGetMemAccess )
+    , BIND_XC_FUNCTION( altp2mSetMemAccess )
+    , BIND_XC_DIRECT_FUNCTION( altp2mSetDomainState )
+    , BIND_XC_DIRECT_FUNCTION( altp2mCreateView )
+    , BIND_XC_DIRECT_FUNCTION( altp2mDestroyView )
+    , BIND_XC_DIRECT_FUNCTION( altp2mSwitchToView )
+    , BIND_XC_FUNCTION( altp2mSetSuppressVE )
+    , BIND_XC_FUNCTION( altp2mGetSuppressVE )
+    , BIND_XC_FUNCTION( altp2mSetSuppressVEMulti )
+    , BIND_XC_DIRECT_FUNCTION( altp2mSetVcpuEnableNotify )
+    , BIND_XC_FUNCTION( altp2mSetVcpuDisableNotify )
+    , BIND_XC_FUNCTION( altp2mGetVcpuP2mIdx )
+    , BIND_XC_DIRECT_FUNCTION( mapForeignRange )
+    , BIND_XC_DIRECT_FUNCTION( mapForeignBulk )
+    , BIND_XC_DIRECT_FUNCTION( getMemAccess )
+    , BIND_XC_DIRECT_FUNCTION( hvmInjectTrap )
+    , BIND_XC_FUNCTION( vcpuSetRegisters )
+    , BIND_XC_DIRECT_FUNCTION( monitorEnable )
+    , BIND_XC_DIRECT_FUNCTION( monitorDisable )
+    , BIND_XC_DIRECT_FUNCTION( monitorSinglestep )
+    , BIND_XC_DIRECT_FUNCTION( monitorSoftwareBreakpoint )
+    , BIND_XC_FUNCTION( monitorEmulateEachRep )
+    , BIND_XC_FUNCTION( monitorMovToMsr )
+    , BIND_XC_FUNCTION( monitorGuestRequest )
+    , BIND_XC_FUNCTION( monitorWriteCtrlreg )
+    , BIND_XC_FUNCTION( monitorDescriptorAccess )
+    , BIND_XC_FUNCTION( monitorInguestPagefault )
+    , BIND_XC_FUNCTION( monitorEmulUnimplemented )
+    , BIND_XC_FUNCTION( domainSetCoresPerSocket )
+    , BIND_XC_FUNCTION( vmEventGetVersion )
     , evtchnOpen{ XCFactory::instance().evtchnOpen }
-    , evtchnClose{ XCFactory::instance().evtchnClose }
-    , evtchnFd{ XCFactory::instance().evtchnFd }
-    , evtchnPending{ XCFactory::instance().evtchnPending }
-    , evtchnBindInterdomain{ XCFactory::instance().evtchnBindInterdomain }
-    , evtchnUnbind{ XCFactory::instance().evtchnUnbind }
-    , evtchnUnmask{ XCFactory::instance().evtchnUnmask }
-    , evtchnNotify{ XCFactory::instance().evtchnNotify }
+    , BIND_XC_DIRECT_CALL( evtchnClose )
+    , BIND_XC_DIRECT_CALL( evtchnFd )
+    , BIND_XC_DIRECT_CALL( evtchnPending )
+    , BIND_XC_DIRECT_CALL( evtchnBindInterdomain )
+    , BIND_XC_DIRECT_CALL( evtchnUnbind )
+    , BIND_XC_DIRECT_CALL( evtchnUnmask )
+    , BIND_XC_DIRECT_CALL( evtchnNotify )
 {
-	if ( XCFactory::instance().monitorEmulateEachRep )
-		monitorEmulateEachRep = std::bind( XCFactory::instance().monitorEmulateEachRep, xci_.get(), _1, _2 );
-
-	if ( XCFactory::instance().monitorInguestPagefault )
-		monitorInguestPagefault =
-		    std::bind( XCFactory::instance().monitorInguestPagefault, xci_.get(), _1, _2 );
-
-	if ( XCFactory::instance().domainSetCoresPerSocket )
-		domainSetCoresPerSocket =
-		    std::bind( XCFactory::instance().domainSetCoresPerSocket, xci_.get(), _1, _2 );
-
-	if ( XCFactory::instance().monitorDescriptorAccess )
-		monitorDescriptorAccess =
-		    std::bind( XCFactory::instance().monitorDescriptorAccess, xci_.get(), _1, _2 );
-
-	if ( XCFactory::instance().altp2mSetVcpuDisableNotify )
-		altp2mSetVcpuDisableNotify =
-		    std::bind( XCFactory::instance().altp2mSetVcpuDisableNotify, xci_.get(), _1, _2 );
-
-	if ( XCFactory::instance().altp2mSetSuppressVE )
-		altp2mSetSuppressVE =
-		    std::bind( XCFactory::instance().altp2mSetSuppressVE, xci_.get(), _1, _2, _3, _4 );
-
-	if ( XCFactory::instance().altp2mGetSuppressVE )
-		altp2mGetSuppressVE =
-		    std::bind( XCFactory::instance().altp2mGetSuppressVE, xci_.get(), _1, _2, _3, _4 );
-
-	if ( XCFactory::instance().altp2mGetVcpuP2mIdx )
-		altp2mGetVcpuP2mIdx = std::bind( XCFactory::instance().altp2mGetVcpuP2mIdx, xci_.get(), _1, _2, _3 );
-
-	if ( XCFactory::instance().monitorEmulUnimplemented )
-		monitorEmulUnimplemented =
-		    std::bind( XCFactory::instance().monitorEmulUnimplemented, xci_.get(), _1, _2 );
 }
 
 xenmem_access_t XC::xenMemAccess( uint8_t bdvmiBitmask )
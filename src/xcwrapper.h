@@ -20,13 +20,28 @@
 #define __XEN_TOOLS__ 1
 #endif
 
-#include <functional>
 #include <memory>
+#include <utility>
 
 extern "C" {
 #include <xen/domctl.h>
 #include <xen/memory.h>
 #include <xen/version.h>
+#ifdef BDVMI_XEN_DIRECT
+// The direct calls below take the addresses of xc_map_foreign_*(), xc_evtchn_*() and
+// xc_hvm_inject_trap(), which newer xenctrl.h only declares on request. configure asks for
+// them too, but that shouldn't be the only thing keeping this header compiling.
+#ifndef XC_WANT_COMPAT_MAP_FOREIGN_API
+#define XC_WANT_COMPAT_MAP_FOREIGN_API
+#endif
+#ifndef XC_WANT_COMPAT_EVTCHN_API
+#define XC_WANT_COMPAT_EVTCHN_API
+#endif
+#ifndef XC_WANT_COMPAT_DEVICEMODEL_API
+#define XC_WANT_COMPAT_DEVICEMODEL_API
+#endif
+#include <xenctrl.h>
+#endif
 }
 
 #include "bdvmi/driver.h"
@@ -88,10 +103,10 @@ struct Registers;
 // _Don't_ add the xc_interface * param.
 //
 // 2. Add a member in class XC:
-// NCFunction<bdvmi_do_stuff_fn_t> doStuff; // NC stands for non-copyable
+// XCFunction<bdvmi_do_stuff_fn_t> doStuff;
 //
 // 3. Add a member in class XCFactory:
-// std::function<xc_do_stuff_fn_t> doStuff;
+// xc_do_stuff_fn_t *doStuff;
 //
 // 4. Add:
 // doStuff = LOOKUP_XC_FUNCTION_REQUIRED( do_stuff );
@@ -99,49 +114,153 @@ struct Registers;
 // If it's OK to _not_ find the function in the library, say LOOKUP_XC_FUNCTION_OPTIONAL() instead.
 // For required functions, not finding them results in an exception being thrown.
 //
-// 5. Add doStuff( std::bind( XCFactory::instance().doStuff, xci_.get(), _1 ) ) to class XC's constructor's
-// initializer list. This will bind the internal libxc handle to the first parameter, and _1 is a
-// placeholder for the uint32_t parameter. If you have several parameters in the original function after
-// xc_interface *, they become _1, _2, _3, and so on here.
+// 5. Add BIND_XC_FUNCTION( doStuff ) to class XC's constructor's initializer list. This binds
+// the internal libxc handle to the first parameter. Optional functions that weren't found
+// simply test false (if ( !xc_.doStuff ) ...).
+//
+// If the function has to be adapted to the running Xen version, or to bdvmi types, specialize
+// XCFactoryImpl for it in xcwrapper.cpp. Whatever the adapter needs goes into static variables,
+// so that the lookup still returns a plain function pointer and the version choice is only
+// made once, at load time.
 //
+// Required functions that take the same arguments on every supported Xen version can be declared
+// with DECLARE_BDVMI_DIRECT_FUNCTION() instead. Their XC member is a bdvmi_do_stuff_xcfn_t, bound
+// with BIND_XC_DIRECT_FUNCTION( doStuff ), and their XCFactory parts go in its #ifndef
+// BDVMI_XEN_DIRECT blocks. With ./configure --enable-xen-direct they are linked against libxenctrl
+// and called straight from the header (so the calls can be inlined), otherwise they behave like
+// the rest.
+//
+
+// An XC entry point: a plain function pointer, called with the XC object's libxc handle
+template <class T> class XCFunction;
+
+template <class R, class... Args> class XCFunction<R( Args... )> : private NonCopyable {
+public:
+	using fn_t = R( xc_interface *, Args... );
+
+	XCFunction() = default;
+
+	XCFunction( fn_t *fn, xc_interface *xci ) : fn_{ fn }, xci_{ xci }
+	{
+	}
+
+	explicit operator bool() const
+	{
+		return fn_ != nullptr;
+	}
+
+	R operator()( Args... args ) const
+	{
+		EventTrace::countHypercall();
+		return fn_( xci_, std::forward<Args>( args )... );
+	}
+
+private:
+	fn_t *        fn_{ nullptr };
+	xc_interface *xci_{ nullptr };
+};
+
+#ifdef BDVMI_XEN_DIRECT
+
+// Same as XCFunction, but fn is known at compile time, so the call can be inlined
+template <class T, class F, F *fn> class XCDirectFunction;
+
+template <class R, class... Args, class F, F *fn> class XCDirectFunction<R( Args... ), F, fn> : private NonCopyable {
+public:
+	explicit XCDirectFunction( xc_interface *xci ) : xci_{ xci }
+	{
+	}
+
+	explicit operator bool() const
+	{
+		return true;
+	}
+
+	R operator()( Args... args ) const
+	{
+		EventTrace::countHypercall();
+		return fn( xci_, std::forward<Args>( args )... );
+	}
+
+private:
+	xc_interface *xci_;
+};
+
+// No libxc handle to bind (the event channel functions)
+template <class T, class F, F *fn> class XCDirectCall;
+
+template <class R, class... Args, class F, F *fn> class XCDirectCall<R( Args... ), F, fn> {
+public:
+	explicit operator bool() const
+	{
+		return true;
+	}
+
+	R operator()( Args... args ) const
+	{
+		return fn( std::forward<Args>( args )... );
+	}
+};
+
+#endif // BDVMI_XEN_DIRECT
 
 #define DECLARE_BDVMI_FUNCTION( NAME, TYPE )                                                                           \
 	using bdvmi_##NAME##_fn_t            = TYPE;                                                                   \
 	using xc_##NAME##_fn_t               = PrependArg<xc_interface *, bdvmi_##NAME##_fn_t>::type;                  \
 	constexpr char xc_##NAME##_fn_name[] = "xc_" #NAME;
 
-DECLARE_BDVMI_FUNCTION( domain_pause, int( uint32_t ) )
-DECLARE_BDVMI_FUNCTION( domain_unpause, int( uint32_t ) )
-DECLARE_BDVMI_FUNCTION( domain_shutdown, int( uint32_t, int ) )
+#ifdef BDVMI_XEN_DIRECT
+#define DECLARE_BDVMI_DIRECT_FUNCTION( NAME, TYPE )                                                                    \
+	DECLARE_BDVMI_FUNCTION( NAME, TYPE )                                                                           \
+	using bdvmi_##NAME##_xcfn_t = XCDirectFunction<bdvmi_##NAME##_fn_t, decltype( ::xc_##NAME ), &::xc_##NAME>;
+#define DECLARE_BDVMI_DIRECT_CALL( NAME, TYPE )                                                                        \
+	using bdvmi_##NAME##_fn_t   = TYPE;                                                                            \
+	using bdvmi_##NAME##_xcfn_t = const XCDirectCall<bdvmi_##NAME##_fn_t, decltype( ::xc_##NAME ), &::xc_##NAME>;
+#else
+#define DECLARE_BDVMI_DIRECT_FUNCTION( NAME, TYPE )                                                                    \
+	DECLARE_BDVMI_FUNCTION( NAME, TYPE )                                                                           \
+	using bdvmi_##NAME##_xcfn_t = XCFunction<bdvmi_##NAME##_fn_t>;
+#define DECLARE_BDVMI_DIRECT_CALL( NAME, TYPE )                                                                        \
+	using bdvmi_##NAME##_fn_t   = TYPE;                                                                            \
+	using bdvmi_##NAME##_xcfn_t = bdvmi_##NAME##_fn_t *const;
+#endif // BDVMI_XEN_DIRECT
+
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_pause, int( uint32_t ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_unpause, int( uint32_t ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_shutdown, int( uint32_t, int ) )
 DECLARE_BDVMI_FUNCTION( domain_getinfo, int( uint32_t, XenDomainInfo & ) )
 DECLARE_BDVMI_FUNCTION( domain_getinfolist, int( uint32_t, XenDomctlInfo & ) )
-DECLARE_BDVMI_FUNCTION( domain_maximum_gpfn, int( uint32_t, xen_pfn_t * ) )
-DECLARE_BDVMI_FUNCTION( domain_debug_control, int( uint32_t, uint32_t, uint32_t ) )
-DECLARE_BDVMI_FUNCTION( domain_get_tsc_info, int( uint32_t, uint32_t *, uint64_t *, uint32_t *, uint32_t * ) )
-DECLARE_BDVMI_FUNCTION( domain_set_access_required, int( uint32_t, unsigned int ) )
-DECLARE_BDVMI_FUNCTION( domain_hvm_getcontext, int( uint32_t, uint8_t *, uint32_t ) )
-DECLARE_BDVMI_FUNCTION( domain_hvm_getcontext_partial, int( uint32_t, uint16_t, uint16_t, void *, uint32_t ) )
+DECLARE_BDVMI_FUNCTION( domain_getinfo_batch, int( uint32_t, unsigned int, XenDomainInfo * ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_maximum_gpfn, int( uint32_t, xen_pfn_t * ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_debug_control, int( uint32_t, uint32_t, uint32_t ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_get_tsc_info, int( uint32_t, uint32_t *, uint64_t *, uint32_t *, uint32_t * ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_set_access_required, int( uint32_t, unsigned int ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_hvm_getcontext, int( uint32_t, uint8_t *, uint32_t ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( domain_hvm_getcontext_partial, int( uint32_t, uint16_t, uint16_t, void *, uint32_t ) )
 DECLARE_BDVMI_FUNCTION( set_mem_access, int( uint32_t, const Driver::MemAccessMap & ) )
+DECLARE_BDVMI_FUNCTION( logdirty_control, int( uint32_t, unsigned int, uint64_t *, unsigned long ) )
 DECLARE_BDVMI_FUNCTION( altp2m_get_mem_access, int( uint32_t, uint16_t, xen_pfn_t, xenmem_access_t * ) )
 DECLARE_BDVMI_FUNCTION( domain_set_cores_per_socket, int( uint32_t, uint32_t ) )
 DECLARE_BDVMI_FUNCTION( altp2m_set_mem_access, int( uint32_t, uint16_t, const Driver::MemAccessMap & ) )
-DECLARE_BDVMI_FUNCTION( altp2m_set_domain_state, int( uint32_t, bool ) )
-DECLARE_BDVMI_FUNCTION( altp2m_create_view, int( uint32_t, xenmem_access_t, uint16_t * ) )
-DECLARE_BDVMI_FUNCTION( altp2m_destroy_view, int( uint32_t, uint16_t ) )
-DECLARE_BDVMI_FUNCTION( altp2m_switch_to_view, int( uint32_t, uint16_t ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( altp2m_set_domain_state, int( uint32_t, bool ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( altp2m_create_view, int( uint32_t, xenmem_access_t, uint16_t * ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( altp2m_destroy_view, int( uint32_t, uint16_t ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( altp2m_switch_to_view, int( uint32_t, uint16_t ) )
 DECLARE_BDVMI_FUNCTION( altp2m_set_suppress_ve, int( uint32_t, uint16_t, xen_pfn_t, bool ) )
 DECLARE_BDVMI_FUNCTION( altp2m_get_suppress_ve, int( uint32_t, uint16_t, xen_pfn_t, bool * ) )
-DECLARE_BDVMI_FUNCTION( altp2m_set_vcpu_enable_notify, int( uint32_t, uint32_t, xen_pfn_t ) )
+DECLARE_BDVMI_FUNCTION( altp2m_set_suppress_ve_multi, int( uint32_t, uint16_t, const Driver::ConvertibleMap & ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( altp2m_set_vcpu_enable_notify, int( uint32_t, uint32_t, xen_pfn_t ) )
 DECLARE_BDVMI_FUNCTION( altp2m_set_vcpu_disable_notify, int( uint32_t, uint32_t ) )
 DECLARE_BDVMI_FUNCTION( altp2m_get_vcpu_p2m_idx, int( uint32_t, uint32_t, uint16_t * ) )
-DECLARE_BDVMI_FUNCTION( map_foreign_range, void *( uint32_t, int, int, unsigned long ))
-DECLARE_BDVMI_FUNCTION( get_mem_access, int( uint32_t, uint64_t, xenmem_access_t * ) )
-DECLARE_BDVMI_FUNCTION( hvm_inject_trap, int( uint32_t, int, uint8_t, uint8_t, uint32_t, uint8_t, uint64_t ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( map_foreign_range, void *( uint32_t, int, int, unsigned long ))
+DECLARE_BDVMI_DIRECT_FUNCTION( map_foreign_bulk, void *( uint32_t, int, const xen_pfn_t *, int *, unsigned int ))
+DECLARE_BDVMI_DIRECT_FUNCTION( get_mem_access, int( uint32_t, uint64_t, xenmem_access_t * ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( hvm_inject_trap, int( uint32_t, int, uint8_t, uint8_t, uint32_t, uint8_t, uint64_t ) )
 DECLARE_BDVMI_FUNCTION( vcpu_set_registers, int( uint32_t, unsigned short, const Registers &, bool ) )
-DECLARE_BDVMI_FUNCTION( monitor_enable, void *( uint32_t, uint32_t * ))
-DECLARE_BDVMI_FUNCTION( monitor_disable, int( uint32_t ) )
-DECLARE_BDVMI_FUNCTION( monitor_singlestep, int( uint32_t, bool ) )
-DECLARE_BDVMI_FUNCTION( monitor_software_breakpoint, int( uint32_t, bool ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( monitor_enable, void *( uint32_t, uint32_t * ))
+DECLARE_BDVMI_DIRECT_FUNCTION( monitor_disable, int( uint32_t ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( monitor_singlestep, int( uint32_t, bool ) )
+DECLARE_BDVMI_DIRECT_FUNCTION( monitor_software_breakpoint, int( uint32_t, bool ) )
 DECLARE_BDVMI_FUNCTION( monitor_emulate_each_rep, int( uint32_t, bool ) )
 DECLARE_BDVMI_FUNCTION( monitor_mov_to_msr, int( uint32_t, uint32_t, bool, bool ) )
 DECLARE_BDVMI_FUNCTION( monitor_guest_request, int( uint32_t, bool, bool, bool ) )
@@ -151,14 +270,15 @@ DECLARE_BDVMI_FUNCTION( monitor_inguest_pagefault, int( uint32_t /* domain */, b
 DECLARE_BDVMI_FUNCTION( monitor_emul_unimplemented, int( uint32_t, bool ) )
 DECLARE_BDVMI_FUNCTION( vm_event_get_version, int() )
 
-using bdvmi_evtchn_open_fn_t             = xc_evtchn *( void );
-using bdvmi_evtchn_close_fn_t            = int( xc_evtchn * );
-using bdvmi_evtchn_fd_fn_t               = int( xc_evtchn * );
-using bdvmi_evtchn_pending_fn_t          = int( xc_evtchn * );
-using bdvmi_evtchn_bind_interdomain_fn_t = int( xc_evtchn *, uint32_t, uint32_t );
-using bdvmi_evtchn_unbind_fn_t           = int( xc_evtchn *, uint32_t );
-using bdvmi_evtchn_unmask_fn_t           = int( xc_evtchn *, uint32_t );
-using bdvmi_evtchn_notify_fn_t           = int( xc_evtchn *, uint32_t );
+using bdvmi_evtchn_open_fn_t = xc_evtchn *( void );
+
+DECLARE_BDVMI_DIRECT_CALL( evtchn_close, int( xc_evtchn * ) )
+DECLARE_BDVMI_DIRECT_CALL( evtchn_fd, int( xc_evtchn * ) )
+DECLARE_BDVMI_DIRECT_CALL( evtchn_pending, int( xc_evtchn * ) )
+DECLARE_BDVMI_DIRECT_CALL( evtchn_bind_interdomain, int( xc_evtchn *, uint32_t, uint32_t ) )
+DECLARE_BDVMI_DIRECT_CALL( evtchn_unbind, int( xc_evtchn *, uint32_t ) )
+DECLARE_BDVMI_DIRECT_CALL( evtchn_unmask, int( xc_evtchn *, uint32_t ) )
+DECLARE_BDVMI_DIRECT_CALL( evtchn_notify, int( xc_evtchn *, uint32_t ) )
 
 class XC {
 public:
@@ -182,67 +302,73 @@ public:
 	const std::string uuid;
 
 	// Domain Management functions
-	NCFunction<bdvmi_domain_pause_fn_t>                  domainPause;
-	NCFunction<bdvmi_domain_unpause_fn_t>                domainUnpause;
-	NCFunction<bdvmi_domain_shutdown_fn_t>               domainShutdown;
-	NCFunction<bdvmi_domain_getinfo_fn_t>                domainGetInfo;
-	NCFunction<bdvmi_domain_getinfolist_fn_t>            domainGetInfoList;
-	NCFunction<bdvmi_domain_maximum_gpfn_fn_t>           domainMaximumGpfn;
-	NCFunction<bdvmi_domain_debug_control_fn_t>          domainDebugControl;
-	NCFunction<bdvmi_domain_get_tsc_info_fn_t>           domainGetTscInfo;
-	NCFunction<bdvmi_domain_set_access_required_fn_t>    domainSetAccessRequired;
-	NCFunction<bdvmi_domain_hvm_getcontext_fn_t>         domainHvmGetContext;
-	NCFunction<bdvmi_domain_hvm_getcontext_partial_fn_t> domainHvmGetContextPartial;
-	NCFunction<bdvmi_set_mem_access_fn_t>                setMemAccess;
+	bdvmi_domain_pause_xcfn_t                   domainPause;
+	bdvmi_domain_unpause_xcfn_t                 domainUnpause;
+	bdvmi_domain_shutdown_xcfn_t                domainShutdown;
+	XCFunction<bdvmi_domain_getinfo_fn_t>       domainGetInfo;
+	XCFunction<bdvmi_domain_getinfolist_fn_t>   domainGetInfoList;
+	XCFunction<bdvmi_domain_getinfo_batch_fn_t> domainGetInfoBatch;
+	bdvmi_domain_maximum_gpfn_xcfn_t            domainMaximumGpfn;
+	bdvmi_domain_debug_control_xcfn_t           domainDebugControl;
+	bdvmi_domain_get_tsc_info_xcfn_t            domainGetTscInfo;
+	bdvmi_domain_set_access_required_xcfn_t     domainSetAccessRequired;
+	bdvmi_domain_hvm_getcontext_xcfn_t          domainHvmGetContext;
+	bdvmi_domain_hvm_getcontext_partial_xcfn_t  domainHvmGetContextPartial;
+	XCFunction<bdvmi_set_mem_access_fn_t>       setMemAccess;
+
+	// Log-dirty mode: ( domain, XEN_DOMCTL_SHADOW_OP_*, bitmap (or nullptr), pages )
+	XCFunction<bdvmi_logdirty_control_fn_t> logdirtyControl;
 
 	// ALTP2M support
-	NCFunction<bdvmi_altp2m_get_mem_access_fn_t>          altp2mGetMemAccess;
-	NCFunction<bdvmi_altp2m_set_mem_access_fn_t>          altp2mSetMemAccess;
-	NCFunction<bdvmi_altp2m_set_domain_state_fn_t>        altp2mSetDomainState;
-	NCFunction<bdvmi_altp2m_create_view_fn_t>             altp2mCreateView;
-	NCFunction<bdvmi_altp2m_destroy_view_fn_t>            altp2mDestroyView;
-	NCFunction<bdvmi_altp2m_switch_to_view_fn_t>          altp2mSwitchToView;
-	NCFunction<bdvmi_altp2m_set_suppress_ve_fn_t>         altp2mSetSuppressVE;
-	NCFunction<bdvmi_altp2m_get_suppress_ve_fn_t>         altp2mGetSuppressVE;
-	NCFunction<bdvmi_altp2m_set_vcpu_enable_notify_fn_t>  altp2mSetVcpuEnableNotify;
-	NCFunction<bdvmi_altp2m_set_vcpu_disable_notify_fn_t> altp2mSetVcpuDisableNotify;
-	NCFunction<bdvmi_altp2m_get_vcpu_p2m_idx_fn_t>        altp2mGetVcpuP2mIdx;
-
-	NCFunction<bdvmi_map_foreign_range_fn_t>  mapForeignRange;
-	NCFunction<bdvmi_get_mem_access_fn_t>     getMemAccess;
-	NCFunction<bdvmi_hvm_inject_trap_fn_t>    hvmInjectTrap;
-	NCFunction<bdvmi_vcpu_set_registers_fn_t> vcpuSetRegisters;
+	XCFunction<bdvmi_altp2m_get_mem_access_fn_t>          altp2mGetMemAccess;
+	XCFunction<bdvmi_altp2m_set_mem_access_fn_t>          altp2mSetMemAccess;
+	bdvmi_altp2m_set_domain_state_xcfn_t                  altp2mSetDomainState;
+	bdvmi_altp2m_create_view_xcfn_t                       altp2mCreateView;
+	bdvmi_altp2m_destroy_view_xcfn_t                      altp2mDestroyView;
+	bdvmi_altp2m_switch_to_view_xcfn_t                    altp2mSwitchToView;
+	XCFunction<bdvmi_altp2m_set_suppress_ve_fn_t>         altp2mSetSuppressVE;
+	XCFunction<bdvmi_altp2m_get_suppress_ve_fn_t>         altp2mGetSuppressVE;
+	XCFunction<bdvmi_altp2m_set_suppress_ve_multi_fn_t>   altp2mSetSuppressVEMulti;
+	bdvmi_altp2m_set_vcpu_enable_notify_xcfn_t            altp2mSetVcpuEnableNotify;
+	XCFunction<bdvmi_altp2m_set_vcpu_disable_notify_fn_t> altp2mSetVcpuDisableNotify;
+	XCFunction<bdvmi_altp2m_get_vcpu_p2m_idx_fn_t>        altp2mGetVcpuP2mIdx;
+
+	bdvmi_map_foreign_range_xcfn_t            mapForeignRange;
+	bdvmi_map_foreign_bulk_xcfn_t             mapForeignBulk;
+	bdvmi_get_mem_access_xcfn_t               getMemAccess;
+	bdvmi_hvm_inject_trap_xcfn_t              hvmInjectTrap;
+	XCFunction<bdvmi_vcpu_set_registers_fn_t> vcpuSetRegisters;
 
 	// Monitor functions
-	NCFunction<bdvmi_monitor_enable_fn_t>              monitorEnable;
-	NCFunction<bdvmi_monitor_disable_fn_t>             monitorDisable;
-	NCFunction<bdvmi_monitor_singlestep_fn_t>          monitorSinglestep;
-	NCFunction<bdvmi_monitor_software_breakpoint_fn_t> monitorSoftwareBreakpoint;
-	NCFunction<bdvmi_monitor_emulate_each_rep_fn_t>    monitorEmulateEachRep;
-	NCFunction<bdvmi_monitor_mov_to_msr_fn_t>          monitorMovToMsr;
-	NCFunction<bdvmi_monitor_guest_request_fn_t>       monitorGuestRequest;
-	NCFunction<bdvmi_monitor_write_ctrlreg_fn_t>       monitorWriteCtrlreg;
-	NCFunction<bdvmi_monitor_descriptor_access_fn_t>   monitorDescriptorAccess;
-	NCFunction<bdvmi_monitor_inguest_pagefault_fn_t>   monitorInguestPagefault;
-	NCFunction<bdvmi_monitor_emul_unimplemented_fn_t>  monitorEmulUnimplemented;
+	bdvmi_monitor_enable_xcfn_t                       monitorEnable;
+	bdvmi_monitor_disable_xcfn_t                      monitorDisable;
+	bdvmi_monitor_singlestep_xcfn_t                   monitorSinglestep;
+	bdvmi_monitor_software_breakpoint_xcfn_t          monitorSoftwareBreakpoint;
+	XCFunction<bdvmi_monitor_emulate_each_rep_fn_t>   monitorEmulateEachRep;
+	XCFunction<bdvmi_monitor_mov_to_msr_fn_t>         monitorMovToMsr;
+	XCFunction<bdvmi_monitor_guest_request_fn_t>      monitorGuestRequest;
+	XCFunction<bdvmi_monitor_write_ctrlreg_fn_t>      monitorWriteCtrlreg;
+	XCFunction<bdvmi_monitor_descriptor_access_fn_t>  monitorDescriptorAccess;
+	XCFunction<bdvmi_monitor_inguest_pagefault_fn_t>  monitorInguestPagefault;
+	XCFunction<bdvmi_monitor_emul_unimplemented_fn_t> monitorEmulUnimplemented;
 
 	// XenServer-specific functions
-	NCFunction<bdvmi_domain_set_cores_per_socket_fn_t> domainSetCoresPerSocket;
+	XCFunction<bdvmi_domain_set_cores_per_socket_fn_t> domainSetCoresPerSocket;
 
 	// General query functions
-	NCFunction<bdvmi_vm_event_get_version_fn_t> vmEventGetVersion;
+	XCFunction<bdvmi_vm_event_get_version_fn_t> vmEventGetVersion;
 
 	/*
 	 * Event Channel functions
 	 */
-	std::function<bdvmi_evtchn_open_fn_t>             evtchnOpen;
-	std::function<bdvmi_evtchn_close_fn_t>            evtchnClose;
-	std::function<bdvmi_evtchn_fd_fn_t>               evtchnFd;
-	std::function<bdvmi_evtchn_pending_fn_t>          evtchnPending;
-	std::function<bdvmi_evtchn_bind_interdomain_fn_t> evtchnBindInterdomain;
-	std::function<bdvmi_evtchn_unbind_fn_t>           evtchnUnbind;
-	std::function<bdvmi_evtchn_unmask_fn_t>           evtchnUnmask;
-	std::function<bdvmi_evtchn_notify_fn_t>           evtchnNotify;
+	bdvmi_evtchn_open_fn_t *const        evtchnOpen;
+	bdvmi_evtchn_close_xcfn_t            evtchnClose;
+	bdvmi_evtchn_fd_xcfn_t               evtchnFd;
+	bdvmi_evtchn_pending_xcfn_t          evtchnPending;
+	bdvmi_evtchn_bind_interdomain_xcfn_t evtchnBindInterdomain;
+	bdvmi_evtchn_unbind_xcfn_t           evtchnUnbind;
+	bdvmi_evtchn_unmask_xcfn_t           evtchnUnmask;
+	bdvmi_evtchn_notify_xcfn_t           evtchnNotify;
 };
 
 } // namespace bdvmi
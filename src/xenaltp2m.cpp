@@ -168,6 +168,17 @@ int XenAltp2mDomainState::setSuppressVE( uint16_t view, xen_pfn_t gfn, bool sve
 	return xc_.altp2mSetSuppressVE( domain_, view, gfn, sve );
 }
 
+int XenAltp2mDomainState::setSuppressVE( uint16_t view, const Driver::ConvertibleMap &convMap )
+{
+	if ( !enabled_ )
+		return -ENOTSUP;
+
+	if ( view && views_.find( view ) == views_.end() )
+		return -EINVAL;
+
+	return xc_.altp2mSetSuppressVEMulti( domain_, view, convMap );
+}
+
 int XenAltp2mDomainState::getSuppressVE( uint16_t view, xen_pfn_t gfn, bool &sve )
 {
 	if ( !enabled_ )
@@ -58,6 +58,9 @@ public:
 
 	int setSuppressVE( uint16_t view, xen_pfn_t gfn, bool sve );
 
+	// Batched, where Xen can do it
+	int setSuppressVE( uint16_t view, const Driver::ConvertibleMap &convMap );
+
 	int getSuppressVE( uint16_t view, xen_pfn_t gfn, bool &sve );
 
 	explicit operator bool() const
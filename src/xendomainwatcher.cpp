@@ -17,6 +17,7 @@
 #include "xcwrapper.h"
 #include "xendomainwatcher.h"
 #include "utils.h"
+#include <algorithm>
 #include <errno.h>
 #include <poll.h>
 #include <cstdlib>
@@ -25,8 +26,9 @@
 
 namespace bdvmi {
 
-constexpr char   XenDomainWatcher::TEMPORARY_UUID_SUFFIX[];
-constexpr size_t XenDomainWatcher::PREFIX_SIZE;
+constexpr char         XenDomainWatcher::TEMPORARY_UUID_SUFFIX[];
+constexpr size_t       XenDomainWatcher::PREFIX_SIZE;
+constexpr unsigned int XenDomainWatcher::DOMAIN_BATCH_SIZE;
 
 XenDomainWatcher::XenDomainWatcher( sig_atomic_t &sigStop )
     : DomainWatcher{ sigStop }
@@ -56,16 +58,87 @@ XenDomainWatcher::~XenDomainWatcher()
 	}
 }
 
-bool XenDomainWatcher::getNewDomains( std::list<DomainInfo> &domains )
+bool XenDomainWatcher::listDomains( std::vector<XenDomainInfo> &list )
 {
-	int           domid = 1;
+	uint32_t domid = 1;
+	int      err   = -1;
+
+	list.clear();
+
+	for ( ;; ) {
+		size_t offset = list.size();
+
+		list.resize( offset + DOMAIN_BATCH_SIZE );
+
+		err = xc_.domainGetInfoBatch( domid, DOMAIN_BATCH_SIZE, list.data() + offset );
+
+		list.resize( offset + ( err > 0 ? err : 0 ) );
+
+		if ( err < static_cast<int>( DOMAIN_BATCH_SIZE ) )
+			break;
+
+		domid = list.back().domid + 1;
+	}
+
+	if ( err != -1 )
+		return true;
+
+	if ( errno == EACCES || errno == EPERM )
+		return false;
+
+	// No usable xc_domain_getinfolist(), go the slow way
 	XenDomainInfo dominfo;
-	int           err = -1;
-	bool          ret = false;
 
-	while ( ( err = xc_.domainGetInfo( domid, dominfo ) ) == 1 ) {
+	list.clear();
+	domid = 1;
 
+	while ( ( err = xc_.domainGetInfo( domid, dominfo ) ) == 1 ) {
+		list.push_back( dominfo );
 		domid = dominfo.domid + 1;
+	}
+
+	return err != -1;
+}
+
+void XenDomainWatcher::watchDomain( domid_t domain, const std::string &path, const std::string &token )
+{
+	unwatchDomain( domain );
+
+	xs_.watch( path, token );
+	watchedDomains_[domain] = std::make_pair( path, token );
+}
+
+void XenDomainWatcher::unwatchDomain( domid_t domain )
+{
+	auto i = watchedDomains_.find( domain );
+
+	if ( i == watchedDomains_.end() )
+		return;
+
+	xs_.unwatch( i->second.first, i->second.second );
+	watchedDomains_.erase( i );
+}
+
+bool XenDomainWatcher::getNewDomains( std::list<DomainInfo> &domains )
+{
+	bool ret = false;
+
+	if ( !listDomains( domainList_ ) ) {
+		if ( errno == EACCES || errno == EPERM ) {
+			std::runtime_error e( "access denied for xc_domain_getinfolist()" );
+			logger << ERROR << e.what() << std::flush;
+			throw e;
+		}
+
+		return false;
+	}
+
+	for ( auto &&dominfo : domainList_ ) {
+		// Only domains we've never seen (or that are still pre-resuming) cost XenStore
+		// traffic, the others are either hooked already or waiting on a watch event.
+		if ( dominfo.domid == ownDomId_ || domIds_.find( dominfo.domid ) != domIds_.end() ||
+		     watchedDomains_.find( dominfo.domid ) != watchedDomains_.end() )
+			continue;
 
 		std::string key = "/local/domain/" + std::to_string( dominfo.domid ) + "/vm-data/pre-resume";
 
@@ -89,45 +162,109 @@ bool XenDomainWatcher::getNewDomains( std::list<DomainInfo> &domains )
 
 		if ( xs_.isDomainIntroduced( dominfo.domid ) ) {
 			// New domain
-			if ( domIds_.find( dominfo.domid ) == domIds_.end() ) {
-				std::string path = "/local/domain/" + std::to_string( dominfo.domid ) + "/name";
-				bool        self = isSelf( dominfo.domid );
-
-				errno = 0;
-
-				if ( self )
-					initControlKey( dominfo.domid );
-
-				CUniquePtr<char> name( xs_.readTimeout( XS::xbtNull, path, nullptr, 1 ) );
-
-				if ( name ) { // domain running or new domain w name set
-					if ( !self ) {
-						std::string guestUuid = uuid( dominfo.domid );
-
-						// Temporary UUID set for localhost migration purposes (XenServer/XAPI).
-						// The guest is not really ready until the real UUID is set, so
-						// wait for that.
-						if ( guestUuid.length() > 24 &&
-						     guestUuid.substr( 24 ) == TEMPORARY_UUID_SUFFIX ) {
-							path =
-							    "/local/domain/" + std::to_string( dominfo.domid ) + "/vm";
-							xs_.watch( path, "uuid" + std::to_string( dominfo.domid ) );
-						} else {
-							processNewDomain( domains, dominfo.domid, guestUuid,
-							                  name.get() );
-							ret = true;
-						}
-					}
-				} else // new domain, name not yet set
-					xs_.watch( path, "dom" + std::to_string( dominfo.domid ) );
+			std::string path = "/local/domain/" + std::to_string( dominfo.domid ) + "/name";
+			bool        self = isSelf( dominfo.domid );
+
+			errno = 0;
+
+			if ( self ) {
+				ownDomId_ = dominfo.domid;
+				initControlKey( dominfo.domid );
 			}
+
+			CUniquePtr<char> name( xs_.readTimeout( XS::xbtNull, path, nullptr, 1 ) );
+
+			if ( name ) { // domain running or new domain w name set
+				if ( !self ) {
+					std::string guestUuid = uuid( dominfo.domid );
+
+					// Temporary UUID set for localhost migration purposes (XenServer/XAPI).
+					// The guest is not really ready until the real UUID is set, so
+					// wait for that.
+					if ( guestUuid.length() > 24 &&
+					     guestUuid.substr( 24 ) == TEMPORARY_UUID_SUFFIX ) {
+						path = "/local/domain/" + std::to_string( dominfo.domid ) + "/vm";
+						watchDomain( dominfo.domid, path,
+						             "uuid" + std::to_string( dominfo.domid ) );
+					} else {
+						processNewDomain( domains, dominfo.domid, guestUuid, name.get() );
+						ret = true;
+					}
+				}
+			} else // new domain, name not yet set
+				watchDomain( dominfo.domid, path, "dom" + std::to_string( dominfo.domid ) );
+		}
+	}
+
+	return ret;
+}
+
+bool XenDomainWatcher::releaseDomains( std::list<DomainInfo> &domains )
+{
+	bool listed = listDomains( domainList_ );
+	bool ret    = false;
+
+	auto find = [this]( domid_t domid ) {
+		auto i = std::lower_bound(
+		    domainList_.begin(), domainList_.end(), domid,
+		    []( const XenDomainInfo &info, domid_t value ) { return info.domid < value; } );
+
+		return ( i != domainList_.end() && i->domid == domid ) ? &*i : nullptr;
+	};
+
+	// A domain that's still listed and neither dying nor shut down is still introduced, so
+	// XenStore only needs asking about the ones on their way out.
+	auto gone = [&]( domid_t domid ) {
+		if ( !listed )
+			return !xs_.isDomainIntroduced( domid );
+
+		const XenDomainInfo *info = find( domid );
+
+		if ( !info )
+			return true;
+
+		if ( !info->dying && !info->shutdown )
+			return false;
+
+		return !xs_.isDomainIntroduced( domid );
+	};
+
+	auto          i = domIds_.begin();
+	decltype( i ) j;
+
+	while ( i != domIds_.end() ) {
+		j = i;
+		++i;
+
+		if ( gone( j->first ) ) {
+			domains.emplace_back( j->second, DomainInfo::STATE_FINISHED );
+
+			preResumeDomains_.erase( j->first );
+			domIds_.erase( j );
+
+			ret = true;
 		}
 	}
 
-	if ( err == -1 && ( errno == EACCES || errno == EPERM ) ) {
-		std::runtime_error e( "access denied for xc_domain_getinfo()" );
-		logger << ERROR << e.what() << std::flush;
-		throw e;
+	if ( !listed )
+		return ret;
+
+	// Domains that went away before we got to hook them
+	for ( auto k = watchedDomains_.begin(); k != watchedDomains_.end(); ) {
+		domid_t domid = ( k++ )->first;
+
+		if ( !find( domid ) )
+			unwatchDomain( domid );
+	}
+
+	for ( auto k = preResumeDomains_.begin(); k != preResumeDomains_.end(); ) {
+		if ( find( *k ) ) {
+			++k;
+			continue;
+		}
+
+		xs_.unwatch( "/local/domain/" + std::to_string( *k ) + "/vm-data/pre-resume", postResumeToken_ );
+		k = preResumeDomains_.erase( k );
 	}
 
 	return ret;
@@ -168,24 +305,8 @@ bool XenDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains,
 		if ( introduceToken_ == vec[XS::watchToken] )
 			ret = getNewDomains( domains );
 
-		if ( releaseToken_ == vec[XS::watchToken] ) {
-			auto          i = domIds_.begin();
-			decltype( i ) j;
-
-			while ( i != domIds_.end() ) {
-				j = i;
-				++i;
-
-				if ( !xs_.isDomainIntroduced( j->first ) ) {
-					domains.emplace_back( j->second, DomainInfo::STATE_FINISHED );
-
-					preResumeDomains_.erase( j->first );
-					domIds_.erase( j );
-
-					ret = true;
-				}
-			}
-		}
+		if ( releaseToken_ == vec[XS::watchToken] && releaseDomains( domains ) )
+			ret = true;
 
 		if ( controlToken_ == vec[XS::watchToken] ) {
 			if ( firstControlCommand_ ) // ignore first event, it's just how XenStore works
@@ -223,6 +344,7 @@ bool XenDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains,
 					}
 
 					xs_.unwatch( vec[XS::watchPath], vec[XS::watchToken] );
+					watchedDomains_.erase( domid );
 				}
 			}
 		}
@@ -247,6 +369,7 @@ bool XenDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains,
 							    "/local/domain/" + std::to_string( domid ) + "/vm";
 
 							xs_.unwatch( path, "uuid" + std::to_string( domid ) );
+							watchedDomains_.erase( domid );
 
 							path = "/local/domain/" + std::to_string( domid ) + "/name";
 
@@ -257,9 +380,8 @@ bool XenDomainWatcher::waitForDomainsOrTimeout( std::list<DomainInfo> &domains,
 								processNewDomain( domains, domid, uuid, name.get() );
 								ret = true;
 							} else
-								xs_.watch( "/local/domain/" + std::to_string( domid ) +
-								               "/name",
-								           "dom" + std::to_string( domid ) );
+								watchDomain( domid, path,
+								             "dom" + std::to_string( domid ) );
 						}
 					}
 				}
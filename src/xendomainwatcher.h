@@ -19,7 +19,9 @@
 #include "bdvmi/domainwatcher.h"
 #include "xcwrapper.h"
 #include "xswrapper.h"
+#include <map>
 #include <unordered_map>
+#include <vector>
 
 namespace bdvmi {
 
@@ -55,6 +57,16 @@ private:
 
 	bool getNewDomains( std::list<DomainInfo> &domains );
 
+	// All the domains but dom0, sorted by domid, DOMAIN_BATCH_SIZE per hypercall
+	bool listDomains( std::vector<XenDomainInfo> &list );
+
+	// Remember that domain's (not yet hooked) fate now depends on the path watch, so scans can skip it
+	void watchDomain( domid_t domain, const std::string &path, const std::string &token );
+
+	void unwatchDomain( domid_t domain );
+
+	bool releaseDomains( std::list<DomainInfo> &domains );
+
 	std::string uuid( domid_t domain ) const;
 
 	void processNewDomain( std::list<DomainInfo> &domains, domid_t domid, const std::string &uuid,
@@ -73,8 +85,12 @@ private:
 	bool                    firstControlCommand_{ true };
 	bool                    keyCreated_{ false };
 	std::set<domid_t>       preResumeDomains_;
-	constexpr static char   TEMPORARY_UUID_SUFFIX[]{ "000000000001" };
-	constexpr static size_t PREFIX_SIZE{ 4 };
+	std::map<domid_t, std::pair<std::string, std::string>> watchedDomains_; // path, token
+	std::vector<XenDomainInfo>                             domainList_;
+	uint32_t                                               ownDomId_{ ~0U };
+	constexpr static char         TEMPORARY_UUID_SUFFIX[]{ "000000000001" };
+	constexpr static size_t       PREFIX_SIZE{ 4 };
+	constexpr static unsigned int DOMAIN_BATCH_SIZE{ 256 };
 };
 
 } // namespace bdvmi
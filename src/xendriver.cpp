@@ -22,6 +22,7 @@
 #include "xcwrapper.h"
 #include "xendriver.h"
 #include <algorithm>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <iomanip>
@@ -239,42 +240,163 @@ bool XenDriver::getPageProtectionImpl( unsigned long long guestAddress, bool &re
 	return true;
 }
 
+bool XenDriver::getPageProtectionRangeImpl( unsigned long long firstGfn, size_t count, uint8_t *access,
+                                            unsigned short view )
+{
+	// There's no multi-gfn xc_get_mem_access(), so this is one hypercall per page (with no locks held)
+	for ( size_t i = 0; i < count; ++i ) {
+		bool read, write, execute;
+
+		if ( !getPageProtectionImpl( gfn_to_gpa( firstGfn + i ), read, write, execute, view ) )
+			continue; // leave it as PageAttributeTable::UNKNOWN
+
+		access[i] = ( read ? PAGE_READ : 0 ) | ( write ? PAGE_WRITE : 0 ) | ( execute ? PAGE_EXECUTE : 0 );
+	}
+
+	return true;
+}
+
 bool XenDriver::registers( unsigned short vcpu, Registers &regs ) const
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	RegsCache::Entry *           e = regsCache_.entry( vcpu );
+	std::unique_lock<std::mutex> lock;
 
-	regs = Registers(); // Fill it up with default values.
+	if ( e ) {
+		lock = std::unique_lock<std::mutex>( e->mutex_ );
+
+		if ( regsCache_.valid( *e ) ) {
+			regs = e->registers_;
+
+			if ( !getPAT( vcpu, regs.msr_pat ) )
+				return false;
+
+			recordRegisters( vcpu, regs );
+			return true;
+		}
+	}
 
-	if ( regsCache_.valid_ && regsCache_.vcpu_ == static_cast<int>( vcpu ) ) {
-		regs = regsCache_.registers_;
+	bool offline = false;
+
+	if ( !queryRegisters( vcpu, regs, offline ) )
+		return false;
 
-		if ( !getPAT( vcpu, regs.msr_pat ) )
+	if ( e && !offline && regsCache_.cacheable( *e ) )
+		regsCache_.fill( *e, regs );
+
+	recordRegisters( vcpu, regs );
+
+	return true;
+}
+
+bool XenDriver::cachedRegisters( unsigned short vcpu, const Registers *&regs ) const
+{
+	RegsCache::Entry *e = regsCache_.entry( vcpu );
+
+	if ( !e )
+		return false;
+
+	std::lock_guard<std::mutex> lock( e->mutex_ );
+
+	if ( !regsCache_.valid( *e ) ) {
+		bool offline = false;
+
+		if ( !regsCache_.cacheable( *e ) || !queryRegisters( vcpu, e->registers_, offline ) || offline )
 			return false;
 
-		return true;
+		regsCache_.validate( *e );
+	}
+
+	regs = &e->registers_;
+
+	return true;
+}
+
+bool XenDriver::readMsr( unsigned short vcpu, uint32_t msr, uint64_t &value ) const
+{
+	// Stopped vCPUs get their whole CPU record cached, it's the same hypercall anyway
+	// and whatever else the handler wants to know about the vCPU is then free
+	const Registers *regs = nullptr;
+
+	if ( cachedRegisters( vcpu, regs ) )
+		return regs->msr( msr, value );
+
+	if ( msr == MSR_IA32_CR_PAT )
+		return getPAT( vcpu, value );
+
+	StatsCounter counter( "partialCpuMsr" );
+
+	struct hvm_hw_cpu hwCpu;
+
+	if ( xc_.domainHvmGetContextPartial( domain_, HVM_SAVE_CODE( CPU ), vcpu, &hwCpu, sizeof( hwCpu ) ) != 0 ) {
+		logger << ( errno == ENODATA ? WARNING : ERROR )
+		       << "xc_domain_hvm_getcontext_partial() (vcpu = " << vcpu << ") failed: " << strerror( errno )
+		       << std::flush;
+		return false;
 	}
 
+	switch ( msr ) {
+		case MSR_IA32_SYSENTER_CS:
+			value = hwCpu.sysenter_cs;
+			break;
+		case MSR_IA32_SYSENTER_ESP:
+			value = hwCpu.sysenter_esp;
+			break;
+		case MSR_IA32_SYSENTER_EIP:
+			value = hwCpu.sysenter_eip;
+			break;
+		case MSR_EFER:
+			value = hwCpu.msr_efer;
+			break;
+		case MSR_STAR:
+			value = hwCpu.msr_star;
+			break;
+		case MSR_LSTAR:
+			value = hwCpu.msr_lstar;
+			break;
+		case MSR_CSTAR:
+			value = hwCpu.msr_cstar;
+			break;
+		case MSR_FS_BASE:
+			value = hwCpu.fs_base;
+			break;
+		case MSR_GS_BASE:
+			value = hwCpu.gs_base;
+			break;
+		case MSR_SHADOW_GS_BASE:
+			value = hwCpu.shadow_gs;
+			break;
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+bool XenDriver::queryRegisters( unsigned short vcpu, Registers &regs, bool &offline ) const
+{
+	regs = Registers(); // Fill it up with default values.
+
 	StatsCounter ctxCounter( "partialContext" );
 	StatsCounter cpuCounter( "partialCpu" );
 
 	struct hvm_hw_cpu hwCpu;
 
 	if ( xc_.domainHvmGetContextPartial( domain_, HVM_SAVE_CODE( CPU ), vcpu, &hwCpu, sizeof( hwCpu ) ) != 0 ) {
-		EventHandler *h          = handler();
-		int           savedErrno = errno;
+		int savedErrno = errno;
 
 		logger << ( errno == ENODATA ? WARNING : ERROR )
 		       << "xc_domain_hvm_getcontext_partial() (vcpu = " << vcpu << ") failed: " << strerror( errno )
 		       << std::flush;
 
-		if ( savedErrno == EINVAL && h )
-			h->handleFatalError();
+		if ( savedErrno == EINVAL )
+			fatalError();
 
 		// If errno is ENODATA, it means that the VCPU is offline (Xen convention), so no data could
 		// be retrieved for it. Introcore insists that it wants to be able to query data for offline
 		// (but valid) VCPUs as well, and Xen insists that this query should not be allowed, hence
 		// this compromise: in that case, serve some default values.
-		return savedErrno == ENODATA;
+		offline = ( savedErrno == ENODATA );
+		return offline;
 	}
 
 	if ( !getPAT( vcpu, regs.msr_pat ) )
@@ -357,79 +479,61 @@ bool XenDriver::registers( unsigned short vcpu, Registers &regs ) const
 			break;
 	}
 
-	if ( regsCache_.vcpu_ == static_cast<int>( vcpu ) ) {
-
-		if ( delayedWrite_.pending_ ) {
-			regs.rax = delayedWrite_.registers_.rax;
-			regs.rcx = delayedWrite_.registers_.rcx;
-			regs.rdx = delayedWrite_.registers_.rdx;
-			regs.rbx = delayedWrite_.registers_.rbx;
-			regs.rsp = delayedWrite_.registers_.rsp;
-			regs.rbp = delayedWrite_.registers_.rbp;
-			regs.rsi = delayedWrite_.registers_.rsi;
-			regs.rdi = delayedWrite_.registers_.rdi;
-
-			regs.r8  = delayedWrite_.registers_.r8;
-			regs.r9  = delayedWrite_.registers_.r9;
-			regs.r10 = delayedWrite_.registers_.r10;
-			regs.r11 = delayedWrite_.registers_.r11;
-			regs.r12 = delayedWrite_.registers_.r12;
-			regs.r13 = delayedWrite_.registers_.r13;
-			regs.r14 = delayedWrite_.registers_.r14;
-			regs.r15 = delayedWrite_.registers_.r15;
-
-			regs.rflags = delayedWrite_.registers_.rflags;
-			regs.rip    = delayedWrite_.registers_.rip;
-		}
+	std::lock_guard<std::mutex> dwLock( delayedWritesMutex_ );
 
-		regsCache_.registers_ = regs;
-		regsCache_.valid_     = true;
-	}
+	auto dw = delayedWrites_.find( vcpu );
+
+	if ( dw != delayedWrites_.end() && dw->second.pending_ )
+		regs.assignGroups( dw->second.registers_, Registers::GROUP_WRITABLE );
 
 	return true;
 }
 
 bool XenDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool setEip, bool delay )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	RegsCache::Entry *           e = regsCache_.entry( vcpu );
+	std::unique_lock<std::mutex> lock;
+
+	if ( e )
+		lock = std::unique_lock<std::mutex>( e->mutex_ );
+
+	bool cached = e && regsCache_.valid( *e );
 
 	if ( !delay ) {
+		// A getcontext / setcontext pair saved, if nothing would change
+		if ( cached && !( e->registers_.changedGroups( regs ) & Registers::GROUP_WRITABLE ) )
+			return true;
+
 		if ( xc_.vcpuSetRegisters( domain_, vcpu, regs, setEip ) != 0 ) {
 			logger << ERROR << "xc_vcpu_set_context failed" << strerror( errno ) << std::flush;
 			return false;
 		}
 	} else {
-		delayedWrite_.registers_ = regs;
+		std::lock_guard<std::mutex> dwLock( delayedWritesMutex_ );
+		DelayedWrite &              dw = delayedWrites_[vcpu];
+
+		dw.registers_ = regs;
 
 		if ( !setEip )
-			delayedWrite_.registers_.rip = regs.rip + 3; // 3 is the size of the VMCALL opcodes
+			dw.registers_.rip = regs.rip + 3; // 3 is the size of the VMCALL opcodes
+
+		// Without a cached copy to compare against, assume everything changed
+		uint32_t changed = Registers::GROUP_WRITABLE;
 
-		delayedWrite_.pending_ = true;
+		if ( cached )
+			changed &= e->registers_.changedGroups( dw.registers_ );
+
+		dw.changed_ |= changed;
+		dw.pending_ = true;
 	}
 
-	if ( regsCache_.valid_ && regsCache_.vcpu_ == static_cast<int>( vcpu ) ) {
-		regsCache_.registers_.rax = regs.rax;
-		regsCache_.registers_.rcx = regs.rcx;
-		regsCache_.registers_.rdx = regs.rdx;
-		regsCache_.registers_.rbx = regs.rbx;
-		regsCache_.registers_.rsp = regs.rsp;
-		regsCache_.registers_.rbp = regs.rbp;
-		regsCache_.registers_.rsi = regs.rsi;
-		regsCache_.registers_.rdi = regs.rdi;
-
-		regsCache_.registers_.r8  = regs.r8;
-		regsCache_.registers_.r9  = regs.r9;
-		regsCache_.registers_.r10 = regs.r10;
-		regsCache_.registers_.r11 = regs.r11;
-		regsCache_.registers_.r12 = regs.r12;
-		regsCache_.registers_.r13 = regs.r13;
-		regsCache_.registers_.r14 = regs.r14;
-		regsCache_.registers_.r15 = regs.r15;
-
-		regsCache_.registers_.rflags = regs.rflags;
-
-		if ( setEip )
-			regsCache_.registers_.rip = regs.rip;
+	if ( cached ) {
+		uint64_t rip = e->registers_.rip;
+
+		e->registers_.assignGroups( regs, Registers::GROUP_WRITABLE );
+
+		if ( !setEip )
+			e->registers_.rip = rip;
 	}
 
 	return true;
@@ -560,6 +664,8 @@ MapReturnCode XenDriver::mapPhysMemToHost( unsigned long long address, size_t le
 		if ( !mapped )
 			return MAP_FAILED_GENERIC;
 
+		recordPage( gfn, mapped );
+
 		pointer = static_cast<char *>( mapped ) + ( address & ~XC::pageMask );
 	} catch ( ... ) {
 		return MAP_FAILED_GENERIC;
@@ -582,6 +688,72 @@ bool XenDriver::unmapPhysMem( void *hostPtr )
 	return true;
 }
 
+MapReturnCode XenDriver::mapGfns( const unsigned long long *gfns, size_t count, uint32_t flags, void *&pointer )
+{
+	pointer = nullptr;
+
+	if ( !gfns || !count )
+		return MAP_INVALID_PARAMETER;
+
+	if ( count == 1 )
+		return mapPhysMemToHost( gfn_to_gpa( gfns[0] ), XC::pageSize, flags, pointer );
+
+	try {
+		void *mapped = nullptr;
+
+#ifdef DISABLE_PAGE_CACHE
+		flags |= PHYSMAP_NO_CACHE;
+#endif
+		if ( flags & PHYSMAP_NO_CACHE )
+			mapped = mapGuestPagesImpl( gfns, count );
+		else {
+			MapReturnCode mrc = pageCache_.updateRange( gfns, count, mapped );
+
+			if ( mrc != MAP_SUCCESS )
+				return mrc;
+		}
+
+		if ( !mapped )
+			return MAP_FAILED_GENERIC;
+
+		for ( size_t i = 0; i < count; ++i )
+			recordPage( gfns[i], static_cast<char *>( mapped ) + i * XC::pageSize );
+
+		pointer = mapped;
+	} catch ( ... ) {
+		return MAP_FAILED_GENERIC;
+	}
+
+	return MAP_SUCCESS;
+}
+
+bool XenDriver::unmapGfns( void *hostPtr, size_t count )
+{
+	if ( count == 1 )
+		return unmapPhysMem( hostPtr );
+
+	void *map = ( void * )( ( long int )hostPtr & XC::pageMask );
+
+#ifdef DISABLE_PAGE_CACHE
+	unmapGuestPagesImpl( map, count );
+#else
+	if ( !pageCache_.releaseRange( map ) )
+		unmapGuestPagesImpl( map, count );
+#endif
+
+	return true;
+}
+
+bool XenDriver::isPageCached( unsigned long long gfn )
+{
+#ifdef DISABLE_PAGE_CACHE
+	( void )gfn;
+	return false;
+#else
+	return pageCache_.contains( gfn );
+#endif
+}
+
 bool XenDriver::injectTrap( unsigned short vcpu, uint8_t trapNumber, uint32_t errorCode, uint64_t cr2 )
 {
 	// It is assumed that the guest is in user-mode and in the proper
@@ -593,6 +765,8 @@ bool XenDriver::injectTrap( unsigned short vcpu, uint8_t trapNumber, uint32_t er
 		return false;
 	}
 
+	std::lock_guard<std::mutex> lock( pendingInjectionsMutex_ );
+
 	pendingInjections_[vcpu] = true;
 
 	return true;
@@ -618,6 +792,8 @@ bool XenDriver::pause()
 		return false;
 	}
 
+	regsCache_.stopAll();
+
 	return true;
 }
 
@@ -625,6 +801,8 @@ bool XenDriver::unpause()
 {
 	flushPageProtections();
 
+	regsCache_.resumeAll();
+
 	if ( xc_.domainUnpause( domain_ ) != 0 ) {
 		logger << ERROR << "xc_domain_unpause() failed: " << strerror( errno ) << std::flush;
 		return false;
@@ -635,6 +813,17 @@ bool XenDriver::unpause()
 	return true;
 }
 
+bool XenDriver::pauseVcpusImpl( uint64_t vcpus, uint64_t paused )
+{
+	// Only the first one pauses the domain
+	return paused != vcpus || pause();
+}
+
+bool XenDriver::unpauseVcpusImpl( uint64_t /* vcpus */, uint64_t paused )
+{
+	return paused || unpause();
+}
+
 bool XenDriver::update()
 {
 	if ( !update_ )
@@ -654,6 +843,32 @@ size_t XenDriver::setPageCacheLimit( size_t limit )
 	return pageCache_.setLimit( limit );
 }
 
+bool XenDriver::setPageCacheLimitRange( size_t minLimit, size_t maxLimit )
+{
+	return pageCache_.setLimitRange( minLimit, maxLimit );
+}
+
+bool XenDriver::pageCacheStats( PageCacheStats &stats )
+{
+#ifdef DISABLE_PAGE_CACHE
+	stats = PageCacheStats();
+	return false;
+#else
+	pageCache_.stats( stats );
+	return true;
+#endif
+}
+
+size_t XenDriver::setPageCacheReadAhead( size_t pages )
+{
+	return pageCache_.setReadAhead( pages );
+}
+
+void XenDriver::prefetchGfns( const unsigned long long *gfns, size_t count )
+{
+	pageCache_.prefetch( gfns, count );
+}
+
 bool XenDriver::getPAT( unsigned short vcpu, uint64_t &pat ) const
 {
 	if ( patInitialized_ ) {
@@ -667,25 +882,57 @@ bool XenDriver::getPAT( unsigned short vcpu, uint64_t &pat ) const
 	struct hvm_hw_mtrr hwMtrr;
 
 	if ( xc_.domainHvmGetContextPartial( domain_, HVM_SAVE_CODE( MTRR ), vcpu, &hwMtrr, sizeof( hwMtrr ) ) != 0 ) {
-		EventHandler *h          = handler();
-		int           savedErrno = errno;
+		int savedErrno = errno;
 
 		logger << ERROR << "xc_domain_hvm_getcontext_partial() (vcpu = " << vcpu
 		       << ") failed: " << strerror( errno ) << std::flush;
 
-		if ( savedErrno == EINVAL && h )
-			h->handleFatalError();
+		if ( savedErrno == EINVAL )
+			fatalError();
 
 		return false;
 	}
 
+	// Racing callers just store the same value twice
 	pat = msrPat_   = hwMtrr.msr_pat_cr;
 	patInitialized_ = true;
 
 	return true;
 }
 
-bool XenDriver::getXSAVEInfo( unsigned short vcpu, struct hvm_hw_cpu_xsave &xsaveInfo ) const
+bool XenDriver::fetchXSAVERecord( unsigned short vcpu, std::vector<uint8_t> &record ) const
+{
+	if ( xsavePartialFailed_ )
+		return fetchXSAVERecordFull( vcpu, record );
+
+	if ( record.empty() ) {
+		unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+		// ECX: the size of the XSAVE area for every feature the CPU supports, so Xen's record
+		// (sized for whatever the guest has ever enabled) can't be larger than this
+		__cpuid_count( 0xD, 0, eax, ebx, ecx, edx );
+
+		record.resize( offsetof( struct hvm_hw_cpu_xsave, save_area ) + std::max( ecx, 512U + 64U ) );
+	}
+
+	StatsCounter counter( "partialXsave" );
+
+	if ( xc_.domainHvmGetContextPartial( domain_, CPU_XSAVE_CODE, vcpu, &record[0], record.size() ) == 0 )
+		return true;
+
+	if ( errno == ENODATA ) // offline VCPU
+		return false;
+
+	// Older hypervisors won't do CPU_XSAVE records one vCPU at a time
+	logger << WARNING << "xc_domain_hvm_getcontext_partial() (CPU_XSAVE, vcpu = " << vcpu
+	       << ") failed: " << strerror( errno ) << ", falling back to the full HVM context" << std::flush;
+
+	xsavePartialFailed_ = true;
+
+	return fetchXSAVERecordFull( vcpu, record );
+}
+
+bool XenDriver::fetchXSAVERecordFull( unsigned short vcpu, std::vector<uint8_t> &record ) const
 {
 	int ret = xc_.domainPause( domain_ );
 
@@ -723,8 +970,8 @@ bool XenDriver::getXSAVEInfo( unsigned short vcpu, struct hvm_hw_cpu_xsave &xsav
 			break;
 
 		if ( descriptor->typecode == CPU_XSAVE_CODE && descriptor->instance == vcpu ) {
-			xsaveInfo = *( struct hvm_hw_cpu_xsave * )( &buf[0] + off );
-			found     = true;
+			record.assign( &buf[0] + off, &buf[0] + off + descriptor->length );
+			found = true;
 			break;
 		}
 
@@ -736,20 +983,43 @@ bool XenDriver::getXSAVEInfo( unsigned short vcpu, struct hvm_hw_cpu_xsave &xsav
 	return found;
 }
 
-bool XenDriver::getXCR0( unsigned short vcpu, uint64_t &xcr0 ) const
+bool XenDriver::getXSAVEInfo( unsigned short vcpu, uint64_t &xcr0, void *area, size_t areaSize ) const
 {
-	struct hvm_hw_cpu_xsave xsaveInfo;
+	RegsCache::Entry *           e = regsCache_.entry( vcpu );
+	std::vector<uint8_t>         local;
+	std::vector<uint8_t> *       record = e ? &e->xsave_ : &local;
+	std::unique_lock<std::mutex> lock;
 
-	if ( getXSAVEInfo( vcpu, xsaveInfo ) ) {
-		xcr0 = xsaveInfo.xcr0;
-		return true;
+	if ( e )
+		lock = std::unique_lock<std::mutex>( e->mutex_ );
+
+	if ( !e || !regsCache_.xsaveValid( *e ) ) {
+		if ( !fetchXSAVERecord( vcpu, *record ) )
+			return false;
+
+		if ( e && regsCache_.cacheable( *e ) )
+			regsCache_.validateXsave( *e );
 	}
 
-	return false;
+	const size_t areaOffset = offsetof( struct hvm_hw_cpu_xsave, save_area );
+
+	if ( record->size() < areaOffset )
+		return false;
+
+	const struct hvm_hw_cpu_xsave *xsaveInfo = reinterpret_cast<const struct hvm_hw_cpu_xsave *>( record->data() );
+
+	xcr0 = xsaveInfo->xcr0;
+
+	if ( area )
+		memcpy( area, record->data() + areaOffset, std::min( areaSize, record->size() - areaOffset ) );
+
+	return true;
 }
 
-#define XCR0_X87 0x00000001 /* x87 FPU/MMX state */
-#define XCR0_SSE 0x00000002 /* SSE state */
+bool XenDriver::getXCR0( unsigned short vcpu, uint64_t &xcr0 ) const
+{
+	return getXSAVEInfo( vcpu, xcr0 );
+}
 
 bool XenDriver::getXSAVESize( unsigned short vcpu, size_t &size )
 {
@@ -791,12 +1061,10 @@ bool XenDriver::getXSAVESize( unsigned short vcpu, size_t &size )
 
 bool XenDriver::getXSAVEArea( unsigned short vcpu, void *buffer, size_t bufSize )
 {
-	struct hvm_hw_cpu_xsave xsaveInfo;
+	uint64_t xcr0 = 0;
 
-	if ( getXSAVEInfo( vcpu, xsaveInfo ) ) {
-		memcpy( buffer, &xsaveInfo.save_area, std::min( bufSize, sizeof( xsaveInfo ) ) );
+	if ( getXSAVEInfo( vcpu, xcr0, buffer, bufSize ) )
 		return true;
-	}
 
 	logger << ERROR << "could not query XSAVE area" << std::flush;
 
@@ -991,6 +1259,69 @@ bool XenDriver::maxGPFNImpl( unsigned long long &gfn )
 	return true;
 }
 
+void XenDriver::probeGfnsImpl( unsigned long long firstGfn, size_t count, std::vector<bool> &present )
+{
+	present.assign( count, false );
+
+	std::vector<xen_pfn_t> pfns( count );
+	std::vector<int>       errs( count, 0 );
+
+	for ( size_t i = 0; i < count; ++i )
+		pfns[i] = firstGfn + i;
+
+	void *ptr;
+
+	{
+		StatsCounter counter( "xcMapPages" );
+		ptr = xc_.mapForeignBulk( domain_, PROT_READ, pfns.data(), errs.data(), count );
+	}
+
+	if ( !ptr )
+		return;
+
+	for ( size_t i = 0; i < count; ++i )
+		present[i] = !errs[i];
+
+	munmap( ptr, count * XC::pageSize );
+}
+
+// Xen's log-dirty mode, as used for live migration
+bool XenDriver::startDirtyLogImpl()
+{
+	if ( !xc_.logdirtyControl ) {
+		logger << ERROR << "Log-dirty mode is not supported by this version of libxenctrl" << std::flush;
+		return false;
+	}
+
+	if ( xc_.logdirtyControl( domain_, XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY, nullptr, 0 ) < 0 ) {
+		logger << ERROR << "Could not enable log-dirty mode: " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	return true;
+}
+
+bool XenDriver::stopDirtyLogImpl()
+{
+	if ( xc_.logdirtyControl( domain_, XEN_DOMCTL_SHADOW_OP_OFF, nullptr, 0 ) < 0 ) {
+		logger << ERROR << "Could not disable log-dirty mode: " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	return true;
+}
+
+bool XenDriver::fetchDirtyLogImpl( unsigned long long pages, std::vector<uint64_t> &bitmap )
+{
+	// CLEAN (as opposed to PEEK) also resets the log
+	if ( xc_.logdirtyControl( domain_, XEN_DOMCTL_SHADOW_OP_CLEAN, bitmap.data(), pages ) < 0 ) {
+		logger << ERROR << "Could not fetch the dirty page log: " << strerror( errno ) << std::flush;
+		return false;
+	}
+
+	return true;
+}
+
 bool XenDriver::getEPTPageConvertible( unsigned short index, unsigned long long address, bool &convertible )
 {
 	if ( !altp2mState_ )
@@ -1011,19 +1342,17 @@ bool XenDriver::setPageConvertibleImpl( const ConvertibleMap &convMap, unsigned
 	if ( !altp2mState_ )
 		return false;
 
-	for ( auto &&item : convMap ) {
-		int rc = altp2mState_.setSuppressVE( view, item.first, item.second );
+	int rc = altp2mState_.setSuppressVE( view, convMap );
 
-		if ( rc < 0 ) {
-			logger << ERROR << "Failed to write the convertible bit: " << strerror( -rc ) << std::flush;
-			return false;
-		}
+	if ( rc < 0 ) {
+		logger << ERROR << "Failed to write the convertible bit: " << strerror( -rc ) << std::flush;
+		return false;
 	}
 
 	return true;
 }
 
-bool XenDriver::createEPT( unsigned short &index )
+bool XenDriver::createEPTImpl( unsigned short &index )
 {
 	if ( !altp2mState_ )
 		return false;
@@ -1038,7 +1367,7 @@ bool XenDriver::createEPT( unsigned short &index )
 	return true;
 }
 
-bool XenDriver::destroyEPT( unsigned short index )
+bool XenDriver::destroyEPTImpl( unsigned short index )
 {
 	if ( !altp2mState_ )
 		return false;
@@ -1095,16 +1424,27 @@ unsigned short XenDriver::eptpIndex( unsigned short vcpu ) const
 
 void XenDriver::enableCache( unsigned short vcpu )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
-	regsCache_.vcpu_  = vcpu;
-	regsCache_.valid_ = false;
+	regsCache_.stop( vcpu );
+}
+
+void XenDriver::disableCache( unsigned short vcpu )
+{
+	regsCache_.resume( vcpu );
 }
 
-void XenDriver::disableCache()
+bool XenDriver::takeDelayedWrite( unsigned short vcpu, DelayedWrite &dw )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
-	regsCache_.vcpu_  = -1;
-	regsCache_.valid_ = false;
+	std::lock_guard<std::mutex> lock( delayedWritesMutex_ );
+
+	auto i = delayedWrites_.find( vcpu );
+
+	if ( i == delayedWrites_.end() || !i->second.pending_ )
+		return false;
+
+	dw = i->second;
+	i->second = DelayedWrite();
+
+	return true;
 }
 
 void XenDriver::enableP2mIdxCache( unsigned short vcpu, unsigned short idx )
@@ -1119,6 +1459,8 @@ void XenDriver::disableP2mIdxCache( unsigned short vcpu )
 
 bool XenDriver::pendingInjection( unsigned short vcpu ) const
 {
+	std::lock_guard<std::mutex> lock( pendingInjectionsMutex_ );
+
 	auto i = pendingInjections_.find( vcpu );
 
 	if ( i == pendingInjections_.end() )
@@ -1129,6 +1471,8 @@ bool XenDriver::pendingInjection( unsigned short vcpu ) const
 
 void XenDriver::clearInjection( unsigned short vcpu )
 {
+	std::lock_guard<std::mutex> lock( pendingInjectionsMutex_ );
+
 	pendingInjections_[vcpu] = false;
 }
 
@@ -1186,6 +1530,40 @@ void XenDriver::unmapGuestPageImpl( void *hostPtr, unsigned long long gfn )
 		       << std::showbase << gfn << ": " << strerror( errno ) << std::flush;
 }
 
+void *XenDriver::mapGuestPagesImpl( const unsigned long long *gfns, size_t count )
+{
+	StatsCounter counter( "xcMapPages" );
+
+	std::vector<xen_pfn_t> pfns( gfns, gfns + count );
+	std::vector<int>       errs( count, 0 );
+
+	void *ptr = xc_.mapForeignBulk( domain_, PROT_READ | PROT_WRITE, pfns.data(), errs.data(), count );
+	if ( !ptr ) {
+		if ( errno != EINVAL )
+			logger << WARNING << "xc_map_foreign_bulk() has failed on " << count << " gfns starting at "
+			       << std::hex << std::showbase << gfns[0] << ": " << strerror( errno ) << std::flush;
+		return nullptr;
+	}
+
+	// The view is only useful if every single page in it could be mapped
+	for ( size_t i = 0; i < count; ++i ) {
+		if ( errs[i] ) {
+			unmapGuestPagesImpl( ptr, count );
+			errno = -errs[i];
+			return nullptr;
+		}
+	}
+
+	return ptr;
+}
+
+void XenDriver::unmapGuestPagesImpl( void *hostPtr, size_t count )
+{
+	if ( munmap( hostPtr, count * XC::pageSize ) < 0 )
+		logger << WARNING << "munmap() has failed on address " << hostPtr << " (" << count
+		       << " pages): " << strerror( errno ) << std::flush;
+}
+
 bool XenDriver::isMsrCached( uint64_t msr ) const
 {
 	return msr != MSR_SHADOW_GS_BASE;
@@ -16,6 +16,7 @@
 #ifndef __BDVMIXENDRIVER_H_INCLUDED__
 #define __BDVMIXENDRIVER_H_INCLUDED__
 
+#include <atomic>
 #include <list>
 #include <set>
 #include <string>
@@ -25,6 +26,7 @@
 #include "bdvmi/driver.h"
 #include "bdvmi/pagecache.h"
 
+#include "regscache.h"
 #include "xcwrapper.h"
 #include "xenaltp2m.h"
 #include "xswrapper.h"
@@ -33,16 +35,10 @@ namespace bdvmi {
 
 class XenDriver : public Driver {
 
-	struct RegsCache {
-		Registers  registers_;
-		int        vcpu_{ -1 };
-		bool       valid_{ false };
-		std::mutex mutex_;
-	};
-
 public:
 	struct DelayedWrite {
 		Registers registers_;
+		uint32_t  changed_{ 0 }; // Registers::Group bits that differ from what the vCPU has now
 		bool      pending_{ false };
 	};
 
@@ -64,6 +60,10 @@ public:
 
 	bool registers( unsigned short vcpu, Registers &regs ) const override;
 
+	bool cachedRegisters( unsigned short vcpu, const Registers *&regs ) const override;
+
+	bool readMsr( unsigned short vcpu, uint32_t msr, uint64_t &value ) const override;
+
 	bool setRegisters( unsigned short vcpu, const Registers &regs, bool setEip, bool delay ) override;
 
 	MapReturnCode mapPhysMemToHost( unsigned long long address, size_t length, uint32_t flags,
@@ -71,6 +71,10 @@ public:
 
 	bool unmapPhysMem( void *hostPtr ) override;
 
+	MapReturnCode mapGfns( const unsigned long long *gfns, size_t count, uint32_t flags, void *&pointer ) override;
+
+	bool unmapGfns( void *hostPtr, size_t count ) override;
+
 	bool injectTrap( unsigned short vcpu, uint8_t trapNumber, uint32_t errorCode, uint64_t cr2 ) override;
 
 	bool setRepOptimizations( bool enable ) override;
@@ -83,16 +87,20 @@ public:
 
 	size_t setPageCacheLimit( size_t limit ) override;
 
+	bool setPageCacheLimitRange( size_t minLimit, size_t maxLimit ) override;
+
+	bool pageCacheStats( PageCacheStats &stats ) override;
+
+	size_t setPageCacheReadAhead( size_t pages ) override;
+
+	void prefetchGfns( const unsigned long long *gfns, size_t count ) override;
+
 	bool getXSAVESize( unsigned short vcpu, size_t &size ) override;
 
 	bool getXSAVEArea( unsigned short vcpu, void *buffer, size_t bufSize ) override;
 
 	bool getEPTPageConvertible( unsigned short index, unsigned long long address, bool &convertible ) override;
 
-	bool createEPT( unsigned short &index ) override;
-
-	bool destroyEPT( unsigned short index ) override;
-
 	bool switchEPT( unsigned short index ) override;
 
 	bool setVEInfoPage( unsigned short vcpu, unsigned long long gpa ) override;
@@ -115,7 +123,7 @@ public:
 
 	void enableCache( unsigned short vcpu ) override;
 
-	void disableCache() override;
+	void disableCache( unsigned short vcpu ) override;
 
 	void enableP2mIdxCache( unsigned short vcpu, unsigned short idx );
 
@@ -150,16 +158,33 @@ public:
 
 	bool getXCR0( unsigned short vcpu, uint64_t &xcr0 ) const override;
 
+	// There's no copy hypercall, everything goes through foreign mappings
+	bool physCopySupported() const override
+	{
+		return false;
+	}
+
 private:
 	void *mapGuestPageImpl( unsigned long long gfn ) override;
 
 	void unmapGuestPageImpl( void *hostPtr, unsigned long long gfn ) override;
 
+	void *mapGuestPagesImpl( const unsigned long long *gfns, size_t count ) override;
+
+	void unmapGuestPagesImpl( void *hostPtr, size_t count ) override;
+
+	bool createEPTImpl( unsigned short &index ) override;
+
+	bool destroyEPTImpl( unsigned short index ) override;
+
 	bool setPageProtectionImpl( const MemAccessMap &accessMap, unsigned short view ) override;
 
 	bool getPageProtectionImpl( unsigned long long guestAddress, bool &read, bool &write, bool &execute,
 	                            unsigned short view ) override;
 
+	bool getPageProtectionRangeImpl( unsigned long long firstGfn, size_t count, uint8_t *access,
+	                                 unsigned short view ) override;
+
 	bool setPageConvertibleImpl( const ConvertibleMap &convMap, unsigned short view ) override;
 
 public: // Xen specific-stuff
@@ -171,10 +196,8 @@ public: // Xen specific-stuff
 public:
 	static int32_t guestX86Mode( const Registers &regs );
 
-	DelayedWrite &delayedWrite()
-	{
-		return delayedWrite_;
-	}
+	// Move vcpu's pending delayed write (if any) into dw and forget about it
+	bool takeDelayedWrite( unsigned short vcpu, DelayedWrite &dw );
 
 	bool pendingInjection( unsigned short vcpu ) const;
 
@@ -197,10 +220,22 @@ private:
 
 	static domid_t getDomainId( const std::string &domainName );
 
-	bool getXSAVEInfo( unsigned short vcpu, struct hvm_hw_cpu_xsave &xsaveInfo ) const;
+	// Copy out XCR0 and, if area is not nullptr, up to areaSize bytes of the XSAVE area. The
+	// CPU_XSAVE record is cached per vCPU for as long as its registers would be.
+	bool getXSAVEInfo( unsigned short vcpu, uint64_t &xcr0, void *area = nullptr, size_t areaSize = 0 ) const;
+
+	// Get the raw CPU_XSAVE record for vcpu into record, reusing its storage
+	bool fetchXSAVERecord( unsigned short vcpu, std::vector<uint8_t> &record ) const;
+
+	// The old way: pause the domain and dig the record out of the full HVM context
+	bool fetchXSAVERecordFull( unsigned short vcpu, std::vector<uint8_t> &record ) const;
 
 	bool getPAT( unsigned short vcpu, uint64_t &pat ) const;
 
+	// Always goes to the hypervisor. offline is set if vcpu is offline and regs only holds
+	// default values (which must not be cached).
+	bool queryRegisters( unsigned short vcpu, Registers &regs, bool &offline ) const;
+
 	bool isVarMtrrOverlapped( const struct hvm_hw_mtrr &hwMtrr ) const;
 
 	void getMtrrRange( uint64_t base_msr, uint64_t mask_msr, uint64_t &base, uint64_t &end ) const;
@@ -211,6 +246,32 @@ private:
 
 	bool maxGPFNImpl( unsigned long long &gfn ) override;
 
+	void probeGfnsImpl( unsigned long long firstGfn, size_t count, std::vector<bool> &present ) override;
+
+	bool startDirtyLogImpl() override;
+
+	bool stopDirtyLogImpl() override;
+
+	bool fetchDirtyLogImpl( unsigned long long pages, std::vector<uint64_t> &bitmap ) override;
+
+	bool readPhysicalImpl( unsigned long long /* gpa */, void * /* buffer */, size_t /* length */ ) override
+	{
+		return false;
+	}
+
+	bool writePhysicalImpl( unsigned long long /* gpa */, const void * /* buffer */,
+	                        size_t /* length */ ) override
+	{
+		return false;
+	}
+
+	bool isPageCached( unsigned long long gfn ) override;
+
+	// Xen can't stop single vCPUs, the domain stays paused while any of them is
+	bool pauseVcpusImpl( uint64_t vcpus, uint64_t paused ) override;
+
+	bool unpauseVcpusImpl( uint64_t vcpus, uint64_t paused ) override;
+
 private:
 	mutable XS        xs_;
 	mutable XC        xc_;
@@ -219,16 +280,21 @@ private:
 	std::string       uuid_;
 	mutable RegsCache regsCache_;
 	bool              update_{ false };
-	DelayedWrite      delayedWrite_;
-	std::unordered_map<unsigned short, bool> pendingInjections_;
 	uint32_t             startTime_{ static_cast<uint32_t>( -1 ) };
-	mutable bool         patInitialized_{ false };
-	mutable uint64_t     msrPat_{ 0 };
+	mutable std::atomic<bool> patInitialized_{ false };
+	mutable std::atomic<uint64_t> msrPat_{ 0 };
+	mutable std::atomic<bool> xsavePartialFailed_{ false };
 	unsigned long long   maxGPFN_{ 0 };
 	XenAltp2mDomainState altp2mState_;
 	std::function<int( const MemAccessMap &, unsigned short )> setMemAccess_;
 	std::function<int( unsigned long long, xenmem_access_t *, unsigned short )> getMemAccess_;
 	unsigned int physAddr_{ 0 };
+
+	// Events for different vCPUs may be handled in parallel (EventManager::parallelEvents())
+	mutable std::mutex                               delayedWritesMutex_;
+	std::unordered_map<unsigned short, DelayedWrite> delayedWrites_;
+	mutable std::mutex                               pendingInjectionsMutex_;
+	std::unordered_map<unsigned short, bool>         pendingInjections_;
 };
 
 } // namespace bdvmi
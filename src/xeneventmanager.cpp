@@ -21,13 +21,16 @@
 #include "xenvmevent_v3.h"
 #include "xenvmevent_v4.h"
 #include "xenvmevent_v5.h"
+#include "vcpudispatcher.h"
 #include "bdvmi/logger.h"
 #include <sys/mman.h>
 #include <poll.h>
 #include <errno.h>
+#include <cstddef>
 #include <cstring>
 #include <cstdlib>
 #include <iomanip>
+#include <memory>
 #include <stdexcept>
 
 #define GLA_VALID( x ) ( x.u.mem_access.flags & MEM_ACCESS_GLA_VALID )
@@ -45,6 +48,51 @@
 
 namespace bdvmi {
 
+namespace {
+
+template <typename Request> EventTrace::EventType traceType( const Request &req )
+{
+	switch ( req.reason ) {
+		case VM_EVENT_REASON_MEM_ACCESS:
+			return EventTrace::PAGE_FAULT;
+		case VM_EVENT_REASON_SINGLESTEP:
+		case VM_EVENT_REASON_EMUL_UNIMPLEMENTED:
+			return EventTrace::SINGLESTEP;
+		case VM_EVENT_REASON_WRITE_CTRLREG:
+			return EventTrace::CR;
+		case VM_EVENT_REASON_MOV_TO_MSR:
+			return EventTrace::MSR;
+		case VM_EVENT_REASON_GUEST_REQUEST:
+			return EventTrace::VMCALL;
+		case VM_EVENT_REASON_SOFTWARE_BREAKPOINT:
+			return EventTrace::BREAKPOINT;
+		case VM_EVENT_REASON_INTERRUPT:
+			return EventTrace::INTERRUPT;
+		case VM_EVENT_REASON_DESCRIPTOR_ACCESS:
+			return EventTrace::DESCRIPTOR;
+		default:
+			return EventTrace::OTHER;
+	}
+}
+
+template <typename Request> uint64_t traceArg( const Request &req )
+{
+	switch ( req.reason ) {
+		case VM_EVENT_REASON_MEM_ACCESS:
+			return ( req.u.mem_access.gfn << PAGE_SHIFT ) | req.u.mem_access.offset;
+		case VM_EVENT_REASON_WRITE_CTRLREG:
+			return req.u.write_ctrlreg.index;
+		case VM_EVENT_REASON_MOV_TO_MSR:
+			return req.u.mov_to_msr.msr;
+		case VM_EVENT_REASON_INTERRUPT:
+			return req.u.interrupt.x86.vector;
+		default:
+			return 0;
+	}
+}
+
+} // namespace
+
 XenEventManager::XenEventManager( XenDriver &driver, sig_atomic_t &sigStop )
     : EventManager{ sigStop }
     , driver_{ driver }
@@ -346,9 +394,11 @@ template <typename Request> inline void copyRegisters( Registers &regs, const Re
 
 template <typename Response> void XenEventManager::setRegisters( Response &rsp )
 {
-	XenDriver::DelayedWrite &dw = driver_.delayedWrite();
+	XenDriver::DelayedWrite dw;
 
-	if ( !dw.pending_ )
+	// vm_event can only set all of the registers at once, but there's no point in asking
+	// for that if the handlers have only written back what the vCPU already had
+	if ( !driver_.takeDelayedWrite( rsp.vcpu_id, dw ) || !dw.changed_ )
 		return;
 
 	rsp.data.regs.x86.rflags = dw.registers_.rflags;
@@ -375,8 +425,6 @@ template <typename Response> void XenEventManager::setRegisters( Response &rsp )
 		rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
 	else
 		logger << WARNING << "VM_EVENT_FLAG_SET_REGISTERS is not available, try a newer Xen!" << std::flush;
-
-	dw.pending_ = false;
 }
 
 void XenEventManager::waitForEvents()
@@ -394,13 +442,55 @@ void XenEventManager::waitForEvents()
 	}
 }
 
+std::vector<int> XenEventManager::pollFds()
+{
+#ifndef DISABLE_MEM_EVENT
+	return { xs_.fileno(), xc_.evtchnFd( xce_ ) };
+#else
+	return { xs_.fileno() };
+#endif
+}
+
+size_t XenEventManager::processPending( size_t budget )
+{
+	switch ( vmEventInterfaceVersion_ ) {
+		case 5:
+			return processPendingByVMEventVersion<vm_event_request_v5_t, vm_event_response_v5_t,
+			                                      vm_event_v5_back_ring_t>( budget );
+		case 4:
+			return processPendingByVMEventVersion<vm_event_request_v4_t, vm_event_response_v4_t,
+			                                      vm_event_v4_back_ring_t>( budget );
+		default:
+			return processPendingByVMEventVersion<vm_event_request_v3_t, vm_event_response_v3_t,
+			                                      vm_event_v3_back_ring_t>( budget );
+	}
+}
+
 template <typename Request, typename Response, typename Ring> void XenEventManager::waitForEventsByVMEventVersion()
 {
-	EventHandler *h            = handler();
-	bool          shuttingDown = false;
+	bool shuttingDown = false;
+#ifndef DISABLE_MEM_EVENT
+	bool handled = false; // events in the last round, so more are likely to follow
+#endif
+
+	std::unique_ptr<VcpuDispatcher> dispatcher;
+
+	if ( workers_ )
+		dispatcher.reset( new VcpuDispatcher( workers_ ) );
 
 	for ( ;; ) {
+#ifndef DISABLE_MEM_EVENT
+		bool spun = handled && busyPollUs_ && spin( [this]() {
+			std::lock_guard<std::mutex> lock( ringMutex_ );
+
+			return RING_HAS_UNCONSUMED_REQUESTS( static_cast<Ring *>( backRing_ ) ) != 0;
+		} );
+
+		// Still look at XenStore (and clear the event channel), just don't sleep
+		waitForEventOrTimeout( spun ? 0 : 100 );
+#else
 		waitForEventOrTimeout( 100 );
+#endif
 
 		if ( sigStop_ )
 			stop();
@@ -409,160 +499,408 @@ template <typename Request, typename Response, typename Ring> void XenEventManag
 			shuttingDown = true;
 
 #ifndef DISABLE_MEM_EVENT
-		Request  req;
-		Response rsp;
+		handled = processRing<Request, Response, Ring>( dispatcher.get(), 0 ) != 0;
+#endif
 
-		int events = 0;
+		if ( shuttingDown ) {
+			if ( dispatcher )
+				dispatcher->drain();
 
-		while ( RING_HAS_UNCONSUMED_REQUESTS( static_cast<Ring *>( backRing_ ) ) ) {
-			getRequest<Request, Ring>( req );
+			completeDeferred();
 
-#ifdef DEBUG_DUMP_EVENTS
-			eventsFile_.write( ( const char * )&req, sizeof( req ) );
+			return;
+		}
+	}
+}
+
+template <typename Request, typename Response, typename Ring>
+size_t XenEventManager::processPendingByVMEventVersion( size_t budget )
+{
+	if ( finished_ )
+		return 0;
+
+	waitForEventOrTimeout( 0 );
+
+	if ( sigStop_ )
+		stop();
+
+	bool   shuttingDown = stop_;
+	size_t events       = 0;
+
+#ifndef DISABLE_MEM_EVENT
+	// Nothing gets left on the ring on the way out
+	events = processRing<Request, Response, Ring>( nullptr, shuttingDown ? 0 : budget );
 #endif
-			++events;
-			foundEvents_ = true;
 
-			StatsCounter counter( "eventCount" );
+	if ( shuttingDown ) {
+		completeDeferred();
+		finished_ = true;
+	}
 
-			memset( &rsp, 0, sizeof( rsp ) );
+	return events;
+}
 
-			rsp.vcpu_id       = req.vcpu_id;
-			rsp.flags         = req.flags & ~VM_EVENT_FLAG_ALTERNATE_P2M;
-			rsp.reason        = req.reason;
-			rsp.altp2m_idx    = req.altp2m_idx;
-			rsp.data.regs.x86 = req.data.regs.x86;
+template <typename Request, typename Response, typename Ring>
+size_t XenEventManager::processRing( VcpuDispatcher *dispatcher, size_t limit )
+{
+	Request  req;
+	Response rsp;
 
-			rsp.version            = req.version;
-			rsp.u.mem_access.flags = req.u.mem_access.flags;
+	size_t       events  = 0;
+	size_t       pending = 0; // batched responses not yet pushed
+	const bool   batch   = batchEvents_ && !dispatcher;
+	const size_t budget  = batchBudget_;
+	EventTrace & trace   = driver_.eventTrace();
 
-			driver_.enableCache( req.vcpu_id );
-			driver_.enableP2mIdxCache( req.vcpu_id, req.altp2m_idx );
+	auto replyToBatch = [&]() {
+		StatsCounter batchCounter( "eventBatches" );
 
-			if ( h )
-				h->runPreEvent();
+		driver_.flushPageProtections();
 
-			bool skip = false;
+		std::lock_guard<std::mutex> lock( ringMutex_ );
 
-			switch ( req.reason ) {
-				case VM_EVENT_REASON_MEM_ACCESS:
-					handleMemAccess( req, rsp, skip );
-					break;
+		pushResponses<Ring>();
+		resumePage();
 
-				case VM_EVENT_REASON_SINGLESTEP: {
-					StatsCounter counter2( "eventsSingleStep" );
+		pending = 0;
+	};
 
-					rsp.flags |= VM_EVENT_FLAG_ALTERNATE_P2M | VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
+	// Workers put responses on the ring while the requests are being read
+	auto nextRequest = [&]() {
+		std::lock_guard<std::mutex> lock( ringMutex_ );
 
-					auto it = singlestepP2mIdx.find( req.vcpu_id );
+		if ( !RING_HAS_UNCONSUMED_REQUESTS( static_cast<Ring *>( backRing_ ) ) )
+			return false;
 
-					if ( handleEmulUnimplemented_ && it != singlestepP2mIdx.end() )
-						rsp.altp2m_idx = it->second;
-					else {
-						logger << ERROR << "Could not find the saved altp2m index for vcpu "
-						       << req.vcpu_id << std::flush;
-						stop();
-					}
+		getRequest<Request, Ring>( req );
 
-					break;
+		return true;
+	};
+
+	while ( ( !limit || events < limit ) && nextRequest() ) {
+#ifdef DEBUG_DUMP_EVENTS
+		eventsFile_.write( ( const char * )&req, sizeof( req ) );
+#endif
+		++events;
+		foundEvents_ = true;
+
+		if ( dispatcher ) {
+			uint64_t received = trace.receivedTimestamp();
+
+			// req gets reused for the next request, so every task has its own copy
+			dispatcher->dispatch( req.vcpu_id, [this, req, received]() {
+				EventTrace::Scope scope( driver_.eventTrace(), req.vcpu_id, traceType( req ),
+				                         traceArg( req ), received );
+				Response          rsp;
+
+				uint64_t deferred = handleRequest( req, rsp, true );
+
+				if ( deferred ) {
+					scope.flags( EventTrace::FLAG_DEFERRED );
+					deferResponse<Request, Response, Ring>( deferred, req, rsp );
+					return;
 				}
 
-				case VM_EVENT_REASON_WRITE_CTRLREG:
-					handleCrWrite( req, rsp );
-					break;
+				std::lock_guard<std::mutex> lock( ringMutex_ );
 
-				case VM_EVENT_REASON_MOV_TO_MSR:
-					handleMsrWrite( req, rsp );
-					break;
+				putResponse<Response, Ring>( rsp );
+				resumePage();
+			} );
 
-				case VM_EVENT_REASON_GUEST_REQUEST: {
-					StatsCounter counter2( "eventsGuestRequest" );
+			continue;
+		}
 
-					if ( h ) {
-						Registers regs;
-						copyRegisters( regs, req );
+		EventTrace::Scope scope( trace, req.vcpu_id, traceType( req ), traceArg( req ) );
 
-						h->handleVMCALL( req.vcpu_id, regs );
-					}
+		uint64_t deferred = handleRequest( req, rsp, !batch );
 
-					break;
-				}
+		if ( deferred ) {
+			scope.flags( EventTrace::FLAG_DEFERRED );
+			deferResponse<Request, Response, Ring>( deferred, req, rsp );
+			continue;
+		}
 
-				case VM_EVENT_REASON_SOFTWARE_BREAKPOINT:
-					handleBreakpoint( req );
-					break;
+		{
+			// Deferred responses may be completed from any thread
+			std::lock_guard<std::mutex> lock( ringMutex_ );
 
-				case VM_EVENT_REASON_INTERRUPT:
-					if ( h ) {
-						Registers regs;
-						copyRegisters( regs, req );
+			/* Put the page info on the ring */
+			putResponse<Response, Ring>( rsp, !batch );
 
-						h->handleInterrupt( req.vcpu_id, regs, req.u.interrupt.x86.vector,
-						                    req.u.interrupt.x86.error_code,
-						                    req.u.interrupt.x86.cr2 );
-					}
+			if ( !batch )
+				resumePage();
+		}
 
-					break;
+		if ( batch && ++pending == budget )
+			replyToBatch();
+	}
 
-				case VM_EVENT_REASON_DESCRIPTOR_ACCESS:
-					handleDescriptorWrite( req, rsp, skip );
-					break;
+	if ( pending )
+		replyToBatch();
 
-				case VM_EVENT_REASON_EMUL_UNIMPLEMENTED: {
-					StatsCounter counter2( "emulUnimplemented" );
+	return events;
+}
 
-					if ( handleEmulUnimplemented_ && req.flags & VM_EVENT_FLAG_ALTERNATE_P2M ) {
-						rsp.flags = req.flags | VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
-						rsp.flags &= ~VM_EVENT_FLAG_EMULATE;
-						rsp.altp2m_idx                = 0;
-						singlestepP2mIdx[req.vcpu_id] = req.altp2m_idx;
-					}
+template <typename Request, typename Response, typename Ring>
+void XenEventManager::deferResponse( uint64_t token, const Request &req, const Response &rsp )
+{
+	// rsp = rsp: a plain capture of a const reference would be const, even in a mutable lambda
+	deferReply( token, [this, req, rsp = rsp]( const Completion &completion ) mutable {
+		bool skip = false;
 
-					break;
-				}
+		applyMemAccessAction( req, rsp, completion.action_, completion.instructionSize_,
+		                      completion.emulatorCtx_, skip );
+		finishResponse( rsp, skip );
 
-				default:
-					// unknown reason code
-					break;
+		driver_.flushPageProtections();
+
+		std::lock_guard<std::mutex> lock( ringMutex_ );
+
+		putResponse<Response, Ring>( rsp );
+		resumePage();
+
+		return true;
+	} );
+}
+
+template <typename Response> void XenEventManager::finishResponse( Response &rsp, bool skip )
+{
+	if ( driver_.pendingInjection( rsp.vcpu_id ) ) {
+		if ( xc_.version >= Version( 4, 9 ) || xc_.isXenServer )
+			rsp.flags |= VM_EVENT_FLAG_GET_NEXT_INTERRUPT;
+		else
+			logger << WARNING
+			       << "VM_EVENT_FLAG_GET_NEXT_INTERRUPT is not available, try a newer Xen!"
+			       << std::flush;
+		driver_.clearInjection( rsp.vcpu_id );
+	}
+
+	if ( !skip )
+		setRegisters( rsp );
+}
+
+template <typename Request, typename Response>
+uint64_t XenEventManager::handleRequest( const Request &req, Response &rsp, bool flush )
+{
+	EventHandler *h = handler();
+
+	StatsCounter counter( "eventCount" );
+
+	// data (the bulk of it) is copied over from req right away, there's no point in clearing it first
+	memset( &rsp, 0, offsetof( Response, data ) );
+
+	rsp.vcpu_id    = req.vcpu_id;
+	rsp.flags      = req.flags & ~VM_EVENT_FLAG_ALTERNATE_P2M;
+	rsp.reason     = req.reason;
+	rsp.altp2m_idx = req.altp2m_idx;
+	rsp.data       = req.data;
+
+	rsp.version            = req.version;
+	rsp.u.mem_access.flags = req.u.mem_access.flags;
+
+	if ( filterRequest( req, rsp ) ) {
+		StatsCounter filteredCounter( "eventsFiltered" );
+		return 0;
+	}
+
+	driver_.enableCache( req.vcpu_id );
+	driver_.enableP2mIdxCache( req.vcpu_id, req.altp2m_idx );
+	driver_.retireTranslationWrites( req.vcpu_id );
+
+	EventTrace::handlerStart();
+
+	if ( h )
+		h->runPreEvent();
+
+	bool     skip     = false;
+	uint64_t deferred = 0;
+
+	switch ( req.reason ) {
+		case VM_EVENT_REASON_MEM_ACCESS:
+			handleMemAccess( req, rsp, skip, deferred );
+			break;
+
+		case VM_EVENT_REASON_SINGLESTEP: {
+			StatsCounter counter2( "eventsSingleStep" );
+
+			rsp.flags |= VM_EVENT_FLAG_ALTERNATE_P2M | VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
+
+			std::unique_lock<std::mutex> lock( vcpuStateMutex_ );
+
+			auto it = singlestepP2mIdx.find( req.vcpu_id );
+
+			if ( handleEmulUnimplemented_ && it != singlestepP2mIdx.end() )
+				rsp.altp2m_idx = it->second;
+			else {
+				lock.unlock();
+
+				logger << ERROR << "Could not find the saved altp2m index for vcpu "
+				       << req.vcpu_id << std::flush;
+				stop();
 			}
 
-			if ( driver_.pendingInjection( req.vcpu_id ) ) {
-				if ( xc_.version >= Version( 4, 9 ) || xc_.isXenServer )
-					rsp.flags |= VM_EVENT_FLAG_GET_NEXT_INTERRUPT;
-				else
-					logger << WARNING
-					       << "VM_EVENT_FLAG_GET_NEXT_INTERRUPT is not available, try a newer Xen!"
-					       << std::flush;
-				driver_.clearInjection( req.vcpu_id );
+			break;
+		}
+
+		case VM_EVENT_REASON_WRITE_CTRLREG:
+			handleCrWrite( req, rsp );
+			break;
+
+		case VM_EVENT_REASON_MOV_TO_MSR:
+			handleMsrWrite( req, rsp );
+			break;
+
+		case VM_EVENT_REASON_GUEST_REQUEST: {
+			StatsCounter counter2( "eventsGuestRequest" );
+
+			if ( h ) {
+				Registers regs;
+				copyRegisters( regs, req );
+
+				h->handleVMCALL( req.vcpu_id, regs );
 			}
 
-			if ( !skip )
-				setRegisters( rsp );
+			break;
+		}
+
+		case VM_EVENT_REASON_SOFTWARE_BREAKPOINT:
+			handleBreakpoint( req );
+			break;
 
-			driver_.flushPageProtections();
+		case VM_EVENT_REASON_INTERRUPT:
+			if ( h ) {
+				Registers regs;
+				copyRegisters( regs, req );
 
-			if ( h )
-				h->runPostEvent();
+				h->handleInterrupt( req.vcpu_id, regs, req.u.interrupt.x86.vector,
+				                    req.u.interrupt.x86.error_code,
+				                    req.u.interrupt.x86.cr2 );
+			}
 
-			driver_.disableP2mIdxCache( req.vcpu_id );
-			driver_.disableCache();
+			break;
 
-			/* Put the page info on the ring */
-			putResponse<Response, Ring>( rsp );
-			resumePage();
+		case VM_EVENT_REASON_DESCRIPTOR_ACCESS:
+			handleDescriptorWrite( req, rsp, skip );
+			break;
+
+		case VM_EVENT_REASON_EMUL_UNIMPLEMENTED: {
+			StatsCounter counter2( "emulUnimplemented" );
+
+			if ( handleEmulUnimplemented_ && req.flags & VM_EVENT_FLAG_ALTERNATE_P2M ) {
+				rsp.flags = req.flags | VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
+				rsp.flags &= ~VM_EVENT_FLAG_EMULATE;
+				rsp.altp2m_idx = 0;
+
+				std::lock_guard<std::mutex> lock( vcpuStateMutex_ );
+
+				singlestepP2mIdx[req.vcpu_id] = req.altp2m_idx;
+			}
+
+			break;
 		}
 
-// if ( events )
-//	resumePage();
-#endif // DISABLE_MEM_EVENT
+		default:
+			// unknown reason code
+			break;
+	}
 
-		if ( shuttingDown )
-			return;
+	if ( !deferred )
+		finishResponse( rsp, skip );
+
+	if ( flush )
+		driver_.flushPageProtections();
+
+	if ( h )
+		h->runPostEvent();
+
+	EventTrace::handlerEnd();
+
+	driver_.disableP2mIdxCache( req.vcpu_id );
+	driver_.disableCache( req.vcpu_id );
+
+	return deferred;
+}
+
+template <typename Request, typename Response>
+bool XenEventManager::filterRequest( const Request &req, Response &rsp )
+{
+	HVAction action = NONE;
+
+	// Writes recorded while handling this vCPU's previous event are done by now. Retiring them
+	// any later would also drop the one recorded below, before the guest has made it.
+	driver_.retireTranslationWrites( req.vcpu_id );
+
+	switch ( req.reason ) {
+		case VM_EVENT_REASON_WRITE_CTRLREG: {
+			unsigned int cr;
+
+			switch ( req.u.write_ctrlreg.index ) {
+				case VM_EVENT_X86_CR0:
+					cr = 0;
+					break;
+				case VM_EVENT_X86_CR3:
+					cr = 3;
+					break;
+				case VM_EVENT_X86_CR4:
+					cr = 4;
+					break;
+				default: // XCR0
+					return false;
+			}
+
+			if ( !filterCr( cr, req.u.write_ctrlreg.old_value, req.u.write_ctrlreg.new_value, action ) )
+				return false;
+
+			// The handler doesn't get to see this, but the translation cache still has to
+			if ( cr == 3 )
+				driver_.flushTranslations( req.u.write_ctrlreg.new_value );
+			else
+				driver_.flushTranslations();
+
+			rsp.u.write_ctrlreg.index = req.u.write_ctrlreg.index;
+
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
+				rsp.flags |= VM_EVENT_FLAG_DENY;
+
+			break;
+		}
+
+		case VM_EVENT_REASON_MOV_TO_MSR:
+			// Older interfaces don't report the old value, handleMsrWrite() has to track it
+			if ( req.version <= 0x00000002 ||
+			     !filterMsr( req.u.mov_to_msr.msr, req.u.mov_to_msr.old_value, req.u.mov_to_msr.new_value,
+			                 action ) )
+				return false;
+
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
+				rsp.flags |= VM_EVENT_FLAG_DENY;
+
+			break;
+
+		case VM_EVENT_REASON_MEM_ACCESS:
+			if ( !filterPageFault( req.u.mem_access.gfn, ACCESS_R( req ) != 0, ACCESS_W( req ) != 0,
+			                       ACCESS_X( req ) != 0, action ) )
+				return false;
+
+			if ( ACCESS_W( req ) )
+				driver_.invalidateTranslations( req.vcpu_id, req.u.mem_access.gfn );
+
+			rsp.u.mem_access.gfn = req.u.mem_access.gfn;
+
+			if ( action != ALLOW_VIRTUAL )
+				rsp.flags |= VM_EVENT_FLAG_EMULATE;
+
+			break;
+
+		default:
+			return false;
 	}
+
+	return true;
 }
 
 template <typename Request, typename Response>
-void XenEventManager::handleMemAccess( const Request &req, Response &rsp, bool &skip )
+void XenEventManager::handleMemAccess( const Request &req, Response &rsp, bool &skip, uint64_t &deferred )
 {
 	uint64_t        gva             = 0;
 	const bool      read            = ( ACCESS_R( req ) != 0 );
@@ -590,9 +928,25 @@ void XenEventManager::handleMemAccess( const Request &req, Response &rsp, bool &
 
 	uint64_t gpa = ( req.u.mem_access.gfn << XC::pageShift ) + req.u.mem_access.offset;
 
+	if ( write )
+		driver_.invalidateTranslations( req.vcpu_id, req.u.mem_access.gfn );
+
+	beginDeferrable();
+
 	h->handlePageFault( req.vcpu_id, regs, gpa, gva, read, write, execute, gptFault, action, emulatorCtx,
 	                    instructionSize );
 
+	deferred = endDeferrable();
+
+	if ( !deferred )
+		applyMemAccessAction( req, rsp, action, instructionSize, emulatorCtx, skip );
+}
+
+template <typename Request, typename Response>
+void XenEventManager::applyMemAccessAction( const Request &req, Response &rsp, HVAction action,
+                                            unsigned short instructionSize, const EmulatorContext &emulatorCtx,
+                                            bool &skip )
+{
 	switch ( action ) {
 		case EMULATE_NOWRITE:
 		case SKIP_INSTRUCTION:
@@ -654,13 +1008,16 @@ template <typename Request, typename Response> void XenEventManager::handleCrWri
 	switch ( req.u.write_ctrlreg.index ) {
 		case VM_EVENT_X86_CR0:
 			crNumber = 0;
+			driver_.flushTranslations();
 			break;
 		case VM_EVENT_X86_CR4:
 			crNumber = 4;
+			driver_.flushTranslations();
 			break;
 		case VM_EVENT_X86_CR3:
 		default:
 			crNumber = 3;
+			driver_.flushTranslations( req.u.write_ctrlreg.new_value );
 			break;
 	}
 
@@ -690,25 +1047,35 @@ template <typename Request, typename Response> void XenEventManager::handleMsrWr
 	if ( req.version > 0x00000002 )
 		oldValue = req.u.mov_to_msr.old_value;
 	else {
-		auto i = msrOldValueCache_.find( req.vcpu_id );
-		if ( i == msrOldValueCache_.end() ) // not found
-			oldValue = getMsr( req.vcpu_id, req.u.mov_to_msr.msr );
-		else {
-			auto j = i->second.find( req.u.mov_to_msr.msr );
+		bool found = false;
 
-			if ( j == i->second.end() ) // not found
-				oldValue = getMsr( req.vcpu_id, req.u.mov_to_msr.msr );
-			else
-				oldValue = j->second;
+		{
+			std::lock_guard<std::mutex> lock( vcpuStateMutex_ );
+
+			auto i = msrOldValueCache_.find( req.vcpu_id );
+			if ( i != msrOldValueCache_.end() ) {
+				auto j = i->second.find( req.u.mov_to_msr.msr );
+
+				if ( j != i->second.end() ) {
+					oldValue = j->second;
+					found    = true;
+				}
+			}
 		}
+
+		if ( !found )
+			oldValue = getMsr( req.vcpu_id, req.u.mov_to_msr.msr );
 	}
 
 	h->handleMSR( req.vcpu_id, req.u.mov_to_msr.msr, oldValue, req.u.mov_to_msr.new_value, action );
 
 	if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
 		rsp.flags |= VM_EVENT_FLAG_DENY;
-	else if ( req.version <= 0x00000002 )
+	else if ( req.version <= 0x00000002 ) {
+		std::lock_guard<std::mutex> lock( vcpuStateMutex_ );
+
 		msrOldValueCache_[req.vcpu_id][req.u.mov_to_msr.msr] = req.u.mov_to_msr.new_value;
+	}
 }
 
 template <typename Request, typename Response>
@@ -781,7 +1148,7 @@ template <typename Request> void XenEventManager::handleBreakpoint( const Reques
 
 void XenEventManager::stop()
 {
-	if ( stop_ ) // It's already been called
+	if ( stop_.exchange( true ) ) // It's already been called (maybe by an event worker)
 		return;
 
 	EventHandler *h = handler();
@@ -789,8 +1156,6 @@ void XenEventManager::stop()
 	if ( h )
 		h->handleSessionOver( guestState_ );
 
-	stop_ = true;
-
 #ifndef DISABLE_MEM_EVENT
 	disableXSETBVEvents();
 	disableCrEvents( 0 );
@@ -1008,7 +1373,7 @@ template <typename Request, typename Ring> void XenEventManager::getRequest( Req
 	backRing->sring->req_event = reqCons + 1;
 }
 
-template <typename Response, typename Ring> void XenEventManager::putResponse( const Response &rsp )
+template <typename Response, typename Ring> void XenEventManager::putResponse( const Response &rsp, bool push )
 {
 	Ring *   backRing = static_cast<Ring *>( backRing_ );
 	RING_IDX rspProd  = backRing->rsp_prod_pvt;
@@ -1019,7 +1384,14 @@ template <typename Response, typename Ring> void XenEventManager::putResponse( c
 
 	/* Update ring */
 	backRing->rsp_prod_pvt = rspProd;
-	RING_PUSH_RESPONSES( backRing );
+
+	if ( push )
+		RING_PUSH_RESPONSES( backRing );
+}
+
+template <typename Ring> void XenEventManager::pushResponses()
+{
+	RING_PUSH_RESPONSES( static_cast<Ring *>( backRing_ ) );
 }
 
 void XenEventManager::resumePage()
@@ -1036,37 +1408,12 @@ std::string XenEventManager::uuid()
 
 uint64_t XenEventManager::getMsr( unsigned short vcpu, uint32_t msr ) const
 {
-	bdvmi::Registers regs;
+	uint64_t value = 0;
 
-	if ( !driver_.registers( vcpu, regs ) )
+	if ( !driver_.readMsr( vcpu, msr, value ) )
 		return 0;
 
-	switch ( msr ) {
-		case MSR_IA32_SYSENTER_CS:
-			return regs.sysenter_cs;
-		case MSR_IA32_SYSENTER_ESP:
-			return regs.sysenter_esp;
-		case MSR_IA32_SYSENTER_EIP:
-			return regs.sysenter_eip;
-		case MSR_EFER:
-			return regs.msr_efer;
-		case MSR_LSTAR:
-			return regs.msr_lstar;
-		case MSR_FS_BASE:
-			return regs.fs_base;
-		case MSR_GS_BASE:
-			return regs.gs_base;
-		case MSR_STAR:
-			return regs.msr_star;
-		case MSR_IA32_CR_PAT:
-			return regs.msr_pat;
-		case MSR_SHADOW_GS_BASE:
-			return regs.shadow_gs;
-		case MSR_IA32_MISC_ENABLE:
-		case MSR_IA32_MC0_CTL:
-		default:
-			return 0;
-	}
+	return value;
 }
 
 } // namespace bdvmi
@@ -18,10 +18,13 @@
 
 #include "bdvmi/eventhandler.h"
 #include "bdvmi/eventmanager.h"
+#include <atomic>
 #include <fstream>
+#include <mutex>
 #include <stdint.h>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 extern "C" {
 #define private rprivate /* private is a C++ keyword */
@@ -34,6 +37,7 @@ extern "C" {
 
 namespace bdvmi {
 
+class VcpuDispatcher;
 class XenDriver;
 
 class XenEventManager : public EventManager {
@@ -50,6 +54,11 @@ public:
 	// Stop the event loop
 	void stop() override;
 
+	// The XenStore and event channel fds
+	std::vector<int> pollFds() override;
+
+	size_t processPending( size_t budget ) override;
+
 private:
 	bool enableMsrEventsImpl( unsigned int msr ) override;
 
@@ -86,7 +95,10 @@ private:
 
 	template <typename Request, typename Ring> void getRequest( Request &req );
 
-	template <typename Response, typename Ring> void putResponse( const Response &rsp );
+	// push == false: leave it to pushResponses() to make the response visible to Xen
+	template <typename Response, typename Ring> void putResponse( const Response &rsp, bool push = true );
+
+	template <typename Ring> void pushResponses();
 
 	void resumePage();
 
@@ -102,8 +114,36 @@ private:
 
 	template <typename Request, typename Response, typename Ring> void waitForEventsByVMEventVersion();
 
+	template <typename Request, typename Response, typename Ring>
+	size_t processPendingByVMEventVersion( size_t budget );
+
+	// Handle the requests on the ring (no more than limit of them, 0 for all), on the dispatcher's
+	// workers if there is one. Returns how many there were.
+	template <typename Request, typename Response, typename Ring>
+	size_t processRing( VcpuDispatcher *dispatcher, size_t limit );
+
+	// Everything between reading a request off the ring and putting the response back.
+	// Returns the deferral token if the handler has deferred the reply (rsp isn't ready
+	// then, it's up to deferResponse() to finish it), 0 otherwise.
 	template <typename Request, typename Response>
-	void handleMemAccess( const Request &req, Response &rsp, bool &skip );
+	uint64_t handleRequest( const Request &req, Response &rsp, bool flush );
+
+	// Register what's needed to finish rsp and put it on the ring once token is complete()d
+	template <typename Request, typename Response, typename Ring>
+	void deferResponse( uint64_t token, const Request &req, const Response &rsp );
+
+	// Injection and register writes, the last things that go into rsp
+	template <typename Response> void finishResponse( Response &rsp, bool skip );
+
+	// If a filter matches req, fill in rsp for it and return true
+	template <typename Request, typename Response> bool filterRequest( const Request &req, Response &rsp );
+
+	template <typename Request, typename Response>
+	void handleMemAccess( const Request &req, Response &rsp, bool &skip, uint64_t &deferred );
+
+	template <typename Request, typename Response>
+	void applyMemAccessAction( const Request &req, Response &rsp, HVAction action, unsigned short instructionSize,
+	                           const EmulatorContext &emulatorCtx, bool &skip );
 
 	template <typename Request, typename Response> void handleCrWrite( const Request &req, Response &rsp );
 
@@ -125,7 +165,6 @@ private:
 	XenDriver & driver_;
 	XC &        xc_;
 	domid_t     domain_;
-	bool        stop_{ false };
 	xc_evtchn * xce_{ nullptr };
 	int         port_{ -1 };
 	XS          xs_;
@@ -151,6 +190,11 @@ private:
 	using p2m_idx_values_map_t = std::unordered_map<uint32_t, uint16_t>;
 	p2m_idx_values_map_t singlestepP2mIdx;
 
+	// With parallelEvents() on, these (and the maps above) are also used by the event workers
+	std::atomic<bool> stop_{ false };
+	std::mutex        ringMutex_;      // the back ring
+	std::mutex        vcpuStateMutex_; // msrOldValueCache_, singlestepP2mIdx
+
 #ifdef DEBUG_DUMP_EVENTS
 	std::ofstream eventsFile_;
 #endif